@@ -0,0 +1,121 @@
+#include "catch.hpp"
+
+#include "DataStructures\peWeakTable.h"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace pe;
+
+struct WeakTableTestObject {
+  explicit WeakTableTestObject(uint32_t value) : value(value) {}
+  uint32_t value;
+  std::string name;
+};
+
+TEST_CASE("Weak pointers expire when their object is destroyed",
+          "[peWeakTable]") {
+  peWeakTable<WeakTableTestObject> table;
+  auto ptr = table.Insert(42u);
+  auto copy = ptr;
+  REQUIRE(ptr.IsAlive());
+  REQUIRE(copy->value == 42u);
+
+  table.Destroy(ptr);
+  REQUIRE(!ptr.IsAlive());
+  REQUIRE(!copy.IsAlive());
+  REQUIRE(copy.Get() == nullptr);
+  REQUIRE_THROWS_AS(*copy, std::runtime_error);
+
+  // Destroying twice does nothing
+  table.Destroy(copy);
+  REQUIRE(!copy.IsAlive());
+}
+
+TEST_CASE("Reused slots don't revive expired weak pointers", "[peWeakTable]") {
+  peWeakTable<WeakTableTestObject> table;
+  auto first = table.Insert(1u);
+  table.Destroy(first);
+
+  // The free list hands out the slot that was freed last
+  auto second = table.Insert(2u);
+  REQUIRE(!first.IsAlive());
+  REQUIRE(first.Get() == nullptr);
+  REQUIRE(second.IsAlive());
+  REQUIRE(second->value == 2u);
+
+  table.Destroy(second);
+  auto third = table.Insert(3u);
+  REQUIRE(!first.IsAlive());
+  REQUIRE(!second.IsAlive());
+  REQUIRE(third->value == 3u);
+}
+
+TEST_CASE("Weak tables grow beyond a single segment of slots",
+          "[peWeakTable]") {
+  peWeakTable<WeakTableTestObject> table;
+  // Segments have 1024 slots
+  constexpr uint32_t NumObjects = 3000;
+  std::vector<peWeakPtr<WeakTableTestObject>> ptrs;
+  for (uint32_t idx = 0; idx < NumObjects; ++idx) {
+    ptrs.push_back(table.Insert(idx));
+    ptrs.back()->name = std::to_string(idx);
+  }
+
+  for (uint32_t idx = 0; idx < NumObjects; ++idx) {
+    REQUIRE(ptrs[idx]->value == idx);
+    REQUIRE(ptrs[idx]->name == std::to_string(idx));
+  }
+
+  // Growing must not move the objects or slots that exist already
+  const auto firstObject = ptrs.front().Get();
+  for (uint32_t idx = 0; idx < NumObjects; ++idx)
+    ptrs.push_back(table.Insert(NumObjects + idx));
+  REQUIRE(ptrs.front().Get() == firstObject);
+
+  for (uint32_t idx = 0; idx < ptrs.size(); idx += 2)
+    table.Destroy(ptrs[idx]);
+  for (uint32_t idx = 0; idx < ptrs.size(); ++idx) {
+    REQUIRE(ptrs[idx].IsAlive() == (idx % 2 == 1));
+    if (idx % 2 == 1)
+      REQUIRE(ptrs[idx]->value == idx);
+  }
+}
+
+TEST_CASE("Concurrent weak tables can be inserted into from multiple threads",
+          "[peWeakTable]") {
+  peConcurrentWeakTable<WeakTableTestObject> table;
+  constexpr uint32_t NumThreads = 4;
+  constexpr uint32_t NumObjectsPerThread = 2000;
+  std::vector<std::vector<peWeakPtr<WeakTableTestObject>>> ptrs(NumThreads);
+
+  std::atomic<uint32_t> numMismatches{0};
+  std::vector<std::thread> threads;
+  for (uint32_t threadIdx = 0; threadIdx < NumThreads; ++threadIdx) {
+    threads.emplace_back([&, threadIdx]() {
+      const auto firstValue = threadIdx * NumObjectsPerThread;
+      for (uint32_t idx = 0; idx < NumObjectsPerThread; ++idx) {
+        ptrs[threadIdx].push_back(table.Insert(firstValue + idx));
+        // Older objects are read while the other threads grow the table
+        const auto &older = ptrs[threadIdx][idx / 2];
+        if (older->value != firstValue + idx / 2)
+          ++numMismatches;
+      }
+    });
+  }
+  for (auto &thread : threads)
+    thread.join();
+  REQUIRE(numMismatches == 0u);
+
+  std::vector<bool> seen(NumThreads * NumObjectsPerThread, false);
+  for (uint32_t threadIdx = 0; threadIdx < NumThreads; ++threadIdx) {
+    for (uint32_t idx = 0; idx < NumObjectsPerThread; ++idx) {
+      const auto &ptr = ptrs[threadIdx][idx];
+      REQUIRE(ptr.IsAlive());
+      REQUIRE(ptr->value == threadIdx * NumObjectsPerThread + idx);
+      REQUIRE(!seen[ptr->value]);
+      seen[ptr->value] = true;
+    }
+  }
+}
@@ -1,7 +1,11 @@
 #include "catch.hpp"
 
 #include "Entities\Entity.h"
+#include "Entities\peSystemScheduler.h"
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <string>
 
 using namespace pe;
 
@@ -61,6 +65,69 @@ struct TestComponent2 : peComponent<TestComponent2> {
   std::string testField;
 };
 
+struct ScheduledVelocity;
+struct ScheduledPosition;
+struct ScheduledHealth;
+
+//! Writes only its own component
+struct ScheduledVelocitySystem : peComponentSystem<ScheduledVelocitySystem> {
+  static std::atomic<uint32_t> s_updateCalls;
+
+  using Component_t = ScheduledVelocity;
+  using Writes_t = mdv::meta::Typelist<>;
+
+  void OnUpdate(ScheduledVelocity &component, const peEntity &entity) {
+    s_updateCalls.fetch_add(1, std::memory_order_relaxed);
+  }
+};
+
+std::atomic<uint32_t> ScheduledVelocitySystem::s_updateCalls{0};
+
+//! Reads the velocity, so it conflicts with ScheduledVelocitySystem
+struct ScheduledPositionSystem : peComponentSystem<ScheduledPositionSystem> {
+  static std::atomic<uint32_t> s_updateCalls;
+
+  using Component_t = ScheduledPosition;
+  using Reads_t = mdv::meta::Typelist<ScheduledVelocity>;
+
+  void OnUpdate(ScheduledPosition &component, const peEntity &entity);
+};
+
+std::atomic<uint32_t> ScheduledPositionSystem::s_updateCalls{0};
+
+//! Independent of the other scheduled systems
+struct ScheduledHealthSystem : peComponentSystem<ScheduledHealthSystem> {
+  static std::atomic<uint32_t> s_updateCalls;
+
+  using Component_t = ScheduledHealth;
+  using Writes_t = mdv::meta::Typelist<>;
+
+  void OnUpdate(ScheduledHealth &component, const peEntity &entity) {
+    s_updateCalls.fetch_add(1, std::memory_order_relaxed);
+  }
+};
+
+std::atomic<uint32_t> ScheduledHealthSystem::s_updateCalls{0};
+
+struct ScheduledVelocity : peComponent<ScheduledVelocity> {
+  using System_t = ScheduledVelocitySystem;
+};
+
+struct ScheduledPosition : peComponent<ScheduledPosition> {
+  using System_t = ScheduledPositionSystem;
+  uint32_t numUpdates = 0;
+};
+
+struct ScheduledHealth : peComponent<ScheduledHealth> {
+  using System_t = ScheduledHealthSystem;
+};
+
+void ScheduledPositionSystem::OnUpdate(ScheduledPosition &component,
+                                       const peEntity &entity) {
+  ++component.numUpdates;
+  s_updateCalls.fetch_add(1, std::memory_order_relaxed);
+}
+
 struct CleanupHandler {
   ~CleanupHandler() {
     auto alloc = GlobalAllocator;
@@ -345,6 +412,442 @@ TEST_CASE("UpdateAll calls update on all relevant entities",
   REQUIRE(TestComponent2System::s_updateCalls == 1u);
 }
 
+TEST_CASE("Components survive moving between archetypes",
+          "[peEntityManager]") {
+  peEntityManager entityManager;
+  auto entity = entityManager.CreateEntity();
+  entity.AddComponent<TestComponent2>()->testField = "Moved";
+  entity.AddComponent<TestComponent1>()->testField = 42;
+  REQUIRE(entity.GetComponent<TestComponent2>()->testField == "Moved");
+
+  entityManager.RemoveComponent<TestComponent2>(entity.GetHandle());
+  REQUIRE_FALSE(entity.GetComponent<TestComponent2>().IsValid());
+  REQUIRE(entity.GetComponent<TestComponent1>()->testField == 42u);
+}
+
+TEST_CASE("Removing an entity from an archetype keeps the other entities",
+          "[peEntityManager]") {
+  peEntityManager entityManager;
+  std::vector<peEntity> entities;
+  // Enough entities to fill more than one chunk
+  for (uint32_t idx = 0; idx < 5000; ++idx) {
+    auto entity = entityManager.CreateEntity();
+    entity.AddComponent<TestComponent1>()->testField = idx;
+    entity.AddComponent<TestComponent2>()->testField = std::to_string(idx);
+    entities.push_back(entity);
+  }
+  for (uint32_t idx = 0; idx < 5000; idx += 3)
+    entities[idx].Destroy();
+
+  for (uint32_t idx = 0; idx < 5000; ++idx) {
+    if (idx % 3 == 0) {
+      REQUIRE_FALSE(entities[idx].IsAlive());
+      continue;
+    }
+    REQUIRE(entities[idx].GetComponent<TestComponent1>()->testField == idx);
+    REQUIRE(entities[idx].GetComponent<TestComponent2>()->testField ==
+            std::to_string(idx));
+  }
+}
+
+TEST_CASE("AllComponents visits every component once", "[peEntityManager]") {
+  peEntityManager entityManager;
+  for (uint32_t idx = 0; idx < 100; ++idx) {
+    auto entity = entityManager.CreateEntity();
+    entity.AddComponent<TestComponent1>()->testField = idx;
+    if (idx % 2)
+      entity.AddComponent<TestComponent2>();
+  }
+
+  std::vector<bool> visited(100, false);
+  for (auto component : entityManager.AllComponents<TestComponent1>()) {
+    REQUIRE_FALSE(visited[component->testField]);
+    visited[component->testField] = true;
+  }
+  REQUIRE(std::count(visited.begin(), visited.end(), true) == 100);
+}
+
+TEST_CASE("ForEachChunk yields packed components", "[peEntityManager]") {
+  peEntityManager entityManager;
+  for (uint32_t idx = 0; idx < 10; ++idx) {
+    auto entity = entityManager.CreateEntity();
+    entity.AddComponent<TestComponent1>()->testField = idx;
+  }
+
+  uint32_t sum = 0, count = 0;
+  entityManager.ForEachChunk<TestComponent1>(
+      [&](const peEntity::Handle *entities, uint32_t numComponents,
+          TestComponent1 *components) {
+        for (uint32_t idx = 0; idx < numComponents; ++idx) {
+          REQUIRE(entityManager.IsAlive(entities[idx]));
+          sum += components[idx].testField;
+        }
+        count += numComponents;
+      });
+  REQUIRE(count == 10u);
+  REQUIRE(sum == 45u);
+}
+
+TEST_CASE("IsAlive is correct after destroying entities in any order",
+          "[peEntityManager]") {
+  peEntityManager entityManager;
+  for (auto idx = 0; idx < 200; idx++)
+    entityManager.CreateEntity();
+  // Destruction order that leaves the free slots unsorted
+  for (uint32_t idx : {150u, 3u, 77u, 64u, 199u})
+    entityManager.GetEntityAt(idx).Destroy();
+
+  for (uint32_t idx = 0; idx < 200; ++idx) {
+    const auto destroyed = idx == 150 || idx == 3 || idx == 77 || idx == 64 ||
+                           idx == 199;
+    REQUIRE(entityManager.IsAlive(idx) == !destroyed);
+  }
+}
+
+TEST_CASE("AllWith skips dead entities across words", "[peEntityManager]") {
+  peEntityManager entityManager;
+  std::vector<peEntity> expected;
+  for (uint32_t idx = 0; idx < 300; ++idx) {
+    auto entity = entityManager.CreateEntity();
+    if (idx % 7 == 0)
+      entity.AddComponent<TestComponent1>();
+    if (idx % 5 == 0)
+      entity.Destroy();
+    else if (idx % 7 == 0)
+      expected.push_back(entity);
+  }
+
+  size_t next = 0;
+  for (auto entity : entityManager.AllWith<TestComponent1>()) {
+    REQUIRE(next < expected.size());
+    REQUIRE(expected[next] == entity);
+    ++next;
+  }
+  REQUIRE(next == expected.size());
+}
+
+TEST_CASE("ForEach passes the components of all matching entities",
+          "[peEntityManager]") {
+  peEntityManager entityManager;
+  for (uint32_t idx = 0; idx < 10; ++idx) {
+    auto entity = entityManager.CreateEntity();
+    entity.AddComponent<TestComponent1>()->testField = idx;
+    if (idx % 2)
+      entity.AddComponent<TestComponent2>()->testField = std::to_string(idx);
+  }
+
+  uint32_t count = 0;
+  entityManager.ForEach<TestComponent1, TestComponent2>(
+      [&](peEntity entity, TestComponent1 &c1, TestComponent2 &c2) {
+        REQUIRE(entity.GetComponent<TestComponent1>()->testField ==
+                c1.testField);
+        REQUIRE(std::to_string(c1.testField) == c2.testField);
+        ++count;
+      });
+  REQUIRE(count == 5u);
+}
+
+TEST_CASE("Query picks up archetypes that were created after the first query",
+          "[peEntityManager]") {
+  peEntityManager entityManager;
+  auto e1 = entityManager.CreateEntity();
+  e1.AddComponent<TestComponent1>();
+  REQUIRE(entityManager.Query<TestComponent1>().Size() == 1u);
+
+  auto e2 = entityManager.CreateEntity();
+  e2.AddComponent<TestComponent2>();
+  e2.AddComponent<TestComponent1>();
+  REQUIRE(entityManager.Query<TestComponent1>().Size() == 2u);
+  REQUIRE((entityManager.Query<TestComponent1, TestComponent2>().Size() == 1u));
+}
+
+TEST_CASE("Component versions grow with adding, changing and removing",
+          "[peEntityManager]") {
+  peEntityManager entityManager;
+  auto entity = entityManager.CreateEntity();
+  const auto initialVersion = entityManager.GetVersion();
+
+  entity.AddComponent<TestComponent1>();
+  const auto addedVersion = entityManager.GetVersion();
+  REQUIRE(addedVersion > initialVersion);
+  REQUIRE(entityManager.HasChangedSince<TestComponent1>(initialVersion));
+  REQUIRE_FALSE(entityManager.HasChangedSince<TestComponent2>(initialVersion));
+
+  // Reading through a const handle is no change
+  const auto constHandle = entity.GetComponent<TestComponent1>();
+  REQUIRE(constHandle->testField == constHandle->testField);
+  REQUIRE_FALSE(entityManager.HasChangedSince<TestComponent1>(addedVersion));
+
+  entity.GetComponent<TestComponent1>()->testField = 42;
+  const auto changedVersion = entityManager.GetVersion();
+  REQUIRE(entityManager.HasChangedSince<TestComponent1>(addedVersion));
+
+  entityManager.RemoveComponent<TestComponent1>(entity.GetHandle());
+  REQUIRE(entityManager.HasChangedSince<TestComponent1>(changedVersion));
+}
+
+TEST_CASE("Changed entities are recorded once tracking is enabled",
+          "[peEntityManager]") {
+  peEntityManager entityManager;
+  auto e1 = entityManager.CreateEntity();
+  auto e2 = entityManager.CreateEntity();
+  auto e3 = entityManager.CreateEntity();
+  e1.AddComponent<TestComponent1>();
+
+  entityManager.TrackChangedEntities<TestComponent1>();
+  const auto version = entityManager.GetVersion();
+  e2.AddComponent<TestComponent1>();
+  e3.AddComponent<TestComponent2>();
+  e1.GetComponent<TestComponent1>()->testField = 23;
+  const auto secondVersion = entityManager.GetVersion();
+  e2.Destroy();
+
+  std::vector<peEntity::Handle> changed;
+  entityManager.ForEachChangedEntity<TestComponent1>(
+      version, [&](peEntity entity) { changed.push_back(entity.GetHandle()); });
+  REQUIRE(changed.size() == 3u);
+  REQUIRE(changed[0] == e2.GetHandle());
+  REQUIRE(changed[1] == e1.GetHandle());
+  REQUIRE(changed[2] == e2.GetHandle());
+
+  entityManager.DiscardChanges<TestComponent1>(secondVersion);
+  changed.clear();
+  entityManager.ForEachChangedEntity<TestComponent1>(
+      0, [&](peEntity entity) { changed.push_back(entity.GetHandle()); });
+  REQUIRE(changed.size() == 1u);
+  REQUIRE_FALSE(entityManager.IsAlive(changed[0]));
+}
+
+TEST_CASE("CreateEntities reuses free slots and creates alive entities",
+          "[peEntityManager]") {
+  peEntityManager entityManager;
+  auto e1 = entityManager.CreateEntity();
+  entityManager.CreateEntity();
+  e1.Destroy();
+
+  auto handles = entityManager.CreateEntities(100);
+  REQUIRE(handles.size() == 100u);
+  REQUIRE(entityManager.Capacity() == 101u);
+  REQUIRE(handles[0].index == 0u);
+  REQUIRE(handles[0].version == 1u);
+  for (auto &handle : handles)
+    REQUIRE(entityManager.IsAlive(handle));
+  size_t count = 0;
+  for (auto entity : entityManager.All())
+    ++count;
+  REQUIRE(count == 101u);
+}
+
+TEST_CASE("AddComponents adds components to entities of any archetype",
+          "[peEntityManager]") {
+  peEntityManager entityManager;
+  auto handles = entityManager.CreateEntities(1000);
+  for (size_t idx = 0; idx < handles.size(); idx += 3)
+    entityManager.AddComponent<TestComponent1>(handles[idx])->testField =
+        static_cast<uint32_t>(idx);
+
+  TestComponent2System::ClearCallCount();
+  entityManager.AddComponents<TestComponent2>(
+      handles, [](const peEntity &entity) {
+        TestComponent2 component;
+        component.testField = std::to_string(entity.GetHandle().index);
+        return component;
+      });
+  REQUIRE(TestComponent2System::s_createCalls == 1000u);
+
+  for (size_t idx = 0; idx < handles.size(); ++idx) {
+    peEntity entity{handles[idx], entityManager};
+    REQUIRE(entity.GetComponent<TestComponent2>()->testField ==
+            std::to_string(handles[idx].index));
+    if (idx % 3 == 0)
+      REQUIRE(entity.GetComponent<TestComponent1>()->testField == idx);
+  }
+  REQUIRE(entityManager.Query<TestComponent2>().Size() == 1000u);
+}
+
+TEST_CASE("AddComponents adds nothing if one of the entities is invalid",
+          "[peEntityManager]") {
+  peEntityManager entityManager;
+  auto handles = entityManager.CreateEntities(10);
+  entityManager.AddComponent<TestComponent1>(handles[5]);
+  REQUIRE_THROWS_AS(entityManager.AddComponents<TestComponent1>(handles),
+                    std::runtime_error);
+  REQUIRE(entityManager.Query<TestComponent1>().Size() == 1u);
+}
+
+TEST_CASE("AddComponents adds nothing if an entity is given twice",
+          "[peEntityManager]") {
+  peEntityManager entityManager;
+  auto handles = entityManager.CreateEntities(10);
+  handles.push_back(handles[3]);
+  REQUIRE_THROWS_AS(entityManager.AddComponents<TestComponent1>(handles),
+                    std::runtime_error);
+  REQUIRE(entityManager.Query<TestComponent1>().Size() == 0u);
+
+  handles.pop_back();
+  entityManager.AddComponents<TestComponent1>(handles);
+  REQUIRE(entityManager.Query<TestComponent1>().Size() == 10u);
+}
+
+TEST_CASE("AddComponents notifies the system of the components added before "
+          "init threw",
+          "[peEntityManager]") {
+  peEntityManager entityManager;
+  auto handles = entityManager.CreateEntities(10);
+
+  TestComponent2System::ClearCallCount();
+  REQUIRE_THROWS_AS(entityManager.AddComponents<TestComponent2>(
+                        handles,
+                        [&](const peEntity &entity) {
+                          if (entity.GetHandle() == handles[6])
+                            throw std::runtime_error{"init failed"};
+                          return TestComponent2{};
+                        }),
+                    std::runtime_error);
+  REQUIRE(TestComponent2System::s_createCalls == 6u);
+  REQUIRE(entityManager.Query<TestComponent2>().Size() == 6u);
+  for (size_t idx = 0; idx < handles.size(); ++idx) {
+    peEntity entity{handles[idx], entityManager};
+    REQUIRE(entity.GetComponent<TestComponent2>().IsValid() == (idx < 6));
+  }
+
+  // The kept components are destroyed like any other
+  for (size_t idx = 0; idx < 6; ++idx)
+    entityManager.RemoveComponent<TestComponent2>(handles[idx]);
+  REQUIRE(TestComponent2System::s_destroyCalls == 6u);
+}
+
+TEST_CASE("Adding components keeps the system of the component type",
+          "[peEntityManager]") {
+  peEntityManager entityManager;
+  entityManager.CreateEntity().AddComponent<TestComponent2>();
+  auto system = &entityManager.GetComponentSystem<TestComponent2>();
+  entityManager.CreateEntity().AddComponent<TestComponent2>();
+  REQUIRE(&entityManager.GetComponentSystem<TestComponent2>() == system);
+}
+
+static_assert(mdv::meta::IndexOf<peTransformComponent,
+                                 peStaticComponents_t>::value <
+                  peBaseComponent::NUM_STATIC_COMPONENTS,
+              "Engine components must have static families!");
+
+struct RuntimeFamilyRegistry : peBaseComponent {
+  using peBaseComponent::RegisterRuntimeFamily;
+};
+
+TEST_CASE("Components outside the static list get distinct runtime families",
+          "[peComponent]") {
+  const auto family1 = GetFamilyOf<TestComponent1>();
+  const auto family2 = GetFamilyOf<TestComponent2>();
+  REQUIRE(family1 >= peBaseComponent::NUM_STATIC_COMPONENTS);
+  REQUIRE(family2 >= peBaseComponent::NUM_STATIC_COMPONENTS);
+  REQUIRE(family1 != family2);
+  REQUIRE(GetFamilyOf<TestComponent1>() == family1);
+  // Another module registers the same type by its name
+  REQUIRE(RuntimeFamilyRegistry::RegisterRuntimeFamily(
+              typeid(TestComponent1).name()) == family1);
+}
+
+#pragma region peSystemScheduler
+
+TEST_CASE("Systems report their declared component accesses",
+          "[peComponentSystem]") {
+  peEntityManager entityManager;
+  auto entity = entityManager.CreateEntity();
+  entity.AddComponent<ScheduledVelocity>();
+  entity.AddComponent<ScheduledPosition>();
+  entity.AddComponent<TestComponent2>();
+
+  auto &positionSystem =
+      entityManager.GetComponentSystem<ScheduledPosition>();
+  REQUIRE(positionSystem.DeclaresAccess());
+  REQUIRE(positionSystem.GetReadMask() ==
+          MakeBitmaskForComponents<ScheduledVelocity>());
+  REQUIRE(positionSystem.GetWriteMask() ==
+          MakeBitmaskForComponents<ScheduledPosition>());
+
+  auto &undeclaredSystem = entityManager.GetComponentSystem<TestComponent2>();
+  REQUIRE(undeclaredSystem.HasUpdate());
+  REQUIRE_FALSE(undeclaredSystem.DeclaresAccess());
+}
+
+TEST_CASE("Scheduler only orders conflicting systems", "[peSystemScheduler]") {
+  peEntityManager entityManager;
+  peTaskSystem taskSystem{4};
+  peSystemScheduler scheduler{entityManager, taskSystem};
+  auto entity = entityManager.CreateEntity();
+  entity.AddComponent<ScheduledVelocity>();
+  entity.AddComponent<ScheduledPosition>();
+  entity.AddComponent<ScheduledHealth>();
+
+  scheduler.Update();
+  auto numDependencies = scheduler.GetNumDependencies();
+  std::sort(numDependencies.begin(), numDependencies.end());
+  REQUIRE((numDependencies == peVector<uint32_t>{0, 0, 1}));
+
+  // Systems without declarations conflict with every other system
+  entity.AddComponent<TestComponent2>();
+  TestComponent2System::s_updateHook = nullptr;
+  scheduler.Update();
+  uint32_t numEdges = 0;
+  for (auto count : scheduler.GetNumDependencies())
+    numEdges += count;
+  REQUIRE(numEdges == 1u + 3u);
+}
+
+TEST_CASE("Parallel system update visits every component once",
+          "[peSystemScheduler]") {
+  peEntityManager entityManager;
+  peTaskSystem taskSystem{4};
+  taskSystem.Start();
+  std::vector<peEntity> entities;
+  for (uint32_t idx = 0; idx < 10000; ++idx) {
+    entities.push_back(entityManager.CreateEntity());
+    entities.back().AddComponent<ScheduledPosition>();
+    if (idx % 3 == 0)
+      entities.back().AddComponent<ScheduledVelocity>();
+  }
+
+  ScheduledPositionSystem::s_updateCalls = 0;
+  peSystemScheduler scheduler{entityManager, taskSystem};
+  scheduler.Update();
+  taskSystem.Stop();
+
+  REQUIRE(ScheduledPositionSystem::s_updateCalls.load() == 10000u);
+  for (auto &entity : entities)
+    REQUIRE(entity.GetComponent<ScheduledPosition>()->numUpdates == 1u);
+}
+
+TEST_CASE("Independent systems query at the same time",
+          "[peSystemScheduler]") {
+  peTaskSystem taskSystem{4};
+  taskSystem.Start();
+  // Every entity manager starts with empty query caches, so the first update
+  // of both systems fills them concurrently
+  for (uint32_t round = 0; round < 500; ++round) {
+    peEntityManager entityManager;
+    for (uint32_t idx = 0; idx < 30; ++idx) {
+      auto entity = entityManager.CreateEntity();
+      if (idx % 3 != 1)
+        entity.AddComponent<ScheduledVelocity>();
+      if (idx % 3 != 0)
+        entity.AddComponent<ScheduledHealth>();
+    }
+
+    ScheduledVelocitySystem::s_updateCalls = 0;
+    ScheduledHealthSystem::s_updateCalls = 0;
+    peSystemScheduler scheduler{entityManager, taskSystem};
+    scheduler.Update();
+
+    REQUIRE((scheduler.GetNumDependencies() == peVector<uint32_t>{0, 0}));
+    REQUIRE(ScheduledVelocitySystem::s_updateCalls.load() == 20u);
+    REQUIRE(ScheduledHealthSystem::s_updateCalls.load() == 20u);
+  }
+  taskSystem.Stop();
+}
+
+#pragma endregion
+
 #pragma region EntityHandle
 
 TEST_CASE("Equality operators work when handles are equal",
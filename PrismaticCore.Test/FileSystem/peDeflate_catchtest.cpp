@@ -0,0 +1,82 @@
+#include "catch.hpp"
+
+#include "FileSystem\lodepng.h"
+#include "FileSystem\peDeflate.h"
+#include <algorithm>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace pe;
+
+namespace {
+//! \brief Compresses the data in strips like DumpPNG does, each strip
+//! referencing the 32KiB before it
+std::vector<unsigned char>
+CompressInStrips(const std::vector<unsigned char> &data, size_t stripSize) {
+  std::vector<unsigned char> compressed;
+  for (size_t start = 0; start < data.size(); start += stripSize) {
+    const auto end = std::min(start + stripSize, data.size());
+    const auto dictionaryStart = start > 32768 ? start - 32768 : 0;
+    deflate::CompressStrip(data.data(), dictionaryStart, start, end,
+                           compressed);
+  }
+  deflate::FinishStream(compressed);
+  return compressed;
+}
+
+std::vector<unsigned char>
+Decompress(const std::vector<unsigned char> &compressed) {
+  unsigned char *out = nullptr;
+  size_t outSize = 0;
+  const auto error =
+      lodepng_inflate(&out, &outSize, compressed.data(), compressed.size(),
+                      &lodepng_default_decompress_settings);
+  REQUIRE(error == 0u);
+  std::vector<unsigned char> result{out, out + outSize};
+  free(out);
+  return result;
+}
+} // namespace
+
+TEST_CASE("Deflate stores incompressible data", "[peDeflate]") {
+  std::mt19937 rng{42};
+  std::vector<unsigned char> data(1 << 20);
+  for (auto &value : data)
+    value = static_cast<unsigned char>(rng());
+
+  const auto compressed = CompressInStrips(data, 256 * 1024);
+  REQUIRE(Decompress(compressed) == data);
+  // A few bytes of block headers per stored block, which hold at most 64KiB
+  REQUIRE(compressed.size() <= data.size() + data.size() / 1024 + 64);
+}
+
+TEST_CASE("Deflate compresses data with mixed compressibility",
+          "[peDeflate]") {
+  std::mt19937 rng{7};
+  std::vector<unsigned char> data;
+  // Runs of noise between repetitive runs, so that blocks of both kinds
+  // reference each other
+  for (uint32_t run = 0; run < 64; ++run) {
+    const auto size = 1000 + rng() % 30000;
+    for (uint32_t idx = 0; idx < size; ++idx) {
+      data.push_back(run % 2 ? static_cast<unsigned char>(rng())
+                             : static_cast<unsigned char>(idx % 97));
+    }
+  }
+
+  const auto compressed = CompressInStrips(data, 100000);
+  REQUIRE(Decompress(compressed) == data);
+  REQUIRE(compressed.size() < data.size());
+}
+
+TEST_CASE("Deflate round-trips empty strips", "[peDeflate]") {
+  const std::vector<unsigned char> data(10, 'a');
+  std::vector<unsigned char> compressed;
+  deflate::CompressStrip(data.data(), 0, 0, 0, compressed);
+  deflate::CompressStrip(data.data(), 0, 0, data.size(), compressed);
+  deflate::CompressStrip(data.data(), 0, data.size(), data.size(),
+                         compressed);
+  deflate::FinishStream(compressed);
+  REQUIRE(Decompress(compressed) == data);
+}
@@ -0,0 +1,122 @@
+#include "catch.hpp"
+
+#include "Film\peFilm.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace pe;
+
+namespace {
+const FilmStorage AllStorages[] = {FilmStorage::Float32, FilmStorage::Half,
+                                   FilmStorage::SharedExponent};
+
+//! \brief Radiance of a pixel, spans a large range of magnitudes
+Spectrum_t TestRadiance(uint32_t x, uint32_t y) {
+  return Spectrum_t{std::exp2(static_cast<float>(x % 24) - 12.f),
+                    static_cast<float>(y) * 0.37f,
+                    static_cast<float>(x + y) / 16.f};
+}
+
+//! \brief Stores TestRadiance, accumulated from x + 1 samples, in every pixel
+//! of the film. The tiles extend past the right and bottom border
+void StoreTestTiles(peFilm &film, uint32_t tileSize) {
+  std::vector<RGBA_32BitFloat> tile(tileSize * tileSize);
+  for (uint32_t tileY = 0; tileY < film.Height(); tileY += tileSize) {
+    for (uint32_t tileX = 0; tileX < film.Width(); tileX += tileSize) {
+      for (uint32_t y = 0; y < tileSize; ++y) {
+        for (uint32_t x = 0; x < tileSize; ++x) {
+          const auto radiance = TestRadiance(tileX + x, tileY + y);
+          const auto samples = static_cast<float>(tileX + x + 1);
+          tile[y * tileSize + x] =
+              RGBA_32BitFloat{radiance.r() * samples, radiance.g() * samples,
+                              radiance.b() * samples, samples};
+        }
+      }
+      film.StoreTile(gsl::span<RGBA_32BitFloat>{
+                         tile.data(), static_cast<std::ptrdiff_t>(tile.size())},
+                     glm::uvec2{tileX, tileY}, tileSize);
+    }
+  }
+}
+
+//! \brief Maximum error of a channel in the given storage format. Computing
+//! the mean of the samples adds a few float roundings to each format
+float Tolerance(FilmStorage storage, const Spectrum_t &expected) {
+  const auto max = std::max(expected.r(), std::max(expected.g(), expected.b()));
+  const auto meanError = max * 1e-6f;
+  switch (storage) {
+  case FilmStorage::Float32:
+    return meanError;
+  case FilmStorage::Half:
+    return max * std::exp2(-11.f) + meanError;
+  case FilmStorage::SharedExponent:
+    return max / 511 + meanError;
+  }
+  return 0;
+}
+} // namespace
+
+TEST_CASE("Films store and resolve pixels in every storage format",
+          "[peFilm]") {
+  for (auto storage : AllStorages) {
+    INFO("Storage " << static_cast<int>(storage));
+    peFilm film{storage};
+    film.Resize(37, 21);
+    REQUIRE(film.Storage() == storage);
+
+    // Pixels without samples are cleared
+    for (uint32_t y = 0; y < film.Height(); ++y) {
+      for (uint32_t x = 0; x < film.Width(); ++x) {
+        REQUIRE(film.SampleCount(x, y) == 0u);
+        REQUIRE(film.Resolve(x, y).IsBlack());
+      }
+    }
+
+    StoreTestTiles(film, 8);
+    std::vector<Spectrum_t> resolved(film.Width() * film.Height());
+    film.ResolveRows(0, film.Height(),
+                     gsl::span<Spectrum_t>{
+                         resolved.data(),
+                         static_cast<std::ptrdiff_t>(resolved.size())});
+    for (uint32_t y = 0; y < film.Height(); ++y) {
+      for (uint32_t x = 0; x < film.Width(); ++x) {
+        const auto expected = TestRadiance(x, y);
+        const auto tolerance = Tolerance(storage, expected);
+        const auto &pixel = resolved[y * film.Width() + x];
+        REQUIRE(std::abs(pixel.r() - expected.r()) <= tolerance);
+        REQUIRE(std::abs(pixel.g() - expected.g()) <= tolerance);
+        REQUIRE(std::abs(pixel.b() - expected.b()) <= tolerance);
+        const auto single = film.Resolve(x, y);
+        REQUIRE((single.r() == pixel.r() && single.g() == pixel.g() &&
+                 single.b() == pixel.b()));
+        REQUIRE(film.SampleCount(x, y) == x + 1);
+      }
+    }
+
+    // Resizing clears the pixels again
+    film.Resize(5, 4);
+    REQUIRE(film.SampleCount(4, 3) == 0u);
+    REQUIRE(film.Resolve(4, 3).IsBlack());
+  }
+}
+
+TEST_CASE("Films clear pixel buffers that are mapped", "[peFilm]") {
+  for (auto storage : AllStorages) {
+    INFO("Storage " << static_cast<int>(storage));
+    peFilm film{storage};
+    // Several MiB in every format, so the buffers are mapped on their own
+    film.Resize(1024, 1024);
+    StoreTestTiles(film, 64);
+    REQUIRE(film.SampleCount(1023, 1023) == 1024u);
+
+    // The new buffers replace the ones that were just written
+    film.Resize(1024, 1024);
+    for (uint32_t y = 0; y < film.Height(); y += 7) {
+      for (uint32_t x = 0; x < film.Width(); x += 5) {
+        REQUIRE(film.SampleCount(x, y) == 0u);
+        REQUIRE(film.Resolve(x, y).IsBlack());
+      }
+    }
+  }
+}
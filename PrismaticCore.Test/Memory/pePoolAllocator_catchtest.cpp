@@ -0,0 +1,91 @@
+#include "catch.hpp"
+
+#include "Memory\peAllocators.h"
+#include <atomic>
+#include <deque>
+#include <set>
+#include <thread>
+#include <vector>
+
+using namespace pe;
+
+TEST_CASE("Pool allocators reuse freed elements", "[pePoolAllocator]") {
+  pePoolAllocator pool{24, 1024};
+  auto first = pool.Allocate(24);
+  auto second = pool.Allocate(24);
+  REQUIRE(first != second);
+
+  pool.Free(first);
+  REQUIRE(pool.Allocate(24) == first);
+  REQUIRE_THROWS_AS(pool.Allocate(100), std::runtime_error);
+}
+
+TEST_CASE("Pool allocators reject memory of others", "[pePoolAllocator]") {
+  pePoolAllocator pool{32, 1024};
+  pePoolAllocator otherPool{32, 1024};
+  auto element = static_cast<char *>(pool.Allocate(32));
+  int onStack = 0;
+
+  REQUIRE_THROWS_AS(pool.Free(&onStack), std::runtime_error);
+  REQUIRE_THROWS_AS(pool.Free(otherPool.Allocate(32)), std::runtime_error);
+  REQUIRE_THROWS_AS(pool.Free(element + 8), std::runtime_error);
+  pool.Free(element);
+}
+
+TEST_CASE("Pool allocators find elements in any of many chunks",
+          "[pePoolAllocator]") {
+  // Chunk sizes don't have to be powers of two, and the chunks need not be
+  // aligned to them
+  pePoolAllocator pool{48, 1000};
+  std::vector<void *> elements;
+  for (uint32_t idx = 0; idx < 5000; ++idx)
+    elements.push_back(pool.Allocate(48));
+  REQUIRE(pool.GetChunks().size() > 200);
+  REQUIRE(std::set<void *>(elements.begin(), elements.end()).size() ==
+          elements.size());
+
+  // The last 40 bytes of each chunk don't fit an element
+  for (auto chunk : pool.GetChunks())
+    REQUIRE_THROWS_AS(pool.Free(chunk + 960), std::runtime_error);
+  for (auto element : elements)
+    pool.Free(element);
+}
+
+TEST_CASE("Concurrent pool allocators hand out each element once",
+          "[pePoolAllocator]") {
+  peConcurrentPoolAllocator pool{sizeof(uint32_t), 256};
+  constexpr uint32_t NumThreads = 4;
+  constexpr uint32_t NumIterations = 20000;
+
+  std::atomic<uint32_t> numMismatches{0};
+  std::vector<std::thread> threads;
+  for (uint32_t threadIdx = 0; threadIdx < NumThreads; ++threadIdx) {
+    threads.emplace_back([&, threadIdx]() {
+      std::deque<uint32_t *> owned;
+      for (uint32_t idx = 0; idx < NumIterations; ++idx) {
+        auto element =
+            static_cast<uint32_t *>(pool.Allocate(sizeof(uint32_t)));
+        *element = threadIdx;
+        owned.push_back(element);
+        // Keeps a few elements around, so that the pool keeps growing while
+        // the other threads free
+        if (idx % 3 != 0) {
+          if (*owned.front() != threadIdx)
+            ++numMismatches;
+          pool.Free(owned.front());
+          owned.pop_front();
+        }
+      }
+      for (auto element : owned) {
+        if (*element != threadIdx)
+          ++numMismatches;
+      }
+    });
+  }
+  for (auto &thread : threads)
+    thread.join();
+  REQUIRE(numMismatches == 0u);
+
+  int onStack = 0;
+  REQUIRE_THROWS_AS(pool.Free(&onStack), std::runtime_error);
+}
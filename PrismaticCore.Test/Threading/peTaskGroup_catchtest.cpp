@@ -0,0 +1,76 @@
+#include "catch.hpp"
+
+#include "Threading\peTaskGroup.h"
+#include <atomic>
+#include <stdexcept>
+
+using namespace pe;
+
+TEST_CASE("Task groups run tasks inline if the task system is stopped",
+          "[peTaskGroup]") {
+  peTaskSystem taskSystem{2};
+  peTaskGroup group{taskSystem};
+  auto numRuns = 0;
+  group.Run([&]() {
+    ++numRuns;
+    group.Run([&]() { ++numRuns; });
+  });
+  REQUIRE(numRuns == 2);
+  REQUIRE(group.IsDone());
+  group.Wait();
+}
+
+TEST_CASE("Task groups finish tasks that throw", "[peTaskGroup]") {
+  // Without runners, only the waiting thread runs the tasks
+  peTaskSystem taskSystem{0};
+  taskSystem.Start();
+  peTaskGroup group{taskSystem};
+  auto continued = false;
+  group.Run([]() { throw std::runtime_error{"Task failed"}; });
+  group.Then([&]() { continued = true; });
+
+  REQUIRE_THROWS_AS(group.Wait(), std::runtime_error);
+  REQUIRE(group.IsDone());
+  // The continuation was submitted when the task finished
+  while (taskSystem.RunPendingTask())
+    ;
+  REQUIRE(continued);
+  taskSystem.Stop();
+}
+
+TEST_CASE("Stopping the task system finishes the queued tasks of groups",
+          "[peTaskGroup]") {
+  peTaskSystem taskSystem{0};
+  taskSystem.Start();
+  std::atomic<uint32_t> numRuns{0};
+  auto continued = false;
+  peTaskGroup group{taskSystem};
+  for (uint32_t idx = 0; idx < 10; ++idx)
+    group.Run([&]() { ++numRuns; });
+  group.Then([&]() { continued = true; });
+  REQUIRE(group.Outstanding() == 10u);
+
+  taskSystem.Stop();
+  REQUIRE(group.IsDone());
+  REQUIRE(numRuns == 0u);
+  // The continuation was submitted while stopping and discarded as well
+  REQUIRE(!continued);
+  group.Wait();
+}
+
+TEST_CASE("Task groups wait for the tasks of all runners", "[peTaskGroup]") {
+  peTaskSystem taskSystem{4};
+  taskSystem.Start();
+  std::atomic<uint32_t> numRuns{0};
+  {
+    peTaskGroup group{taskSystem};
+    for (uint32_t idx = 0; idx < 100; ++idx) {
+      group.Run([&]() {
+        for (uint32_t child = 0; child < 10; ++child)
+          group.Run([&]() { ++numRuns; });
+      });
+    }
+    // The destructor waits
+  }
+  REQUIRE(numRuns == 1000u);
+}
@@ -0,0 +1,157 @@
+#include "catch.hpp"
+
+#include "Type\peHalf.h"
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <random>
+
+using namespace pe;
+
+namespace {
+bool IsHalfNaN(uint16_t half) {
+  return (half & 0x7C00u) == 0x7C00u && (half & 0x3FFu) != 0;
+}
+
+float FromBits(uint32_t bits) {
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+} // namespace
+
+TEST_CASE("Every half value survives the round trip through float",
+          "[peHalf]") {
+  for (uint32_t half = 0; half <= 0xFFFFu; ++half) {
+    const auto value = HalfToFloat(static_cast<uint16_t>(half));
+    if (IsHalfNaN(static_cast<uint16_t>(half))) {
+      REQUIRE(std::isnan(value));
+      REQUIRE(IsHalfNaN(FloatToHalf(value)));
+    } else {
+      REQUIRE(FloatToHalf(value) == half);
+    }
+  }
+}
+
+TEST_CASE("Half floats have a relative error below 2^-11", "[peHalf]") {
+  std::mt19937 rng{42};
+  // Covers the whole range of normalized halfs
+  std::uniform_real_distribution<float> exponent{-14.f, 15.9f};
+  for (uint32_t idx = 0; idx < 100000; ++idx) {
+    const auto value = std::exp2(exponent(rng));
+    const auto roundTrip = HalfToFloat(FloatToHalf(value));
+    REQUIRE(std::abs(roundTrip - value) <= value * std::exp2(-11.f));
+    REQUIRE(HalfToFloat(FloatToHalf(-value)) == -roundTrip);
+  }
+}
+
+TEST_CASE("Half floats round to nearest even", "[peHalf]") {
+  // Halfway between 1 and the next half, which is 1 + 2^-10
+  REQUIRE(FloatToHalf(1.f + std::exp2(-11.f)) == 0x3C00u);
+  REQUIRE(FloatToHalf(1.f + 3 * std::exp2(-11.f)) == 0x3C02u);
+  REQUIRE(FloatToHalf(1.f + std::exp2(-11.f) + std::exp2(-20.f)) == 0x3C01u);
+  // The carry of the mantissa moves into the exponent
+  REQUIRE(FloatToHalf(2.f - std::exp2(-12.f)) == 0x4000u);
+}
+
+TEST_CASE("Half floats represent denormals", "[peHalf]") {
+  const auto smallest = std::exp2(-24.f);
+  REQUIRE(FloatToHalf(smallest) == 0x0001u);
+  REQUIRE(HalfToFloat(0x0001u) == smallest);
+  REQUIRE(HalfToFloat(0x03FFu) == 1023 * smallest);
+  REQUIRE(FloatToHalf(1023 * smallest) == 0x03FFu);
+  REQUIRE(FloatToHalf(-5 * smallest) == 0x8005u);
+  // Rounding the largest denormal up yields the smallest normalized half
+  REQUIRE(FloatToHalf(1023.5f * smallest) == 0x0400u);
+
+  // Half of the smallest denormal rounds to even, anything above it up
+  REQUIRE(FloatToHalf(0.5f * smallest) == 0x0000u);
+  REQUIRE(FloatToHalf(0.75f * smallest) == 0x0001u);
+  REQUIRE(FloatToHalf(1.5f * smallest) == 0x0002u);
+  // Values that are too small keep their sign
+  REQUIRE(FloatToHalf(0.25f * smallest) == 0x0000u);
+  REQUIRE(FloatToHalf(-0.25f * smallest) == 0x8000u);
+  REQUIRE(FloatToHalf(std::numeric_limits<float>::denorm_min()) == 0x0000u);
+  REQUIRE(std::signbit(HalfToFloat(0x8000u)));
+}
+
+TEST_CASE("Half floats overflow to infinity", "[peHalf]") {
+  REQUIRE(FloatToHalf(65504.f) == 0x7BFFu);
+  REQUIRE(HalfToFloat(0x7BFFu) == 65504.f);
+  // Values below the halfway point to 65536 still round to the largest half
+  REQUIRE(FloatToHalf(65519.f) == 0x7BFFu);
+  REQUIRE(FloatToHalf(65520.f) == 0x7C00u);
+  REQUIRE(FloatToHalf(1e10f) == 0x7C00u);
+  REQUIRE(FloatToHalf(-1e10f) == 0xFC00u);
+  REQUIRE(FloatToHalf(std::numeric_limits<float>::max()) == 0x7C00u);
+
+  const auto inf = std::numeric_limits<float>::infinity();
+  REQUIRE(FloatToHalf(inf) == 0x7C00u);
+  REQUIRE(FloatToHalf(-inf) == 0xFC00u);
+  REQUIRE(HalfToFloat(0x7C00u) == inf);
+  REQUIRE(HalfToFloat(0xFC00u) == -inf);
+}
+
+TEST_CASE("Half floats keep NaNs", "[peHalf]") {
+  REQUIRE(IsHalfNaN(FloatToHalf(std::numeric_limits<float>::quiet_NaN())));
+  // The payload of this NaN is lost entirely, it must not turn into infinity
+  REQUIRE(IsHalfNaN(FloatToHalf(FromBits(0x7F800001u))));
+  REQUIRE((FloatToHalf(FromBits(0xFF800001u)) & 0x8000u) != 0);
+  REQUIRE(std::isnan(HalfToFloat(0x7E00u)));
+  REQUIRE(std::isnan(HalfToFloat(0xFC01u)));
+}
+
+TEST_CASE("RGB9E5 has an error below 2^-9 of the largest channel",
+          "[peHalf]") {
+  std::mt19937 rng{7};
+  std::uniform_real_distribution<float> exponent{-14.f, 15.9f};
+  std::uniform_real_distribution<float> fraction{0.f, 1.f};
+  for (uint32_t idx = 0; idx < 100000; ++idx) {
+    const auto max = std::exp2(exponent(rng));
+    const float in[3] = {max, max * fraction(rng), max * fraction(rng)};
+    const auto shift = idx % 3;
+    float out[3];
+    UnpackRGB9E5(PackRGB9E5(in[shift], in[(shift + 1) % 3],
+                            in[(shift + 2) % 3]),
+                 out[shift], out[(shift + 1) % 3], out[(shift + 2) % 3]);
+    // Slightly more than 2^-9 if the largest channel rounds up to the next
+    // exponent, which halves the precision of the others
+    for (uint32_t channel = 0; channel < 3; ++channel)
+      REQUIRE(std::abs(out[channel] - in[channel]) <= max / 511);
+  }
+}
+
+TEST_CASE("RGB9E5 stores exact values exactly", "[peHalf]") {
+  float r, g, b;
+  UnpackRGB9E5(PackRGB9E5(1.f, 0.5f, 0.25f), r, g, b);
+  REQUIRE(r == 1.f);
+  REQUIRE(g == 0.5f);
+  REQUIRE(b == 0.25f);
+
+  REQUIRE(PackRGB9E5(0.f, 0.f, 0.f) == 0u);
+  UnpackRGB9E5(0u, r, g, b);
+  REQUIRE((r == 0.f && g == 0.f && b == 0.f));
+}
+
+TEST_CASE("RGB9E5 clamps values outside of its range", "[peHalf]") {
+  float r, g, b;
+  UnpackRGB9E5(PackRGB9E5(-1.f, 2.f, -1e10f), r, g, b);
+  REQUIRE(r == 0.f);
+  REQUIRE(g == 2.f);
+  REQUIRE(b == 0.f);
+
+  const auto nan = std::numeric_limits<float>::quiet_NaN();
+  REQUIRE(PackRGB9E5(nan, -0.f, -std::numeric_limits<float>::infinity()) ==
+          0u);
+
+  UnpackRGB9E5(PackRGB9E5(1e10f, std::numeric_limits<float>::infinity(),
+                          65408.f),
+               r, g, b);
+  REQUIRE(r == 65408.f);
+  REQUIRE(g == 65408.f);
+  REQUIRE(b == 65408.f);
+
+  // Rounding the mantissa of the largest channel up bumps the exponent
+  UnpackRGB9E5(PackRGB9E5(1.f - std::exp2(-12.f), 0.f, 0.f), r, g, b);
+  REQUIRE(r == 1.f);
+}
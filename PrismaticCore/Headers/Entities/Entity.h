@@ -1,12 +1,25 @@
 #pragma once
-#include "DataStructures/pePool.h"
 #include "DataStructures/peUniquePtr.h"
+#include "DataStructures/peUnorderedMap.h"
+#include "DataStructures/peVector.h"
+#include "Memory/peMemoryTracking.h"
+#include "Threading/peParallel.h"
+#include "Type/Meta.h"
 #include "peCoreDefs.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <bitset>
 #include <cstdint>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <optional>
+#include <span.h>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
 
 #pragma warning(push)
 #pragma warning(disable : 4251)
@@ -15,6 +28,7 @@ namespace pe {
 
 class peEntityManager;
 template <typename T> class peComponentHandle;
+template <typename... Components> class peQueryView;
 
 #pragma region peEntity
 
@@ -102,13 +116,15 @@ public:
   peComponentHandle(const peComponentHandle &) = default;
   peComponentHandle &operator=(const peComponentHandle &) = default;
 
-  Component *operator->() { return Dereference(); }
+  //! \brief Mutable access marks the component as changed, see
+  //! peEntityManager::MarkChanged
+  Component *operator->() { return DereferenceMutable(); }
   const Component *operator->() const { return Dereference(); }
 
   Component &operator*() {
     if (!IsValid())
       throw std::runtime_error{"Can't dereference invalid component handle!"};
-    return *Dereference();
+    return *DereferenceMutable();
   }
   const Component &operator*() const {
     if (!IsValid())
@@ -146,6 +162,7 @@ public:
 private:
   friend class peEntityManager;
   Component *Dereference() const;
+  Component *DereferenceMutable() const;
 
   peEntity::Handle _entityHandle;
   peEntityManager *_entityManager;
@@ -155,6 +172,21 @@ private:
 
 #pragma region Components
 
+struct peCameraComponent;
+struct peDirectionalLightComponent;
+struct pePointLightComponent;
+struct pePrimitiveRenderComponent;
+struct peStaticRenderComponent;
+struct peTransformComponent;
+
+//! \brief Components of the engine. The family of each of them is its index in
+//! this list, so it is known at compile time. All other components get their
+//! families at runtime, after the ones of this list
+using peStaticComponents_t =
+    mdv::meta::Typelist<peCameraComponent, peDirectionalLightComponent,
+                        pePointLightComponent, pePrimitiveRenderComponent,
+                        peStaticRenderComponent, peTransformComponent>;
+
 //! \brief Component base class, only used for the component type counter
 struct PE_CORE_API peBaseComponent {
   using Family_t = std::size_t;
@@ -162,10 +194,15 @@ struct PE_CORE_API peBaseComponent {
       sizeof(Family_t) * 8; // TODO Done this way so that masking is easy,
                             // however this limits us to a relatively small
                             // number of components...
+  constexpr static Family_t NUM_STATIC_COMPONENTS =
+      mdv::meta::Size<peStaticComponents_t>::value;
 
 protected:
-  // Counts up types of components
-  static Family_t s_familyCounter;
+  //! \brief Returns the family of the component type with the given name and
+  //! assigns the next free one on the first call. Templates are instantiated
+  //! once per module, so the families are matched by name in the core module
+  //! to be the same everywhere. Thread-safe
+  static Family_t RegisterRuntimeFamily(const char *typeName);
 };
 
 //! \brief Component base class from which all component implementations should
@@ -178,8 +215,12 @@ public:
 };
 
 template <typename T> peBaseComponent::Family_t peComponent<T>::Family() {
-  static auto s_family = s_familyCounter++;
-  return s_family;
+  if constexpr (mdv::meta::Contains<T, peStaticComponents_t>::value) {
+    return mdv::meta::IndexOf<T, peStaticComponents_t>::value;
+  } else {
+    static const auto s_family = RegisterRuntimeFamily(typeid(T).name());
+    return s_family;
+  }
 }
 
 //! \brief Helper function to get the family for a given component type
@@ -224,6 +265,155 @@ constexpr peComponentBitmask MakeBitmaskForComponents() {
 
 #pragma endregion
 
+#pragma region peArchetype
+
+//! \brief Type-erased operations on one component type, so that archetypes can
+//! store and move components without knowing their types
+struct PE_CORE_API peComponentTypeInfo {
+  size_t size;
+  size_t alignment;
+  //! \brief Move-constructs the component at dst from the one at src and
+  //! destroys the one at src. Null for trivially copyable components, which
+  //! are relocated with memcpy
+  void (*relocate)(void *dst, void *src);
+  //! \brief Null for trivially destructible components
+  void (*destruct)(void *component);
+
+  template <typename Component> static const peComponentTypeInfo &Of();
+};
+
+namespace detail {
+template <typename Component> void RelocateComponent(void *dst, void *src) {
+  auto srcComponent = static_cast<Component *>(src);
+  new (dst) Component(std::move(*srcComponent));
+  srcComponent->~Component();
+}
+
+template <typename Component> void DestructComponent(void *component) {
+  static_cast<Component *>(component)->~Component();
+}
+} // namespace detail
+
+template <typename Component>
+const peComponentTypeInfo &peComponentTypeInfo::Of() {
+  static const peComponentTypeInfo s_info = {
+      sizeof(Component), alignof(Component),
+      std::is_trivially_copyable_v<Component>
+          ? nullptr
+          : &detail::RelocateComponent<Component>,
+      std::is_trivially_destructible_v<Component>
+          ? nullptr
+          : &detail::DestructComponent<Component>};
+  return s_info;
+}
+
+//! \brief Stores all entities that have the same set of components. Entities
+//! live in fixed-size chunks, and each chunk holds one tightly packed array per
+//! component type plus an array of the entity handles. Rows are kept dense by
+//! moving the last row into every removed one, so iterating an archetype walks
+//! straight through memory
+class PE_CORE_API peArchetype {
+public:
+  //! \brief Target size of each chunk. Chunks only get larger if a single row
+  //! doesn't fit
+  constexpr static size_t TargetChunkSize = 16 * 1024;
+  constexpr static uint32_t InvalidEntityIndex = ~0u;
+
+  //! \param mask Components of the archetype
+  //! \param componentTypes Type infos of all registered components, indexed
+  //! by family
+  //! \param allocator Allocator for the chunks
+  peArchetype(const peComponentBitmask &mask,
+              const peVector<const peComponentTypeInfo *> &componentTypes,
+              IAllocator *allocator);
+  //! \brief Destroys the components of all rows
+  ~peArchetype();
+
+  peArchetype(const peArchetype &) = delete;
+  peArchetype &operator=(const peArchetype &) = delete;
+
+  const peComponentBitmask &GetMask() const { return _mask; }
+  //! \brief Number of rows, i.e. entities in the archetype
+  uint32_t Size() const { return _size; }
+  //! \brief Number of rows that fit into one chunk
+  uint32_t ChunkCapacity() const { return _chunkCapacity; }
+  //! \brief Number of chunks that contain rows
+  size_t NumChunks() const {
+    return (static_cast<size_t>(_size) + _chunkCapacity - 1) / _chunkCapacity;
+  }
+  //! \brief Number of rows in the given chunk
+  uint32_t NumRowsInChunk(size_t chunkIdx) const {
+    const auto first = chunkIdx * _chunkCapacity;
+    return static_cast<uint32_t>(
+        std::min<size_t>(_size - first, _chunkCapacity));
+  }
+
+  //! \brief Entity handles of all rows in the given chunk
+  const peEntity::Handle *GetEntities(size_t chunkIdx) const {
+    return reinterpret_cast<const peEntity::Handle *>(_chunks[chunkIdx]);
+  }
+  //! \brief Array of the components of the given family in the given chunk,
+  //! or nullptr if the archetype doesn't contain this component
+  void *GetColumn(size_t chunkIdx, peBaseComponent::Family_t family) const {
+    if (!_mask.test(family))
+      return nullptr;
+    return _chunks[chunkIdx] + _columns[_columnOfFamily[family]].offset;
+  }
+
+  const peEntity::Handle &GetEntity(uint32_t row) const {
+    return GetEntities(row / _chunkCapacity)[row % _chunkCapacity];
+  }
+  //! \brief Component of the given family in the given row. The archetype must
+  //! contain the component
+  void *GetComponent(uint32_t row, peBaseComponent::Family_t family) const {
+    const auto &column = _columns[_columnOfFamily[family]];
+    return _chunks[row / _chunkCapacity] + column.offset +
+           (row % _chunkCapacity) * column.type->size;
+  }
+
+  //! \brief Allocates the chunks for the given number of rows up front
+  void Reserve(uint32_t numRows);
+  //! \brief Appends a row for the given entity. The components of the new row
+  //! are not constructed
+  //! \returns Index of the new row
+  uint32_t AddRow(const peEntity::Handle &entity);
+  //! \brief Removes a row by moving the last row into it. The components of
+  //! the row have to be destroyed or relocated already
+  //! \returns Index of the entity that moved into the row, or
+  //! InvalidEntityIndex if the removed row was the last one
+  uint32_t RemoveRow(uint32_t row);
+  //! \brief Relocates all components of a row that the target archetype also
+  //! contains to a row of the target. Components that the target doesn't
+  //! contain have to be destroyed before
+  void RelocateRow(uint32_t row, peArchetype &target, uint32_t targetRow);
+  //! \brief Destroys all components of a row
+  void DestroyRow(uint32_t row);
+
+private:
+  struct Column {
+    peBaseComponent::Family_t family;
+    const peComponentTypeInfo *type;
+    //! \brief Offset of the array of this component inside each chunk
+    size_t offset;
+  };
+
+  //! \brief Computes the column offsets for the given number of rows per chunk
+  //! \returns Number of bytes of a chunk
+  size_t Layout(uint32_t rowsPerChunk);
+
+  const peComponentBitmask _mask;
+  IAllocator *const _allocator;
+  peVector<Column> _columns;
+  uint8_t _columnOfFamily[peBaseComponent::MAX_COMPONENTS];
+  size_t _chunkBytes;
+  size_t _chunkAlignment;
+  uint32_t _chunkCapacity;
+  uint32_t _size;
+  peVector<char *> _chunks;
+};
+
+#pragma endregion
+
 #pragma region Systems
 
 namespace {
@@ -247,6 +437,19 @@ struct PE_CORE_API peBaseComponentSystem {
   virtual ~peBaseComponentSystem() {}
 
   virtual void OnUpdateAll() = 0;
+  //! \brief Like OnUpdateAll, but splits the update into chunks that run in
+  //! parallel on the given task system, if the system declares its accesses
+  virtual void OnUpdateAll(peTaskSystem &taskSystem) = 0;
+
+  //! \brief Does the system define an OnUpdate method?
+  virtual bool HasUpdate() const = 0;
+  //! \brief Does the system declare the components that it reads and writes?
+  //! Systems without declarations are assumed to access all components
+  virtual bool DeclaresAccess() const = 0;
+  //! \brief Components that the update of this system reads
+  virtual peComponentBitmask GetReadMask() const = 0;
+  //! \brief Components that the update of this system writes
+  virtual peComponentBitmask GetWriteMask() const = 0;
 };
 
 //! \brief Base class for all systems that interact with components. All systems
@@ -257,14 +460,28 @@ struct PE_CORE_API peBaseComponentSystem {
 //!   OnCreate(Component&, const peEntity&) : Gets called when a component is
 //!   created \n OnDestroy(Component&, const peEntity&) : Gets called right
 //!   before a component is destroyed \n OnUpdate(Component&, const peEntity&) :
-//!   Gets called once per frame during the engine update phase
+//!   Gets called once per frame during the engine update phase \n
+//! Systems with an OnUpdate method can declare the components that it accesses
+//! besides its own component through the type aliases Reads_t and Writes_t,
+//! e.g. using Reads_t = mdv::meta::Typelist<peTransformComponent>. Such systems
+//! are updated in parallel with systems that access other components, and
+//! their OnUpdate gets called for many components at once, so it must not touch
+//! other components than the declared ones
 //! \tparam System The subclass that is inheriting from this class (as per CRTP)
 template <typename System>
 class peComponentSystem : public peBaseComponentSystem {
 public:
   //! \brief Gets called once per frame to call an update method on all
-  //! components of type <paramref name="Component">
+  //! components of type <paramref name="Component">. OnUpdate must not add or
+  //! remove components, since the components are visited chunk by chunk
   void OnUpdateAll() override;
+  void OnUpdateAll(peTaskSystem &taskSystem) override;
+
+  bool HasUpdate() const override;
+  bool DeclaresAccess() const override;
+  peComponentBitmask GetReadMask() const override;
+  //! \brief The own component is always written if the system has an update
+  peComponentBitmask GetWriteMask() const override;
 
 private:
   friend class peEntityManager;
@@ -311,87 +528,72 @@ struct HasOnUpdate<System, std::void_t<decltype(std::declval<System>().OnUpdate(
                                std::declval<typename System::Component_t &>(),
                                std::declval<const peEntity &>()))>>
     : std::true_type {};
-} // namespace detail
-#pragma endregion
 
-#pragma region IteratorPredicates
-//! \brief Iterator predicate that checks that an entity has all of the given
-//! components
-template <typename... Components> struct AllOfPredicate {
-  bool operator()(uint32_t index, peEntityManager &entityManager) const;
-};
-#pragma endregion
+template <typename System, typename = std::void_t<>>
+struct HasReads : std::false_type {};
 
-#pragma region peEntityManager
+template <typename System>
+struct HasReads<System, std::void_t<typename System::Reads_t>>
+    : std::true_type {};
 
-namespace detail {
-struct AlwaysTrue {
-  template <typename... Args> constexpr bool operator()(Args &&...) const {
-    return true;
+template <typename System, typename = std::void_t<>>
+struct HasWrites : std::false_type {};
+
+template <typename System>
+struct HasWrites<System, std::void_t<typename System::Writes_t>>
+    : std::true_type {};
+
+//! \brief Bitmask of all components in a mdv::meta::Typelist
+template <typename List> struct TypelistBitmask {};
+
+template <typename... Components>
+struct TypelistBitmask<mdv::meta::Typelist<Components...>> {
+  static peComponentBitmask Get() {
+    return MakeBitmaskForComponents<Components...>();
   }
 };
 } // namespace detail
+#pragma endregion
+
+#pragma region peEntityManager
 
-//! \brief Manages lifecycle of entities and their components. Stores all
-//! component references in containers, one for each type of component. Stores a
-//! bitmask which indicates which entity has which components assigned.
+//! \brief Manages lifecycle of entities and their components. Components are
+//! stored in archetypes, one for each combination of component types that is in
+//! use, so memory scales with the components that entities actually have.
+//! Stores a bitmask which indicates which entity has which components assigned.
+//! Every change to a component bumps a version counter of its type, so
+//! consumers like the renderer only need to update what changed.
 class PE_CORE_API peEntityManager {
 public:
-  //! \brief Basic iterator
-  template <typename Predicate = detail::AlwaysTrue> class BaseIterator {
+  //! \brief Iterator for all living entities that have a given set of
+  //! components. Scans the alive bitset one word of 64 entities at a time and
+  //! only looks at the component masks of living entities
+  class EntityIterator {
   public:
-    BaseIterator(uint32_t startIndex, peEntityManager &entityManager)
-        : _entityManager(entityManager), _index(startIndex) {
-      GoToFirstValid();
+    EntityIterator(uint32_t startIndex, peEntityManager &entityManager,
+                   const peComponentBitmask &requiredComponents = {})
+        : _entityManager(entityManager),
+          _requiredComponents(requiredComponents),
+          _index(entityManager.FindNextEntity(startIndex, requiredComponents)) {
     }
 
-    BaseIterator &operator++() {
+    EntityIterator &operator++() {
       if (IsAtEnd())
         return *this;
-      Next();
+      _index = _entityManager.FindNextEntity(_index + 1, _requiredComponents);
       return *this;
     }
-    bool operator==(const BaseIterator &other) const {
+    bool operator==(const EntityIterator &other) const {
       return (&other._entityManager == &_entityManager) &&
              other._index == _index;
     }
 
-    bool operator!=(const BaseIterator &other) const {
+    bool operator!=(const EntityIterator &other) const {
       return !operator==(other);
     }
 
     bool IsAtEnd() const { return _index == _entityManager.Capacity(); }
 
-  protected:
-    peEntityManager &_entityManager;
-    uint32_t _index;
-
-  private:
-    void Next() {
-      // Skip all dead entities and all entities that don't match the predicate
-      do {
-        ++_index;
-      } while (!IsAtEnd() && (!_entityManager.IsAlive(_index) ||
-                              !Predicate{}(_index, _entityManager)));
-    }
-
-    //! \brief Move to the first valid index from the current position. If the
-    //! current index is valid, do nothing
-    void GoToFirstValid() {
-      while (!IsAtEnd() && (!_entityManager.IsAlive(_index) ||
-                            !Predicate{}(_index, _entityManager))) {
-        ++_index;
-      }
-    }
-  };
-
-  //! \brief Iterator for entites
-  template <typename Predicate = detail::AlwaysTrue>
-  class EntityIterator : public BaseIterator<Predicate> {
-  public:
-    EntityIterator(uint32_t startIndex, peEntityManager &entityManager)
-        : BaseIterator<Predicate>(startIndex, entityManager) {}
-
     peEntity operator*() const {
       auto version = _entityManager._entityVersions[_index];
       return {{_index, version}, _entityManager};
@@ -399,31 +601,73 @@ public:
 
     auto begin() const { return *this; }
     auto end() const {
-      return EntityIterator<Predicate>{
-          static_cast<uint32_t>(_entityManager.Capacity()), _entityManager};
+      return EntityIterator{static_cast<uint32_t>(_entityManager.Capacity()),
+                            _entityManager, _requiredComponents};
     }
+
+  private:
+    peEntityManager &_entityManager;
+    peComponentBitmask _requiredComponents;
+    uint32_t _index;
   };
 
-  //! \brief Iterator for components of a given type
+  //! \brief Iterator for components of a given type. Walks the rows of all
+  //! archetypes that contain the component, so the order is that of the
+  //! storage and not that of the entity indices
   //! \tparam Component Component type
-  template <typename Component, typename Predicate = detail::AlwaysTrue>
-  class ComponentIterator : public BaseIterator<Predicate> {
+  template <typename Component> class ComponentIterator {
   public:
-    ComponentIterator(uint32_t startIndex, peEntityManager &entityManager)
-        : BaseIterator<Predicate>(startIndex, entityManager) {}
+    ComponentIterator(size_t archetypeIdx, peEntityManager &entityManager)
+        : _entityManager(entityManager), _archetypeIdx(archetypeIdx), _row(0) {
+      SkipToValid();
+    }
+
+    ComponentIterator &operator++() {
+      if (IsAtEnd())
+        return *this;
+      ++_row;
+      SkipToValid();
+      return *this;
+    }
+    bool operator==(const ComponentIterator &other) const {
+      return (&other._entityManager == &_entityManager) &&
+             other._archetypeIdx == _archetypeIdx && other._row == _row;
+    }
+    bool operator!=(const ComponentIterator &other) const {
+      return !operator==(other);
+    }
+
+    bool IsAtEnd() const {
+      return _archetypeIdx == _entityManager._archetypes.size();
+    }
 
     peComponentHandle<Component> operator*() const {
-      // Assumes that the BaseIterator takes care of invalid components etc.
-      auto entityHandle =
-          peEntity::Handle(_index, _entityManager._entityVersions[_index]);
-      return _entityManager.GetComponentForEntity<Component>(entityHandle);
+      const auto &archetype = *_entityManager._archetypes[_archetypeIdx];
+      return {archetype.GetEntity(_row), &_entityManager};
     }
 
     auto begin() const { return *this; }
     auto end() const {
-      return ComponentIterator<Component, Predicate>{
-          static_cast<uint32_t>(_entityManager.Capacity()), _entityManager};
+      return ComponentIterator<Component>{_entityManager._archetypes.size(),
+                                          _entityManager};
+    }
+
+  private:
+    //! \brief Moves on to the next archetype that contains the component if
+    //! the current one has no more rows
+    void SkipToValid() {
+      const auto family = GetFamilyOf<Component>();
+      for (; !IsAtEnd(); ++_archetypeIdx, _row = 0) {
+        const auto &archetype = *_entityManager._archetypes[_archetypeIdx];
+        if (archetype.GetMask().test(family) && _row < archetype.Size())
+          return;
+      }
+      _row = 0;
     }
+
+    peEntityManager &_entityManager;
+    size_t _archetypeIdx;
+    uint32_t _row;
   };
 
   peEntityManager() = default;
@@ -434,6 +678,10 @@ public:
   //! \brief Creates a new entity
   //! \returns New entity
   peEntity CreateEntity();
+  //! \brief Creates the given number of entities at once, growing the entity
+  //! arrays only once
+  //! \returns Handles of the new entities
+  peVector<peEntity::Handle> CreateEntities(uint32_t count);
 
   //! \brief Destroys the given entity
   //! \param entityHandle Handle to an entity
@@ -467,18 +715,28 @@ public:
       throw std::runtime_error{
           "Entity already contains a component of this type!"};
     auto family = GetFamilyOf<Component>();
-    EnsureComponentPoolExists<Component>(family);
+    RegisterComponentType(family, peComponentTypeInfo::Of<Component>());
     EnsureComponentSystemExists<Component>(family);
-    auto &pool = _componentPools[family];
-    // TODO By doing it this way, each entity occupies space for ALL possible
-    // components, even if they are not used...
-    // Create the new component...
-    auto componentMemory = pool->Get(entityHandle.index);
-    auto component =
-        new (componentMemory) Component{std::forward<Args>(args)...};
-    //... and set the bit in the components mask
-    auto &componentsMask = _entityComponentMasks[entityHandle.index];
-    componentsMask.set(family, true);
+
+    // The entity moves to the archetype that has the new component on top of
+    // its current ones. The new component is constructed first, so that a
+    // throwing constructor leaves the entity untouched
+    auto newMask = _entityComponentMasks[entityHandle.index];
+    newMask.set(family, true);
+    const auto archetypeIdx = GetOrCreateArchetype(newMask);
+    auto &archetype = *_archetypes[archetypeIdx];
+    const auto row = archetype.AddRow(entityHandle);
+    Component *component;
+    try {
+      component = new (archetype.GetComponent(row, family))
+          Component{std::forward<Args>(args)...};
+    } catch (...) {
+      archetype.RemoveRow(row);
+      throw;
+    }
+    MoveEntity(entityHandle.index, archetypeIdx, row);
+    _entityComponentMasks[entityHandle.index] = newMask;
+    MarkChanged(family, entityHandle);
 
     // If system is registered for component type, notify of component
     // creation
@@ -491,6 +749,24 @@ public:
 
     return {entityHandle, this};
   }
+  //! \brief Adds a default-constructed component of type <paramref
+  //! name="Component"/> to each of the given entities. The target archetypes
+  //! are reserved once and the system is notified after all components were
+  //! constructed. Throws before adding anything if one of the entities is
+  //! invalid, already contains such a component or is given more than once
+  //! \param entityHandles Handles to the entities, each at most once
+  template <typename Component>
+  void AddComponents(gsl::span<const peEntity::Handle> entityHandles) {
+    AddComponents<Component>(entityHandles,
+                             [](const peEntity &) { return Component{}; });
+  }
+  //! \brief Like AddComponents(entityHandles), but constructs each component
+  //! from the result of init(const peEntity&). If init throws, the entities
+  //! before keep their new components and the system is notified of them
+  //! before the exception is passed on
+  template <typename Component, typename Init>
+  void AddComponents(gsl::span<const peEntity::Handle> entityHandles,
+                     const Init &init);
   //! \brief Tries to remove the component of type <paramref name="Component"/>
   //! from the given entity \param entityHandle Handle to the entity
   template <typename Component>
@@ -501,11 +777,21 @@ public:
     if (!componentHandle.IsValid())
       return;
 
+    // Make room in the new archetype before anything is destroyed
+    auto family = GetFamilyOf<Component>();
+    auto newMask = _entityComponentMasks[entityHandle.index];
+    newMask.set(family, false);
+    auto archetypeIdx = NoArchetype;
+    uint32_t row = 0;
+    if (newMask.any()) {
+      archetypeIdx = GetOrCreateArchetype(newMask);
+      row = _archetypes[archetypeIdx]->AddRow(entityHandle);
+    }
+
     auto component = DerefComponentHandle(componentHandle);
 
     // If system is registered for componen type, notify of component
     // destruction
-    auto family = GetFamilyOf<Component>();
     auto system = _systems[family].get();
     if constexpr (HasAssociatedSystem_v<Component>) {
       using System_t = typename Component::System_t;
@@ -515,8 +801,9 @@ public:
 
     component->~Component();
 
-    auto &componentsMask = _entityComponentMasks[entityHandle.index];
-    componentsMask.flip(GetFamilyOf<Component>());
+    MoveEntity(entityHandle.index, archetypeIdx, row);
+    _entityComponentMasks[entityHandle.index] = newMask;
+    MarkChanged(family, entityHandle);
   }
 
   //! \brief Returns a handle to the component of type <paramref
@@ -544,35 +831,46 @@ public:
 
   //! \brief Returns an iterator to iterate over all entities
   //! \returns Iterator to iterate over all entities
-  EntityIterator<> All();
+  EntityIterator All();
   //! \brief Returns an iterator to iterate over all entites that have all of
   //! the given components assigned \tparam Components Zero or more component
   //! types \returns Iterator to iterate over all entities that have the given
   //! components assigned
   template <typename... Components> decltype(auto) AllWith() {
-    return EntityIterator<AllOfPredicate<Components...>>{0, *this};
+    return EntityIterator{0, *this, MakeBitmaskForComponents<Components...>()};
   }
 
   //! \brief Returns an iterator to iterate over all components of the given
   //! type \tparam Component Component type \returns Iterator to iterate over
   //! all components of type <paramref name="Component"/>
   template <typename Component> decltype(auto) AllComponents() {
-    return ComponentIterator<Component, AllOfPredicate<Component>>{0, *this};
+    return ComponentIterator<Component>{0, *this};
   }
 
-  //! \brief Applies the given function to each entity that has the given set of
-  //! components assigned. If <paramref name="Components"/> contains no types,
-  //! all entities will be enumerated \param func Function to call on each
-  //! matching entity \tparam Components Zero or more component types
-  template <typename... Components>
-  void
-  ForEach(const std::function<void(peEntity, peComponentHandle<Components>...)>
-              &func) const {
-    auto iter = AllWith<Components...>();
-    for (auto entity : iter) {
-      func(entity, GetComponentForEntity<Components>(entity.GetHandle())...);
-    }
-  }
+  //! \brief Returns a view of all entities that have the given components.
+  //! The matching archetypes are cached per set of components, so repeated
+  //! queries only look at archetypes that were created since
+  //! \tparam Components One or more component types
+  template <typename... Components> peQueryView<Components...> Query();
+
+  //! \brief Calls func(peEntity, Components &...) for each entity that has the
+  //! given set of components assigned. If <paramref name="Components"/>
+  //! contains no types, all entities will be enumerated. Entities are visited
+  //! archetype by archetype, and func receives references into the archetype
+  //! chunks, so it must not add or remove components or destroy entities
+  //! \param func Function to call on each matching entity
+  //! \tparam Components Zero or more component types
+  template <typename... Components, typename Func>
+  void ForEach(const Func &func);
+
+  //! \brief Calls func(const peEntity::Handle *entities, uint32_t count,
+  //! Components *...components) once for every chunk that stores entities
+  //! with the given components. The components of a chunk are tightly packed,
+  //! which makes this the fastest way to process components. Components must
+  //! not be added or removed while iterating
+  //! \tparam Components One or more component types
+  template <typename... Components, typename Func>
+  void ForEachChunk(const Func &func);
 
   //!\brief Returns true if the given entity has all of the given components
   //! \param entityHandle Handle to an entity
@@ -594,12 +892,74 @@ public:
   //! does not exist
   peEntity GetEntityAt(uint32_t index);
 
+  //! \brief Returns the index of the first living entity at or after the
+  //! given index that has all of the required components
+  //! \returns Index of the entity, or Capacity() if there is none
+  uint32_t FindNextEntity(uint32_t index,
+                          const peComponentBitmask &requiredComponents) const;
+
   //! \brief Returns a pointer to the component system for the given componen
   //! type
   template <typename Component> decltype(auto) GetComponentSystem() const;
+  //! \brief All component systems, indexed by the family of their component.
+  //! Families without a system have a null entry
+  const peVector<std::unique_ptr<peBaseComponentSystem>> &
+  GetComponentSystems() const {
+    return _systems;
+  }
+
+  //! \brief Version of the last change to any component. Versions only grow,
+  //! so consumers remember the version that they are up to date with and ask
+  //! for the changes since then
+  uint64_t GetVersion() const {
+    return _version.load(std::memory_order_acquire);
+  }
+  //! \brief Version of the last change to a component of the given type, 0 if
+  //! no such component ever changed
+  template <typename Component> uint64_t GetComponentVersion() const {
+    return _componentChanges[GetFamilyOf<Component>()].version.load(
+        std::memory_order_acquire);
+  }
+  //! \brief Did any component of the given type change after the given
+  //! version?
+  template <typename Component> bool HasChangedSince(uint64_t version) const {
+    return GetComponentVersion<Component>() > version;
+  }
+
+  //! \brief Marks the component of the given type of an entity as changed.
+  //! Adding and removing components and mutable access through component
+  //! handles do this already. Components that are written through ForEach,
+  //! ForEachChunk, Query or the OnUpdate of a system have to be marked by hand.
+  //! May be called concurrently. Every call bumps the version of the whole
+  //! manager with an atomic increment, so threads that write components
+  //! through mutable handles at the same time contend on it. Hot loops should
+  //! read through const handles, or write through ForEachChunk and only mark
+  //! the entities that they actually changed
+  template <typename Component>
+  void MarkChanged(peEntity::Handle entityHandle) {
+    MarkChanged(GetFamilyOf<Component>(), entityHandle);
+  }
+
+  //! \brief Starts or stops recording which entities changed their component
+  //! of the given type. Stopping discards the recorded changes
+  template <typename Component> void TrackChangedEntities(bool track = true) {
+    SetTrackChangedEntities(GetFamilyOf<Component>(), track);
+  }
+  //! \brief Calls func(peEntity) for every recorded change of a component of
+  //! the given type after the given version, in the order of the changes. An
+  //! entity shows up once per change, and entities that were destroyed since
+  //! are passed as well, so func has to check if they are alive
+  template <typename Component, typename Func>
+  void ForEachChangedEntity(uint64_t sinceVersion, const Func &func);
+  //! \brief Drops the recorded changes of the given type up to and including
+  //! the given version, once every consumer has seen them
+  template <typename Component> void DiscardChanges(uint64_t upToVersion) {
+    DiscardChanges(GetFamilyOf<Component>(), upToVersion);
+  }
 
 private:
   template <typename Component> friend class peComponentHandle;
+  template <typename... Components> friend class peQueryView;
 
   //! \brief Dereferences a component handle, returning a pointer to the actual
   //! component \param handle Component handle \returns Pointer to actual
@@ -615,30 +975,52 @@ private:
     auto &entityMask = _entityComponentMasks[entityHandle.index];
     if (!entityMask.test(family))
       return nullptr;
-    auto &pool = _componentPools[family];
-    return reinterpret_cast<Component *>(pool->Get(entityHandle.index));
+    const auto &location = _entityLocations[entityHandle.index];
+    return static_cast<Component *>(
+        _archetypes[location.archetype]->GetComponent(location.row, family));
   }
 
-  //! \brief Makes sure that the component pool for the component of type
-  //! <paramref name="Component"/> has been
-  //!        created
-  //! \param family Component family. We pass this in so that we don't have to
-  //! look it up again
-  template <typename Component>
-  void EnsureComponentPoolExists(peBaseComponent::Family_t family) {
-    if (_componentPools.size() <= family)
-      _componentPools.resize(family + 1);
-    auto &pool = _componentPools[family];
-    if (!pool) {
-      pool = std::make_unique<pePool<Component>>();
-    }
-    pool->Reserve(_entityVersions.size());
-  }
+  //! \brief Where the components of an entity are stored
+  struct EntityLocation {
+    uint32_t archetype;
+    uint32_t row;
+  };
+  //! \brief Archetype index of entities without components, which are not
+  //! stored in any archetype
+  constexpr static uint32_t NoArchetype = ~0u;
+
+  //! \brief Remembers the type info of a component type for new archetypes
+  void RegisterComponentType(peBaseComponent::Family_t family,
+                             const peComponentTypeInfo &typeInfo);
+  //! \returns Index of the archetype for the given components
+  uint32_t GetOrCreateArchetype(const peComponentBitmask &mask);
+  //! \brief Returns the indices of all archetypes that contain at least the
+  //! given components. The reference stays valid for the lifetime of the
+  //! entity manager, but the list grows when new archetypes are created.
+  //! Thread-safe, component systems that run in parallel query at the same
+  //! time
+  const peVector<uint32_t> &
+  GetMatchingArchetypes(const peComponentBitmask &mask);
+  //! \brief Moves an entity from its current archetype to a row that was
+  //! added to the target archetype. Relocates all components that both
+  //! archetypes share, components that the target lacks have to be destroyed
+  //! before. The components that only the target has are not touched
+  //! \param entityIndex Index of the entity
+  //! \param archetypeIdx Target archetype, or NoArchetype
+  //! \param row Row in the target archetype
+  void MoveEntity(uint32_t entityIndex, uint32_t archetypeIdx, uint32_t row);
+
+  void MarkChanged(peBaseComponent::Family_t family,
+                   peEntity::Handle entityHandle);
+  void SetTrackChangedEntities(peBaseComponent::Family_t family, bool track);
+  void DiscardChanges(peBaseComponent::Family_t family, uint64_t upToVersion);
 
   template <typename Component>
   void EnsureComponentSystemExists(peBaseComponent::Family_t family) {
     if (_systems.size() <= family)
       _systems.resize(family + 1);
+    if (_systems[family])
+      return;
     if constexpr (HasAssociatedSystem_v<Component>) {
       using System_t = typename Component::System_t;
       auto sys = std::make_unique<System_t>();
@@ -647,10 +1029,27 @@ private:
     }
   }
 
-  // One object pool for each type of components
-  peVector<std::unique_ptr<peBasePool>> _componentPools;
+  // Type infos of all component types that were added so far, by family
+  peVector<const peComponentTypeInfo *> _componentTypes;
+  // One archetype for each combination of components in use. Archetypes are
+  // never removed, so their indices stay valid
+  peVector<std::unique_ptr<peArchetype>> _archetypes;
+  peUnorderedMap<peComponentBitmask, uint32_t> _archetypeIndices;
+  // Archetype and row of each entity
+  peVector<EntityLocation> _entityLocations;
+  //! \brief Archetypes that match a query. Archetypes are never removed, so a
+  //! cache only ever has to check the archetypes that were created since
+  struct QueryCache {
+    peVector<uint32_t> archetypes;
+    size_t numArchetypesChecked = 0;
+  };
+  peUnorderedMap<peComponentBitmask, QueryCache> _queryCaches;
+  // Guards the query caches
+  std::mutex _queryCachesLock;
   // Bitmasks for each entity that indicate which components the entity has
   peVector<peComponentBitmask> _entityComponentMasks;
+  // One bit per entity slot that is set while the entity is alive
+  peVector<uint64_t> _aliveBits;
   // Version indices for the entity handles. Each time an entity gets destroyed
   // the index is incremented by one, this invalidates all the handles
   peVector<uint32_t> _entityVersions;
@@ -659,6 +1058,89 @@ private:
   peVector<uint32_t> _freeSlots;
   // The systems that interact with components
   peVector<std::unique_ptr<peBaseComponentSystem>> _systems;
+  //! \brief A change to a component of one entity
+  struct ComponentChange {
+    peEntity::Handle entity;
+    uint64_t version;
+  };
+  //! \brief Change tracking of one component type
+  struct ComponentChanges {
+    std::atomic<uint64_t> version{0};
+    bool trackEntities = false;
+    // Sorted by version
+    peVector<ComponentChange> entities;
+  };
+  // Counts up with every change
+  std::atomic<uint64_t> _version{0};
+  std::array<ComponentChanges, peBaseComponent::MAX_COMPONENTS>
+      _componentChanges;
+  // Guards the changed entities, which are recorded from parallel updates
+  std::mutex _changedEntitiesLock;
+};
+
+#pragma endregion
+
+#pragma region peQueryView
+
+//! \brief View of all entities that have a given set of components. Hands out
+//! raw pointers into the archetype chunks, which stay valid until components
+//! are added or removed or entities are destroyed, so the view is meant to be
+//! used for the duration of one loop
+//! \tparam Components One or more component types
+template <typename... Components> class peQueryView {
+public:
+  static_assert(sizeof...(Components) > 0,
+                "A query needs at least one component type!");
+
+  peQueryView(peEntityManager &entityManager,
+              const peVector<uint32_t> &archetypes)
+      : _entityManager(entityManager), _archetypes(archetypes) {}
+
+  //! \brief Calls func(const peEntity::Handle *entities, uint32_t count,
+  //! Components *...components) for every chunk of the matching archetypes
+  template <typename Func> void ForEachChunk(const Func &func) const {
+    const Families_t families = {GetFamilyOf<Components>()...};
+    for (size_t idx = 0; idx < _archetypes.size(); ++idx) {
+      const auto &archetype = *_entityManager._archetypes[_archetypes[idx]];
+      for (size_t chunkIdx = 0; chunkIdx < archetype.NumChunks(); ++chunkIdx) {
+        InvokeForChunk(func, archetype, chunkIdx, families,
+                       std::index_sequence_for<Components...>{});
+      }
+    }
+  }
+
+  //! \brief Calls func(peEntity, Components &...) for every matching entity
+  template <typename Func> void ForEach(const Func &func) const {
+    ForEachChunk([&](const peEntity::Handle *entities, uint32_t count,
+                     Components *... components) {
+      for (uint32_t row = 0; row < count; ++row)
+        func(peEntity{entities[row], _entityManager}, components[row]...);
+    });
+  }
+
+  //! \brief Returns the number of matching entities
+  size_t Size() const {
+    size_t size = 0;
+    for (size_t idx = 0; idx < _archetypes.size(); ++idx)
+      size += _entityManager._archetypes[_archetypes[idx]]->Size();
+    return size;
+  }
+
+private:
+  using Families_t =
+      std::array<peBaseComponent::Family_t, sizeof...(Components)>;
+
+  template <typename Func, size_t... Indices>
+  static void InvokeForChunk(const Func &func, const peArchetype &archetype,
+                             size_t chunkIdx, const Families_t &families,
+                             std::index_sequence<Indices...>) {
+    func(archetype.GetEntities(chunkIdx), archetype.NumRowsInChunk(chunkIdx),
+         static_cast<Components *>(
+             archetype.GetColumn(chunkIdx, families[Indices]))...);
+  }
+
+  peEntityManager &_entityManager;
+  const peVector<uint32_t> &_archetypes;
 };
 
 #pragma endregion
@@ -708,17 +1190,16 @@ Component *peComponentHandle<Component>::Dereference() const {
 }
 
 template <typename Component>
-peEntity peComponentHandle<Component>::GetEntity() const {
-  return peEntity{_entityHandle, *_entityManager};
+Component *peComponentHandle<Component>::DereferenceMutable() const {
+  auto component = Dereference();
+  if (component)
+    _entityManager->MarkChanged<Component>(_entityHandle);
+  return component;
 }
-#pragma endregion
 
-#pragma region IteratorPredicateTemplates
-template <typename... Components>
-bool AllOfPredicate<Components...>::
-operator()(uint32_t index, peEntityManager &entityManager) const {
-  return entityManager.HasAllOf<Components...>(
-      entityManager.GetEntityAt(index).GetHandle());
+template <typename Component>
+peEntity peComponentHandle<Component>::GetEntity() const {
+  return peEntity{_entityHandle, *_entityManager};
 }
 #pragma endregion
 
@@ -760,17 +1241,202 @@ template <typename System> void peComponentSystem<System>::OnUpdateAll() {
     // of the OnUpdate function on class System
     using Component_t = std::decay_t<typename FirstFunctionArgument<decltype(
         &System::OnUpdate)>::FirstArgument_t>;
-    auto all = _entityManager->AllComponents<Component_t>();
-    for (auto &comp : all) {
-      static_cast<System *>(this)->OnUpdate(*comp, comp.GetEntity());
+    _entityManager->ForEachChunk<Component_t>(
+        [this](const peEntity::Handle *entities, uint32_t count,
+               Component_t *components) {
+          for (uint32_t idx = 0; idx < count; ++idx) {
+            static_cast<System *>(this)->OnUpdate(
+                components[idx], peEntity{entities[idx], *_entityManager});
+          }
+        });
+  }
+}
+
+template <typename System>
+void peComponentSystem<System>::OnUpdateAll(peTaskSystem &taskSystem) {
+  if constexpr (detail::HasOnUpdate<System>::value) {
+    // Without declarations, OnUpdate might rely on being called sequentially
+    if (!DeclaresAccess()) {
+      OnUpdateAll();
+      return;
     }
+
+    using Component_t = typename System::Component_t;
+    struct Chunk {
+      const peEntity::Handle *entities;
+      uint32_t count;
+      Component_t *components;
+    };
+    // Chunks are the unit of work, they are large enough to amortize a task
+    peVector<Chunk> chunks;
+    _entityManager->ForEachChunk<Component_t>(
+        [&chunks](const peEntity::Handle *entities, uint32_t count,
+                  Component_t *components) {
+          chunks.push_back({entities, count, components});
+        });
+    ParallelFor(taskSystem, 0, chunks.size(), 1, [this, &chunks](size_t idx) {
+      const auto &chunk = chunks[idx];
+      for (uint32_t row = 0; row < chunk.count; ++row) {
+        static_cast<System *>(this)->OnUpdate(
+            chunk.components[row],
+            peEntity{chunk.entities[row], *_entityManager});
+      }
+    });
   }
 }
 
+template <typename System> bool peComponentSystem<System>::HasUpdate() const {
+  return detail::HasOnUpdate<System>::value;
+}
+
+template <typename System>
+bool peComponentSystem<System>::DeclaresAccess() const {
+  return detail::HasReads<System>::value || detail::HasWrites<System>::value;
+}
+
+template <typename System>
+peComponentBitmask peComponentSystem<System>::GetReadMask() const {
+  peComponentBitmask mask;
+  if constexpr (detail::HasReads<System>::value)
+    mask = detail::TypelistBitmask<typename System::Reads_t>::Get();
+  return mask;
+}
+
+template <typename System>
+peComponentBitmask peComponentSystem<System>::GetWriteMask() const {
+  peComponentBitmask mask;
+  if constexpr (detail::HasWrites<System>::value)
+    mask = detail::TypelistBitmask<typename System::Writes_t>::Get();
+  if constexpr (detail::HasOnUpdate<System>::value)
+    mask |= MakeBitmaskForComponents<typename System::Component_t>();
+  return mask;
+}
+
 #pragma endregion
 
 #pragma region peEntityManagerTemplates
 
+template <typename... Components>
+peQueryView<Components...> peEntityManager::Query() {
+  return {*this,
+          GetMatchingArchetypes(MakeBitmaskForComponents<Components...>())};
+}
+
+template <typename... Components, typename Func>
+void peEntityManager::ForEach(const Func &func) {
+  if constexpr (sizeof...(Components) == 0) {
+    for (auto entity : All())
+      func(entity);
+  } else {
+    Query<Components...>().ForEach(func);
+  }
+}
+
+template <typename... Components, typename Func>
+void peEntityManager::ForEachChunk(const Func &func) {
+  Query<Components...>().ForEachChunk(func);
+}
+
+template <typename Component, typename Init>
+void peEntityManager::AddComponents(
+    gsl::span<const peEntity::Handle> entityHandles, const Init &init) {
+  for (const auto &entityHandle : entityHandles) {
+    if (!IsAlive(entityHandle))
+      throw std::runtime_error{"Can't add component to invalid entity!"};
+    if (GetComponentForEntity<Component>(entityHandle).IsValid())
+      throw std::runtime_error{
+          "Entity already contains a component of this type!"};
+  }
+  // A second occurrence would add a second row for the same entity
+  peVector<uint32_t> indices;
+  indices.reserve(static_cast<size_t>(entityHandles.size()));
+  for (const auto &entityHandle : entityHandles)
+    indices.push_back(entityHandle.index);
+  std::sort(indices.begin(), indices.end());
+  if (std::adjacent_find(indices.begin(), indices.end()) != indices.end())
+    throw std::runtime_error{"Can't add components to an entity twice!"};
+
+  auto family = GetFamilyOf<Component>();
+  RegisterComponentType(family, peComponentTypeInfo::Of<Component>());
+  EnsureComponentSystemExists<Component>(family);
+
+  // Entities that share an archetype also share the target archetype, so the
+  // targets are looked up once per source archetype
+  peUnorderedMap<uint32_t, uint32_t> targetOfSource;
+  peVector<uint32_t> targets;
+  targets.reserve(static_cast<size_t>(entityHandles.size()));
+  for (const auto &entityHandle : entityHandles) {
+    const auto source = _entityLocations[entityHandle.index].archetype;
+    auto iter = targetOfSource.find(source);
+    if (iter == targetOfSource.end()) {
+      auto newMask = _entityComponentMasks[entityHandle.index];
+      newMask.set(family, true);
+      iter = targetOfSource.emplace(source, GetOrCreateArchetype(newMask))
+                 .first;
+    }
+    targets.push_back(iter->second);
+  }
+
+  peUnorderedMap<uint32_t, uint32_t> numRowsOfTarget;
+  for (auto target : targets)
+    ++numRowsOfTarget[target];
+  for (const auto &[target, numRows] : numRowsOfTarget)
+    _archetypes[target]->Reserve(_archetypes[target]->Size() + numRows);
+
+  // Notifies the system of the first numCreated components
+  const auto notifySystem = [&](size_t numCreated) {
+    if constexpr (HasAssociatedSystem_v<Component>) {
+      using System_t = typename Component::System_t;
+      auto system =
+          static_cast<peComponentSystem<System_t> *>(_systems[family].get());
+      // OnCreate might move the entity, so each component is looked up again
+      for (size_t idx = 0; idx < numCreated; ++idx) {
+        const auto &entityHandle = entityHandles[idx];
+        auto component = DerefComponentHandle(
+            peComponentHandle<Component>{entityHandle, this});
+        system->OnCreateComponent(*component, {entityHandle, *this});
+      }
+    }
+  };
+
+  for (size_t idx = 0; idx < targets.size(); ++idx) {
+    const auto &entityHandle = entityHandles[idx];
+    auto &archetype = *_archetypes[targets[idx]];
+    const auto row = archetype.AddRow(entityHandle);
+    try {
+      new (archetype.GetComponent(row, family))
+          Component(init(peEntity{entityHandle, *this}));
+    } catch (...) {
+      archetype.RemoveRow(row);
+      // The components that exist already are kept, so their system has to
+      // know about them like about any other component
+      notifySystem(idx);
+      throw;
+    }
+    MoveEntity(entityHandle.index, targets[idx], row);
+    _entityComponentMasks[entityHandle.index].set(family, true);
+    MarkChanged(family, entityHandle);
+  }
+  notifySystem(targets.size());
+}
+
+template <typename Component, typename Func>
+void peEntityManager::ForEachChangedEntity(uint64_t sinceVersion,
+                                           const Func &func) {
+  const auto &entities = _componentChanges[GetFamilyOf<Component>()].entities;
+  const auto first = std::upper_bound(
+      entities.begin(), entities.end(), sinceVersion,
+      [](uint64_t version, const ComponentChange &change) {
+        return version < change.version;
+      });
+  // func might change components itself, which appends to the changes, so
+  // only the ones that were there up front are visited, by index
+  const auto count = entities.size();
+  for (auto idx = static_cast<size_t>(first - entities.begin()); idx < count;
+       ++idx)
+    func(peEntity{entities[idx].entity, *this});
+}
+
 template <typename Component>
 decltype(auto) peEntityManager::GetComponentSystem() const {
   static_assert(HasAssociatedSystem_v<Component>,
@@ -0,0 +1,64 @@
+#pragma once
+#include "Entities/Entity.h"
+#include "Threading/peTaskGroup.h"
+#include "peCoreDefs.h"
+
+#include <atomic>
+#include <memory>
+
+#pragma warning(push)
+#pragma warning(disable : 4251)
+
+namespace pe {
+
+//! \brief Updates the component systems of an entity manager on a task system.
+//! Two systems conflict if one of them writes a component that the other one
+//! reads or writes. Conflicting systems are updated in the order in which their
+//! components were registered, all others run in parallel. Systems that don't
+//! declare their accesses conflict with every other system
+class PE_CORE_API peSystemScheduler {
+public:
+  peSystemScheduler(peEntityManager &entityManager, peTaskSystem &taskSystem);
+
+  peSystemScheduler(const peSystemScheduler &) = delete;
+  peSystemScheduler &operator=(const peSystemScheduler &) = delete;
+
+  //! \brief Updates every system once and returns when all of them are done.
+  //! The dependency graph is rebuilt on each call, since systems can be added
+  //! at any time. Systems must not create or destroy entities or components
+  //! during the update
+  void Update();
+
+  //! \brief Number of systems that the last update had to wait for, per system
+  //! in the order of their components. Systems without an update are left out
+  const peVector<uint32_t> &GetNumDependencies() const {
+    return _numPredecessors;
+  }
+
+private:
+  struct Node {
+    peBaseComponentSystem *system;
+    bool declaresAccess;
+    peComponentBitmask readMask;
+    peComponentBitmask writeMask;
+    //! \brief Nodes that have to wait for this one
+    peVector<uint32_t> successors;
+  };
+
+  static bool Conflict(const Node &first, const Node &second);
+
+  void BuildGraph();
+  void RunNode(peTaskGroup &group, uint32_t nodeIdx);
+
+  peEntityManager &_entityManager;
+  peTaskSystem &_taskSystem;
+  peVector<Node> _nodes;
+  peVector<uint32_t> _numPredecessors;
+  //! \brief Predecessors of each node that are not finished yet in the
+  //! current update
+  std::unique_ptr<std::atomic<uint32_t>[]> _remainingPredecessors;
+};
+
+} // namespace pe
+
+#pragma warning(pop)
@@ -4,8 +4,12 @@
 #include "peEngine.h"
 
 #include "Type/RAII.h"
+#include <atomic>
 #include <stdint.h>
 
+#pragma warning(push)
+#pragma warning(disable : 4251)
+
 namespace pe {
 
 template <typename T, typename DataStorage> class peRenderResourceBase;
@@ -25,7 +29,13 @@ template <> struct DataStorageHelper<void> {};
 //! class will be available outside of the renderer to all other subsystems
 class PE_CORE_API peRenderResource : peNonCopyable {
 public:
-  auto IsDirty() const { return _dirty; }
+  //! \brief Whether the resource changed since the renderer last copied it into
+  //! its proxy
+  auto IsDirty() const { return _dirty.load(std::memory_order_acquire); }
+  //! \brief Clears the dirty flag. Called by the renderer when it copies the
+  //! resource into its proxy
+  //! \returns True if the resource was dirty
+  bool ConsumeDirty();
 
 protected:
   peRenderResource() = default;
@@ -34,7 +44,9 @@ protected:
   template <typename T> static peWeakTable<T> &WeakTable();
 
 private:
-  bool _dirty;
+  //! \brief Set from whichever thread modifies the resource. New resources
+  //! start out dirty, since the renderer has no proxy for them yet
+  std::atomic<bool> _dirty{true};
 };
 
 //! \brief Actual base class for render resources. Use this instead of
@@ -86,7 +98,8 @@ private:
 #pragma region peRenderResourceBaseImpl
 
 template <typename T> peWeakTable<T> &peRenderResource::WeakTable() {
-  static peWeakTable<T> s_instance;
+  // Assets are loaded in parallel
+  static peConcurrentWeakTable<T> s_instance;
   return s_instance;
 }
 
@@ -105,3 +118,5 @@ peRenderResourceBase<T, DataStorage>::GetDataStorage() const {
 #pragma endregion
 
 } // namespace pe
+
+#pragma warning(pop)
@@ -1,6 +1,7 @@
 #pragma once
 #include "Subsystems\IUpdateSystem.h"
 #include "DataStructures\peVector.h"
+#include "Threading\peTaskSystem.h"
 
 #include <atomic>
 
@@ -15,6 +16,7 @@ namespace pe
 
         void                                       Init() override;
         inline bool                                IsRunning() const override { return _isRunning; }
+        uint32_t                                   Concurrency() const override { return _taskSystem.Concurrency(); }
         void                                       Run() override;
         void                                       Shutdown() override;
         void                                       Stop() override;
@@ -24,7 +26,12 @@ namespace pe
         CallbackID                                 RegisterUpdateCallback(std::function<void(float)> callback) override;
     private:
         peVector<std::function<void(float)>>       _callbacks;
-        bool                                       _isRunning;
+        //! Read by the render thread
+        std::atomic<bool>                          _isRunning;
+        //! Runs the component system updates. Sized to a fraction of the
+        //! processors and not pinned, the renderer pins its own runners to
+        //! the rest
+        peTaskSystem                               _taskSystem;
     };
 
 }
\ No newline at end of file
@@ -13,8 +13,15 @@ struct IRenderer {
   virtual void Init() = 0;
   //! Destroy the renderer. Call this once during shutdown
   virtual void Shutdown() = 0;
-  //! Updates the renderer with the given delta time (in seconds)
+  //! Updates the renderer with the given delta time (in seconds). Runs on the
+  //! render thread concurrently to the simulation of the next frame, so it may
+  //! only access the proxies that the last Synchronize created
   virtual void Update(double deltaTime) = 0;
+  //! \brief Copies everything that changed since the last call from the world
+  //! and the render resources into proxies owned by the renderer, and hands
+  //! them over to the render thread. Called on the game thread between two
+  //! frames, while no component systems are running
+  virtual void Synchronize() = 0;
 
   //! \brief Register an entity that shall be drawn
   //! \param entity Entity that contains exactly one renderable component
@@ -26,17 +33,17 @@ struct IRenderer {
 private:
   template <typename T, typename DataStorage> friend class peRenderResourceBase;
 
-  //! \brief Registers a new resource that is relevant to the renderer. This
-  //! will
-  //!        create an internal proxy object that mirrors the resource. The
-  //!        renderer will perform all relevant rendering operations using this
-  //!        proxy object so that rendering operations can happen on multiple
-  //!        threads
+  //! \brief Registers a new resource that is relevant to the renderer. The
+  //!        renderer copies the resource into an internal proxy object during
+  //!        Synchronize whenever it is dirty, and performs all rendering
+  //!        operations using the proxy so that rendering can happen on another
+  //!        thread. May be called from any thread
   //! \param res Resource
   virtual void
   RegisterRenderResource(const peWeakPtr<peRenderResource> &res) = 0;
 
-  //! \brief Deregisters a resource that was previously registered
+  //! \brief Deregisters a resource that was previously registered. May be
+  //! called from any thread
   //! \param res Resource
   virtual void
   DeregisterRenderResource(const peWeakPtr<peRenderResource> &res) = 0;
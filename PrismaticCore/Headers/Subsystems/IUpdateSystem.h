@@ -1,5 +1,6 @@
 #pragma once
 #include "ISubsystem.h"
+#include <cstdint>
 #include <functional>
 
 namespace pe {
@@ -24,6 +25,10 @@ public:
   virtual void Run() = 0;
   //! Stops the game
   virtual void Stop() = 0;
+  //! Number of worker threads that update the component systems, besides the
+  //! thread that runs the game. Other subsystems that start workers should
+  //! leave these processors to the update system
+  virtual uint32_t Concurrency() const = 0;
 
   //! Registers a custom update callback for the game loop
   virtual void DeregisterUpdateCallback(const CallbackID &id) = 0;
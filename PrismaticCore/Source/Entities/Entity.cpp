@@ -1,8 +1,34 @@
 #include "Entities\Entity.h"
 
+#include <cstring>
+#include <mutex>
+#include <string>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 namespace pe {
 
-peBaseComponent::Family_t peBaseComponent::s_familyCounter = 0;
+#pragma region peBaseComponent
+
+peBaseComponent::Family_t
+peBaseComponent::RegisterRuntimeFamily(const char *typeName) {
+  static std::mutex s_lock;
+  static peUnorderedMap<std::string, Family_t> s_families;
+
+  std::lock_guard<std::mutex> guard{s_lock};
+  auto iter = s_families.find(typeName);
+  if (iter != s_families.end())
+    return iter->second;
+  const auto family = NUM_STATIC_COMPONENTS + s_families.size();
+  if (family >= MAX_COMPONENTS)
+    throw std::runtime_error{"Too many component types!"};
+  s_families.emplace(typeName, family);
+  return family;
+}
+
+#pragma endregion
 
 #pragma region peEntity
 
@@ -49,6 +75,157 @@ bool peEntity::IsAlive() const {
 
 #pragma endregion
 
+#pragma region peArchetype
+
+namespace {
+constexpr uint8_t NoColumn = 0xff;
+constexpr size_t MinChunkAlignment = 16;
+
+size_t AlignUp(size_t value, size_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+constexpr uint32_t BitsPerWord = 64;
+
+//! \brief Index of the lowest set bit, word must not be zero
+uint32_t LowestSetBit(uint64_t word) {
+#ifdef _MSC_VER
+  unsigned long idx;
+  _BitScanForward64(&idx, word);
+  return static_cast<uint32_t>(idx);
+#else
+  return static_cast<uint32_t>(__builtin_ctzll(word));
+#endif
+}
+} // namespace
+
+peArchetype::peArchetype(
+    const peComponentBitmask &mask,
+    const peVector<const peComponentTypeInfo *> &componentTypes,
+    IAllocator *allocator)
+    : _mask(mask), _allocator(allocator),
+      _chunkAlignment(
+          std::max(MinChunkAlignment, alignof(peEntity::Handle))),
+      _size(0) {
+  std::fill(std::begin(_columnOfFamily), std::end(_columnOfFamily), NoColumn);
+  size_t bytesPerRow = sizeof(peEntity::Handle);
+  for (size_t family = 0; family < componentTypes.size(); ++family) {
+    if (!mask.test(family))
+      continue;
+    auto type = componentTypes[family];
+    _columnOfFamily[family] = static_cast<uint8_t>(_columns.size());
+    _columns.push_back({family, type, 0});
+    bytesPerRow += type->size;
+    _chunkAlignment = std::max(_chunkAlignment, type->alignment);
+  }
+
+  // Start with the row count that ignores the padding between the columns and
+  // remove rows until the padding fits as well
+  _chunkCapacity = static_cast<uint32_t>(TargetChunkSize / bytesPerRow);
+  while (_chunkCapacity > 1 && Layout(_chunkCapacity) > TargetChunkSize)
+    --_chunkCapacity;
+  _chunkCapacity = std::max(_chunkCapacity, 1u);
+  _chunkBytes = std::max(Layout(_chunkCapacity), TargetChunkSize);
+}
+
+peArchetype::~peArchetype() {
+  for (uint32_t row = 0; row < _size; ++row)
+    DestroyRow(row);
+  for (auto chunk : _chunks)
+    _allocator->Free(chunk);
+}
+
+size_t peArchetype::Layout(uint32_t rowsPerChunk) {
+  // The entity handles come first, followed by one array per component
+  auto offset = static_cast<size_t>(rowsPerChunk) * sizeof(peEntity::Handle);
+  for (auto &column : _columns) {
+    offset = AlignUp(offset, column.type->alignment);
+    column.offset = offset;
+    offset += rowsPerChunk * column.type->size;
+  }
+  return offset;
+}
+
+void peArchetype::Reserve(uint32_t numRows) {
+  const auto numChunks =
+      (static_cast<size_t>(numRows) + _chunkCapacity - 1) / _chunkCapacity;
+  _chunks.reserve(numChunks);
+  while (_chunks.size() < numChunks) {
+    auto chunk = static_cast<char *>(
+        _allocator->Allocate(_chunkBytes, _chunkAlignment));
+    if (!chunk)
+      throw std::runtime_error{"Could not allocate archetype chunk!"};
+    _chunks.push_back(chunk);
+  }
+}
+
+uint32_t peArchetype::AddRow(const peEntity::Handle &entity) {
+  const auto row = _size;
+  const auto chunkIdx = row / _chunkCapacity;
+  if (chunkIdx == _chunks.size()) {
+    auto chunk = static_cast<char *>(
+        _allocator->Allocate(_chunkBytes, _chunkAlignment));
+    if (!chunk)
+      throw std::runtime_error{"Could not allocate archetype chunk!"};
+    _chunks.push_back(chunk);
+  }
+  new (_chunks[chunkIdx] + (row % _chunkCapacity) * sizeof(peEntity::Handle))
+      peEntity::Handle(entity);
+  ++_size;
+  return row;
+}
+
+uint32_t peArchetype::RemoveRow(uint32_t row) {
+  const auto last = _size - 1;
+  auto movedEntity = InvalidEntityIndex;
+  if (row != last) {
+    for (auto &column : _columns) {
+      auto dst = GetComponent(row, column.family);
+      auto src = GetComponent(last, column.family);
+      if (column.type->relocate)
+        column.type->relocate(dst, src);
+      else
+        std::memcpy(dst, src, column.type->size);
+    }
+    const auto &lastEntity = GetEntity(last);
+    new (const_cast<peEntity::Handle *>(&GetEntity(row)))
+        peEntity::Handle(lastEntity);
+    movedEntity = lastEntity.index;
+  }
+  --_size;
+
+  // Keep one empty chunk around, so that an entity that moves back and forth
+  // across a chunk boundary doesn't allocate every time
+  while (_chunks.size() > NumChunks() + 1) {
+    _allocator->Free(_chunks.back());
+    _chunks.pop_back();
+  }
+  return movedEntity;
+}
+
+void peArchetype::RelocateRow(uint32_t row, peArchetype &target,
+                              uint32_t targetRow) {
+  for (auto &column : _columns) {
+    if (!target._mask.test(column.family))
+      continue;
+    auto dst = target.GetComponent(targetRow, column.family);
+    auto src = GetComponent(row, column.family);
+    if (column.type->relocate)
+      column.type->relocate(dst, src);
+    else
+      std::memcpy(dst, src, column.type->size);
+  }
+}
+
+void peArchetype::DestroyRow(uint32_t row) {
+  for (auto &column : _columns) {
+    if (column.type->destruct)
+      column.type->destruct(GetComponent(row, column.family));
+  }
+}
+
+#pragma endregion
+
 #pragma region peEntityManager
 peEntity peEntityManager::CreateEntity() {
   // If there are no free slots, we accomodate a new entity
@@ -56,46 +233,76 @@ peEntity peEntityManager::CreateEntity() {
     const auto version = 0u;
     _entityVersions.push_back(version);
     _entityComponentMasks.emplace_back();
+    _entityLocations.push_back({NoArchetype, 0});
     auto entityCount = static_cast<uint32_t>(_entityComponentMasks.size());
-    for (auto &pool : _componentPools) {
-      if (!pool)
-        continue;
-      pool->Reserve(entityCount);
-    }
+    const auto index = entityCount - 1;
+    if (index / BitsPerWord == _aliveBits.size())
+      _aliveBits.push_back(0);
+    _aliveBits[index / BitsPerWord] |= uint64_t{1} << (index % BitsPerWord);
 
-    return {{entityCount - 1, version}, *this};
+    return {{index, version}, *this};
   }
 
   auto freeIdx = _freeSlots.back();
   _freeSlots.pop_back();
+  _aliveBits[freeIdx / BitsPerWord] |= uint64_t{1} << (freeIdx % BitsPerWord);
   auto version = _entityVersions[freeIdx];
   return {{freeIdx, version}, *this};
 }
 
+peVector<peEntity::Handle> peEntityManager::CreateEntities(uint32_t count) {
+  peVector<peEntity::Handle> handles;
+  handles.reserve(count);
+
+  // Free slots are reused first, like in CreateEntity
+  while (handles.size() < count && !_freeSlots.empty()) {
+    auto freeIdx = _freeSlots.back();
+    _freeSlots.pop_back();
+    _aliveBits[freeIdx / BitsPerWord] |= uint64_t{1} << (freeIdx % BitsPerWord);
+    handles.push_back({freeIdx, _entityVersions[freeIdx]});
+  }
+
+  const auto first = static_cast<uint32_t>(_entityComponentMasks.size());
+  const auto end = first + (count - static_cast<uint32_t>(handles.size()));
+  _entityVersions.resize(end, 0u);
+  _entityComponentMasks.resize(end);
+  _entityLocations.resize(end, {NoArchetype, 0});
+  _aliveBits.resize((end + BitsPerWord - 1) / BitsPerWord, 0);
+  for (auto index = first; index < end; ++index) {
+    _aliveBits[index / BitsPerWord] |= uint64_t{1} << (index % BitsPerWord);
+    handles.push_back({index, 0u});
+  }
+  return handles;
+}
+
 void peEntityManager::DestroyEntity(peEntity::Handle entityHandle) {
   if (!IsAlive(entityHandle))
     throw std::runtime_error{"Entity is already destroyed!"};
   // Increment the version number, destroy all components and clear the
   // components mask
   ++_entityVersions[entityHandle.index];
-  auto &mask = _entityComponentMasks[entityHandle.index];
-  for (std::size_t idx = 0; idx < _componentPools.size(); ++idx) {
-    if (!mask.test(idx))
-      continue;
-    auto &pool = _componentPools[idx];
-    pool->DestructAt(entityHandle.index);
+  const auto &mask = _entityComponentMasks[entityHandle.index];
+  for (peBaseComponent::Family_t family = 0; family < mask.size(); ++family) {
+    if (mask.test(family))
+      MarkChanged(family, entityHandle);
+  }
+  const auto &location = _entityLocations[entityHandle.index];
+  if (location.archetype != NoArchetype) {
+    _archetypes[location.archetype]->DestroyRow(location.row);
+    MoveEntity(entityHandle.index, NoArchetype, 0);
   }
 
-  mask.reset();
+  _entityComponentMasks[entityHandle.index].reset();
+  _aliveBits[entityHandle.index / BitsPerWord] &=
+      ~(uint64_t{1} << (entityHandle.index % BitsPerWord));
   _freeSlots.push_back(entityHandle.index);
 }
 
 bool peEntityManager::IsAlive(uint32_t index) const {
   if (index >= Capacity())
     return false;
-  // Here we don't have a version number, so we have to check if this index is
-  // in the _freeSlots list
-  return !std::binary_search(_freeSlots.begin(), _freeSlots.end(), index);
+  // Here we don't have a version number, so the alive bit decides
+  return (_aliveBits[index / BitsPerWord] >> (index % BitsPerWord)) & 1;
 }
 
 bool peEntityManager::IsAlive(peEntity::Handle entityHandle) const {
@@ -111,8 +318,8 @@ std::size_t peEntityManager::Capacity() const {
   return _entityComponentMasks.size();
 }
 
-peEntityManager::EntityIterator<> peEntityManager::All() {
-  return EntityIterator<>{0, *this};
+peEntityManager::EntityIterator peEntityManager::All() {
+  return EntityIterator{0, *this};
 }
 
 peEntity peEntityManager::GetEntityAt(uint32_t index) {
@@ -120,6 +327,113 @@ peEntity peEntityManager::GetEntityAt(uint32_t index) {
     return {};
   return peEntity{{index, _entityVersions[index]}, *this};
 }
+
+uint32_t peEntityManager::FindNextEntity(
+    uint32_t index, const peComponentBitmask &requiredComponents) const {
+  const auto capacity = static_cast<uint32_t>(Capacity());
+  while (index < capacity) {
+    // Bits past the capacity are never set, so the last word needs no mask
+    const auto wordIdx = index / BitsPerWord;
+    auto word = _aliveBits[wordIdx] & (~uint64_t{0} << (index % BitsPerWord));
+    while (word) {
+      const auto candidate = wordIdx * BitsPerWord + LowestSetBit(word);
+      if ((_entityComponentMasks[candidate] & requiredComponents) ==
+          requiredComponents)
+        return candidate;
+      word &= word - 1;
+    }
+    index = (wordIdx + 1) * BitsPerWord;
+  }
+  return capacity;
+}
+
+void peEntityManager::RegisterComponentType(
+    peBaseComponent::Family_t family, const peComponentTypeInfo &typeInfo) {
+  if (_componentTypes.size() <= family)
+    _componentTypes.resize(family + 1, nullptr);
+  if (!_componentTypes[family])
+    _componentTypes[family] = &typeInfo;
+}
+
+uint32_t peEntityManager::GetOrCreateArchetype(const peComponentBitmask &mask) {
+  auto iter = _archetypeIndices.find(mask);
+  if (iter != _archetypeIndices.end())
+    return iter->second;
+
+  const auto archetypeIdx = static_cast<uint32_t>(_archetypes.size());
+  _archetypes.push_back(std::make_unique<peArchetype>(
+      mask, _componentTypes, peTaggedAllocator::ForTag(MemoryTag::Entities)));
+  _archetypeIndices[mask] = archetypeIdx;
+  return archetypeIdx;
+}
+
+const peVector<uint32_t> &
+peEntityManager::GetMatchingArchetypes(const peComponentBitmask &mask) {
+  std::lock_guard<std::mutex> guard{_queryCachesLock};
+  auto &cache = _queryCaches[mask];
+  for (; cache.numArchetypesChecked < _archetypes.size();
+       ++cache.numArchetypesChecked) {
+    const auto archetypeIdx = cache.numArchetypesChecked;
+    if ((_archetypes[archetypeIdx]->GetMask() & mask) == mask)
+      cache.archetypes.push_back(static_cast<uint32_t>(archetypeIdx));
+  }
+  return cache.archetypes;
+}
+
+void peEntityManager::MoveEntity(uint32_t entityIndex, uint32_t archetypeIdx,
+                                 uint32_t row) {
+  auto &location = _entityLocations[entityIndex];
+  if (location.archetype != NoArchetype) {
+    auto &source = *_archetypes[location.archetype];
+    if (archetypeIdx != NoArchetype)
+      source.RelocateRow(location.row, *_archetypes[archetypeIdx], row);
+    // The last entity of the source moves into the freed row
+    const auto movedEntity = source.RemoveRow(location.row);
+    if (movedEntity != peArchetype::InvalidEntityIndex)
+      _entityLocations[movedEntity].row = location.row;
+  }
+  location = {archetypeIdx, row};
+}
+
+void peEntityManager::MarkChanged(peBaseComponent::Family_t family,
+                                  peEntity::Handle entityHandle) {
+  const auto version = _version.fetch_add(1, std::memory_order_acq_rel) + 1;
+  auto &changes = _componentChanges[family];
+  // Concurrent changes can get here out of order, the version only grows
+  auto current = changes.version.load(std::memory_order_relaxed);
+  while (current < version &&
+         !changes.version.compare_exchange_weak(current, version,
+                                                std::memory_order_acq_rel))
+    ;
+  if (!changes.trackEntities)
+    return;
+
+  std::lock_guard<std::mutex> guard{_changedEntitiesLock};
+  auto &entities = changes.entities;
+  auto where = entities.end();
+  while (where != entities.begin() && std::prev(where)->version > version)
+    --where;
+  entities.insert(where, {entityHandle, version});
+}
+
+void peEntityManager::SetTrackChangedEntities(peBaseComponent::Family_t family,
+                                              bool track) {
+  auto &changes = _componentChanges[family];
+  changes.trackEntities = track;
+  if (!track)
+    changes.entities.clear();
+}
+
+void peEntityManager::DiscardChanges(peBaseComponent::Family_t family,
+                                     uint64_t upToVersion) {
+  auto &entities = _componentChanges[family].entities;
+  const auto last = std::upper_bound(
+      entities.begin(), entities.end(), upToVersion,
+      [](uint64_t version, const ComponentChange &change) {
+        return version < change.version;
+      });
+  entities.erase(entities.begin(), last);
+}
 #pragma endregion
 
 } // namespace pe
@@ -0,0 +1,73 @@
+#include "Entities\peSystemScheduler.h"
+
+namespace pe {
+
+peSystemScheduler::peSystemScheduler(peEntityManager &entityManager,
+                                     peTaskSystem &taskSystem)
+    : _entityManager(entityManager), _taskSystem(taskSystem) {}
+
+void peSystemScheduler::Update() {
+  BuildGraph();
+  if (_nodes.empty())
+    return;
+
+  // Edges only point from earlier to later nodes, so the node order is a valid
+  // serial schedule
+  if (!_taskSystem.IsRunning()) {
+    for (auto &node : _nodes)
+      node.system->OnUpdateAll();
+    return;
+  }
+
+  _remainingPredecessors.reset(new std::atomic<uint32_t>[_nodes.size()]);
+  for (size_t idx = 0; idx < _nodes.size(); ++idx)
+    _remainingPredecessors[idx].store(_numPredecessors[idx],
+                                      std::memory_order_relaxed);
+
+  peTaskGroup group{_taskSystem};
+  for (uint32_t idx = 0; idx < _nodes.size(); ++idx) {
+    if (!_numPredecessors[idx])
+      group.Run([this, &group, idx]() { RunNode(group, idx); });
+  }
+  group.Wait();
+}
+
+bool peSystemScheduler::Conflict(const Node &first, const Node &second) {
+  if (!first.declaresAccess || !second.declaresAccess)
+    return true;
+  return (first.writeMask & (second.readMask | second.writeMask)).any() ||
+         (second.writeMask & first.readMask).any();
+}
+
+void peSystemScheduler::BuildGraph() {
+  _nodes.clear();
+  for (auto &system : _entityManager.GetComponentSystems()) {
+    if (!system || !system->HasUpdate())
+      continue;
+    _nodes.push_back({system.get(), system->DeclaresAccess(),
+                      system->GetReadMask(), system->GetWriteMask(),
+                      peVector<uint32_t>{}});
+  }
+
+  _numPredecessors.assign(_nodes.size(), 0);
+  for (uint32_t later = 0; later < _nodes.size(); ++later) {
+    for (uint32_t earlier = 0; earlier < later; ++earlier) {
+      if (!Conflict(_nodes[earlier], _nodes[later]))
+        continue;
+      _nodes[earlier].successors.push_back(later);
+      ++_numPredecessors[later];
+    }
+  }
+}
+
+void peSystemScheduler::RunNode(peTaskGroup &group, uint32_t nodeIdx) {
+  auto &node = _nodes[nodeIdx];
+  node.system->OnUpdateAll(_taskSystem);
+  for (auto successor : node.successors) {
+    if (_remainingPredecessors[successor].fetch_sub(
+            1, std::memory_order_acq_rel) == 1)
+      group.Run([this, &group, successor]() { RunNode(group, successor); });
+  }
+}
+
+} // namespace pe
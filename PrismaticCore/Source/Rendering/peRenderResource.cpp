@@ -1,3 +1,9 @@
 #include "Rendering\peRenderResource.h"
 
-void pe::peRenderResource::MarkDirty() { _dirty = true; }
+bool pe::peRenderResource::ConsumeDirty() {
+  return _dirty.exchange(false, std::memory_order_acq_rel);
+}
+
+void pe::peRenderResource::MarkDirty() {
+  _dirty.store(true, std::memory_order_release);
+}
@@ -1,17 +1,29 @@
 
 #include "SubsystemImpl\peUpdateSystem.h"
+#include "Entities\peSystemScheduler.h"
 #include "peEngine.h"
+#include <algorithm>
+#include <exception>
+#include <thread>
 #include <vector>
 
 namespace pe {
 
+namespace {
+//! \brief The simulation runs while the renderer keeps most processors busy,
+//! a quarter of them is plenty for the component systems
+uint32_t SimulationConcurrency() {
+  return std::max(1u, std::thread::hardware_concurrency() / 4);
+}
+} // namespace
+
 peUpdateSystem::peUpdateSystem()
     : _callbacks(WrapAllocator<std::function<void(float)>>(GlobalAllocator)),
-      _isRunning(false) {}
+      _isRunning(false), _taskSystem(SimulationConcurrency()) {}
 
 peUpdateSystem::~peUpdateSystem() {}
 
-void peUpdateSystem::Init() {}
+void peUpdateSystem::Init() { _taskSystem.Start(); }
 
 void peUpdateSystem::Run() {
   PrismaticEngine.GetInputSystem()->GetKeyEvent() +=
@@ -20,17 +32,45 @@ void peUpdateSystem::Run() {
           _isRunning = false;
       };
 
+  peSystemScheduler systemScheduler{
+      PrismaticEngine.GetWorld()->EntityManager(), _taskSystem};
+
   _isRunning = true;
-  while (_isRunning) {
-    double deltaTime = 0;
-    PrismaticEngine.GetInputSystem()->Update(deltaTime); // TODO Delta time
 
-    PrismaticEngine.GetRenderer()->Update(deltaTime);
+  // Renders the frame that was synchronized last while this thread simulates
+  // the next one. The window belongs to this thread, so input stays here
+  std::exception_ptr renderError;
+  std::thread renderThread{[this, &renderError]() {
+    try {
+      while (_isRunning)
+        PrismaticEngine.GetRenderer()->Update(0); // TODO Delta time
+    } catch (...) {
+      renderError = std::current_exception();
+      _isRunning = false;
+    }
+  }};
+
+  try {
+    while (_isRunning) {
+      double deltaTime = 0;
+      PrismaticEngine.GetInputSystem()->Update(deltaTime); // TODO Delta time
+
+      systemScheduler.Update();
+
+      PrismaticEngine.GetRenderer()->Synchronize();
+    }
+  } catch (...) {
+    _isRunning = false;
+    renderThread.join();
+    throw;
   }
-  // TODO Stop and wait for renderer thread / other threads?
+
+  renderThread.join();
+  if (renderError)
+    std::rethrow_exception(renderError);
 }
 
-void peUpdateSystem::Shutdown() {}
+void peUpdateSystem::Shutdown() { _taskSystem.Stop(); }
 
 void peUpdateSystem::Stop() { _isRunning = false; }
 
@@ -68,6 +68,10 @@ void peEngine::Shutdown() {
   if (_logger != nullptr) {
     DeleteAndNull(_logger);
   }
+
+  // Everything the engine owns is gone, what is still allocated now leaked
+  // (or belongs to a static)
+  PrintLeaks
 }
 
 IRenderer *Renderer() { return peEngine::GetInstance().GetRenderer(); }
@@ -0,0 +1,135 @@
+#pragma once
+#include "DataStructures/peVector.h"
+#include "Memory/peAllocators.h"
+#include "Memory/peMemoryTracking.h"
+#include "Rendering/Utility/peBxDF.h"
+#include "Type/peColor.h"
+
+#include <span.h>
+#include <stdint.h>
+
+namespace pe {
+
+//! \brief Storage formats for the film
+enum class FilmStorage {
+  //! \brief Accumulated radiance and sample count as 32-bit floats (16 bytes
+  //! per pixel)
+  Float32,
+  //! \brief Mean radiance as half floats plus a 16-bit sample count (8 bytes
+  //! per pixel). Relative error per channel is below 2^-11
+  Half,
+  //! \brief Mean radiance in the shared-exponent RGB9E5 format plus a 16-bit
+  //! sample count (6 bytes per pixel). Error per channel is below 2^-9 of the
+  //! brightest channel of the pixel
+  SharedExponent
+};
+
+//! \brief Stores the image that the path tracer renders into. Tiles accumulate
+//! their samples in full precision and fold the result into the film, so the
+//! compact storage formats lose precision only once per pixel instead of once
+//! per sample. Not thread-safe, callers have to synchronize access
+class peFilm {
+  //! \brief Accumulated radiance and sample count. Trivial unlike
+  //! RGBA_32BitFloat, so that new buffers are not cleared element by element
+  struct FloatPixel {
+    float r, g, b;
+    float sampleCount;
+  };
+  struct HalfPixel {
+    uint16_t r, g, b;
+    uint16_t sampleCount;
+  };
+
+public:
+  //! \brief Resizing leaves the pixels uninitialized, see AllocateBuffers
+  template <typename T>
+  using PixelBuffer = std::vector<T, peDefaultInitAllocatorWrapper<T>>;
+
+  //! \brief Pixel buffers of a film, only the ones of its storage format are
+  //! used
+  struct Buffers {
+    uint32_t width, height;
+    PixelBuffer<FloatPixel> floatPixels;
+    PixelBuffer<HalfPixel> halfPixels;
+    PixelBuffer<uint32_t> sharedExponentPixels;
+    PixelBuffer<uint16_t> sampleCounts;
+  };
+
+  //! \param storage Pixel format
+  //! \param prefaultTaskSystem Task system that pre-faults the pixel buffers
+  //! when the film is resized, so that their pages are spread over the NUMA
+  //! nodes of the workers that render the tiles. Optional
+  explicit peFilm(FilmStorage storage = FilmStorage::Half,
+                  peTaskSystem *prefaultTaskSystem = nullptr);
+
+  peFilm(const peFilm &) = delete;
+  peFilm &operator=(const peFilm &) = delete;
+
+  //! \brief Resizes the film and clears all pixels
+  //! \param width Width in pixels
+  //! \param height Height in pixels
+  void Resize(uint32_t width, uint32_t height);
+
+  //! \brief Allocates cleared pixel buffers of the given size. Buffers that
+  //! the large page allocator maps come zeroed, only smaller ones are cleared
+  //! here. Pre-faulting them runs tasks on the pre-fault task system and
+  //! waits for them, so this must not be called while holding a lock that
+  //! these tasks might take. Safe to call concurrently with the other methods
+  //! \param width Width in pixels
+  //! \param height Height in pixels
+  Buffers AllocateBuffers(uint32_t width, uint32_t height);
+
+  //! \brief Exchanges the pixel buffers of the film with the given ones
+  //! \param buffers New buffers from AllocateBuffers, holds the old buffers
+  //! afterwards
+  void SwapBuffers(Buffers &buffers);
+
+  //! \brief Stores the accumulated pixels of a tile in the film, replacing the
+  //! previous values of these pixels
+  //! \param tile Accumulated radiance of the tile in rgb, number of samples in
+  //! the alpha channel
+  //! \param offset Position of the tile inside the film
+  //! \param stride Width of the tile. The tile may extend past the borders of
+  //! the film, these pixels are ignored
+  void StoreTile(gsl::span<RGBA_32BitFloat> tile, const glm::uvec2 &offset,
+                 uint32_t stride);
+
+  //! \brief Resolves the normalized radiance of a range of rows
+  //! \param firstRow First row to resolve
+  //! \param numRows Number of rows to resolve
+  //! \param result Destination, must hold numRows * Width() values
+  void ResolveRows(uint32_t firstRow, uint32_t numRows,
+                   gsl::span<Spectrum_t> result) const;
+
+  //! \brief Returns the normalized radiance of the given pixel
+  Spectrum_t Resolve(uint32_t x, uint32_t y) const;
+
+  //! \brief Returns the number of samples that were stored for the given pixel
+  uint32_t SampleCount(uint32_t x, uint32_t y) const;
+
+  //! \brief Returns the memory used for the pixel storage in bytes
+  size_t ResidentMemory() const;
+
+  auto Storage() const { return _storage; }
+  auto Width() const { return _width; }
+  auto Height() const { return _height; }
+
+private:
+  void StorePixel(size_t idx, const RGBA_32BitFloat &accumulated);
+  Spectrum_t ResolvePixel(size_t idx) const;
+
+  const FilmStorage _storage;
+  uint32_t _width, _height;
+
+  //! \brief The pixel buffers are mapped directly on huge pages, and still
+  //! accounted to the film tag
+  peLargePageAllocator _largePageAllocator;
+  peTaggedAllocator _allocator;
+
+  PixelBuffer<FloatPixel> _floatPixels;
+  PixelBuffer<HalfPixel> _halfPixels;
+  PixelBuffer<uint32_t> _sharedExponentPixels;
+  PixelBuffer<uint16_t> _sampleCounts;
+};
+
+} // namespace pe
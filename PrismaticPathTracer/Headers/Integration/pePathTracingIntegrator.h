@@ -12,7 +12,10 @@ class peScene;
 //! \brief Integrator that uses path tracing
 class pePathTracingIntegrator : public peSurfaceIntegrator {
 public:
-  explicit pePathTracingIntegrator(uint32_t maxDepth);
+  //! \param maxDepth Maximum length of a path
+  //! \param allocator Allocator for the sample offsets
+  explicit pePathTracingIntegrator(uint32_t maxDepth,
+                                   IAllocator *allocator = GlobalAllocator);
 
   Spectrum_t Estimate(const peScene &scene, const Sample &sample,
                       const SceneHit &hit, const glm::vec3 &wo,
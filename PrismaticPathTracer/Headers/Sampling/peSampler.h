@@ -24,7 +24,11 @@ enum class Jitter {
 //! \brief Sample from a sampler
 struct Sample {
   Sample() = default;
-  Sample(peSurfaceIntegrator &surfaceIntegrator, const peScene &scene);
+  //! \brief Creates a sample with the layout that the integrator needs
+  //! \param allocator Allocator for the sample memory, which is shared by all
+  //! clones of this sample
+  Sample(peSurfaceIntegrator &surfaceIntegrator, const peScene &scene,
+         IAllocator *allocator = GlobalAllocator);
   //! \brief Requests 'numSamples' 1D samples and returns the offset into this
   //! sample at which the requested samples can be accessed
   //! \param numSamples Number of samples
@@ -62,7 +66,8 @@ struct Sample {
   //! \returns Number of samples in chunk
   uint32_t ChunkSize2D(uint32_t chunkIdx) const;
 
-  //! \brief Clones this sample multiple times
+  //! \brief Clones this sample multiple times. The clones use the allocator
+  //! of this sample
   void CloneNTimes(gsl::span<Sample> clones) const;
 
   glm::vec2 sampleValues;
@@ -106,7 +111,8 @@ class peStratifiedSampler : public peSampler {
 public:
   peStratifiedSampler(const glm::uvec2 &startPoint, const glm::uvec2 &endPoint,
                       uint32_t samplesX, uint32_t samplesY,
-                      std::default_random_engine &rng);
+                      std::default_random_engine &rng,
+                      IAllocator *allocator = GlobalAllocator);
 
   uint32_t GetMoreSamples(gsl::span<Sample> samples) override;
 
@@ -0,0 +1,57 @@
+#pragma once
+#include "Components/peCameraComponent.h"
+#include "Components/peLightComponent.h"
+#include "DataStructures/peVector.h"
+#include "Rendering/Utility/peBxDF.h"
+#include "Rendering/pePrimitives.h"
+#include "Shapes/Triangle.h"
+
+#include <glm/mat4x4.hpp>
+#include <memory>
+#include <optional>
+
+namespace pe {
+
+//! \brief Copy of a mesh resource in object space
+struct peMeshProxy {
+  peVector<Vertex> vertices;
+  peVector<uint32_t> indices;
+};
+
+//! \brief Copy of a static render component and the resources it references
+struct peStaticMeshProxy {
+  std::shared_ptr<const peMeshProxy> mesh;
+  std::shared_ptr<const BSDF> bsdf;
+  glm::mat4 objectToWorld;
+};
+
+//! \brief Copy of a primitive render component
+struct peSphereProxy {
+  peSpherePrimitive sphere;
+  std::shared_ptr<const BSDF> bsdf;
+};
+
+//! \brief Everything that the scene builds its geometry from. Never modified
+//! once it was handed to the render thread, so frames share it until the
+//! geometry changes
+struct peGeometryProxy {
+  peVector<peSphereProxy> spheres;
+  peVector<peStaticMeshProxy> staticMeshes;
+};
+
+//! \brief Copies of the light components. The light samplers of the scene
+//! reference them
+struct peLightsProxy {
+  peVector<pePointLightComponent> pointLights;
+  peVector<peDirectionalLightComponent> directionalLights;
+};
+
+//! \brief State of the world that the render thread draws from
+struct peFrameProxy {
+  std::shared_ptr<const peGeometryProxy> geometry;
+  std::shared_ptr<const peLightsProxy> lights;
+  //! \brief Copy of the active camera, if there is one
+  std::optional<peCameraComponent> camera;
+};
+
+} // namespace pe
@@ -1,15 +1,13 @@
 #pragma once
-#include "Components/pePrimitiveRenderComponent.h"
-#include "Components/peStaticRenderComponent.h"
 #include "DataStructures/peVector.h"
 #include "Math\peCoordSys.h"
-#include "Rendering/pePrimitives.h"
+#include "Memory/peMemoryTracking.h"
 #include "Sampling/peLightSampler.h"
+#include "Scene/peRenderProxies.h"
 #include "Shapes/Intersectable.h"
 #include "Shapes/Sphere.h"
 #include "Shapes/Triangle.h"
 #include <optional>
-#include <span.h>
 
 namespace pe {
 struct Ray;
@@ -35,6 +33,8 @@ template <typename T> struct PrimitiveHelper {
 //! \brief Encapsulates all objects in the scene
 class peScene {
 public:
+  peScene();
+
   bool Intersects(const Ray &ray) const;
   std::optional<SceneHit> GetIntersection(const Ray &ray) const;
 
@@ -42,16 +42,16 @@ public:
 
   const auto &GetLights() const { return _lightSamplers; }
 
-  void BuildScene(
-      gsl::span<peComponentHandle<pePrimitiveRenderComponent>> primitives,
-      gsl::span<peStaticRenderComponent::Handle_t> staticEntities,
-      gsl::span<peComponentHandle<pePointLightComponent>> pointLights,
-      gsl::span<peComponentHandle<peDirectionalLightComponent>>
-          directionalLights);
+  //! \brief Builds the scene from the given proxies, replacing everything that
+  //! the scene held before. The lights have to outlive the scene or the next
+  //! call to SetLights
+  void BuildScene(const peGeometryProxy &geometry,
+                  const peLightsProxy &lights);
+  //! \brief Replaces the lights of the scene and keeps the geometry
+  void SetLights(const peLightsProxy &lights);
 
 private:
-  void AddStaticMesh(const peStaticRenderComponent &comp,
-                     const peEntity &entity);
+  void AddStaticMesh(const peStaticMeshProxy &meshProxy);
 
   template <typename T> void AddIntersectable(const T &prim) {
     auto tmpPrim = prim;
@@ -64,7 +64,13 @@ private:
     _bsdfIndices[primIdx] = bsdfIdx;
   }
 
-  // TODO Here we will use an acceleration structure later on
+  //! \brief Geometry and intersectables are the largest arrays of the scene,
+  //! so they go through the large page allocator. Declared before the arrays
+  //! that use them
+  peTaggedAllocator _geometryAllocator;
+  // TODO Here we will use an acceleration structure later on. Until then
+  // the list of intersectables is accounted as one
+  peTaggedAllocator _accelerationAllocator;
 
   peVector<std::unique_ptr<peLightSampler>> _lightSamplers;
 
@@ -1,47 +1,128 @@
 #pragma once
+#include "Components/peCameraComponent.h"
 #include "Components/pePrimitiveRenderComponent.h"
 #include "DataStructures/peVector.h"
+#include "FileSystem/peHDRImageWriter.h"
+#include "Film/peFilm.h"
 #include "Sampling/peSampler.h"
 #include "Scene/peScene.h"
+#include "Threading/peCancellationToken.h"
+#include "Threading/peTaskGroup.h"
 #include "Threading/peTaskSystem.h"
+#include "Tracers/peTileOrder.h"
 #include "Type/peColor.h"
 
 #include <atomic>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <stdint.h>
+#include <thread>
 
 namespace pe {
-struct peCameraComponent;
 
 //! \brief Path-tracing implementation
 class pePathTracer {
 public:
   using ImageData_t = peVector<RGBA_8Bit>;
 
-  explicit pePathTracer(const peScene &scene);
-
-  //! \brief Starts the (asynchronous) rendering process
+  //! \brief Creates a new path tracer for the given scene
+  //! \param scene Scene to render
+  //! \param filmStorage Storage format of the film. The compact formats need
+  //! only a fraction of the memory of the full-precision film
+  //! \param concurrency Number of runners, each pinned to its own processor
+  explicit pePathTracer(
+      const peScene &scene, FilmStorage filmStorage = FilmStorage::Half,
+      uint32_t concurrency = std::thread::hardware_concurrency());
+  //! \brief Cancels the current frame and waits for its tiles, they still
+  //! reference the film
+  ~pePathTracer();
+
+  //! \brief Starts the (asynchronous) rendering process. If a frame is still
+  //! being rendered, it is cancelled and its tiles are dropped, so that the
+  //! new frame gets all cores right away. Does not block
+  //! \param camera Camera to render from. The frame keeps a copy of it
   //! \param width Width of the image to render
   //! \param height Height of the image to render
-  void BeginRenderProcess(uint32_t width, uint32_t height);
+  void BeginRenderProcess(const peCameraComponent &camera, uint32_t width,
+                          uint32_t height);
+
+  //! \brief Cancels the current frame. Tiles stop after their current batch
+  //! of samples and do not touch the film anymore
+  void CancelRenderProcess();
+
+  //! \brief Sets the order in which the tiles of the next frame are rendered
+  void SetTileOrder(TileOrder order) { _tileOrder = order; }
+
+  //! \brief Sets the focus point for TileOrder::FocusFirst
+  //! \param pixel Focus point in pixels, with row 0 at the bottom of the image
+  void SetFocus(const glm::uvec2 &pixel) { _focus = pixel; }
+
+  //! \brief Streams the final image into the given writer. Rows are written as
+  //! soon as all tiles that cover them are finished. Has to be called before
+  //! BeginRenderProcess
+  //! \param writer Image writer, must match the size of the rendered image
+  void SetImageWriter(std::unique_ptr<peHDRImageWriter> writer);
 
   //! \brief Returns true if a new result has arrived
   bool HasNewResult() const;
 
-  //! \brief Stores the result image in the given buffer
+  //! \brief Stores the result image in the given buffer. Has to be called
+  //! from the thread that calls BeginRenderProcess
   //! \param results Results buffer
   void GetResult(ImageData_t &results);
 
-private:
-  void GeneratePrimaryTasks(const peCameraComponent &camera);
+  //! \brief Task system that runs the rendering. Other work, e.g. encoding of
+  //! finished frames, can be scheduled on it as well
+  peTaskSystem &TaskSystem() { return _taskSystem; }
+
+  //! \brief Returns true if all tiles of the current frame are rendered.
+  //! Tiles of cancelled frames count as well, but they finish quickly
+  bool IsFrameComplete() const { return _frameTasks.IsDone(); }
+
+  //! \brief Waits until the current frame is rendered. The calling thread
+  //! helps with the rendering in the meantime
+  void WaitForFrame() { _frameTasks.Wait(); }
+
+  //! \brief Schedules the given continuation once the current frame is
+  //! rendered, e.g. to resolve and encode the result. Runs right away if the
+  //! frame is already complete. Skipped if the frame is cancelled
+  template <typename F> void OnFrameComplete(F &&continuation) {
+    _frameTasks.Then([frame = _frame,
+                      continuation = std::forward<F>(continuation)]() mutable {
+      if (!frame || !frame->cancellation.IsCancelled())
+        continuation();
+    });
+  }
 
-  void TraceChunk(const peCameraComponent &camera, const glm::uvec2 &offset,
+private:
+  //! \brief State of one frame that the tiles of the frame share. Outlives
+  //! the frame if a tile of it is still running
+  struct Frame {
+    explicit Frame(const peCameraComponent &camera, uint32_t width,
+                   uint32_t height)
+        : camera(camera), width(width), height(height) {}
+
+    peCancellationToken cancellation;
+    //! \brief Camera at the start of the frame. Moving the camera starts a
+    //! new frame, so the tiles must not see the live component
+    const peCameraComponent camera;
+    const uint32_t width, height;
+  };
+
+  void GeneratePrimaryTasks(const std::shared_ptr<Frame> &frame);
+
+  void TraceChunk(const Frame &frame, const glm::uvec2 &offset,
                   const glm::uvec2 &extent, uint32_t seed);
 
-  void AccumulatePixels(gsl::span<RGBA_32BitFloat> newPixels,
+  void AccumulatePixels(const Frame &frame,
+                        gsl::span<RGBA_32BitFloat> newPixels,
                         const glm::uvec2 &offset, uint32_t stride);
 
+  void OnChunkFinished(const Frame &frame, const glm::uvec2 &offset,
+                       const glm::uvec2 &extent);
+  void StreamFinishedStrips();
+
   constexpr static uint32_t ChunkSizeX = 32;
   constexpr static uint32_t ChunkSizeY = 32;
 
@@ -50,12 +131,23 @@ private:
   uint32_t _width, _height;
   uint32_t _samplesPerPixel;
   Jitter _jitter;
+  TileOrder _tileOrder;
+  glm::uvec2 _focus;
 
   peTaskSystem _taskSystem;
+  //! \brief All tile tasks of the current frame and of cancelled frames that
+  //! are still running
+  peTaskGroup _frameTasks;
+  std::shared_ptr<Frame> _frame;
 
-  peVector<RGBA_32BitFloat> _pixelAccumulator;
-  peVector<Spectrum_t> _normalizedPixels;
+  peFilm _film;
   mutable std::mutex _pixelsLock;
+
+  std::unique_ptr<peHDRImageWriter> _imageWriter;
+  //! \brief Number of unfinished tiles in each strip of ChunkSizeY rows
+  peVector<uint32_t> _remainingTilesPerStrip;
+  uint32_t _nextStripToWrite;
+  std::mutex _imageWriterLock;
   std::atomic_bool _hasNewResult;
 };
 
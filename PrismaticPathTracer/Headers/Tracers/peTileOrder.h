@@ -0,0 +1,31 @@
+#pragma once
+#include "DataStructures/peVector.h"
+
+#include <glm/vec2.hpp>
+#include <stdint.h>
+
+namespace pe {
+
+//! \brief Order in which the tiles of an image are rendered
+enum class TileOrder {
+  //! \brief Row by row, starting at the top of the image
+  Scanline,
+  //! \brief Square spiral from the center of the image outwards
+  Spiral,
+  //! \brief Along a Hilbert curve, so that consecutive tiles are neighbours
+  //! and hit the same parts of the scene
+  Hilbert,
+  //! \brief By distance to a focus point, e.g. the mouse cursor
+  FocusFirst
+};
+
+//! \brief Returns the coordinates of all tiles in the given order
+//! \param tilesX Number of tiles in x-direction
+//! \param tilesY Number of tiles in y-direction
+//! \param order Order of the tiles
+//! \param focus Focus point in tile coordinates, only used for
+//! TileOrder::FocusFirst
+peVector<glm::uvec2> OrderTiles(uint32_t tilesX, uint32_t tilesY,
+                                TileOrder order, const glm::vec2 &focus);
+
+} // namespace pe
@@ -16,12 +16,14 @@ public:
 
   //! Create the native window
   void Create(uint32_t width, uint32_t height);
-  //! Create the OpenGL context for the native window
+  //! Create the OpenGL context for the native window. The context is not
+  //! current on any thread afterwards
   void CreateRenderContext();
   //! Destroy the native window and OpenGL rendering context
   void Destroy();
 
-  //! Swap the buffers and present the rendered image to the user
+  //! Swap the buffers and present the rendered image to the user. Releases the
+  //! context from the calling thread
   void Present() const;
   //! Sets this window as active render target
   void SetActive() const;
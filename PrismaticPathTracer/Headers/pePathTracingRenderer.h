@@ -3,18 +3,33 @@
 #include "Components/pePrimitiveRenderComponent.h"
 #include "Components/peStaticRenderComponent.h"
 #include "Entities\Entity.h"
+#include "Scene/peRenderProxies.h"
 #include "Shapes/Triangle.h"
 #include "Subsystems/IRenderer.h"
+#include "Threading/peTripleBuffer.h"
+#include "Tracers/pePathTracer.h"
 #include "Window/peGlWindow.h"
 
+#include <condition_variable>
+#include <future>
+#include <glm/mat4x4.hpp>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+
 namespace pe {
 struct peStaticRenderComponent;
 
+//! \brief Renders the world with the path tracer. Synchronize copies the
+//! world into proxies on the game thread, Update renders the latest proxies on
+//! the render thread. The two only share the triple buffer of frame proxies
 class pePathTracingRenderer : public IRenderer {
 public:
   void Init() override;
   void Shutdown() override;
   void Update(double deltaTime) override;
+  void Synchronize() override;
 
   void RegisterDrawableEntity(const peEntity &entity) override;
   void DeregisterDrawableEntity(const peEntity &entity) override;
@@ -24,17 +39,126 @@ private:
   void
   DeregisterRenderResource(const peWeakPtr<peRenderResource> &res) override;
 
-  void GatherLights();
-  void AddStaticMesh(const peStaticRenderComponent &comp,
-                     const peEntity &entity);
+#pragma region GameThread
+  //! \brief Drops the proxies of all resources that changed since the last
+  //! call. Expects the resources lock to be held
+  //! \returns True if any resource changed
+  bool DropDirtyResourceProxies();
+  //! \brief Copies all drawable entities into a new geometry proxy. Drops the
+  //! components of destroyed entities from the drawables first, since
+  //! destroying an entity does not deregister it
+  std::shared_ptr<const peGeometryProxy> BuildGeometryProxy();
+  //! \brief Copies the current geometry proxy and replaces the proxies of the
+  //! drawable entities that changed since the last synchronization. Falls back
+  //! to BuildGeometryProxy if an entity gains or loses its proxy
+  std::shared_ptr<const peGeometryProxy> UpdateGeometryProxy();
+  //! \brief Replaces the proxies of a single entity in the given geometry
+  //! \returns False if the entity has no proxy yet or can't have one anymore,
+  //! e.g. because it was destroyed
+  bool UpdateEntityProxy(peGeometryProxy &geometry, const peEntity &entity);
+  //! \brief Empty if the material of the component has no offline data
+  std::optional<peSphereProxy>
+  MakeSphereProxy(const pePrimitiveRenderComponent::Handle_t &primComponent);
+  //! \brief Empty if the mesh or the material can't be rendered
+  std::optional<peStaticMeshProxy>
+  MakeStaticMeshProxy(const peStaticRenderComponent::Handle_t &staticEntity);
+  std::shared_ptr<const peLightsProxy> BuildLightsProxy();
+  //! \brief Returns the proxy of the given material, which is created if the
+  //! material has none. Null if the material has no offline data
+  std::shared_ptr<const BSDF>
+  GetBSDFProxy(const peMaterial::Handle_t &material);
+  //! \brief Returns the proxy of the given mesh, which is created if the mesh
+  //! has none. Null if the vertex layout is not supported
+  std::shared_ptr<const peMeshProxy> GetMeshProxy(const peMesh::Handle_t &mesh);
 
-  uint32_t _windowWidth, _windowHeight;
-  std::unique_ptr<peGlWindow> _window;
+  //! \brief Version of the entity manager at the last synchronization
+  uint64_t _syncVersion;
+  //! \brief Set when drawable entities were registered or deregistered
+  bool _drawablesChanged;
+  std::shared_ptr<const peGeometryProxy> _geometry;
+  //! \brief Where the proxies of a drawable entity are in the geometry proxy
+  struct ProxyIndices {
+    constexpr static uint32_t None = ~0u;
+    uint32_t sphere = None;
+    uint32_t staticMesh = None;
+  };
+  struct HandleHash {
+    size_t operator()(const peEntity::Handle &handle) const {
+      return std::hash<uint64_t>{}(uint64_t{handle.version} << 32 |
+                                   handle.index);
+    }
+  };
+  //! \brief Proxy indices of every drawable entity as of the last
+  //! BuildGeometryProxy. Keyed by the whole handle, since the index of a
+  //! destroyed entity is reused by the next one that is created
+  peUnorderedMap<peEntity::Handle, ProxyIndices, HandleHash> _proxyIndices;
+  std::shared_ptr<const peLightsProxy> _lights;
 
   peVector<pePrimitiveRenderComponent::Handle_t> _primitiveEntites;
   peVector<peStaticRenderComponent::Handle_t> _staticEntities;
-  peVector<pePointLightComponent::Handle_t> _pointLights;
-  peVector<peDirectionalLightComponent::Handle_t> _directionalLights;
+
+  //! \brief Resources are registered from whichever thread creates them, the
+  //! lock guards the resources and their proxies
+  std::mutex _resourcesLock;
+  peVector<peWeakPtr<peRenderResource>> _resources;
+  peUnorderedMap<const peRenderResource *, std::shared_ptr<const peMeshProxy>>
+      _meshProxies;
+  peUnorderedMap<const peRenderResource *, std::shared_ptr<const BSDF>>
+      _bsdfProxies;
+#pragma endregion
+
+  peTripleBuffer<peFrameProxy> _frames;
+  //! \brief Set by the first Synchronize. Until then the render thread sleeps
+  //! instead of spinning, since there is nothing to render
+  bool _hasFirstFrame;
+  std::mutex _firstFrameLock;
+  std::condition_variable _firstFrameSynchronized;
+
+#pragma region RenderThread
+  //! \brief Sleeps until the first frame is synchronized. Wakes up after a
+  //! short timeout as well, so that the render loop notices when the game
+  //! stops before the first frame
+  void WaitForFirstFrame();
+  //! \brief Builds the scene, the path tracer and the texture that shows the
+  //! result
+  void BeginRendering(const peFrameProxy &frame);
+  //! \brief Brings the scene up to date with the given frame and restarts the
+  //! frame if anything changed. Only the lights are replaced if the geometry is
+  //! the same, any change to the geometry rebuilds the acceleration structure
+  void UpdateScene(const peFrameProxy &frame);
+  //! \brief Starts a new frame if the camera moved since the last one. The
+  //! tiles of the old frame are cancelled
+  void RestartFrameOnCameraMove(const peFrameProxy &frame);
+  void DrawResult();
+  //! \brief Saves the image of the complete frame to the frame output
+  //! directory. The PNG is encoded on the task system of the path tracer
+  void SaveFrame();
+  //! \brief Waits until the last saved frame is written and logs its errors
+  void FinishSavingFrame();
+
+  uint32_t _windowWidth, _windowHeight;
+  std::unique_ptr<peGlWindow> _window;
+
+  //! \brief Proxies that the scene was built from. The scene references the
+  //! lights
+  std::shared_ptr<const peGeometryProxy> _sceneGeometry;
+  std::shared_ptr<const peLightsProxy> _sceneLights;
+  std::unique_ptr<peScene> _scene;
+  //! \brief Declared after the scene, since it references it
+  std::unique_ptr<pePathTracer> _pathTracer;
+  pePathTracer::ImageData_t _image;
+  uint32_t _texture;
+  //! \brief Camera of the current frame
+  bool _hasFrame;
+  glm::mat4 _frameView, _frameProjection;
+  //! \brief Set by PE_FRAME_OUTPUT. If set, every complete frame is saved as
+  //! frame_<number>.png to this directory
+  std::string _frameOutputDirectory;
+  //! \brief Whether the current frame was saved already
+  bool _frameSaved;
+  uint32_t _numSavedFrames;
+  std::future<void> _savedFrame;
+#pragma endregion
 };
 
 } // namespace pe
@@ -0,0 +1,179 @@
+#include "Film/peFilm.h"
+#include "Type/peHalf.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace {
+uint16_t ToCompactSampleCount(float sampleCount) {
+  // Saturate instead of wrapping around, the mean stays correct anyway
+  return static_cast<uint16_t>(
+      std::min(sampleCount, static_cast<float>(UINT16_MAX)));
+}
+
+//! \brief Resizes a new buffer to the given number of cleared pixels. Skips
+//! clearing if the block is mapped, since the OS zeroed it already and
+//! clearing it would rewrite every pre-faulted page on this thread
+template <typename T>
+void ResizeCleared(pe::peFilm::PixelBuffer<T> &buffer, size_t count,
+                   const pe::peLargePageAllocator &allocator) {
+  buffer.resize(count);
+  if (count * sizeof(T) < allocator.GetMinMappedSize())
+    std::fill(buffer.begin(), buffer.end(), T{});
+}
+} // namespace
+
+pe::peFilm::peFilm(FilmStorage storage, peTaskSystem *prefaultTaskSystem)
+    : _storage(storage), _width(0), _height(0),
+      _largePageAllocator(GlobalAllocator, prefaultTaskSystem),
+      _allocator(MemoryTag::Film, &_largePageAllocator),
+      _floatPixels(peDefaultInitAllocatorWrapper<FloatPixel>(&_allocator)),
+      _halfPixels(peDefaultInitAllocatorWrapper<HalfPixel>(&_allocator)),
+      _sharedExponentPixels(
+          peDefaultInitAllocatorWrapper<uint32_t>(&_allocator)),
+      _sampleCounts(peDefaultInitAllocatorWrapper<uint16_t>(&_allocator)) {}
+
+void pe::peFilm::Resize(uint32_t width, uint32_t height) {
+  auto buffers = AllocateBuffers(width, height);
+  SwapBuffers(buffers);
+}
+
+pe::peFilm::Buffers pe::peFilm::AllocateBuffers(uint32_t width,
+                                                uint32_t height) {
+  Buffers buffers{
+      width,
+      height,
+      PixelBuffer<FloatPixel>{
+          peDefaultInitAllocatorWrapper<FloatPixel>(&_allocator)},
+      PixelBuffer<HalfPixel>{
+          peDefaultInitAllocatorWrapper<HalfPixel>(&_allocator)},
+      PixelBuffer<uint32_t>{
+          peDefaultInitAllocatorWrapper<uint32_t>(&_allocator)},
+      PixelBuffer<uint16_t>{
+          peDefaultInitAllocatorWrapper<uint16_t>(&_allocator)}};
+
+  const auto count = static_cast<size_t>(width) * height;
+  switch (_storage) {
+  case FilmStorage::Float32:
+    ResizeCleared(buffers.floatPixels, count, _largePageAllocator);
+    break;
+  case FilmStorage::Half:
+    ResizeCleared(buffers.halfPixels, count, _largePageAllocator);
+    break;
+  case FilmStorage::SharedExponent:
+    ResizeCleared(buffers.sharedExponentPixels, count, _largePageAllocator);
+    ResizeCleared(buffers.sampleCounts, count, _largePageAllocator);
+    break;
+  }
+  return buffers;
+}
+
+void pe::peFilm::SwapBuffers(Buffers &buffers) {
+  std::swap(_width, buffers.width);
+  std::swap(_height, buffers.height);
+  _floatPixels.swap(buffers.floatPixels);
+  _halfPixels.swap(buffers.halfPixels);
+  _sharedExponentPixels.swap(buffers.sharedExponentPixels);
+  _sampleCounts.swap(buffers.sampleCounts);
+}
+
+void pe::peFilm::StoreTile(gsl::span<RGBA_32BitFloat> tile,
+                           const glm::uvec2 &offset, uint32_t stride) {
+  if (offset.x >= _width || offset.y >= _height)
+    return;
+
+  const auto rows = static_cast<uint32_t>(tile.size() / stride);
+  const auto rowEnd = std::min(offset.y + rows, _height);
+  // Tiles at the right border extend past the film, these pixels must not
+  // spill into the next row
+  const auto columns = std::min(stride, _width - offset.x);
+
+  for (auto y = offset.y; y < rowEnd; ++y) {
+    const auto srcRow = static_cast<size_t>(y - offset.y) * stride;
+    const auto dstRow = static_cast<size_t>(y) * _width + offset.x;
+    for (uint32_t x = 0; x < columns; ++x) {
+      StorePixel(dstRow + x, tile[srcRow + x]);
+    }
+  }
+}
+
+void pe::peFilm::ResolveRows(uint32_t firstRow, uint32_t numRows,
+                             gsl::span<Spectrum_t> result) const {
+  const auto count = static_cast<size_t>(numRows) * _width;
+  if (firstRow + numRows > _height ||
+      static_cast<size_t>(result.size()) < count)
+    throw std::runtime_error{"Resolved rows exceed the film!"};
+
+  const auto start = static_cast<size_t>(firstRow) * _width;
+  for (size_t idx = 0; idx < count; ++idx) {
+    result[idx] = ResolvePixel(start + idx);
+  }
+}
+
+pe::Spectrum_t pe::peFilm::Resolve(uint32_t x, uint32_t y) const {
+  return ResolvePixel(static_cast<size_t>(y) * _width + x);
+}
+
+uint32_t pe::peFilm::SampleCount(uint32_t x, uint32_t y) const {
+  const auto idx = static_cast<size_t>(y) * _width + x;
+  switch (_storage) {
+  case FilmStorage::Float32:
+    return static_cast<uint32_t>(_floatPixels[idx].sampleCount);
+  case FilmStorage::Half:
+    return _halfPixels[idx].sampleCount;
+  case FilmStorage::SharedExponent:
+    return _sampleCounts[idx];
+  }
+  return 0;
+}
+
+size_t pe::peFilm::ResidentMemory() const {
+  return _floatPixels.capacity() * sizeof(FloatPixel) +
+         _halfPixels.capacity() * sizeof(HalfPixel) +
+         _sharedExponentPixels.capacity() * sizeof(uint32_t) +
+         _sampleCounts.capacity() * sizeof(uint16_t);
+}
+
+void pe::peFilm::StorePixel(size_t idx, const RGBA_32BitFloat &accumulated) {
+  if (_storage == FilmStorage::Float32) {
+    _floatPixels[idx] = {accumulated.r(), accumulated.g(), accumulated.b(),
+                         accumulated.a()};
+    return;
+  }
+
+  // The compact formats store the mean instead of the sum, this keeps the
+  // values inside the representable range regardless of the sample count
+  const auto sampleCount = accumulated.a();
+  const auto div = sampleCount > 0 ? (1 / sampleCount) : 1;
+  const auto r = accumulated.r() * div;
+  const auto g = accumulated.g() * div;
+  const auto b = accumulated.b() * div;
+
+  if (_storage == FilmStorage::Half) {
+    _halfPixels[idx] = {FloatToHalf(r), FloatToHalf(g), FloatToHalf(b),
+                        ToCompactSampleCount(sampleCount)};
+  } else {
+    _sharedExponentPixels[idx] = PackRGB9E5(r, g, b);
+    _sampleCounts[idx] = ToCompactSampleCount(sampleCount);
+  }
+}
+
+pe::Spectrum_t pe::peFilm::ResolvePixel(size_t idx) const {
+  switch (_storage) {
+  case FilmStorage::Float32: {
+    auto &px = _floatPixels[idx];
+    auto div = px.sampleCount > 0 ? (1 / px.sampleCount) : 1;
+    return Spectrum_t{px.r * div, px.g * div, px.b * div};
+  }
+  case FilmStorage::Half: {
+    auto &px = _halfPixels[idx];
+    return Spectrum_t{HalfToFloat(px.r), HalfToFloat(px.g), HalfToFloat(px.b)};
+  }
+  case FilmStorage::SharedExponent: {
+    float r, g, b;
+    UnpackRGB9E5(_sharedExponentPixels[idx], r, g, b);
+    return Spectrum_t{r, g, b};
+  }
+  }
+  return Spectrum_t{0, 0, 0};
+}
@@ -1,6 +1,7 @@
 #include "Integration\peDirectLightIntegrator.h"
 #include "Math/peSampling.h"
 #include "Scene/peScene.h"
+#include "peEngine.h"
 
 pe::Spectrum_t pe::peDirectLightIntegrator::Estimate(
     const peScene &scene, const Sample &sample, const SceneHit &hit,
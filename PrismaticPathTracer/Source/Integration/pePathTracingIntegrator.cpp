@@ -21,8 +21,13 @@ UniformSampleOneLight(const pe::peScene &scene, const glm::vec3 &point,
                                  flags);
 }
 
-pe::pePathTracingIntegrator::pePathTracingIntegrator(uint32_t maxDepth)
-    : _maxDepth(maxDepth), _numSamplesPerPixel(1) {}
+pe::pePathTracingIntegrator::pePathTracingIntegrator(uint32_t maxDepth,
+                                                     IAllocator *allocator)
+    : _maxDepth(maxDepth), _numSamplesPerPixel(1),
+      _lightSampleOffsets(WrapAllocator<LightSampleOffset>(allocator)),
+      _bsdfSampleOffsets(WrapAllocator<BSDFSampleOffset>(allocator)),
+      _pathSampleOffsets(WrapAllocator<BSDFSampleOffset>(allocator)),
+      _sampleOffsets(WrapAllocator<uint32_t>(allocator)) {}
 
 static pe::Spectrum_t NormalToSpectrum(const glm::vec3 &normal) {
   return pe::Spectrum_t{0.5f + normal.x / 2, 0.5f + normal.y / 2,
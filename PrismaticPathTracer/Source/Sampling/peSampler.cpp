@@ -39,9 +39,14 @@ uint32_t Sample::ChunkSize2D(uint32_t chunkIdx) const {
 }
 
 void Sample::CloneNTimes(gsl::span<Sample> clones) const {
+  const auto allocator = _1dCounts.get_allocator();
   for (auto &clone : clones) {
-    clone._1dCounts = _1dCounts;
-    clone._2dCounts = _2dCounts;
+    // Assigning fresh vectors propagates the allocator
+    clone._1dCounts = peVector<uint32_t>{_1dCounts, allocator};
+    clone._2dCounts = peVector<uint32_t>{_2dCounts, allocator};
+    clone._sampleBuffer = peVector<float>{allocator};
+    clone._1dSamples = peVector<float *>{allocator};
+    clone._2dSamples = peVector<float *>{allocator};
     clone.AllocateSampleMemory();
   }
 }
@@ -83,8 +88,12 @@ uint32_t peSampler::MaxSampleCount() const { return _samplesX * _samplesY; }
 peStratifiedSampler::peStratifiedSampler(const glm::uvec2 &startPoint,
                                          const glm::uvec2 &endPoint,
                                          uint32_t samplesX, uint32_t samplesY,
-                                         std::default_random_engine &rng)
-    : peSampler(startPoint, endPoint, samplesX, samplesY, rng) {
+                                         std::default_random_engine &rng,
+                                         IAllocator *allocator)
+    : peSampler(startPoint, endPoint, samplesX, samplesY, rng),
+      _imageSamples(WrapAllocator<glm::vec2>(allocator)),
+      _1dSamples(WrapAllocator<float>(allocator)),
+      _2dSamples(WrapAllocator<glm::vec2>(allocator)) {
   _curX = startPoint.x;
   _curY = startPoint.y;
   _imageSamples.resize(samplesX * samplesY);
@@ -135,7 +144,13 @@ uint32_t peStratifiedSampler::GetMoreSamples(gsl::span<Sample> samples) {
   return numSamples;
 }
 
-Sample::Sample(peSurfaceIntegrator &surfaceIntegrator, const peScene &scene) {
+Sample::Sample(peSurfaceIntegrator &surfaceIntegrator, const peScene &scene,
+               IAllocator *allocator)
+    : _1dCounts(WrapAllocator<uint32_t>(allocator)),
+      _2dCounts(WrapAllocator<uint32_t>(allocator)),
+      _sampleBuffer(WrapAllocator<float>(allocator)),
+      _1dSamples(WrapAllocator<float *>(allocator)),
+      _2dSamples(WrapAllocator<float *>(allocator)) {
   surfaceIntegrator.AllocateSamples(*this, scene);
 }
 
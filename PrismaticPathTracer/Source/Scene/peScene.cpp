@@ -1,10 +1,20 @@
 #include "Scene\peScene.h"
-#include "Components/peTransformComponent.h"
 #include "Math/peCoordSys.h"
-#include "Rendering/peMesh.h"
+#include "Memory/peAllocators.h"
 #include "Shapes/Triangle.h"
 #include "Util/Intersections.h"
 
+pe::peScene::peScene()
+    : _geometryAllocator(MemoryTag::Geometry,
+                         peLargePageAllocator::GetInstance()),
+      _accelerationAllocator(MemoryTag::AccelerationStructures,
+                             peLargePageAllocator::GetInstance()),
+      _spheres(WrapAllocator<Sphere>(&_geometryAllocator)),
+      _triangles(WrapAllocator<Triangle>(&_geometryAllocator)),
+      _intersectables(WrapAllocator<Intersectable>(&_accelerationAllocator)),
+      _bsdfIndices(WrapAllocator<std::pair<const uint32_t, uint32_t>>(
+          &_accelerationAllocator)) {}
+
 bool pe::peScene::Intersects(const Ray &ray) const {
   auto wasHit = false;
   for (auto &intersectable : _intersectables) {
@@ -37,96 +47,73 @@ const pe::BSDF &pe::peScene::GetBSDFForPrimitive(uint32_t id) const {
   return _bsdfs[bsdfIdx];
 }
 
-void pe::peScene::BuildScene(
-    gsl::span<peComponentHandle<pePrimitiveRenderComponent>> primitives,
-    gsl::span<peStaticRenderComponent::Handle_t> staticEntities,
-    gsl::span<peComponentHandle<pePointLightComponent>> pointLights,
-    gsl::span<peComponentHandle<peDirectionalLightComponent>>
-        directionalLights) {
-  for (auto &primComponent : primitives) {
-    auto &sphere = primComponent->primitive;
-    auto &material = primComponent->material;
-    const auto offlineData = material->GetOfflineData();
-    if (!offlineData)
-      continue;
-
+void pe::peScene::BuildScene(const peGeometryProxy &geometry,
+                             const peLightsProxy &lights) {
+  // Triangles and their copies in the intersectables reference the meshes
+  _intersectables.clear();
+  _bsdfIndices.clear();
+  _bsdfs.clear();
+  _triangles.clear();
+  _meshes.clear();
+  _spheres.clear();
+
+  for (const auto &sphereProxy : geometry.spheres) {
     // TODO Transform sphere to world space
 
-    _spheres.emplace_back(sphere);
-    _bsdfs.emplace_back(*offlineData);
+    _spheres.emplace_back(sphereProxy.sphere);
+    _bsdfs.emplace_back(*sphereProxy.bsdf);
 
     AddIntersectable(_spheres.back());
   }
 
-  for (auto staticEntity : staticEntities) {
-    AddStaticMesh(*staticEntity, staticEntity.GetEntity());
+  for (const auto &meshProxy : geometry.staticMeshes) {
+    AddStaticMesh(meshProxy);
   }
 
-  for (auto &light : pointLights) {
-    _lightSamplers.push_back(std::make_unique<pePointLightSampler>(*light));
+  SetLights(lights);
+}
+
+void pe::peScene::SetLights(const peLightsProxy &lights) {
+  _lightSamplers.clear();
+  for (const auto &light : lights.pointLights) {
+    _lightSamplers.push_back(std::make_unique<pePointLightSampler>(light));
   }
 
-  for (auto &light : directionalLights) {
+  for (const auto &light : lights.directionalLights) {
     // TODO
-    //_lightSamplers.push_back(std::make_unique<peDirect>(*light));
+    //_lightSamplers.push_back(std::make_unique<peDirect>(light));
   }
 }
 
-void pe::peScene::AddStaticMesh(const peStaticRenderComponent &comp,
-                                const peEntity &entity) {
-  auto &material = comp.material;
-  if (!material.IsAlive())
-    return;
-  const auto offlineData = material->GetOfflineData();
-  if (!offlineData) {
-    PrismaticEngine.GetLogging()->LogError(
-        "Mesh has no offline material data!");
-    return;
-  }
+void pe::peScene::AddStaticMesh(const peStaticMeshProxy &meshProxy) {
+  auto &mesh = *meshProxy.mesh;
 
-  auto &mesh = *comp.mesh;
-  auto &meshData = mesh.GetData();
-  auto &vertexLayout = mesh.GetVertexLayout();
-
-  // TODO Support different vertex layouts
-  if (vertexLayout.components.size() != 2 ||
-      vertexLayout.components[0].attribute != VertexAttribute::Position ||
-      vertexLayout.components[0].dataType != VertexDataType::Float ||
-      vertexLayout.components[1].attribute != VertexAttribute::Normal ||
-      vertexLayout.components[1].dataType != VertexDataType::Float) {
-    PrismaticEngine.GetLogging()->LogError("Invalid vertex layout on mesh!");
-    return;
-  }
+  // The mesh keeps these arrays, so they share the allocator of the scene
+  peVector<Vertex> vertices{mesh.vertices.begin(), mesh.vertices.end(),
+                            WrapAllocator<Vertex>(&_geometryAllocator)};
+  peVector<uint32_t> indices{mesh.indices.begin(), mesh.indices.end(),
+                             WrapAllocator<uint32_t>(&_geometryAllocator)};
+
+  // Transform geometry to world space
+  const auto &objToWorld = meshProxy.objectToWorld;
+  for (auto &vertex : vertices) {
+    auto worldPos4d = (objToWorld * glm::vec4{vertex.position, 1.f});
+    vertex.position = {worldPos4d.x, worldPos4d.y, worldPos4d.z};
 
-  peVector<Vertex> vertices{
-      reinterpret_cast<Vertex const *>(meshData._vertexData.data()),
-      reinterpret_cast<Vertex const *>(meshData._vertexData.data() +
-                                       meshData._vertexData.size())};
-
-  auto transformComponent = entity.GetComponent<peTransformComponent>();
-  if (transformComponent) {
-    // Get object-to-world matrix
-    auto &objToWorld = transformComponent->transformation;
-    // Transform geometry to world space
-    for (auto &vertex : vertices) {
-      auto worldPos4d = (objToWorld * glm::vec4{vertex.position, 1.f});
-      vertex.position = {worldPos4d.x, worldPos4d.y, worldPos4d.z};
-
-      auto normal4d = (objToWorld * glm::vec4(vertex.normal, 0.f));
-      vertex.normal =
-          glm::normalize(glm::vec3{normal4d.x, normal4d.y, normal4d.z});
-    }
+    auto normal4d = (objToWorld * glm::vec4(vertex.normal, 0.f));
+    vertex.normal =
+        glm::normalize(glm::vec3{normal4d.x, normal4d.y, normal4d.z});
   }
 
   auto newMesh = std::make_unique<TriangleMesh>();
-  newMesh->SetGeometry(std::move(vertices), meshData._indexData);
+  newMesh->SetGeometry(std::move(vertices), std::move(indices));
 
   const auto oldTriangleCount = _triangles.size();
   newMesh->Refine(_triangles);
 
   _meshes.push_back(std::move(newMesh));
 
-  _bsdfs.emplace_back(*offlineData);
+  _bsdfs.emplace_back(*meshProxy.bsdf);
 
   for (auto idx = oldTriangleCount; idx < _triangles.size(); ++idx) {
     AddIntersectable(_triangles[idx]);
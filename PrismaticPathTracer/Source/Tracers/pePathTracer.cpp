@@ -6,6 +6,7 @@
 #include "Math/MathUtil.h"
 #include "Math/peCoordSys.h"
 #include "Sampling/peSampler.h"
+#include "Threading/peParallel.h"
 #include "Util/Intersections.h"
 #include "Util/Ray.h"
 #include "Util\ToneMapping.h"
@@ -13,36 +14,67 @@
 
 //#define LOG_HITS
 
-static pe::peComponentHandle<pe::peCameraComponent> GetActiveCamera() {
-  auto cameras = PrismaticEngine.GetWorld()
-                     ->EntityManager()
-                     .AllComponents<pe::peCameraComponent>();
-  pe::peComponentHandle<pe::peCameraComponent> camera;
-  for (auto cam : cameras) {
-    camera = cam;
-    break;
-  }
-
-  return camera;
+pe::pePathTracer::pePathTracer(const peScene &scene, FilmStorage filmStorage,
+                               uint32_t concurrency)
+    : _scene(scene), _width(0), _height(0), _samplesPerPixel(16),
+      _jitter(Jitter::Uniform), _tileOrder(TileOrder::Scanline), _focus(0, 0),
+      // Rendering keeps its processors busy for seconds, so it is worth
+      // pinning the runners and keeping their caches warm
+      _taskSystem(concurrency, true),
+      _frameTasks(_taskSystem), _film(filmStorage, &_taskSystem),
+      _nextStripToWrite(0) {}
+
+pe::pePathTracer::~pePathTracer() {
+  CancelRenderProcess();
+  WaitForFrame();
 }
 
-pe::pePathTracer::pePathTracer(const peScene &scene)
-    : _scene(scene), _width(0), _height(0), _samplesPerPixel(16),
-      _jitter(Jitter::Uniform) {}
+void pe::pePathTracer::BeginRenderProcess(const peCameraComponent &camera,
+                                          uint32_t width, uint32_t height) {
+  if (_frame && _imageWriter)
+    throw std::runtime_error{
+        "A render process that streams into an image writer can't restart!"};
+  if (_imageWriter &&
+      (_imageWriter->Width() != width || _imageWriter->Height() != height))
+    throw std::runtime_error{"Image writer does not match the image size!"};
 
-void pe::pePathTracer::BeginRenderProcess(uint32_t width, uint32_t height) {
   _taskSystem.Start();
 
-  auto camera = GetActiveCamera();
-  if (!camera)
-    return;
+  // Tiles of the old frame check the token under the pixels lock, so none of
+  // them writes to the film after it is resized below
+  CancelRenderProcess();
 
-  _width = width;
-  _height = height;
-  _pixelAccumulator.resize(width * height, RGBA_32BitFloat{0, 0, 0, 0});
-  _normalizedPixels.resize(width * height, Spectrum_t{0, 0, 0});
+  // Pre-faulting the film runs tasks on the task system and helps with them
+  // while waiting, stale tiles among them lock the pixels. The old buffers
+  // are freed outside of the lock as well
+  auto filmBuffers = _film.AllocateBuffers(width, height);
+  {
+    std::lock_guard<std::mutex> guard{_pixelsLock};
+    _width = width;
+    _height = height;
+    _film.SwapBuffers(filmBuffers);
+
+    if (_imageWriter) {
+      const auto chunksX = (width + ChunkSizeX - 1) / ChunkSizeX;
+      const auto chunksY = (height + ChunkSizeY - 1) / ChunkSizeY;
+      _remainingTilesPerStrip.assign(chunksY, chunksX);
+      _nextStripToWrite = 0;
+    }
+  }
+  _hasNewResult = false;
+
+  _frame = std::make_shared<Frame>(camera, width, height);
+  GeneratePrimaryTasks(_frame);
+}
 
-  GeneratePrimaryTasks(*camera);
+void pe::pePathTracer::CancelRenderProcess() {
+  if (_frame)
+    _frame->cancellation.Cancel();
+}
+
+void pe::pePathTracer::SetImageWriter(
+    std::unique_ptr<peHDRImageWriter> writer) {
+  _imageWriter = std::move(writer);
 }
 
 bool pe::pePathTracer::HasNewResult() const {
@@ -50,30 +82,44 @@ bool pe::pePathTracer::HasNewResult() const {
 }
 
 void pe::pePathTracer::GetResult(ImageData_t &results) {
-  // Resolve the accumulation buffer into the resolved image
-  results.resize(_pixelAccumulator.size());
-  {
-    std::lock_guard<std::mutex> guard{_pixelsLock};
-
-    // First normalize all the pixels since we might have multiple samples per
-    // pixel
-    std::transform(
-        _pixelAccumulator.begin(), _pixelAccumulator.end(),
-        _normalizedPixels.begin(), [](auto &px) {
-          auto div = px.a() > 0 ? (1 / px.a()) : 1;
-          return Spectrum_t{px.r() * div, px.g() * div, px.b() * div};
-        });
+  results.resize(static_cast<size_t>(_width) * _height);
+  // Cleared up front, so tiles that arrive while we resolve are not lost
+  _hasNewResult = false;
+
+  // Resolve the film in strips of rows so that we never need a normalized
+  // copy of the whole image. This is only valid as long as the tone mapping
+  // works on each pixel independently. The lock is only held while reading
+  // from the film, never while waiting for other strips, since the waiting
+  // thread might pick up a tile that needs the lock as well
+  const auto resolveStrips = [&](size_t firstStrip, size_t lastStrip) {
+    peVector<Spectrum_t> strip;
+    strip.resize(static_cast<size_t>(_width) * ChunkSizeY);
+    for (auto stripIdx = firstStrip; stripIdx < lastStrip; ++stripIdx) {
+      const auto row = static_cast<uint32_t>(stripIdx) * ChunkSizeY;
+      const auto numRows = std::min(ChunkSizeY, _height - row);
+      const auto numPixels = static_cast<size_t>(numRows) * _width;
+      gsl::span<Spectrum_t> resolved{strip.data(),
+                                     static_cast<std::ptrdiff_t>(numPixels)};
+      {
+        std::lock_guard<std::mutex> guard{_pixelsLock};
+        _film.ResolveRows(row, numRows, resolved);
+      }
 
-    // then tone map
-    ToneMap(results, _normalizedPixels, _width, _height, ToneMapping::Saturate);
+      gsl::span<RGBA_8Bit> mapped{
+          results.data() + static_cast<size_t>(row) * _width,
+          static_cast<std::ptrdiff_t>(numPixels)};
+      ToneMap(mapped, resolved, _width, numRows, ToneMapping::Saturate);
+    }
+  };
 
-    _hasNewResult = false;
-  }
+  const auto numStrips = (_height + ChunkSizeY - 1) / ChunkSizeY;
+  ParallelFor(_taskSystem, 0, numStrips, 1, resolveStrips);
 }
 
-void pe::pePathTracer::GeneratePrimaryTasks(const peCameraComponent &camera) {
-  const auto chunksX = (_width + ChunkSizeX - 1) / ChunkSizeX;
-  const auto chunksY = (_height + ChunkSizeY - 1) / ChunkSizeY;
+void pe::pePathTracer::GeneratePrimaryTasks(
+    const std::shared_ptr<Frame> &frame) {
+  const auto chunksX = (frame->width + ChunkSizeX - 1) / ChunkSizeX;
+  const auto chunksY = (frame->height + ChunkSizeY - 1) / ChunkSizeY;
 
   std::default_random_engine rng;
   auto now = std::chrono::high_resolution_clock::now();
@@ -84,55 +130,77 @@ void pe::pePathTracer::GeneratePrimaryTasks(const peCameraComponent &camera) {
   std::generate(seeds.begin(), seeds.end(), [&]() { return rng(); });
 
 #ifdef _DEBUG
-  _taskSystem.AddTask([&]() {
-    TraceChunk(camera, {0, 0}, {_width, _height}, seeds[0]);
+  _frameTasks.Run([this, frame, seed = seeds[0]]() {
+    TraceChunk(*frame, {0, 0}, {frame->width, frame->height}, seed);
   });
 #else
-  for (uint32_t y = chunksY; y > 0; --y) {
-    for (uint32_t x = 0; x < chunksX; ++x) {
-      const auto offsetX = x * ChunkSizeX;
-      const auto offsetY = (y - 1) * ChunkSizeY;
-
-      auto seed = seeds[(y * chunksX) + x];
-
-      _taskSystem.AddTask([&, offsetX, offsetY, seed]() {
-        TraceChunk(camera, {offsetX, offsetY}, {ChunkSizeX, ChunkSizeY}, seed);
-      });
-    }
+  const glm::vec2 focusTile{static_cast<float>(_focus.x) / ChunkSizeX,
+                            static_cast<float>(_focus.y) / ChunkSizeY};
+  const auto tiles = OrderTiles(chunksX, chunksY, _tileOrder, focusTile);
+
+  // The tiles around the focus jump ahead of everything else that is queued,
+  // the rest follows in the given order
+  const auto numFocusTiles = _tileOrder == TileOrder::FocusFirst
+                                 ? static_cast<size_t>(_taskSystem.Concurrency())
+                                 : size_t{0};
+  for (size_t idx = 0; idx < tiles.size(); ++idx) {
+    const auto &tile = tiles[idx];
+    const auto offsetX = tile.x * ChunkSizeX;
+    const auto offsetY = tile.y * ChunkSizeY;
+    const auto seed = seeds[tile.y * chunksX + tile.x];
+    const auto priority =
+        idx < numFocusTiles ? peTaskPriority::High : peTaskPriority::Normal;
+
+    _frameTasks.Run(
+        [this, frame, offsetX, offsetY, seed]() {
+          TraceChunk(*frame, {offsetX, offsetY}, {ChunkSizeX, ChunkSizeY},
+                     seed);
+        },
+        priority);
   }
 #endif
 }
 
-void pe::pePathTracer::TraceChunk(const peCameraComponent &camera,
-                                  const glm::uvec2 &offset,
+void pe::pePathTracer::TraceChunk(const Frame &frame, const glm::uvec2 &offset,
                                   const glm::uvec2 &extent, uint32_t seed) {
-  const auto rangeXEnd = std::min(offset.x + extent.x, _width);
-  const auto rangeYEnd = std::min(offset.y + extent.y, _height);
+  // Tiles of a cancelled frame are dropped without any work
+  if (frame.cancellation.IsCancelled())
+    return;
+
+  const auto &camera = frame.camera;
+  const auto rangeXEnd = std::min(offset.x + extent.x, frame.width);
+  const auto rangeYEnd = std::min(offset.y + extent.y, frame.height);
   auto sqrtSamples = static_cast<uint32_t>(std::sqrt(_samplesPerPixel));
 
   std::default_random_engine rng;
   rng.seed(seed);
 
+  // All buffers of the tile live in the scratch arena of this thread, which
+  // is reset once the tile task returns
+  auto &scratch = _taskSystem.ScratchArena();
+
   peStratifiedSampler sampler{{offset.x, offset.y},
                               {rangeXEnd, rangeYEnd},
                               sqrtSamples,
                               sqrtSamples,
-                              rng};
+                              rng,
+                              &scratch};
 
   // peDirectLightIntegrator integrator;
-  pePathTracingIntegrator integrator{5};
+  pePathTracingIntegrator integrator{5, &scratch};
   // peDebugIntegrator integrator;
   // integrator.SetVisualizationMode(DebugVisualizationMode::Sample);
-  Sample baseSample{integrator, _scene};
+  Sample baseSample{integrator, _scene, &scratch};
 
-  peVector<Sample> samples;
+  peVector<Sample> samples{WrapAllocator<Sample>(&scratch)};
   samples.resize(sampler.MaxSampleCount());
   baseSample.CloneNTimes(samples);
 
-  peVector<Ray> rays;
+  peVector<Ray> rays{WrapAllocator<Ray>(&scratch)};
   rays.resize(sampler.MaxSampleCount());
 
-  peVector<RGBA_32BitFloat> colorAccumulator;
+  peVector<RGBA_32BitFloat> colorAccumulator{
+      WrapAllocator<RGBA_32BitFloat>(&scratch)};
   colorAccumulator.resize(extent.x * extent.y, RGBA_32BitFloat{0, 0, 0, 0});
 
   uint32_t totalSamplesProcessed = 0;
@@ -142,7 +210,11 @@ void pe::pePathTracer::TraceChunk(const peCameraComponent &camera,
 
   uint32_t numGeneratedSamples;
   while ((numGeneratedSamples = sampler.GetMoreSamples(samples)) != 0) {
-    GetPrimaryRaysFromSamples(rays, samples, camera, {_width, _height});
+    if (frame.cancellation.IsCancelled())
+      return;
+
+    GetPrimaryRaysFromSamples(rays, samples, camera,
+                              {frame.width, frame.height});
 
     for (uint32_t idx = 0; idx < numGeneratedSamples; ++idx) {
       auto &ray = rays[idx];
@@ -187,39 +259,77 @@ void pe::pePathTracer::TraceChunk(const peCameraComponent &camera,
     totalSamplesProcessed += numGeneratedSamples;
     if (totalSamplesProcessed >= UpdateAfterNSamples) {
       totalSamplesProcessed -= UpdateAfterNSamples;
-      AccumulatePixels(colorAccumulator, {offset.x, offset.y}, extent.x);
+      AccumulatePixels(frame, colorAccumulator, {offset.x, offset.y},
+                       extent.x);
     }
   }
 
-  AccumulatePixels(colorAccumulator, {offset.x, offset.y}, extent.x);
+  AccumulatePixels(frame, colorAccumulator, {offset.x, offset.y}, extent.x);
+  OnChunkFinished(frame, offset, extent);
 }
 
-void pe::pePathTracer::AccumulatePixels(gsl::span<RGBA_32BitFloat> newPixels,
+void pe::pePathTracer::AccumulatePixels(const Frame &frame,
+                                        gsl::span<RGBA_32BitFloat> newPixels,
                                         const glm::uvec2 &offset,
                                         uint32_t stride) {
   std::lock_guard<std::mutex> guard{_pixelsLock};
+  // The film might already belong to a newer frame
+  if (frame.cancellation.IsCancelled())
+    return;
+  _film.StoreTile(newPixels, offset, stride);
+  _hasNewResult = true;
+}
+
+void pe::pePathTracer::OnChunkFinished(const Frame &frame,
+                                       const glm::uvec2 &offset,
+                                       const glm::uvec2 &extent) {
+  if (!_imageWriter)
+    return;
 
-  const auto rows = static_cast<uint32_t>(newPixels.size() / stride);
-  const auto end = std::min(offset.y + rows, _height);
-  for (auto y = offset.y; y < end; ++y) {
-    // The newPixels buffer might extend past the end of the _pixelAccumulator,
-    // so we have to make sure  that we don't go out of bounds!
-    const auto dstStartIdx = (y * _width) + offset.x;
-    const auto dstEndIdx =
-        std::min(dstStartIdx + stride,
-                 static_cast<uint32_t>(_pixelAccumulator.size()) - 1);
-
-    const auto srcStartIdx = (y - offset.y) * stride;
-    const auto srcEndIdx = srcStartIdx + (dstEndIdx - dstStartIdx);
-
-    auto srcStart = newPixels.begin() + srcStartIdx;
-    const auto srcEnd = newPixels.begin() + srcEndIdx;
-    auto dstStart = _pixelAccumulator.begin() + dstStartIdx;
-
-    for (; srcStart != srcEnd; ++srcStart, ++dstStart) {
-      *dstStart = *srcStart;
+  {
+    std::lock_guard<std::mutex> guard{_pixelsLock};
+    if (frame.cancellation.IsCancelled())
+      return;
+    // In debug builds, a single chunk covers the whole image
+    const auto columnEnd = std::min(offset.x + extent.x, _width);
+    const auto tilesX = (columnEnd - offset.x + ChunkSizeX - 1) / ChunkSizeX;
+    const auto rowEnd = std::min(offset.y + extent.y, _height);
+    for (auto row = offset.y; row < rowEnd; row += ChunkSizeY) {
+      _remainingTilesPerStrip[row / ChunkSizeY] -= tilesX;
     }
   }
 
-  _hasNewResult = true;
+  try {
+    StreamFinishedStrips();
+  } catch (const std::exception &ex) {
+    PrismaticEngine.GetLogging()->LogError("Writing the image failed: %s",
+                                           ex.what());
+  }
+}
+
+void pe::pePathTracer::StreamFinishedStrips() {
+  std::lock_guard<std::mutex> writerGuard{_imageWriterLock};
+
+  // Strips have to be written in order, so each finished strip is resolved
+  // from the film once all strips below it are written. That way, we never
+  // need a full-precision copy of the image
+  const auto numStrips = static_cast<uint32_t>(_remainingTilesPerStrip.size());
+  peVector<Spectrum_t> strip;
+  while (_nextStripToWrite < numStrips) {
+    {
+      std::lock_guard<std::mutex> guard{_pixelsLock};
+      if (_remainingTilesPerStrip[_nextStripToWrite] != 0)
+        return;
+
+      const auto firstRow = _nextStripToWrite * ChunkSizeY;
+      const auto numRows = std::min(ChunkSizeY, _height - firstRow);
+      strip.resize(static_cast<size_t>(numRows) * _width);
+      _film.ResolveRows(firstRow, numRows, strip);
+    }
+
+    _imageWriter->WriteRows(strip);
+    ++_nextStripToWrite;
+  }
+
+  _imageWriter->Finish();
 }
@@ -0,0 +1,119 @@
+#include "Tracers\peTileOrder.h"
+
+#include <algorithm>
+
+static pe::peVector<glm::uvec2> ScanlineOrder(uint32_t tilesX,
+                                              uint32_t tilesY) {
+  pe::peVector<glm::uvec2> tiles;
+  tiles.reserve(static_cast<size_t>(tilesX) * tilesY);
+  // Row 0 is the bottom of the image
+  for (uint32_t y = tilesY; y > 0; --y) {
+    for (uint32_t x = 0; x < tilesX; ++x) {
+      tiles.push_back({x, y - 1});
+    }
+  }
+  return tiles;
+}
+
+static pe::peVector<glm::uvec2> SpiralOrder(uint32_t tilesX,
+                                            uint32_t tilesY) {
+  const auto numTiles = static_cast<size_t>(tilesX) * tilesY;
+  pe::peVector<glm::uvec2> tiles;
+  tiles.reserve(numTiles);
+
+  // Walks 1 right, 1 up, 2 left, 2 down, 3 right... and skips everything
+  // outside of the image, until all tiles are visited
+  constexpr int32_t DirX[] = {1, 0, -1, 0};
+  constexpr int32_t DirY[] = {0, 1, 0, -1};
+  int32_t x = static_cast<int32_t>(tilesX / 2);
+  int32_t y = static_cast<int32_t>(tilesY / 2);
+  const auto visit = [&]() {
+    if (x >= 0 && y >= 0 && x < static_cast<int32_t>(tilesX) &&
+        y < static_cast<int32_t>(tilesY))
+      tiles.push_back(
+          {static_cast<uint32_t>(x), static_cast<uint32_t>(y)});
+  };
+
+  visit();
+  for (int32_t legLength = 1, dir = 0; tiles.size() < numTiles; ++dir) {
+    for (int32_t step = 0; step < legLength; ++step) {
+      x += DirX[dir % 4];
+      y += DirY[dir % 4];
+      visit();
+    }
+    // Every second leg is one tile longer
+    if (dir % 2)
+      ++legLength;
+  }
+  return tiles;
+}
+
+//! \brief Maps a distance along a Hilbert curve that covers a square of side
+//! length n (a power of two) to a position
+static glm::uvec2 HilbertPosition(uint32_t n, uint32_t distance) {
+  glm::uvec2 pos{0, 0};
+  for (uint32_t s = 1; s < n; s *= 2) {
+    const auto rx = 1 & (distance / 2);
+    const auto ry = 1 & (distance ^ rx);
+    if (ry == 0) {
+      if (rx == 1) {
+        pos.x = s - 1 - pos.x;
+        pos.y = s - 1 - pos.y;
+      }
+      std::swap(pos.x, pos.y);
+    }
+    pos.x += s * rx;
+    pos.y += s * ry;
+    distance /= 4;
+  }
+  return pos;
+}
+
+static pe::peVector<glm::uvec2> HilbertOrder(uint32_t tilesX,
+                                             uint32_t tilesY) {
+  pe::peVector<glm::uvec2> tiles;
+  tiles.reserve(static_cast<size_t>(tilesX) * tilesY);
+
+  // The curve covers the next power of two, tiles outside of the image are
+  // skipped
+  uint32_t n = 1;
+  while (n < std::max(tilesX, tilesY))
+    n *= 2;
+  for (uint32_t distance = 0; distance < n * n; ++distance) {
+    const auto pos = HilbertPosition(n, distance);
+    if (pos.x < tilesX && pos.y < tilesY)
+      tiles.push_back(pos);
+  }
+  return tiles;
+}
+
+static pe::peVector<glm::uvec2> FocusFirstOrder(uint32_t tilesX,
+                                                uint32_t tilesY,
+                                                const glm::vec2 &focus) {
+  auto tiles = ScanlineOrder(tilesX, tilesY);
+  const auto distanceToFocus = [&](const glm::uvec2 &tile) {
+    const auto dx = static_cast<float>(tile.x) + 0.5f - focus.x;
+    const auto dy = static_cast<float>(tile.y) + 0.5f - focus.y;
+    return dx * dx + dy * dy;
+  };
+  std::stable_sort(tiles.begin(), tiles.end(),
+                   [&](const glm::uvec2 &l, const glm::uvec2 &r) {
+                     return distanceToFocus(l) < distanceToFocus(r);
+                   });
+  return tiles;
+}
+
+pe::peVector<glm::uvec2> pe::OrderTiles(uint32_t tilesX, uint32_t tilesY,
+                                        TileOrder order,
+                                        const glm::vec2 &focus) {
+  switch (order) {
+  case TileOrder::Spiral:
+    return SpiralOrder(tilesX, tilesY);
+  case TileOrder::Hilbert:
+    return HilbertOrder(tilesX, tilesY);
+  case TileOrder::FocusFirst:
+    return FocusFirstOrder(tilesX, tilesY, focus);
+  default:
+    return ScanlineOrder(tilesX, tilesY);
+  }
+}
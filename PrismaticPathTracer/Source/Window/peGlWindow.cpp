@@ -91,6 +91,10 @@ void peGlWindow::CreateRenderContext() {
   auto glVersion = glGetString(GL_VERSION);
   PrismaticEngine.GetLogging()->LogInfo(
       "Initialized OpenGL context with version %s", glVersion);
+
+  // A context can only be current on one thread, the renderer might use it on
+  // another one
+  wglMakeCurrent(nullptr, nullptr);
 }
 
 void peGlWindow::Destroy() {
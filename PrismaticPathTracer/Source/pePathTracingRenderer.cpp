@@ -1,6 +1,7 @@
 #include "pePathTracingRenderer.h"
 #include "Components/peCameraComponent.h"
 #include "Math/MathUtil.h"
+#include "Memory/peMemoryTracking.h"
 #include "Util/Intersections.h"
 #include "Util/Ray.h"
 #include "peEngine.h"
@@ -9,10 +10,16 @@
 #include "Tracers/pePathTracer.h"
 #include "Type/peColor.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
 #include <sstream>
+#include <thread>
 
 #include "Components/peStaticRenderComponent.h"
 #include "Components/peTransformComponent.h"
+#include "FileSystem/peBufferedFile.h"
 #include "FileSystem/peFileSystemUtil.h"
 #include <GL/glew.h>
 #include <GL\freeglut.h>
@@ -20,18 +27,57 @@
 static void dumpPPM(const pe::peVector<pe::RGBA_8Bit> &pixels,
                     const uint32_t width, const uint32_t height,
                     const std::string &path) {
-  FILE *fp; /* b - binary mode */
-  auto err = fopen_s(&fp, path.c_str(), "wb");
-  (void)fprintf(fp, "P6\n%d %d\n255\n", width, height);
-  for (auto &px : pixels) {
-    fwrite(px.data(), 3, 1, fp);
+  pe::peBufferedFileWriter file{path};
+  char header[64];
+  const auto headerLength =
+      snprintf(header, sizeof(header), "P6\n%u %u\n255\n", width, height);
+  file.Write(header, static_cast<size_t>(headerLength));
+
+  // Strip the alpha channel row by row instead of writing every pixel on its
+  // own
+  pe::peVector<uint8_t> row;
+  row.resize(static_cast<size_t>(width) * 3);
+  for (uint32_t y = 0; y < height; ++y) {
+    auto src = pixels.data() + static_cast<size_t>(y) * width;
+    for (uint32_t x = 0; x < width; ++x) {
+      std::memcpy(row.data() + x * 3, src[x].data(), 3);
+    }
+    file.Write(row.data(), row.size());
   }
-  fclose(fp);
+  file.Close();
+}
+
+//! \brief Reads PE_FRAME_OUTPUT, the directory that finished frames are
+//! saved to. Empty if frames are not saved
+static std::string ReadFrameOutputDirectory() {
+#ifdef _WIN32
+  char buffer[MAX_PATH] = {'\0'};
+  if (!GetEnvironmentVariableA("PE_FRAME_OUTPUT", buffer,
+                               static_cast<DWORD>(sizeof(buffer))))
+    return {};
+  const char *value = buffer;
+#else
+  const char *value = std::getenv("PE_FRAME_OUTPUT");
+  if (!value)
+    return {};
+#endif
+  return value;
 }
 
 void pe::pePathTracingRenderer::Init() {
   _windowWidth = 800;
   _windowHeight = 600;
+  _texture = 0;
+  _syncVersion = 0;
+  _drawablesChanged = false;
+  _hasFirstFrame = false;
+  _hasFrame = false;
+  _frameOutputDirectory = ReadFrameOutputDirectory();
+  _frameSaved = false;
+  _numSavedFrames = 0;
+  auto textureAllocator = peTaggedAllocator::ForTag(MemoryTag::Textures);
+  _image =
+      pePathTracer::ImageData_t{WrapAllocator<RGBA_8Bit>(textureAllocator)};
 
   _window = std::make_unique<peGlWindow>();
   _window->Create(_windowWidth, _windowHeight);
@@ -39,95 +85,123 @@ void pe::pePathTracingRenderer::Init() {
 }
 
 void pe::pePathTracingRenderer::Shutdown() {
+  // The encoding runs on the task system of the path tracer
+  FinishSavingFrame();
+  // Cancels the current frame, the tiles must not outlive the scene
+  _pathTracer = nullptr;
+  _scene = nullptr;
+
+  if (_texture) {
+    _window->SetActive();
+    GLuint texID = _texture;
+    glDeleteTextures(1, &texID);
+    _texture = 0;
+  }
+
   _window->Destroy();
   _window = nullptr;
 }
 
 void pe::pePathTracingRenderer::Update(double deltaTime) {
+  if (!_pathTracer)
+    WaitForFirstFrame();
+
+  // The messages of the window are pumped by the input system on the game
+  // thread, which created the window
+  if (_frames.Acquire()) {
+    const auto &frame = _frames.Front();
+    if (!_pathTracer)
+      BeginRendering(frame);
+    else
+      UpdateScene(frame);
+
+    RestartFrameOnCameraMove(frame);
+  }
 
-  GatherLights();
-
-  peScene scene;
-  scene.BuildScene(_primitiveEntites, _staticEntities, _pointLights,
-                   _directionalLights);
-
-  pePathTracer pathTracer{scene};
-  pathTracer.BeginRenderProcess(_windowWidth, _windowHeight);
+  // Nothing was synchronized yet
+  if (!_pathTracer)
+    return;
 
   _window->SetActive();
 
-  pePathTracer::ImageData_t image;
-  uint32_t version = 0;
-
-  GLuint texID;
-  glGenTextures(1, &texID);
-
-  glBindTexture(GL_TEXTURE_2D, texID);
+  // Checked before fetching the result, so that the result of a complete
+  // frame contains all of its tiles
+  const auto frameComplete = _pathTracer->IsFrameComplete();
+  if (_pathTracer->HasNewResult()) {
+    _pathTracer->GetResult(_image);
 
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, _windowWidth, _windowHeight, 0,
-               GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
-
-  glActiveTexture(GL_TEXTURE0);
-  glDisable(GL_DEPTH_TEST);
-  glEnable(GL_TEXTURE_2D);
-
-  MSG msg;
-  while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE)) {
-    TranslateMessage(&msg);
-    DispatchMessage(&msg);
+    glBindTexture(GL_TEXTURE_2D, _texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, _windowWidth, _windowHeight, 0,
+                 GL_RGBA, GL_UNSIGNED_BYTE, _image.data());
   }
+  if (frameComplete && !_frameSaved && !_frameOutputDirectory.empty())
+    SaveFrame();
 
-  while (true) {
-
-    _window->SetActive();
-
-    if (pathTracer.HasNewResult()) {
-      pathTracer.GetResult(image);
-
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, _windowWidth, _windowHeight, 0,
-                   GL_RGBA, GL_UNSIGNED_BYTE, image.data());
+  DrawResult();
+  // Also releases the context, so that Shutdown can use it on the game thread
+  _window->Present();
+}
 
-      // std::stringstream ss;
-      // ss << "D:\\tmp\\tracer_" << version << ".png";
-      // DumpPNG(image, _windowWidth, _windowHeight, ss.str());
+void pe::pePathTracingRenderer::Synchronize() {
+  auto &entityManager = PrismaticEngine.GetWorld()->EntityManager();
+  // Changes that happen from here on are picked up by the next call
+  const auto version = entityManager.GetVersion();
+  {
+    std::lock_guard<std::mutex> guard{_resourcesLock};
+    const auto resourcesChanged = DropDirtyResourceProxies();
+    if (!_geometry) {
+      // From now on the geometry proxy only needs to copy the drawable
+      // entities that changed
+      entityManager.TrackChangedEntities<pePrimitiveRenderComponent>();
+      entityManager.TrackChangedEntities<peStaticRenderComponent>();
+      entityManager.TrackChangedEntities<peTransformComponent>();
     }
 
-    glViewport(0, 0, _windowWidth, _windowHeight);
-
-    glClearColor(0, 0, 0, 1);
-    glClear(GL_COLOR_BUFFER_BIT);
-
-    glBegin(GL_TRIANGLES);
-
-    glTexCoord2f(0, 0);
-    glVertex2f(-1.f, -1.f);
-
-    glTexCoord2f(1, 0);
-    glVertex2f(1.f, -1.f);
-
-    glTexCoord2f(1, 1);
-    glVertex2f(1.f, 1.f);
-
-    glTexCoord2f(0, 0);
-    glVertex2f(-1.f, -1.f);
-
-    glTexCoord2f(0, 1);
-    glVertex2f(-1.f, 1.f);
-
-    glTexCoord2f(1, 1);
-    glVertex2f(1.f, 1.f);
-
-    glEnd();
-
-    _window->Present();
+    if (!_geometry || resourcesChanged || _drawablesChanged) {
+      _geometry = BuildGeometryProxy();
+    } else if (entityManager.HasChangedSince<pePrimitiveRenderComponent>(
+                   _syncVersion) ||
+               entityManager.HasChangedSince<peStaticRenderComponent>(
+                   _syncVersion) ||
+               entityManager.HasChangedSince<peTransformComponent>(
+                   _syncVersion)) {
+      _geometry = UpdateGeometryProxy();
+    }
   }
+  entityManager.DiscardChanges<pePrimitiveRenderComponent>(version);
+  entityManager.DiscardChanges<peStaticRenderComponent>(version);
+  entityManager.DiscardChanges<peTransformComponent>(version);
+
+  const auto lightsChanged =
+      !_lights ||
+      entityManager.HasChangedSince<pePointLightComponent>(_syncVersion) ||
+      entityManager.HasChangedSince<peDirectionalLightComponent>(
+          _syncVersion);
+  if (lightsChanged)
+    _lights = BuildLightsProxy();
+
+  _syncVersion = version;
+  _drawablesChanged = false;
+
+  // Unchanged proxies are shared with the frames before
+  auto &frame = _frames.Back();
+  frame.geometry = _geometry;
+  frame.lights = _lights;
+  frame.camera.reset();
+  // The components are only read, mutable access would mark them as changed
+  for (const auto camera : entityManager.AllComponents<peCameraComponent>()) {
+    frame.camera = *camera;
+    break;
+  }
+  _frames.Publish();
 
-  getchar();
+  if (!_hasFirstFrame) {
+    {
+      std::lock_guard<std::mutex> guard{_firstFrameLock};
+      _hasFirstFrame = true;
+    }
+    _firstFrameSynchronized.notify_one();
+  }
 }
 
 void pe::pePathTracingRenderer::RegisterDrawableEntity(const peEntity &entity) {
@@ -142,6 +216,7 @@ void pe::pePathTracingRenderer::RegisterDrawableEntity(const peEntity &entity) {
   if (staticRenderComponent) {
     _staticEntities.push_back(staticRenderComponent);
   }
+  _drawablesChanged = true;
 }
 
 void pe::pePathTracingRenderer::DeregisterDrawableEntity(
@@ -157,25 +232,376 @@ void pe::pePathTracingRenderer::DeregisterDrawableEntity(
   };
 
   eraseComponent(_primitiveEntites);
+  eraseComponent(_staticEntities);
+  _drawablesChanged = true;
 }
 
 void pe::pePathTracingRenderer::RegisterRenderResource(
-    const peWeakPtr<peRenderResource> &res) {}
+    const peWeakPtr<peRenderResource> &res) {
+  std::lock_guard<std::mutex> guard{_resourcesLock};
+  _resources.push_back(res);
+}
 
 void pe::pePathTracingRenderer::DeregisterRenderResource(
-    const peWeakPtr<peRenderResource> &res) {}
+    const peWeakPtr<peRenderResource> &res) {
+  std::lock_guard<std::mutex> guard{_resourcesLock};
+  auto where = std::find_if(
+      _resources.begin(), _resources.end(),
+      [&](const auto &resource) { return resource.Get() == res.Get(); });
+  if (where != _resources.end())
+    _resources.erase(where);
+
+  // Frames that use the proxies keep them alive
+  _meshProxies.erase(res.Get());
+  _bsdfProxies.erase(res.Get());
+}
+
+#pragma region GameThread
+
+bool pe::pePathTracingRenderer::DropDirtyResourceProxies() {
+  auto changed = false;
+  for (auto &resource : _resources) {
+    if (!resource->ConsumeDirty())
+      continue;
+    // The next geometry proxy copies the resource again
+    _meshProxies.erase(resource.Get());
+    _bsdfProxies.erase(resource.Get());
+    changed = true;
+  }
+  return changed;
+}
+
+std::shared_ptr<const pe::peGeometryProxy>
+pe::pePathTracingRenderer::BuildGeometryProxy() {
+  auto geometry = std::make_shared<peGeometryProxy>();
+  _proxyIndices.clear();
+
+  const auto eraseInvalid = [](auto &components) {
+    components.erase(std::remove_if(components.begin(), components.end(),
+                                    [](const auto &component) {
+                                      return !component.IsValid();
+                                    }),
+                     components.end());
+  };
+  eraseInvalid(_primitiveEntites);
+  eraseInvalid(_staticEntities);
+
+  // The components are only read, mutable access would mark them as changed
+  for (const auto &primComponent : _primitiveEntites) {
+    auto &indices = _proxyIndices[primComponent.GetEntity().GetHandle()];
+    auto sphere = MakeSphereProxy(primComponent);
+    if (!sphere)
+      continue;
+    indices.sphere = static_cast<uint32_t>(geometry->spheres.size());
+    geometry->spheres.push_back(std::move(*sphere));
+  }
+
+  for (const auto &staticEntity : _staticEntities) {
+    auto &indices = _proxyIndices[staticEntity.GetEntity().GetHandle()];
+    auto staticMesh = MakeStaticMeshProxy(staticEntity);
+    if (!staticMesh)
+      continue;
+    indices.staticMesh = static_cast<uint32_t>(geometry->staticMeshes.size());
+    geometry->staticMeshes.push_back(std::move(*staticMesh));
+  }
+  return geometry;
+}
+
+std::shared_ptr<const pe::peGeometryProxy>
+pe::pePathTracingRenderer::UpdateGeometryProxy() {
+  auto &entityManager = PrismaticEngine.GetWorld()->EntityManager();
+  // The frames before still use the current proxy. The copy shares the mesh
+  // and BSDF proxies with it
+  auto geometry = std::make_shared<peGeometryProxy>(*_geometry);
+
+  auto updated = true;
+  const auto updateEntity = [&](const peEntity &entity) {
+    if (updated)
+      updated = UpdateEntityProxy(*geometry, entity);
+  };
+  entityManager.ForEachChangedEntity<pePrimitiveRenderComponent>(
+      _syncVersion, updateEntity);
+  entityManager.ForEachChangedEntity<peStaticRenderComponent>(_syncVersion,
+                                                              updateEntity);
+  entityManager.ForEachChangedEntity<peTransformComponent>(_syncVersion,
+                                                           updateEntity);
+  if (!updated)
+    return BuildGeometryProxy();
+  return geometry;
+}
+
+bool pe::pePathTracingRenderer::UpdateEntityProxy(peGeometryProxy &geometry,
+                                                  const peEntity &entity) {
+  const auto where = _proxyIndices.find(entity.GetHandle());
+  // Not drawable, e.g. a transform without render components
+  if (where == _proxyIndices.end())
+    return true;
+  const auto &indices = where->second;
+  // Its proxies have to go, which changes the indices of the others
+  if (!entity.IsAlive())
+    return false;
+
+  // Handles are const, mutable access would mark the components as changed.
+  // Proxies that appear or disappear change the indices of the others
+  const auto primComponent = entity.GetComponent<pePrimitiveRenderComponent>();
+  auto sphere = primComponent ? MakeSphereProxy(primComponent) : std::nullopt;
+  if (sphere.has_value() != (indices.sphere != ProxyIndices::None))
+    return false;
+  if (sphere)
+    geometry.spheres[indices.sphere] = std::move(*sphere);
+
+  const auto staticEntity = entity.GetComponent<peStaticRenderComponent>();
+  auto staticMesh =
+      staticEntity ? MakeStaticMeshProxy(staticEntity) : std::nullopt;
+  if (staticMesh.has_value() != (indices.staticMesh != ProxyIndices::None))
+    return false;
+  if (staticMesh)
+    geometry.staticMeshes[indices.staticMesh] = std::move(*staticMesh);
+  return true;
+}
+
+std::optional<pe::peSphereProxy> pe::pePathTracingRenderer::MakeSphereProxy(
+    const pePrimitiveRenderComponent::Handle_t &primComponent) {
+  auto bsdf = GetBSDFProxy(primComponent->material);
+  if (!bsdf)
+    return std::nullopt;
+  return peSphereProxy{primComponent->primitive, std::move(bsdf)};
+}
+
+std::optional<pe::peStaticMeshProxy>
+pe::pePathTracingRenderer::MakeStaticMeshProxy(
+    const peStaticRenderComponent::Handle_t &staticEntity) {
+  const auto &material = staticEntity->material;
+  if (!material.IsAlive())
+    return std::nullopt;
+  auto bsdf = GetBSDFProxy(material);
+  if (!bsdf) {
+    PrismaticEngine.GetLogging()->LogError(
+        "Mesh has no offline material data!");
+    return std::nullopt;
+  }
+  auto mesh = GetMeshProxy(staticEntity->mesh);
+  if (!mesh)
+    return std::nullopt;
+
+  glm::mat4 objectToWorld{1.f};
+  const auto transformComponent =
+      staticEntity.GetEntity().GetComponent<peTransformComponent>();
+  if (transformComponent)
+    objectToWorld = transformComponent->transformation;
+
+  return peStaticMeshProxy{std::move(mesh), std::move(bsdf), objectToWorld};
+}
 
-void pe::pePathTracingRenderer::GatherLights() {
-  _pointLights.clear();
-  _directionalLights.clear();
+std::shared_ptr<const pe::peLightsProxy>
+pe::pePathTracingRenderer::BuildLightsProxy() {
+  auto &entityManager = PrismaticEngine.GetWorld()->EntityManager();
+  auto lights = std::make_shared<peLightsProxy>();
 
-  auto &entitySys = PrismaticEngine.GetWorld()->EntityManager();
+  for (const auto pointLight :
+       entityManager.AllComponents<pePointLightComponent>()) {
+    lights->pointLights.push_back(*pointLight);
+  }
+
+  for (const auto dirLight :
+       entityManager.AllComponents<peDirectionalLightComponent>()) {
+    lights->directionalLights.push_back(*dirLight);
+  }
+  return lights;
+}
 
-  for (auto pointLight : entitySys.AllComponents<pePointLightComponent>()) {
-    _pointLights.push_back(pointLight);
+std::shared_ptr<const pe::BSDF>
+pe::pePathTracingRenderer::GetBSDFProxy(const peMaterial::Handle_t &material) {
+  if (!material.IsAlive())
+    return nullptr;
+  auto &proxy = _bsdfProxies[material.Get()];
+  if (!proxy) {
+    const auto offlineData = material->GetOfflineData();
+    if (offlineData)
+      proxy = std::make_shared<const BSDF>(*offlineData);
   }
+  return proxy;
+}
 
-  for (auto dirLight : entitySys.AllComponents<peDirectionalLightComponent>()) {
-    _directionalLights.push_back(dirLight);
+std::shared_ptr<const pe::peMeshProxy>
+pe::pePathTracingRenderer::GetMeshProxy(const peMesh::Handle_t &mesh) {
+  if (!mesh.IsAlive())
+    return nullptr;
+  auto &proxy = _meshProxies[mesh.Get()];
+  if (proxy)
+    return proxy;
+
+  auto &vertexLayout = mesh->GetVertexLayout();
+  // TODO Support different vertex layouts
+  if (vertexLayout.components.size() != 2 ||
+      vertexLayout.components[0].attribute != VertexAttribute::Position ||
+      vertexLayout.components[0].dataType != VertexDataType::Float ||
+      vertexLayout.components[1].attribute != VertexAttribute::Normal ||
+      vertexLayout.components[1].dataType != VertexDataType::Float) {
+    PrismaticEngine.GetLogging()->LogError("Invalid vertex layout on mesh!");
+    return nullptr;
   }
+
+  auto &meshData = mesh->GetData();
+  auto geometryAllocator = peTaggedAllocator::ForTag(MemoryTag::Geometry);
+  proxy = std::make_shared<const peMeshProxy>(peMeshProxy{
+      {reinterpret_cast<Vertex const *>(meshData._vertexData.data()),
+       reinterpret_cast<Vertex const *>(meshData._vertexData.data() +
+                                        meshData._vertexData.size()),
+       WrapAllocator<Vertex>(geometryAllocator)},
+      {meshData._indexData.begin(), meshData._indexData.end(),
+       WrapAllocator<uint32_t>(geometryAllocator)}});
+  return proxy;
 }
+
+#pragma endregion
+
+#pragma region RenderThread
+
+void pe::pePathTracingRenderer::WaitForFirstFrame() {
+  std::unique_lock<std::mutex> lock{_firstFrameLock};
+  _firstFrameSynchronized.wait_for(lock, std::chrono::milliseconds(100),
+                                   [this]() { return _hasFirstFrame; });
+}
+
+void pe::pePathTracingRenderer::BeginRendering(const peFrameProxy &frame) {
+  _scene = std::make_unique<peScene>();
+  _scene->BuildScene(*frame.geometry, *frame.lights);
+  _sceneGeometry = frame.geometry;
+  _sceneLights = frame.lights;
+
+  // The workers of the update system and the game thread simulate the next
+  // frame in the meantime, the path tracer gets the remaining processors
+  const auto numProcessors = std::thread::hardware_concurrency();
+  const auto numReserved = PrismaticEngine.GetUpdateSystem()->Concurrency() + 1;
+  const auto concurrency =
+      numProcessors > numReserved ? numProcessors - numReserved : 1u;
+  _pathTracer =
+      std::make_unique<pePathTracer>(*_scene, FilmStorage::Half, concurrency);
+  // The center of the image is usually what the camera looks at
+  _pathTracer->SetTileOrder(TileOrder::Spiral);
+
+  _window->SetActive();
+
+  GLuint texID;
+  glGenTextures(1, &texID);
+  _texture = texID;
+
+  glBindTexture(GL_TEXTURE_2D, texID);
+
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, _windowWidth, _windowHeight, 0,
+               GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+
+  glActiveTexture(GL_TEXTURE0);
+  glDisable(GL_DEPTH_TEST);
+  glEnable(GL_TEXTURE_2D);
+}
+
+void pe::pePathTracingRenderer::UpdateScene(const peFrameProxy &frame) {
+  const auto geometryChanged = frame.geometry != _sceneGeometry;
+  const auto lightsChanged = frame.lights != _sceneLights;
+  if (!geometryChanged && !lightsChanged)
+    return;
+
+  // The tiles of the current frame read the scene, so they have to be gone
+  // before it changes
+  _pathTracer->CancelRenderProcess();
+  _pathTracer->WaitForFrame();
+
+  if (geometryChanged)
+    _scene->BuildScene(*frame.geometry, *frame.lights);
+  else
+    _scene->SetLights(*frame.lights);
+  // Only now the scene stops referencing the old lights
+  _sceneGeometry = frame.geometry;
+  _sceneLights = frame.lights;
+
+  // Starts a new frame even if the camera did not move
+  _hasFrame = false;
+}
+
+void pe::pePathTracingRenderer::SaveFrame() {
+  _frameSaved = true;
+  FinishSavingFrame();
+
+  std::ostringstream path;
+  path << _frameOutputDirectory << "\\frame_" << std::setw(5)
+       << std::setfill('0') << _numSavedFrames++ << ".png";
+  // The copy is encoded while the next frame renders into the image
+  _savedFrame = DumpPNGAsync(_image, _windowWidth, _windowHeight, path.str(),
+                             _pathTracer->TaskSystem());
+}
+
+void pe::pePathTracingRenderer::FinishSavingFrame() {
+  if (!_savedFrame.valid())
+    return;
+  try {
+    _savedFrame.get();
+  } catch (const std::exception &e) {
+    PrismaticEngine.GetLogging()->LogError("Failed to save frame: %s",
+                                           e.what());
+  }
+}
+
+void pe::pePathTracingRenderer::RestartFrameOnCameraMove(
+    const peFrameProxy &frame) {
+  if (!frame.camera)
+    return;
+  const auto &camera = *frame.camera;
+
+  if (_hasFrame && camera.view == _frameView &&
+      camera.projection == _frameProjection)
+    return;
+  _hasFrame = true;
+  _frameView = camera.view;
+  _frameProjection = camera.projection;
+
+  // Does not block, stale tiles of the previous frame drop out after their
+  // current batch of samples
+  const auto renderStart = std::chrono::high_resolution_clock::now();
+  _pathTracer->BeginRenderProcess(camera, _windowWidth, _windowHeight);
+  _frameSaved = false;
+  _pathTracer->OnFrameComplete([renderStart]() {
+    const std::chrono::duration<double> renderTime =
+        std::chrono::high_resolution_clock::now() - renderStart;
+    PrismaticEngine.GetLogging()->LogInfo("Frame finished after %.2f s",
+                                          renderTime.count());
+  });
+}
+
+void pe::pePathTracingRenderer::DrawResult() {
+  glViewport(0, 0, _windowWidth, _windowHeight);
+
+  glClearColor(0, 0, 0, 1);
+  glClear(GL_COLOR_BUFFER_BIT);
+
+  glBindTexture(GL_TEXTURE_2D, _texture);
+  glBegin(GL_TRIANGLES);
+
+  glTexCoord2f(0, 0);
+  glVertex2f(-1.f, -1.f);
+
+  glTexCoord2f(1, 0);
+  glVertex2f(1.f, -1.f);
+
+  glTexCoord2f(1, 1);
+  glVertex2f(1.f, 1.f);
+
+  glTexCoord2f(0, 0);
+  glVertex2f(-1.f, -1.f);
+
+  glTexCoord2f(0, 1);
+  glVertex2f(-1.f, 1.f);
+
+  glTexCoord2f(1, 1);
+  glVertex2f(1.f, 1.f);
+
+  glEnd();
+}
+
+#pragma endregion
@@ -14,6 +14,7 @@ public:
   void Init() override;
   void Shutdown() override;
   void Update(double delta) override;
+  void Synchronize() override;
 
   void RegisterDrawableEntity(const peEntity &entity) override;
   void DeregisterDrawableEntity(const peEntity &entity) override;
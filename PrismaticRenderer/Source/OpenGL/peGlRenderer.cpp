@@ -13,6 +13,8 @@ void peGlRenderer::Shutdown() { _backend.Shutdown(); }
 
 void peGlRenderer::Update(double delta) {}
 
+void peGlRenderer::Synchronize() {}
+
 void peGlRenderer::RegisterDrawableEntity(const peEntity &entity) {}
 
 void peGlRenderer::DeregisterDrawableEntity(const peEntity &entity) {}
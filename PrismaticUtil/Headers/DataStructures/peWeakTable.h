@@ -1,9 +1,11 @@
 #pragma once
 #include <stdint.h>
 
-#include "DataStructures\peUnorderedMap.h"
 #include "Memory\peAllocators.h"
 
+#include <atomic>
+#include <mutex>
+
 #pragma warning(push)
 #pragma warning(disable : 4251)
 
@@ -22,23 +24,68 @@ struct PE_UTIL_API peWeakHandle {
 
 template <typename T> struct peWeakPtr;
 
-//! \brief Weak table base class. Used for access of the peWeakPtr
+//! \brief Weak table base class. Used for access of the peWeakPtr. Stores the
+//! objects in a slot map: handles index into segments of slots that never
+//! move, and each slot holds the object and the version of the handles that
+//! may access it. Free slots form an intrusive list
 class PE_UTIL_API peWeakTableBase {
 protected:
   template <typename T> friend struct peWeakPtr;
 
-  peWeakTableBase(size_t elementSize, size_t chunkSize,
-                  IAllocator *parentAllocator);
+  //! \param concurrent Guard inserting and destroying by a lock, so that
+  //! multiple threads can insert at the same time
+  peWeakTableBase(size_t elementSize, size_t alignment, size_t chunkSize,
+                  IAllocator *parentAllocator, bool concurrent);
+  ~peWeakTableBase();
+
+  peWeakTableBase(const peWeakTableBase &) = delete;
+  peWeakTableBase &operator=(const peWeakTableBase &) = delete;
 
+  //! \brief Returns the object of the handle, or nullptr if it is expired.
+  //! Lock-free, even for concurrent tables
   void *Deref(peWeakHandle handle) const;
 
-  struct Entry {
-    void *instance;
-    uint32_t version;
+  //! \brief Memory for one object, from the pool of this table
+  void *AllocateInstance();
+  void FreeInstance(void *instance);
+  //! \brief Puts a constructed object into a free slot
+  //! \returns Handle to the object
+  peWeakHandle Publish(void *instance);
+  //! \brief Empties the slot of the handle, which expires all handles to it
+  //! \returns The object of the slot, or nullptr if the handle was expired
+  //! already
+  void *Unpublish(peWeakHandle handle);
+
+  struct Slot {
+    std::atomic<void *> instance;
+    std::atomic<uint32_t> version;
+    //! \brief Next free slot while this slot is free
+    uint32_t nextFree;
   };
+
+  uint32_t NumSlots() const {
+    return _numSlots.load(std::memory_order_acquire);
+  }
+  Slot &SlotAt(uint32_t index) const {
+    return _segments[index / SlotsPerSegment].load(
+        std::memory_order_acquire)[index % SlotsPerSegment];
+  }
+
+private:
+  constexpr static uint32_t SlotsPerSegment = 1024;
+  constexpr static uint32_t MaxSegments = 4096;
+  constexpr static uint32_t NoSlot = ~0u;
+
+  const size_t _elementSize;
+  IAllocator *const _parentAllocator;
+  const bool _concurrent;
+  //! \brief Guards the pool, the free list and appending slots of concurrent
+  //! tables
+  std::mutex _lock;
   pePoolAllocator _allocator;
-  peUnorderedMap<uint32_t, Entry> _entries;
-  peVector<uint32_t> _freeList;
+  std::atomic<Slot *> _segments[MaxSegments];
+  std::atomic<uint32_t> _numSlots;
+  uint32_t _firstFree;
 };
 
 //! \brief A weak table that stores objects that may expire
@@ -48,14 +95,22 @@ public:
   ~peWeakTable();
 
   template <typename... Args> peWeakPtr<T> Insert(Args &&... args);
-  void Insert(T &&obj);
+  peWeakPtr<T> Insert(T &&obj);
 
   void Destroy(const peWeakHandle &handle);
 
   template <typename U> void Destroy(const peWeakPtr<U> &ptr);
 
-private:
-  bool IsEntryAlive(const Entry &entry) const;
+protected:
+  explicit peWeakTable(bool concurrent);
+};
+
+//! \brief A weak table that multiple threads can insert into at the same time,
+//! e.g. while loading assets in parallel. The objects are constructed outside
+//! of the lock. Objects must not be destroyed while other threads access them
+template <typename T> class peConcurrentWeakTable : public peWeakTable<T> {
+public:
+  peConcurrentWeakTable() : peWeakTable<T>(true) {}
 };
 
 namespace {
@@ -70,7 +125,7 @@ template <typename T> struct peWeakPtr {
   using Underlying_t = std::decay_t<T>;
 
   peWeakPtr();
-  peWeakPtr(peWeakHandle handle, peWeakTable<Underlying_t> *weakTable);
+  peWeakPtr(peWeakHandle handle, peWeakTableBase *weakTable);
 
   peWeakPtr(const peWeakPtr<T> &other) = default;
   peWeakPtr<T> &operator=(const peWeakPtr<T> &other) = default;
@@ -100,76 +155,55 @@ private:
 };
 
 #pragma region peWeakTableImpl
+template <typename T> peWeakTable<T>::peWeakTable() : peWeakTable(false) {}
+
 template <typename T>
-peWeakTable<T>::peWeakTable()
-    : peWeakTableBase(sizeof(T), 8192, GlobalAllocator) {}
+peWeakTable<T>::peWeakTable(bool concurrent)
+    : peWeakTableBase(sizeof(T), alignof(T), 8192, GlobalAllocator,
+                      concurrent) {}
 
 template <typename T> peWeakTable<T>::~peWeakTable() {
-  for (auto &keyVal : _entries) {
-    auto &entry = keyVal.second;
-    if (!IsEntryAlive(entry))
+  const auto numSlots = NumSlots();
+  for (uint32_t index = 0; index < numSlots; ++index) {
+    auto instance =
+        SlotAt(index).instance.load(std::memory_order_relaxed);
+    if (!instance)
       continue;
-    reinterpret_cast<T *>(entry.instance)->~T();
-    _allocator.Free(entry.instance);
+    reinterpret_cast<T *>(instance)->~T();
+    FreeInstance(instance);
   }
 }
 
 template <typename T>
 template <typename... Args>
 peWeakPtr<T> peWeakTable<T>::Insert(Args &&... args) {
-  if (_freeList.size()) {
-    auto index = _freeList.back();
-    _freeList.pop_back();
-
-    auto &entry = _entries[index];
-    entry.instance = pe::New<T>(&_allocator, std::forward<Args>(args)...);
-
-    return {{index, entry.version}, this};
+  auto instance = AllocateInstance();
+  try {
+    new (instance) T(std::forward<Args>(args)...);
+  } catch (...) {
+    FreeInstance(instance);
+    throw;
   }
-
-  const auto index = _entries.size();
-  Entry entry;
-  entry.version = 0;
-  entry.instance = pe::New<T>(&_allocator, std::forward<Args>(args)...);
-  _entries.emplace(static_cast<uint32_t>(index), entry);
-
-  return {{static_cast<uint32_t>(index), entry.version}, this};
+  return {Publish(instance), this};
 }
 
-template <typename T> void peWeakTable<T>::Insert(T &&obj) {
-  if (_freeList.size()) {
-    auto index = _freeList.back();
-    _freeList.pop_back();
-
-    auto &entry = _entries[index];
-    entry.instance = pe::New<T>(&_allocator, std::move(obj));
-
-    return {{index, entry.version}, this};
+template <typename T> peWeakPtr<T> peWeakTable<T>::Insert(T &&obj) {
+  auto instance = AllocateInstance();
+  try {
+    new (instance) T(std::move(obj));
+  } catch (...) {
+    FreeInstance(instance);
+    throw;
   }
-
-  auto index = _entries.size();
-  auto iter = _entries.emplace(index);
-  auto &entry = iter.first->second;
-  entry.version = 0;
-  entry.instance = pe::New<T>(&_allocator, std::move(obj));
-
-  return {{index, entry.version}, this};
+  return {Publish(instance), this};
 }
 
 template <typename T> void peWeakTable<T>::Destroy(const peWeakHandle &handle) {
-  auto iter = _entries.find(handle.index);
-  if (iter == _entries.end())
-    throw std::runtime_error{"Invalid handle!"};
-  auto &entry = iter->second;
-  if (entry.version != handle.version)
+  auto instance = Unpublish(handle);
+  if (!instance)
     return; // Already destroyed
-  if (!IsEntryAlive(entry))
-    return;
-
-  Delete<T>(reinterpret_cast<T *>(entry.instance), &_allocator);
-  ++entry.version;
-
-  _freeList.push_back(handle.index);
+  reinterpret_cast<T *>(instance)->~T();
+  FreeInstance(instance);
 }
 
 template <typename T>
@@ -177,19 +211,13 @@ template <typename U>
 void peWeakTable<T>::Destroy(const peWeakPtr<U> &ptr) {
   Destroy(ptr._weakHandle);
 }
-
-template <typename T>
-bool peWeakTable<T>::IsEntryAlive(const Entry &entry) const {
-  return entry.instance != nullptr;
-}
 #pragma endregion
 
 #pragma region peWeakPtrImpl
 template <typename T> peWeakPtr<T>::peWeakPtr() : _weakTable(nullptr) {}
 
 template <typename T>
-peWeakPtr<T>::peWeakPtr(peWeakHandle handle,
-                        peWeakTable<Underlying_t> *weakTable)
+peWeakPtr<T>::peWeakPtr(peWeakHandle handle, peWeakTableBase *weakTable)
     : _weakHandle(handle), _weakTable(weakTable) {}
 
 template <typename T> T *peWeakPtr<T>::operator->() { return Get(); }
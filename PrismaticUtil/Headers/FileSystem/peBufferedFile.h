@@ -0,0 +1,64 @@
+#pragma once
+#include "DataStructures/peVector.h"
+#include "peUtilDefs.h"
+
+#include <cstdio>
+#include <stdint.h>
+#include <string>
+#include <type_traits>
+
+#pragma warning(push)
+#pragma warning(disable : 4251)
+
+namespace pe {
+
+//! \brief Binary file writer that collects writes in a large buffer and hands
+//! them to the OS in big blocks. Throws std::runtime_error on I/O errors
+class PE_UTIL_API peBufferedFileWriter {
+public:
+  constexpr static size_t DefaultBufferSize = 4 * 1024 * 1024;
+
+  //! \brief Opens the given file for writing, replacing existing files
+  //! \param path Path of the file
+  //! \param bufferSize Size of the write buffer in bytes
+  explicit peBufferedFileWriter(const std::string &path,
+                                size_t bufferSize = DefaultBufferSize);
+  ~peBufferedFileWriter();
+
+  peBufferedFileWriter(const peBufferedFileWriter &) = delete;
+  peBufferedFileWriter &operator=(const peBufferedFileWriter &) = delete;
+
+  //! \brief Appends the given data to the file
+  void Write(const void *data, size_t size);
+
+  //! \brief Appends the object representation of the given value to the file
+  template <typename T> void WriteValue(const T &value) {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "Only trivially copyable types can be written!");
+    Write(&value, sizeof(T));
+  }
+
+  //! \brief Overwrites already written data at the given position. The current
+  //! write position stays at the end of the file
+  //! \param position Byte offset from the start of the file
+  void WriteAt(uint64_t position, const void *data, size_t size);
+
+  //! \brief Writes all buffered data to the file
+  void Flush();
+
+  //! \brief Flushes and closes the file
+  void Close();
+
+  //! \brief Number of bytes written so far, including buffered bytes
+  auto Position() const { return _position; }
+
+private:
+  FILE *_file;
+  peVector<char> _buffer;
+  size_t _bufferFill;
+  uint64_t _position;
+};
+
+} // namespace pe
+
+#pragma warning(pop)
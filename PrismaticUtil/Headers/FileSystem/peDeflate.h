@@ -0,0 +1,44 @@
+#pragma once
+#include "peUtilDefs.h"
+
+#include <stdint.h>
+#include <vector>
+
+namespace pe {
+namespace deflate {
+
+//! \brief Compresses a strip of a larger buffer into raw deflate blocks. The
+//! blocks are never final and the output ends with an empty stored block, so it
+//! always ends on a byte boundary. Compressed strips of consecutive parts of a
+//! buffer can therefore be concatenated into a single deflate stream, which
+//! allows compressing the strips independently of each other. Blocks that
+//! would be larger with huffman codes are stored uncompressed instead, so the
+//! output is at most a few bytes per 64KiB larger than the strip
+//! \param data Buffer that contains the strip
+//! \param dictionaryStart Start of the data that precedes the strip and may be
+//! referenced by the strip. Must not be more than 32KiB before the strip
+//! \param start Start of the strip
+//! \param end End of the strip
+//! \param out Compressed data is appended to this buffer
+PE_UTIL_API void CompressStrip(const unsigned char *data,
+                               size_t dictionaryStart, size_t start,
+                               size_t end, std::vector<unsigned char> &out);
+
+//! \brief Appends the final (empty) block that terminates a deflate stream
+//! that consists of compressed strips
+PE_UTIL_API void FinishStream(std::vector<unsigned char> &out);
+
+//! \brief Computes the Adler-32 checksum of the given data
+PE_UTIL_API uint32_t Adler32(const unsigned char *data, size_t size,
+                             uint32_t adler = 1);
+
+//! \brief Combines the Adler-32 checksums of two consecutive buffers
+//! \param adler1 Checksum of the first buffer
+//! \param adler2 Checksum of the second buffer
+//! \param size2 Size of the second buffer
+//! \returns Checksum of both buffers
+PE_UTIL_API uint32_t CombineAdler32(uint32_t adler1, uint32_t adler2,
+                                    size_t size2);
+
+} // namespace deflate
+} // namespace pe
@@ -1,7 +1,9 @@
 #pragma once
 #include "DataStructures/peVector.h"
+#include "Threading/peTaskSystem.h"
 #include "Type\peColor.h"
 #include "peUtilDefs.h"
+#include <future>
 #include <string>
 
 namespace pe {
@@ -22,4 +24,25 @@ void PE_UTIL_API DumpPNG(const peVector<RGBA_8Bit> &pixels,
                          const uint32_t width, const uint32_t height,
                          const std::string &path);
 
+//! \brief Encodes the image as PNG and saves it. The image data is split into
+//! strips that are compressed concurrently on the given task system
+//! \param pixels Image data
+//! \param width Width of the image
+//! \param height Height of the image
+//! \param path Path of the PNG file
+//! \param taskSystem Running task system that compresses the strips
+void PE_UTIL_API DumpPNG(const peVector<RGBA_8Bit> &pixels,
+                         const uint32_t width, const uint32_t height,
+                         const std::string &path, peTaskSystem &taskSystem);
+
+//! \brief Like DumpPNG, but encodes and saves the image in the background so
+//! that the caller can continue with the next frame right away
+//! \returns Future that becomes ready once the file is written. Errors are
+//! reported through the future
+PE_UTIL_API std::future<void> DumpPNGAsync(peVector<RGBA_8Bit> pixels,
+                                           const uint32_t width,
+                                           const uint32_t height,
+                                           std::string path,
+                                           peTaskSystem &taskSystem);
+
 } // namespace pe
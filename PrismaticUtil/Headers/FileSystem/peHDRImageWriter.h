@@ -0,0 +1,111 @@
+#pragma once
+#include "DataStructures/peVector.h"
+#include "FileSystem/peBufferedFile.h"
+#include "Type/peColor.h"
+#include "peUtilDefs.h"
+
+#include <span.h>
+#include <stdint.h>
+#include <string>
+
+#pragma warning(push)
+#pragma warning(disable : 4251)
+
+namespace pe {
+
+//! \brief Base class for writers of floating point images. Images are streamed
+//! row by row, starting with the bottom row, so the caller never has to hold
+//! the whole image in memory
+class PE_UTIL_API peHDRImageWriter {
+public:
+  peHDRImageWriter(const std::string &path, uint32_t width, uint32_t height);
+  virtual ~peHDRImageWriter() = default;
+
+  peHDRImageWriter(const peHDRImageWriter &) = delete;
+  peHDRImageWriter &operator=(const peHDRImageWriter &) = delete;
+
+  //! \brief Appends the given rows to the image
+  //! \param rows Pixels of one or more complete rows, in bottom-to-top order
+  void WriteRows(gsl::span<const RGB_32BitFloat> rows);
+
+  //! \brief Completes the file. Must be called after all rows were written
+  void Finish();
+
+  auto Width() const { return _width; }
+  auto Height() const { return _height; }
+  auto RowsWritten() const { return _rowsWritten; }
+
+protected:
+  //! \brief Writes a single row
+  //! \param row Index of the row, counted from the bottom of the image
+  //! \param pixels Pixels of the row
+  virtual void WriteRow(uint32_t row,
+                        gsl::span<const RGB_32BitFloat> pixels) = 0;
+  virtual void FinishImage() = 0;
+
+  peBufferedFileWriter _file;
+  const uint32_t _width, _height;
+
+private:
+  uint32_t _rowsWritten;
+  bool _finished;
+};
+
+//! \brief Writes little-endian, three channel portable float maps
+class PE_UTIL_API pePFMWriter : public peHDRImageWriter {
+public:
+  pePFMWriter(const std::string &path, uint32_t width, uint32_t height);
+
+protected:
+  void WriteRow(uint32_t row, gsl::span<const RGB_32BitFloat> pixels) override;
+  void FinishImage() override;
+};
+
+//! \brief Compression methods supported by the OpenEXR writer
+enum class EXRCompression {
+  //! \brief Uncompressed, one scanline per chunk
+  None,
+  //! \brief zlib compression, 16 scanlines per chunk
+  Zip
+};
+
+//! \brief Pixel formats supported by the OpenEXR writer
+enum class EXRPixelType { Half, Float };
+
+//! \brief Writes single-part scanline OpenEXR images with R, G and B
+//! channels. Each chunk is written as soon as all of its scanlines arrived, so
+//! at most one chunk is held in memory
+class PE_UTIL_API peEXRWriter : public peHDRImageWriter {
+public:
+  peEXRWriter(const std::string &path, uint32_t width, uint32_t height,
+              EXRCompression compression = EXRCompression::Zip,
+              EXRPixelType pixelType = EXRPixelType::Half);
+
+protected:
+  void WriteRow(uint32_t row, gsl::span<const RGB_32BitFloat> pixels) override;
+  void FinishImage() override;
+
+private:
+  void WriteHeader();
+  void FlushChunk();
+
+  const EXRCompression _compression;
+  const EXRPixelType _pixelType;
+  const uint32_t _linesPerChunk;
+  const size_t _bytesPerLine;
+
+  uint64_t _offsetTablePosition;
+  peVector<uint64_t> _chunkOffsets;
+
+  //! \brief Scanline data of the current chunk, top-down as stored in the file
+  peVector<unsigned char> _chunkData;
+  //! \brief Scratch buffers for compression
+  peVector<unsigned char> _reordered;
+  std::vector<unsigned char> _compressed;
+  uint32_t _currentChunk;
+  uint32_t _linesInCurrentChunk;
+};
+
+} // namespace pe
+
+#pragma warning(pop)
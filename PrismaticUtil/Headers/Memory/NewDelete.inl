@@ -16,6 +16,26 @@ void operator delete(void* mem)
 }
 
 void operator delete[](void* mem)
+{
+	GlobalAllocator->Free(mem);
+}
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+	return GlobalAllocator->Allocate(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+	return GlobalAllocator->Allocate(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* mem, std::align_val_t)
+{
+	GlobalAllocator->Free(mem);
+}
+
+void operator delete[](void* mem, std::align_val_t)
 {
 	GlobalAllocator->Free(mem);
 }
\ No newline at end of file
@@ -6,6 +6,7 @@
 
 #include <Windows.h>
 #include <functional>
+#include <iostream>
 
 namespace pe {
 
@@ -14,6 +15,10 @@ public:
   virtual ~IAllocator() {}
 
   virtual void *Allocate(size_t numBytes) = 0;
+  //! \brief Allocates memory whose address is a multiple of the alignment,
+  //! which has to be a power of two. The memory is released with Free like
+  //! every other allocation
+  virtual void *Allocate(size_t numBytes, size_t alignment) = 0;
   virtual void Free(void *mem) = 0;
 };
 
@@ -33,12 +38,8 @@ public:
   static peStdAllocator *GetInstance();
 
   // Getters
-  size_t GetFreeMemory() const override {
-    MEMORYSTATUSEX status;
-    status.dwLength = sizeof(status);
-    GlobalMemoryStatusEx(&status);
-    return status.ullTotalPhys;
-  }
+  //! \brief Physical memory of the system, queried once and then cached
+  size_t GetFreeMemory() const override;
   size_t GetNumAllocations() const override { return m_numAllocations; }
   size_t GetNumFrees() const override { return m_numFrees; }
   IAllocator *GetParentAllocator() const override { return nullptr; }
@@ -49,6 +50,7 @@ public:
 
   // Allocation/deallocation
   void *Allocate(size_t numBytes) override;
+  void *Allocate(size_t numBytes, size_t alignment) override;
   void Free(void *mem) override;
 
 private:
@@ -63,17 +65,14 @@ private:
 class PE_UTIL_API peLeakDetectionAllocator : public IAllocatorStatistics {
 public:
   virtual void *Allocate(size_t size) override;
+  virtual void *Allocate(size_t size, size_t alignment) override;
   virtual void Free(void *mem) override;
 
   static peLeakDetectionAllocator *GetInstance();
 
   // Getters
-  virtual size_t GetFreeMemory() const override {
-    MEMORYSTATUSEX status;
-    status.dwLength = sizeof(status);
-    GlobalMemoryStatusEx(&status);
-    return status.ullTotalPhys;
-  }
+  //! \brief Physical memory of the system, queried once and then cached
+  virtual size_t GetFreeMemory() const override;
   virtual size_t GetNumAllocations() const override { return m_numAllocations; }
   virtual size_t GetNumFrees() const override { return m_numFrees; }
   virtual IAllocator *GetParentAllocator() const override { return nullptr; }
@@ -109,13 +108,107 @@ private:
   void TrackFree(void *mem);
 };
 
+//! \brief General-purpose allocator that is safe and fast to use from many
+//! threads. Small blocks are rounded up to a size class and come from free
+//! lists of the calling thread, which exchange blocks with central free lists
+//! in batches. The central lists carve their blocks out of spans of one
+//! reserved address range. Larger blocks go straight to malloc
+class PE_UTIL_API peThreadCachingAllocator : public IAllocatorStatistics {
+public:
+  //! \brief Largest block that is served from the size classes
+  constexpr static size_t MaxSmallSize = 16 * 1024;
+
+  static peThreadCachingAllocator *GetInstance();
+
+  void *Allocate(size_t numBytes) override;
+  //! \brief Alignments up to MaxSmallSize come from size classes that are a
+  //! multiple of the alignment, larger ones from over-allocated large blocks
+  void *Allocate(size_t numBytes, size_t alignment) override;
+  void Free(void *mem) override;
+
+  // Getters
+  //! \brief Memory that the allocator holds, but that is not handed out
+  size_t GetFreeMemory() const override {
+    return GetTotalMemory() - GetReservedMemory();
+  }
+  size_t GetNumAllocations() const override;
+  size_t GetNumFrees() const override;
+  IAllocator *GetParentAllocator() const override { return nullptr; }
+  size_t GetReservedMemory() const override;
+  size_t GetTotalMemory() const override;
+
+private:
+  peThreadCachingAllocator();
+  //! \brief Never called, blocks might be freed until the process ends
+  ~peThreadCachingAllocator();
+};
+
+//! \brief Allocator that profiles the allocations going through it at low
+//! cost. It picks one byte out of every SampleInterval bytes at random and
+//! records the callstack of the allocation that contains it. The samples are
+//! aggregated per call site in a lock-free table, which yields both where
+//! memory is allocated and, for samples that were not freed yet, where it is
+//! held. Everything else goes straight to the parent allocator
+class PE_UTIL_API peHeapProfiler : public IAllocatorStatistics {
+public:
+  //! \brief Which amount the folded stacks report per call site
+  enum class Profile {
+    //! \brief Estimated bytes that were allocated in total
+    AllocatedBytes,
+    //! \brief Estimated bytes that are still allocated
+    LiveBytes
+  };
+
+  //! \brief Default sampling interval of debug builds. Release builds start
+  //! with sampling disabled, unless the environment variable
+  //! PE_HEAP_PROFILE_INTERVAL sets an interval in bytes
+  constexpr static size_t DefaultSampleInterval = 512 * 1024;
+
+  static peHeapProfiler *GetInstance();
+
+  void *Allocate(size_t numBytes) override;
+  void *Allocate(size_t numBytes, size_t alignment) override;
+  void Free(void *mem) override;
+
+  //! \brief Sets the mean number of bytes between two samples, 0 disables
+  //! sampling
+  void SetSampleInterval(size_t numBytes);
+  size_t GetSampleInterval() const;
+
+  //! \brief Prints one line per call site in the folded format of
+  //! flamegraph.pl: the frames from the root to the allocation separated by
+  //! semicolons, followed by the estimated bytes
+  void WriteFoldedStacks(Profile profile,
+                         std::function<void(const char *)> printer) const;
+  //! \brief Prints the call sites that still hold sampled memory. Prints
+  //! nothing if there are none
+  void LogLeaks(std::function<void(const char *)> printer) const;
+
+  // Getters, forwarded to the parent allocator
+  size_t GetFreeMemory() const override;
+  size_t GetNumAllocations() const override;
+  size_t GetNumFrees() const override;
+  IAllocator *GetParentAllocator() const override { return _parentAllocator; }
+  size_t GetReservedMemory() const override;
+  size_t GetTotalMemory() const override;
+
+private:
+  explicit peHeapProfiler(IAllocatorStatistics *parentAllocator);
+  //! \brief Never called, blocks might be freed until the process ends
+  ~peHeapProfiler();
+
+  void *RecordSample(void *mem, size_t numBytes);
+
+  IAllocatorStatistics *const _parentAllocator;
+};
+
 #pragma region NewDelete
 
 template <typename T, typename... Args>
 std::enable_if_t<std::is_base_of<pe::peAllocatable, T>::value, T *>
 New(IAllocator *allocator, Args &&... ctorArgs) {
-  T *ret =
-      new (allocator->Allocate(sizeof(T))) T(std::forward<Args>(ctorArgs)...);
+  T *ret = new (allocator->Allocate(sizeof(T), alignof(T)))
+      T(std::forward<Args>(ctorArgs)...);
   ret->SetAllocator(allocator);
   return ret;
 }
@@ -123,7 +216,7 @@ New(IAllocator *allocator, Args &&... ctorArgs) {
 template <typename T, typename... Args>
 std::enable_if_t<!std::is_base_of<pe::peAllocatable, T>::value, T *>
 New(IAllocator *allocator, Args &&... ctorArgs) {
-  return new (allocator->Allocate(sizeof(T)))
+  return new (allocator->Allocate(sizeof(T), alignof(T)))
       T(std::forward<Args>(ctorArgs)...);
 }
 
@@ -153,22 +246,34 @@ template <typename T> void DeleteAndNull(T *&obj, IAllocator *allocator) {
 
 } // namespace pe
 
+// Tracking captures a callstack for every allocation and is limited to 10000
+// live blocks, so it is only meant for hunting down a specific leak. The heap
+// profiler samples instead, and is cheap enough to stay on
+#ifdef PE_TRACK_LEAKS
 #define TRACK_LEAKS
+#endif
 
+// PrintLeaks writes the leaks that the global allocator knows of to stderr.
+// The heap profiler only reports call sites of sampled allocations
 #ifdef TRACK_LEAKS
 #define GlobalAllocator pe::peLeakDetectionAllocator::GetInstance()
 #define PrintLeaks                                                             \
-  static_cast<pe::LeakDetectionAllocator &>(                                   \
-      pe::LeakDetectionAllocator::GetInstance())                               \
-      .LogLeaks();
+  pe::peLeakDetectionAllocator::GetInstance()->LogLeaks(                       \
+      [](const char *msg) { std::cerr << msg << std::endl; });
 #else
-#define GlobalAllocator pe::peStdAllocator::GetInstance()
-#define PrintLeaks
+#define GlobalAllocator pe::peHeapProfiler::GetInstance()
+#define PrintLeaks                                                             \
+  pe::peHeapProfiler::GetInstance()->LogLeaks(                                 \
+      [](const char *msg) { std::cerr << msg << std::endl; });
 #endif
 
 #include <new>
 
 void *operator new(size_t size);
 void *operator new[](size_t size);
+void *operator new(size_t size, std::align_val_t alignment);
+void *operator new[](size_t size, std::align_val_t alignment);
 void operator delete(void *mem);
 void operator delete[](void *mem);
+void operator delete(void *mem, std::align_val_t alignment);
+void operator delete[](void *mem, std::align_val_t alignment);
@@ -1,10 +1,16 @@
 #pragma once
 #include "DataStructures/peVector.h"
 #include "peAllocator.h"
+#include "peMemoryUtil.h"
 #include "peUtilDefs.h"
 
+#include <atomic>
+#include <mutex>
+
 namespace pe {
 
+class peTaskSystem;
+
 #pragma warning(push)
 #pragma warning(disable : 4251)
 
@@ -34,7 +40,11 @@ public:
 
   size_t GetTotalMemory() const override { return m_bufferSize; }
 
+  //! \brief Bumps the stack by exactly numBytes, without any padding
   void *Allocate(size_t numBytes) override;
+  //! \brief Pads the stack up to the alignment first. The padding belongs to
+  //! the allocation and is released with it
+  void *Allocate(size_t numBytes, size_t alignment) override;
   void Free(void *mem) override;
 
   //! Clears the stack and resets the number of allocations / frees
@@ -55,7 +65,115 @@ private:
   peVector<size_t> m_sizePerAlloc;
 };
 
-//! Simple pool allocator to allocate fixed size memeory blocks
+//! \brief Growable linear allocator for short-lived scratch memory. Allocates
+//! from a chain of stack allocators and adds a new, larger block whenever the
+//! current one is full. Single allocations can't be freed, the memory is
+//! reclaimed with FreeToMarker or Clear. Blocks are kept, so an arena that has
+//! reached its high-water mark never allocates from its parent again
+class PE_UTIL_API peScratchArena : public IAllocatorStatistics {
+public:
+  //! \brief Position in the arena
+  struct Marker {
+    size_t blockIdx;
+    //! \brief Top of the stack of the block, nullptr for an empty block
+    void *stackMarker;
+  };
+
+  //! \brief Minimum alignment of all allocations
+  constexpr static size_t Alignment = 16;
+
+  //! \brief Creates a new arena. The first block is allocated lazily, so
+  //! the memory is first touched by the thread that uses the arena
+  //! \param blockSize Size of the first block
+  //! \param parentAllocator Allocator for the blocks
+  explicit peScratchArena(
+      size_t blockSize = 1 << 20,
+      IAllocator *parentAllocator = peStdAllocator::GetInstance());
+  ~peScratchArena();
+
+  peScratchArena(const peScratchArena &) = delete;
+  const peScratchArena &operator=(const peScratchArena &) = delete;
+
+  // Getters
+  size_t GetFreeMemory() const override {
+    return GetTotalMemory() - GetReservedMemory();
+  }
+  size_t GetNumAllocations() const override { return m_numAllocations; }
+  size_t GetNumFrees() const override { return m_numFrees; }
+  IAllocator *GetParentAllocator() const override { return m_parentAllocator; }
+  size_t GetReservedMemory() const override;
+  size_t GetTotalMemory() const override;
+
+  void *Allocate(size_t numBytes) override;
+  void *Allocate(size_t numBytes, size_t alignment) override;
+  //! \brief Does nothing, the memory is reclaimed with FreeToMarker or Clear
+  void Free(void *mem) override;
+
+  //! \brief Frees all allocations, but keeps the blocks
+  void Clear();
+  //! \brief Obtain a marker to the current position
+  Marker ObtainMarker() const;
+  //! \brief Frees everything that was allocated after the marker was obtained
+  void FreeToMarker(const Marker &marker);
+
+private:
+  IAllocator *m_parentAllocator;
+
+  peVector<peStackAllocator *> m_blocks;
+  size_t m_currentBlock;
+  size_t m_blockSize;
+  size_t m_numAllocations;
+  size_t m_numFrees;
+};
+
+//! \brief Chunks of a pool allocator. Finds the chunk that contains an
+//! address in O(1) without touching the memory at that address: every chunk
+//! is entered into a hash table under each chunk-sized bucket of the address
+//! space that it overlaps, which are at most two, so chunks need no alignment
+//! beyond that of their elements. Find is lock-free and may run concurrently
+//! with one thread that adds chunks
+class PE_UTIL_API pePoolChunks {
+public:
+  pePoolChunks(size_t chunkSize, size_t alignment,
+               IAllocator *parentAllocator);
+  ~pePoolChunks();
+
+  pePoolChunks(const pePoolChunks &) = delete;
+  const pePoolChunks &operator=(const pePoolChunks &) = delete;
+
+  //! \brief Allocates a new chunk from the parent allocator
+  char *AddChunk();
+  //! \brief Start of the chunk that contains mem, nullptr if there is none
+  char *Find(const void *mem) const;
+
+  //! \brief Start addresses of all chunks in the order they were added
+  const peVector<char *> &GetChunks() const { return _chunks; }
+
+private:
+  struct Table {
+    uint32_t capacityLog2;
+    std::atomic<uintptr_t> *slots;
+  };
+
+  Table *AllocateTable(uint32_t capacityLog2);
+  void Insert(Table &table, uintptr_t chunk);
+
+  IAllocator *const _parentAllocator;
+  const size_t _chunkSize;
+  const size_t _alignment;
+
+  peVector<char *> _chunks;
+  //! \brief Every table that was ever in use. Readers might still probe one of
+  //! the smaller ones, so they are only freed on destruction
+  peVector<Table *> _tables;
+  std::atomic<Table *> _table;
+  size_t _numEntries;
+};
+
+//! \brief Simple pool allocator to allocate fixed size memory blocks. Free
+//! elements form an intrusive list that is threaded through the elements
+//! themselves, so allocation and deallocation are O(1) regardless of the pool
+//! size
 class PE_UTIL_API pePoolAllocator : public IAllocator {
 public:
   /// <summary>
@@ -65,37 +183,158 @@ public:
   /// <param name="chunkSize">Size of each new memory block that will be
   /// allocated whenever there are no free elements</param> <param
   /// name="parentAllocator">Parent allocator</param>
+  /// <param name="alignment">Alignment of every element</param>
   explicit pePoolAllocator(
       size_t elementSize, size_t chunkSize = 8192,
-      IAllocator *parentAllocator = peStdAllocator::GetInstance());
-  ~pePoolAllocator();
+      IAllocator *parentAllocator = peStdAllocator::GetInstance(),
+      size_t alignment = AlignmentHelper::ALIGNMENT);
 
   pePoolAllocator(const pePoolAllocator &) = delete;
   const pePoolAllocator &operator=(const pePoolAllocator &) = delete;
 
   // Allocation/deallocation
   void *Allocate(size_t numBytes) override;
+  //! \brief Throws if the alignment is stricter than that of the pool
+  void *Allocate(size_t numBytes, size_t alignment) override;
+  //! \brief Returns the element to the pool. Throws if mem is not an element
+  //! of one of the chunks of this pool, without touching its memory
   void Free(void *mem) override;
 
-  const auto &GetChunks() const { return _chunks; }
+  //! \brief Start addresses of all chunks in the order they were added
+  const auto &GetChunks() const { return _chunks.GetChunks(); }
 
 private:
-  struct FreeIndex {
-    FreeIndex(uint32_t, uint32_t);
-    const uint32_t chunkIdx;
-    const uint32_t offset;
+  struct FreeNode {
+    FreeNode *next;
   };
 
   void AllocateNewChunk();
 
-  IAllocator *_parentAllocator;
+  const size_t _chunkSize;
+  const size_t _alignment;
+  const size_t _elementSize;
+  pePoolChunks _chunks;
+
+  FreeNode *_freeList;
+  //! \brief Elements of the newest chunk that were never handed out. They are
+  //! carved on demand so that a fresh chunk is not touched all at once
+  char *_bumpCurrent;
+  char *_bumpEnd;
+};
+
+//! \brief Thread-safe variant of the pePoolAllocator. Allocate and Free are
+//! lock-free: the free list head is a pointer tagged with a counter in its
+//! unused upper bits, which guards the compare-and-swap against ABA. Only
+//! growing the pool by a new chunk takes a lock
+class PE_UTIL_API peConcurrentPoolAllocator : public IAllocator {
+public:
+  explicit peConcurrentPoolAllocator(
+      size_t elementSize, size_t chunkSize = 8192,
+      IAllocator *parentAllocator = peStdAllocator::GetInstance(),
+      size_t alignment = AlignmentHelper::ALIGNMENT);
+
+  peConcurrentPoolAllocator(const peConcurrentPoolAllocator &) = delete;
+  const peConcurrentPoolAllocator &
+  operator=(const peConcurrentPoolAllocator &) = delete;
+
+  // Allocation/deallocation
+  void *Allocate(size_t numBytes) override;
+  //! \brief Throws if the alignment is stricter than that of the pool
+  void *Allocate(size_t numBytes, size_t alignment) override;
+  //! \brief Returns the element to the pool. Throws if mem is not an element
+  //! of one of the chunks of this pool, without touching its memory
+  void Free(void *mem) override;
+
+private:
+  struct FreeNode {
+    std::atomic<FreeNode *> next;
+  };
+
+  void Push(FreeNode *first, FreeNode *last);
+  void AllocateNewChunk();
 
-  peVector<char *> _chunks;
   const size_t _chunkSize;
+  const size_t _alignment;
   const size_t _elementSize;
 
-  peVector<FreeIndex> _freeList;
-  static constexpr int INVALID_IDX = -1;
+  std::mutex _growLock;
+  pePoolChunks _chunks;
+
+  //! \brief Tagged pointer to the first free element
+  std::atomic<uint64_t> _freeList;
+};
+
+//! \brief Allocator for multi-megabyte buffers like geometry, acceleration
+//! structures and film pixels. Large blocks bypass the heap and are mapped
+//! directly, backed by explicit huge pages where the OS grants them and by
+//! transparent huge pages otherwise, which cuts the TLB misses of traversal.
+//! Mapped blocks can be pre-faulted in parallel, so that every page is touched
+//! first by a worker thread and lands on that worker's NUMA node instead of
+//! faulting one by one on the thread that fills the buffer. Mapped blocks are
+//! zeroed by the OS, callers don't have to clear them. Smaller blocks are
+//! forwarded to the parent allocator
+class PE_UTIL_API peLargePageAllocator : public IAllocatorStatistics {
+public:
+  //! \brief Blocks below this size go to the parent allocator
+  constexpr static size_t DefaultMinMappedSize = 2 * 1024 * 1024;
+
+  //! \param parentAllocator Allocator for blocks below minMappedSize
+  //! \param prefaultTaskSystem Task system whose workers pre-fault new mapped
+  //! blocks. No pre-faulting happens if this is nullptr or not running
+  //! \param minMappedSize Smallest block that is mapped directly
+  explicit peLargePageAllocator(IAllocator *parentAllocator,
+                                peTaskSystem *prefaultTaskSystem = nullptr,
+                                size_t minMappedSize = DefaultMinMappedSize);
+
+  peLargePageAllocator(const peLargePageAllocator &) = delete;
+  const peLargePageAllocator &operator=(const peLargePageAllocator &) = delete;
+
+  //! \brief Shared instance on top of the GlobalAllocator that doesn't
+  //! pre-fault. Never destroyed, so it may be used by static objects
+  static peLargePageAllocator *GetInstance();
+
+  void *Allocate(size_t numBytes) override;
+  void *Allocate(size_t numBytes, size_t alignment) override;
+  void Free(void *mem) override;
+
+  //! \brief Bytes that are currently mapped, including the rounding to pages
+  size_t GetReservedMemory() const override {
+    return _mappedBytes.load(std::memory_order_relaxed);
+  }
+  //! \brief Mapped blocks are sized exactly, so there is never any free memory
+  size_t GetFreeMemory() const override { return 0; }
+  size_t GetTotalMemory() const override { return GetReservedMemory(); }
+  size_t GetNumAllocations() const override {
+    return _numAllocations.load(std::memory_order_relaxed);
+  }
+  size_t GetNumFrees() const override {
+    return _numFrees.load(std::memory_order_relaxed);
+  }
+  IAllocator *GetParentAllocator() const override { return _parentAllocator; }
+
+  //! \brief Blocks of at least this size are always mapped, and thus zeroed
+  size_t GetMinMappedSize() const { return _minMappedSize; }
+
+  //! \brief Bytes of currently mapped blocks that are backed by explicit huge
+  //! pages, i.e. that are guaranteed to not use small pages
+  size_t GetHugePageBytes() const {
+    return _hugePageBytes.load(std::memory_order_relaxed);
+  }
+
+  //! \brief Touches every page of [mem;mem+numBytes) from the workers of the
+  //! task system. Runs on the calling thread if the task system is not running
+  static void Prefault(void *mem, size_t numBytes, size_t pageSize,
+                       peTaskSystem &taskSystem);
+
+private:
+  IAllocator *const _parentAllocator;
+  peTaskSystem *const _prefaultTaskSystem;
+  const size_t _minMappedSize;
+
+  std::atomic<size_t> _mappedBytes;
+  std::atomic<size_t> _hugePageBytes;
+  std::atomic<size_t> _numAllocations;
+  std::atomic<size_t> _numFrees;
 };
 
 #pragma warning(pop)
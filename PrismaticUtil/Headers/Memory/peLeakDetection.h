@@ -2,6 +2,8 @@
 #include "peAllocator.h"
 #include "peUtilDefs.h"
 
+#include <string>
+
 namespace pe
 {
 
@@ -0,0 +1,114 @@
+#pragma once
+#include "peAllocator.h"
+#include "peUtilDefs.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#pragma warning(push)
+#pragma warning(disable : 4251)
+
+namespace pe {
+
+//! \brief Subsystems whose memory is accounted separately
+enum class MemoryTag : uint8_t {
+  General,
+  Geometry,
+  AccelerationStructures,
+  Film,
+  Textures,
+  Entities,
+  Count
+};
+
+//! \brief Memory statistics of one tag at one point in time
+struct peMemoryTagStatistics {
+  //! \brief Bytes that are currently allocated
+  size_t currentBytes;
+  //! \brief Highest value of currentBytes since the start or the last
+  //! ResetPeaks
+  size_t peakBytes;
+  size_t numAllocations;
+  size_t numFrees;
+};
+
+//! \brief Keeps lock-free counters of the memory that is allocated under each
+//! tag. The counters are updated by peTaggedAllocator, but can also be fed
+//! by hand for memory that bypasses the engine allocators
+class PE_UTIL_API peMemoryTracker {
+public:
+  static void TrackAllocation(MemoryTag tag, size_t numBytes);
+  static void TrackFree(MemoryTag tag, size_t numBytes);
+
+  static peMemoryTagStatistics GetStatistics(MemoryTag tag);
+  static const char *GetTagName(MemoryTag tag);
+
+  //! \brief Sets the peak of every tag to its current value
+  static void ResetPeaks();
+
+  //! \brief Returns the statistics of all tags as a JSON object that maps tag
+  //! names to objects with the fields currentBytes, peakBytes, numAllocations
+  //! and numFrees
+  static std::string ToJson();
+  //! \brief Prints a human-readable table of the statistics of all tags
+  static void LogReport(std::function<void(const char *)> printer);
+};
+
+//! \brief Allocator that accounts all its allocations to a memory tag and
+//! forwards them to its parent. Each allocation carries a small header with
+//! its size, so that Free knows what to subtract
+class PE_UTIL_API peTaggedAllocator : public IAllocator {
+public:
+  peTaggedAllocator(MemoryTag tag, IAllocator *parentAllocator);
+
+  //! \brief Returns a tagged allocator on top of the GlobalAllocator. These
+  //! instances are never destroyed, so they may be used by static objects
+  static peTaggedAllocator *ForTag(MemoryTag tag);
+
+  void *Allocate(size_t numBytes) override;
+  void *Allocate(size_t numBytes, size_t alignment) override;
+  void Free(void *mem) override;
+
+  MemoryTag GetTag() const { return _tag; }
+  IAllocator *GetParentAllocator() const { return _parentAllocator; }
+
+private:
+  const MemoryTag _tag;
+  IAllocator *const _parentAllocator;
+};
+
+//! \brief Prints the report of the peMemoryTracker periodically from a
+//! background thread, until it is destroyed
+class PE_UTIL_API peMemoryReporter {
+public:
+  //! \param interval Time between two reports
+  //! \param printer Receives each report, called from the background thread
+  //! \param asJson Print the JSON statistics instead of the table
+  peMemoryReporter(std::chrono::milliseconds interval,
+                   std::function<void(const char *)> printer,
+                   bool asJson = false);
+  ~peMemoryReporter();
+
+  peMemoryReporter(const peMemoryReporter &) = delete;
+  peMemoryReporter &operator=(const peMemoryReporter &) = delete;
+
+private:
+  void Run();
+
+  const std::chrono::milliseconds _interval;
+  const std::function<void(const char *)> _printer;
+  const bool _asJson;
+
+  std::mutex _lock;
+  std::condition_variable _stopSignal;
+  bool _stop;
+  std::thread _thread;
+};
+
+} // namespace pe
+
+#pragma warning(pop)
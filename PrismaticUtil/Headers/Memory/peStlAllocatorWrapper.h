@@ -1,5 +1,7 @@
 #pragma once
 #include "peAllocator.h"
+#include <new>
+#include <utility>
 #include <vector>
 
 namespace pe {
@@ -52,7 +54,8 @@ public:
   }
 
   pointer allocate(size_t n) {
-    return static_cast<pointer>(_allocator->Allocate(n * sizeof(T)));
+    return static_cast<pointer>(
+        _allocator->Allocate(n * sizeof(T), alignof(T)));
   }
 
   void deallocate(pointer ptr, size_t n) {
@@ -73,6 +76,32 @@ private:
   IAllocator *_allocator;
 };
 
+//! \brief STL allocator like peStlAllocatorWrapper, but default-initializes
+//! the elements that containers create without a value, e.g. in resize. This
+//! leaves trivial elements uninitialized instead of zeroing them
+template <typename T>
+class peDefaultInitAllocatorWrapper : public peStlAllocatorWrapper<T> {
+public:
+  template <typename U> struct rebind {
+    using other = peDefaultInitAllocatorWrapper<U>;
+  };
+
+  using peStlAllocatorWrapper<T>::peStlAllocatorWrapper;
+
+  template <typename U, typename = std::enable_if_t<!std::is_same_v<U, T>>>
+  peDefaultInitAllocatorWrapper(const peDefaultInitAllocatorWrapper<U> &other)
+      : peStlAllocatorWrapper<T>(other) {}
+
+  template <typename U> void construct(U *ptr) {
+    ::new (static_cast<void *>(ptr)) U;
+  }
+
+  template <typename U, typename... Args>
+  void construct(U *ptr, Args &&... args) {
+    ::new (static_cast<void *>(ptr)) U(std::forward<Args>(args)...);
+  }
+};
+
 //! \brief Wraps an allocator to be used with STL containers
 template <typename T>
 peStlAllocatorWrapper<T> WrapAllocator(IAllocator *allocator) {
@@ -0,0 +1,27 @@
+#pragma once
+#include <atomic>
+
+namespace pe {
+
+//! \brief Flag that tells long-running tasks to give up. Tasks poll it at
+//! points where stopping is cheap, e.g. between batches of work. Usually
+//! shared between the tasks of one job through a std::shared_ptr, so that a
+//! new job can get a fresh token while stale tasks still drain
+class peCancellationToken {
+public:
+  peCancellationToken() : _cancelled(false) {}
+
+  peCancellationToken(const peCancellationToken &) = delete;
+  peCancellationToken &operator=(const peCancellationToken &) = delete;
+
+  void Cancel() { _cancelled.store(true, std::memory_order_release); }
+
+  bool IsCancelled() const {
+    return _cancelled.load(std::memory_order_acquire);
+  }
+
+private:
+  std::atomic_bool _cancelled;
+};
+
+} // namespace pe
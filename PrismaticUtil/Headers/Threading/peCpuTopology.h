@@ -0,0 +1,70 @@
+#pragma once
+#include "DataStructures/peVector.h"
+#include "peUtilDefs.h"
+
+#include <stdint.h>
+#include <string>
+
+#pragma warning(push)
+#pragma warning(disable : 4251)
+
+namespace pe {
+
+//! \brief Logical processor, i.e. one hardware thread
+struct peLogicalCpu {
+  //! \brief Index of the processor in the OS. Windows processor groups are
+  //! numbered consecutively, 64 processors per group
+  uint32_t id;
+  //! \brief Physical core, unique over all packages
+  uint32_t core;
+  //! \brief Index of this hardware thread within its core, 0 for the first one
+  uint32_t smtIndex;
+  uint32_t package;
+  uint32_t numaNode;
+  //! \brief Processors with the same value share the last-level cache
+  uint32_t lastLevelCache;
+};
+
+//! \brief Processor topology of the machine: physical cores, SMT siblings,
+//! NUMA nodes and last-level caches. All indices except the processor id are
+//! dense, starting at zero
+class PE_UTIL_API peCpuTopology {
+public:
+  //! \brief Detects the topology of this machine. Falls back to a uniform
+  //! topology if detection fails
+  static peCpuTopology Detect();
+
+  //! \brief One core per processor, single NUMA node and cache
+  static peCpuTopology Uniform(uint32_t numCpus);
+
+#ifndef _WIN32
+  //! \brief Reads the topology from sysfs
+  //! \param sysRoot Usually /sys/devices/system
+  static peCpuTopology FromSysfs(const std::string &sysRoot);
+#endif
+
+  const auto &Cpus() const { return _cpus; }
+
+  //! \brief Processors in the order in which workers should be placed on them.
+  //! The first hardware thread of every physical core comes first, filling one
+  //! NUMA node after another, then the SMT siblings
+  peVector<peLogicalCpu> PlacementOrder() const;
+
+  uint32_t NumCores() const;
+  uint32_t NumNumaNodes() const;
+
+  //! \brief Restricts the calling thread to the given processor
+  //! \returns True on success
+  static bool PinCurrentThread(const peLogicalCpu &cpu);
+
+private:
+  //! \brief Renumbers cores, packages, nodes and caches densely and computes
+  //! the SMT indices
+  void Normalize();
+
+  peVector<peLogicalCpu> _cpus;
+};
+
+} // namespace pe
+
+#pragma warning(pop)
@@ -0,0 +1,61 @@
+#pragma once
+#include "peUtilDefs.h"
+
+#include <atomic>
+#include <stdint.h>
+
+#pragma warning(push)
+#pragma warning(disable : 4251)
+
+namespace pe {
+
+//! \brief Eventcount, lets threads sleep until some condition becomes true
+//! without a lock around the condition. Waiters announce themselves with
+//! PrepareWait, check the condition once more and then either cancel or commit
+//! to the wait. Notifiers make the condition true before calling Notify. Sleeps
+//! on a futex (Linux) or WaitOnAddress (Windows), so notifying without waiters
+//! costs only a single atomic increment
+//!
+//! \code
+//! while (!condition()) {
+//!   const auto key = eventCount.PrepareWait();
+//!   if (condition()) {
+//!     eventCount.CancelWait();
+//!     break;
+//!   }
+//!   eventCount.CommitWait(key);
+//! }
+//! \endcode
+class PE_UTIL_API peEventCount {
+public:
+  using Key_t = uint32_t;
+
+  peEventCount();
+
+  peEventCount(const peEventCount &) = delete;
+  peEventCount &operator=(const peEventCount &) = delete;
+
+  //! \brief Registers the calling thread as a waiter. Has to be followed by
+  //! either CancelWait or CommitWait
+  Key_t PrepareWait();
+  void CancelWait();
+  //! \brief Sleeps until a notification arrives that was sent after the
+  //! corresponding PrepareWait
+  void CommitWait(Key_t key);
+
+  //! \brief Wakes up one waiting thread
+  void NotifyOne();
+  //! \brief Wakes up all waiting threads
+  void NotifyAll();
+
+private:
+  void Notify(bool all);
+
+  //! \brief Incremented by every notification, the futex word
+  std::atomic<uint32_t> _epoch;
+  std::atomic<uint32_t> _numWaiters;
+};
+
+} // namespace pe
+
+#pragma warning(pop)
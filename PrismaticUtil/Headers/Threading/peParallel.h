@@ -0,0 +1,141 @@
+#pragma once
+#include "DataStructures/peVector.h"
+#include "Threading/peTaskGroup.h"
+#include "Threading/peTaskSystem.h"
+
+#include <algorithm>
+#include <type_traits>
+
+namespace pe {
+
+namespace detail {
+
+//! \brief Calls the body either with a whole range or once per index,
+//! depending on what it accepts
+template <typename Body>
+void InvokeForRange(const Body &body, size_t begin, size_t end) {
+  if constexpr (std::is_invocable_v<const Body &, size_t, size_t>) {
+    body(begin, end);
+  } else {
+    for (auto idx = begin; idx < end; ++idx)
+      body(idx);
+  }
+}
+
+//! \brief Lazy binary splitting: the range is processed in chunks of 'grain'
+//! elements, and the remaining range is only split in half when the own queue
+//! is empty, i.e. when another thread could steal the second half. Splitting
+//! adapts to the load this way instead of creating a task per chunk
+template <typename Body>
+void ParallelForRange(peTaskSystem &taskSystem, peTaskGroup &group,
+                      size_t begin, size_t end, const size_t grain,
+                      const Body &body) {
+  while (end - begin > grain) {
+    if (taskSystem.IsLocalQueueEmpty()) {
+      const auto mid = begin + (end - begin) / 2;
+      group.Run([&taskSystem, &group, mid, end, grain, &body]() {
+        ParallelForRange(taskSystem, group, mid, end, grain, body);
+      });
+      end = mid;
+    } else {
+      InvokeForRange(body, begin, begin + grain);
+      begin += grain;
+    }
+  }
+  if (begin < end)
+    InvokeForRange(body, begin, end);
+}
+
+template <typename T, typename Body, typename Combine>
+T ParallelReduceRange(peTaskSystem &taskSystem, size_t begin, size_t end,
+                      const size_t grain, const T &identity, const Body &body,
+                      const Combine &combine) {
+  // Every split halves the remaining range, so there are never more than 64
+  // of them. Reserving up front keeps the slots of running tasks in place
+  constexpr size_t MaxSplits = 64;
+  peVector<T> splitResults;
+  splitResults.reserve(MaxSplits);
+
+  peTaskGroup splitTasks{taskSystem};
+  auto result = identity;
+  while (end - begin > grain) {
+    if (splitResults.size() < MaxSplits && taskSystem.IsLocalQueueEmpty()) {
+      const auto mid = begin + (end - begin) / 2;
+      splitResults.push_back(identity);
+      auto slot = &splitResults.back();
+      splitTasks.Run([&, slot, mid, end]() {
+        *slot = ParallelReduceRange(taskSystem, mid, end, grain, identity,
+                                    body, combine);
+      });
+      end = mid;
+    } else {
+      result = body(begin, begin + grain, std::move(result));
+      begin += grain;
+    }
+  }
+  if (begin < end)
+    result = body(begin, end, std::move(result));
+
+  splitTasks.Wait();
+
+  // The last split is the one right next to our own range, so combining in
+  // reverse keeps the order of the elements for non-commutative operations
+  for (auto iter = splitResults.rbegin(); iter != splitResults.rend(); ++iter)
+    result = combine(std::move(result), std::move(*iter));
+  return result;
+}
+
+} // namespace detail
+
+//! \brief Calls body for all indices in [begin;end) in parallel. The calling
+//! thread takes part in the work and returns once everything is done
+//! \param taskSystem Task system to run on. If it is not running, the loop runs
+//! on the calling thread
+//! \param begin First index
+//! \param end One past the last index
+//! \param grain Minimum number of indices per chunk. Should be large enough
+//! that the body runs for a few microseconds per chunk
+//! \param body Either body(size_t chunkBegin, size_t chunkEnd) or
+//! body(size_t idx)
+template <typename Body>
+void ParallelFor(peTaskSystem &taskSystem, const size_t begin,
+                 const size_t end, const size_t grain, const Body &body) {
+  if (begin >= end)
+    return;
+  if (!taskSystem.IsRunning()) {
+    detail::InvokeForRange(body, begin, end);
+    return;
+  }
+
+  peTaskGroup group{taskSystem};
+  detail::ParallelForRange(taskSystem, group, begin, end,
+                           std::max<size_t>(grain, 1), body);
+  group.Wait();
+}
+
+//! \brief Reduces all indices in [begin;end) in parallel
+//! \param taskSystem Task system to run on. If it is not running, the
+//! reduction runs on the calling thread
+//! \param begin First index
+//! \param end One past the last index
+//! \param grain Minimum number of indices per chunk
+//! \param identity Identity element of the reduction
+//! \param body T body(size_t chunkBegin, size_t chunkEnd, T init) that reduces
+//! a chunk on top of init
+//! \param combine T combine(T left, T right) that merges partial results. Has
+//! to be associative, but need not be commutative
+//! \returns Result of the reduction
+template <typename T, typename Body, typename Combine>
+T ParallelReduce(peTaskSystem &taskSystem, const size_t begin,
+                 const size_t end, const size_t grain, const T &identity,
+                 const Body &body, const Combine &combine) {
+  if (begin >= end)
+    return identity;
+  if (!taskSystem.IsRunning())
+    return body(begin, end, identity);
+  return detail::ParallelReduceRange(taskSystem, begin, end,
+                                     std::max<size_t>(grain, 1), identity,
+                                     body, combine);
+}
+
+} // namespace pe
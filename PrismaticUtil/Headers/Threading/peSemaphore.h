@@ -1,7 +1,11 @@
 #pragma once
+#include "peEventCount.h"
 #include "peUtilDefs.h"
 
-#include <Windows.h>
+#include <atomic>
+
+#pragma warning(push)
+#pragma warning(disable : 4251)
 
 namespace pe {
 
@@ -20,11 +24,17 @@ public:
   bool TryDecrement() const;
   //! Increments the semaphore count by one
   void Increment() const;
-  //! Increments the semaphore count to the given value
+  //! Increments the semaphore count by the given value. Like a Win32
+  //! semaphore, the count stays unchanged if it would exceed the maximum
   void IncrementToCount(unsigned int count) const;
 
 private:
-  HANDLE m_handle;
+  mutable std::atomic<int> _count;
+  const int _maxCount;
+  //! \brief Threads that wait for the count to become positive
+  mutable peEventCount _waiters;
 };
 
 }; // namespace pe
+
+#pragma warning(pop)
@@ -0,0 +1,74 @@
+#pragma once
+#include "Memory/peAllocator.h"
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace pe {
+
+//! \brief Type-erased task of a fixed size. Callables that fit into the inline
+//! storage are constructed in place, larger ones go to the heap. The task
+//! system recycles these records, so small tasks never allocate
+class alignas(64) peTask {
+public:
+  //! \brief Size of a whole record, two cache lines
+  constexpr static size_t RecordSize = 128;
+  //! \brief Maximum size of a callable that is stored inline
+  constexpr static size_t InlineStorageSize = RecordSize - 32;
+
+  peTask() : next(nullptr), _invoke(nullptr), _destroy(nullptr) {}
+  peTask(const peTask &) = delete;
+  peTask &operator=(const peTask &) = delete;
+
+  template <typename F>
+  constexpr static bool FitsInline =
+      sizeof(F) <= InlineStorageSize && alignof(F) <= 16;
+
+  //! \brief Stores the given callable in this record. The record must be empty
+  template <typename F> void Emplace(F &&callable) {
+    using Callable_t = std::decay_t<F>;
+    if constexpr (FitsInline<Callable_t>) {
+      new (_storage) Callable_t(std::forward<F>(callable));
+      _invoke = [](void *storage) { (*static_cast<Callable_t *>(storage))(); };
+      _destroy = [](void *storage) {
+        static_cast<Callable_t *>(storage)->~Callable_t();
+      };
+    } else {
+      auto heapCallable =
+          New<Callable_t>(GlobalAllocator, std::forward<F>(callable));
+      new (_storage) Callable_t *(heapCallable);
+      _invoke = [](void *storage) {
+        (**static_cast<Callable_t **>(storage))();
+      };
+      _destroy = [](void *storage) {
+        Delete(*static_cast<Callable_t **>(storage), GlobalAllocator);
+      };
+    }
+  }
+
+  void Run() { _invoke(_storage); }
+
+  //! \brief Destroys the stored callable, the record can be reused afterwards
+  void Reset() {
+    _destroy(_storage);
+    _invoke = nullptr;
+    _destroy = nullptr;
+  }
+
+  //! \brief Intrusive link for the queues and free lists that hold this record
+  peTask *next;
+
+private:
+  using Function_t = void (*)(void *);
+
+  Function_t _invoke;
+  Function_t _destroy;
+  alignas(16) unsigned char _storage[InlineStorageSize];
+};
+
+static_assert(sizeof(peTask) == peTask::RecordSize,
+              "peTask records must not have padding!");
+
+} // namespace pe
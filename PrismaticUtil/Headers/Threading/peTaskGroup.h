@@ -0,0 +1,99 @@
+#pragma once
+#include "Threading/peTaskSystem.h"
+
+#include <atomic>
+#include <mutex>
+#include <utility>
+
+#pragma warning(push)
+#pragma warning(disable : 4251)
+
+namespace pe {
+
+//! \brief Group of tasks that can be waited on as a whole. Tracks the number of
+//! outstanding tasks and runs continuations once all of them are finished, so
+//! pipelines of dependent work don't need polling or sleeping threads
+class PE_UTIL_API peTaskGroup {
+public:
+  explicit peTaskGroup(peTaskSystem &taskSystem);
+  //! \brief Waits for all outstanding tasks
+  ~peTaskGroup();
+
+  peTaskGroup(const peTaskGroup &) = delete;
+  peTaskGroup &operator=(const peTaskGroup &) = delete;
+
+  //! \brief Runs the given task as part of this group. Tasks of the group may
+  //! add more tasks to it. If the task system is not running, nothing would
+  //! ever pick the task up, so it runs right away on the calling thread
+  template <typename F>
+  void Run(F &&task, peTaskPriority priority = peTaskPriority::Normal) {
+    if (!_taskSystem.IsRunning()) {
+      task();
+      return;
+    }
+    _outstanding.fetch_add(1, std::memory_order_relaxed);
+    FinishGuard finish{*this};
+    _taskSystem.AddTask(
+        [finish = std::move(finish), task = std::forward<F>(task)]() mutable {
+          // The task counts as finished even if it throws
+          const auto finishOnReturn = std::move(finish);
+          task();
+        },
+        priority);
+  }
+
+  //! \brief Waits until all tasks of this group are finished. The calling
+  //! thread executes pending tasks in the meantime and only sleeps if there is
+  //! nothing to help with, so it is safe to wait from within a task
+  void Wait();
+
+  //! \brief Registers a continuation that is scheduled as a new task once all
+  //! tasks of this group are finished. If the group has no outstanding tasks,
+  //! the continuation is scheduled right away
+  template <typename F> void Then(F &&continuation) {
+    AddContinuation(_taskSystem.CreateTask(std::forward<F>(continuation)));
+  }
+
+  //! \brief Number of tasks that are scheduled or running
+  size_t Outstanding() const {
+    return _outstanding.load(std::memory_order_acquire);
+  }
+
+  bool IsDone() const { return Outstanding() == 0; }
+
+private:
+  //! \brief Finishes one task of the group when it goes away. Each task holds
+  //! one, so that tasks which are discarded by a stopping task system without
+  //! running count as finished as well
+  class FinishGuard {
+  public:
+    explicit FinishGuard(peTaskGroup &group) : _group(&group) {}
+    FinishGuard(FinishGuard &&other) noexcept
+        : _group(std::exchange(other._group, nullptr)) {}
+    FinishGuard &operator=(FinishGuard &&) = delete;
+    ~FinishGuard() {
+      if (_group)
+        _group->OnTaskFinished();
+    }
+
+  private:
+    peTaskGroup *_group;
+  };
+
+  void AddContinuation(peTask *continuation);
+  void OnTaskFinished();
+
+  peTaskSystem &_taskSystem;
+  std::atomic<size_t> _outstanding;
+  //! \brief Number of threads that sleep in Wait
+  std::atomic<uint32_t> _numSleepingWaiters;
+  //! \brief Guards the continuations and the transition to zero outstanding
+  //! tasks
+  std::mutex _lock;
+  //! \brief Continuations, linked through their task records
+  peTask *_continuations;
+};
+
+} // namespace pe
+
+#pragma warning(pop)
@@ -1,6 +1,11 @@
 #pragma once
 #include "DataStructures/peVector.h"
-#include "peSemaphore.h"
+#include "Memory/peAllocators.h"
+#include "peCpuTopology.h"
+#include "peEventCount.h"
+#include "peTask.h"
+#include "peWorkStealingDeque.h"
+#include <array>
 #include <atomic>
 #include <mutex>
 #include <optional>
@@ -11,46 +16,194 @@
 
 namespace pe {
 
-//! \brief Task queue
+//! \brief Priority of a task. Runners take the task of the highest priority
+//! from their own deque and the injection queues. Only if both are empty they
+//! steal, again highest priority first. So a runner with local work of a low
+//! priority runs it even while other runners hold tasks of a higher one
+enum class peTaskPriority : uint32_t { High, Normal, Low };
+
+constexpr uint32_t NumTaskPriorities = 3;
+
+//! \brief FIFO task queue for tasks that are submitted from threads that are
+//! not part of the task system. Links the tasks through their records, so it
+//! never allocates
 struct PE_UTIL_API peTaskQueue {
   peTaskQueue();
 
-  void Enqueue(std::function<void()> task);
-  std::function<void()> WaitAndDequeue();
-  std::optional<std::function<void()>> TryDequeue();
+  void Enqueue(peTask *task);
+  peTask *TryDequeue();
 
   size_t Count() const;
 
 private:
-  peVector<std::function<void()>> _tasks;
+  peTask *_head;
+  peTask *_tail;
+  std::atomic<size_t> _count;
   mutable std::mutex _lock;
-  mutable std::condition_variable _available;
 };
 
-//! \brief Task system
+//! \brief Task system with one work-stealing deque per runner. Tasks that
+//! runners create for themselves go into their own deque, other threads submit
+//! tasks through a shared injection queue. Idle runners steal from random
+//! victims and sleep when there is no work at all
 class PE_UTIL_API peTaskSystem {
 public:
+  //! \param pinRunners Pin each runner to its own processor, physical cores
+  //! first. Every task system starts at the same processors, so only the one
+  //! that does the heavy lifting should pin its runners
   explicit peTaskSystem(
-      const uint32_t concurrency = std::thread::hardware_concurrency());
+      const uint32_t concurrency = std::thread::hardware_concurrency(),
+      const bool pinRunners = false);
+  ~peTaskSystem();
 
   peTaskSystem(const peTaskSystem &) = delete;
   peTaskSystem(peTaskSystem &&) = delete;
 
   void Start();
+  //! \brief Joins the runners. Tasks that did not run yet are discarded, task
+  //! groups count them as finished
   void Stop();
 
-  void AddTask(std::function<void()> task);
+  template <typename F>
+  void AddTask(F &&task, peTaskPriority priority = peTaskPriority::Normal) {
+    Submit(CreateTask(std::forward<F>(task)), priority);
+  }
+
+  //! \brief Creates a task without scheduling it. The task has to be passed to
+  //! either Submit or DiscardTask eventually
+  template <typename F> peTask *CreateTask(F &&task) {
+    auto record = AcquireTask();
+    try {
+      record->Emplace(std::forward<F>(task));
+    } catch (...) {
+      ReleaseTask(record);
+      throw;
+    }
+    return record;
+  }
+
+  //! \brief Schedules a task that was created with CreateTask
+  void Submit(peTask *task, peTaskPriority priority = peTaskPriority::Normal);
+
+  //! \brief Destroys a task that was created with CreateTask but never
+  //! submitted
+  void DiscardTask(peTask *task);
+
+  //! \brief Runs one pending task on the calling thread, if there is one. Lets
+  //! threads that wait for the results of other tasks help with the work
+  //! instead of blocking a runner
+  //! \returns True if a task was run
+  bool RunPendingTask();
+
+  //! \brief Returns true if no task that the calling thread added is waiting
+  //! to be picked up. Data-parallel algorithms use this to split their work
+  //! only when other threads could actually take a part of it
+  bool IsLocalQueueEmpty() const;
+
+  bool IsRunning() const { return _running.load(std::memory_order_relaxed); }
+
+  //! \brief Puts the calling thread to sleep until either a new task arrives
+  //! or the given condition is true. Threads that change the condition have to
+  //! call WakeAll afterwards. Returns right away if the task system is stopped
+  template <typename Condition> void ParkUntil(const Condition &condition) {
+    const auto key = _idleThreads.PrepareWait();
+    if (!IsRunning() || HasPendingTasks() || condition()) {
+      _idleThreads.CancelWait();
+      return;
+    }
+    _idleThreads.CommitWait(key);
+  }
+
+  //! \brief Wakes up all idle runners and threads in ParkUntil
+  void WakeAll() { _idleThreads.NotifyAll(); }
+
+  //! \brief Scratch arena of the calling thread. Everything a task allocates
+  //! from it is freed once the task returns, so it is meant for temporary
+  //! buffers that would otherwise go through the global allocator
+  peScratchArena &ScratchArena();
 
   auto Concurrency() const { return _concurrency; }
 
 private:
+  struct Runner {
+    //! \brief One deque per priority
+    std::array<peWorkStealingDeque<peTask *>, NumTaskPriorities> tasks;
+    uint32_t rngState;
+    //! \brief Processor that the runner is pinned to. Empty if the task
+    //! system doesn't pin its runners, and for runners beyond the number of
+    //! processors
+    std::optional<peLogicalCpu> cpu;
+    //! \brief All other runners, closest first. The first numCacheVictims
+    //! share the last-level cache with this runner, the first numNodeVictims
+    //! are on the same NUMA node
+    peVector<uint32_t> victims;
+    uint32_t numCacheVictims = 0;
+    uint32_t numNodeVictims = 0;
+    //! \brief Task records that this runner recycles without synchronization
+    peTask *freeTasks = nullptr;
+    uint32_t numFreeTasks = 0;
+    peScratchArena scratch;
+  };
+
+  //! \brief Number of times an idle runner looks for work before it sleeps
+  constexpr static uint32_t IdleSpinRounds = 16;
+  //! \brief Number of task records that runners exchange with the shared pool
+  //! at once
+  constexpr static uint32_t PoolBatchSize = 64;
+  //! \brief Runners that collect more free records than this (because other
+  //! threads create the tasks they run) return a batch to the shared pool
+  constexpr static uint32_t MaxLocalFreeTasks = 4 * PoolBatchSize;
+
   void Run(const uint32_t idx);
+  void BuildVictimList(const uint32_t idx);
+
+  //! \brief Looks for a task in the own deques and the injection queues,
+  //! highest priority first. Only if there is none, steals from the deques of
+  //! other runners, again highest priority first and the closest runners first
+  //! \param idx Index of the calling runner, or Concurrency() for threads that
+  //! are not part of this task system
+  peTask *FindTask(const uint32_t idx);
+  peTask *TrySteal(const uint32_t idx, uint32_t &rngState,
+                   const uint32_t priority);
+  bool HasPendingTasks() const;
+  void Execute(peTask *task);
+
+  //! \brief Takes a task record from the pool of the calling runner, or from
+  //! the shared pool for threads outside of the task system
+  peTask *AcquireTask();
+  void ReleaseTask(peTask *task);
+  //! \brief Moves a batch of records from the shared pool into the pool of
+  //! the given runner
+  void RefillPool(Runner &runner);
+  //! \brief Moves a batch of records from the pool of the given runner into
+  //! the shared pool
+  void DrainPool(Runner &runner, uint32_t count);
+  //! \brief Adds a new slab of records to the shared pool. Expects the pool
+  //! lock to be held
+  void AllocateSlab();
+
+  //! \brief Index of the calling thread within this task system, Concurrency()
+  //! if the calling thread is not a runner of this task system
+  uint32_t CurrentRunnerIdx() const;
+
 
   const uint32_t _concurrency;
+  const bool _pinRunners;
   std::atomic_bool _running;
-  std::atomic<uint32_t> _nextRunnerIdx;
   peVector<std::thread> _runners;
-  peVector<std::unique_ptr<peTaskQueue>> _queues;
+  peVector<std::unique_ptr<Runner>> _runnerStates;
+  std::array<peTaskQueue, NumTaskPriorities> _injectionQueues;
+
+  //! \brief Shared pool of task records, mostly used by threads that are not
+  //! part of the task system
+  peTask *_sharedFreeTasks;
+  std::mutex _poolLock;
+  //! \brief Memory of all task records, released with the task system
+  peVector<void *> _slabs;
+
+  //! \brief Idle runners and waiting threads sleep here, every new task
+  //! wakes one of them
+  peEventCount _idleThreads;
 };
 
 } // namespace pe
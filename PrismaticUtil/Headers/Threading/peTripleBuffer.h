@@ -0,0 +1,61 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <stdint.h>
+
+namespace pe {
+
+//! \brief Hands values from one producer thread to one consumer thread without
+//! locks. The producer writes into the back buffer and publishes it, the
+//! consumer reads the latest published buffer. Neither side ever waits for the
+//! other, values that the consumer did not pick up in time are skipped
+template <typename T> class peTripleBuffer {
+public:
+  peTripleBuffer() : _back(0), _middle(1), _front(2) {}
+
+  peTripleBuffer(const peTripleBuffer &) = delete;
+  peTripleBuffer &operator=(const peTripleBuffer &) = delete;
+
+  //! \brief Buffer that the producer writes. Holds whatever it held when it
+  //! was handed back to the producer, which is not necessarily the value that
+  //! was published last
+  T &Back() { return _buffers[_back]; }
+
+  //! \brief Publishes the back buffer. The producer continues with the buffer
+  //! that was published before, unless the consumer took it already
+  void Publish() {
+    const auto previous = _middle.exchange(
+        static_cast<uint8_t>(_back | Published), std::memory_order_acq_rel);
+    _back = previous & IndexMask;
+  }
+
+  //! \brief Makes the latest published buffer the front buffer
+  //! \returns True if a buffer was published since the last call
+  bool Acquire() {
+    if (!(_middle.load(std::memory_order_relaxed) & Published))
+      return false;
+    const auto previous = _middle.exchange(_front, std::memory_order_acq_rel);
+    _front = previous & IndexMask;
+    return true;
+  }
+
+  //! \brief Buffer that the consumer reads. Stays the same until the next call
+  //! to Acquire
+  const T &Front() const { return _buffers[_front]; }
+
+private:
+  constexpr static uint8_t IndexMask = 0x3;
+  //! \brief Set in the middle index while the consumer has not picked up the
+  //! buffer
+  constexpr static uint8_t Published = 0x4;
+
+  std::array<T, 3> _buffers;
+  //! \brief Only accessed by the producer
+  uint8_t _back;
+  //! \brief Index of the buffer that is exchanged between both sides
+  std::atomic<uint8_t> _middle;
+  //! \brief Only accessed by the consumer
+  uint8_t _front;
+};
+
+} // namespace pe
@@ -0,0 +1,142 @@
+#pragma once
+#include "DataStructures/peVector.h"
+
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <stdint.h>
+#include <type_traits>
+
+namespace pe {
+
+//! \brief Lock-free Chase-Lev work-stealing deque. The owning thread pushes and
+//! pops elements at the bottom (LIFO), any other thread can steal elements from
+//! the top (FIFO). Grows on demand. Memory orderings follow Lê et al., "Correct
+//! and Efficient Work-Stealing for Weak Memory Models" (PPoPP 2013)
+//! \tparam T Element type. Elements are copied while other threads might read
+//! them, so T has to be trivially copyable (e.g. a pointer)
+template <typename T> class peWorkStealingDeque {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "peWorkStealingDeque only supports trivially copyable types!");
+
+  struct Buffer {
+    explicit Buffer(int64_t capacity)
+        : capacity(capacity), mask(capacity - 1),
+          elements(std::make_unique<std::atomic<T>[]>(
+              static_cast<size_t>(capacity))) {}
+
+    T Get(int64_t idx) const {
+      return elements[idx & mask].load(std::memory_order_relaxed);
+    }
+
+    void Put(int64_t idx, T value) {
+      elements[idx & mask].store(value, std::memory_order_relaxed);
+    }
+
+    const int64_t capacity;
+    const int64_t mask;
+    std::unique_ptr<std::atomic<T>[]> elements;
+  };
+
+public:
+  //! \brief Creates a new deque
+  //! \param initialCapacity Initial capacity, must be a power of two
+  explicit peWorkStealingDeque(int64_t initialCapacity = 1024)
+      : _top(0), _bottom(0) {
+    _buffers.push_back(std::make_unique<Buffer>(initialCapacity));
+    _buffer.store(_buffers.back().get(), std::memory_order_relaxed);
+  }
+
+  peWorkStealingDeque(const peWorkStealingDeque &) = delete;
+  peWorkStealingDeque &operator=(const peWorkStealingDeque &) = delete;
+
+  //! \brief Pushes an element at the bottom. Only the owner may call this
+  void Push(T value) {
+    const auto bottom = _bottom.load(std::memory_order_relaxed);
+    const auto top = _top.load(std::memory_order_acquire);
+    auto buffer = _buffer.load(std::memory_order_relaxed);
+    if (bottom - top > buffer->capacity - 1)
+      buffer = Grow(buffer, top, bottom);
+
+    // The paper uses a release fence and a relaxed store here, a release
+    // store is equivalent and easier on race detectors
+    buffer->Put(bottom, value);
+    _bottom.store(bottom + 1, std::memory_order_release);
+  }
+
+  //! \brief Pops the most recently pushed element. Only the owner may call this
+  std::optional<T> Pop() {
+    const auto bottom = _bottom.load(std::memory_order_relaxed) - 1;
+    auto buffer = _buffer.load(std::memory_order_relaxed);
+    _bottom.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto top = _top.load(std::memory_order_relaxed);
+
+    if (top > bottom) {
+      // Empty
+      _bottom.store(bottom + 1, std::memory_order_relaxed);
+      return {};
+    }
+
+    auto value = buffer->Get(bottom);
+    if (top == bottom) {
+      // Last element, race against the thieves for it
+      const auto won = _top.compare_exchange_strong(
+          top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+      _bottom.store(bottom + 1, std::memory_order_relaxed);
+      if (!won)
+        return {};
+    }
+    return value;
+  }
+
+  //! \brief Steals the oldest element. Can be called from any thread. Might
+  //! fail spuriously if another thread takes an element at the same time
+  std::optional<T> Steal() {
+    auto top = _top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const auto bottom = _bottom.load(std::memory_order_acquire);
+    if (top >= bottom)
+      return {};
+
+    // Consume ordering would suffice, but compilers promote it anyway
+    auto buffer = _buffer.load(std::memory_order_acquire);
+    auto value = buffer->Get(top);
+    if (!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed))
+      return {};
+    return value;
+  }
+
+  //! \brief Approximate number of elements
+  size_t ApproximateSize() const {
+    const auto bottom = _bottom.load(std::memory_order_relaxed);
+    const auto top = _top.load(std::memory_order_relaxed);
+    return bottom > top ? static_cast<size_t>(bottom - top) : 0;
+  }
+
+  bool ApproximatelyEmpty() const { return ApproximateSize() == 0; }
+
+private:
+  Buffer *Grow(Buffer *old, int64_t top, int64_t bottom) {
+    auto bigger = std::make_unique<Buffer>(old->capacity * 2);
+    for (auto idx = top; idx < bottom; ++idx)
+      bigger->Put(idx, old->Get(idx));
+
+    // Thieves might still read from the old buffer, so it stays alive until
+    // the deque is destroyed
+    auto ret = bigger.get();
+    _buffers.push_back(std::move(bigger));
+    _buffer.store(ret, std::memory_order_release);
+    return ret;
+  }
+
+  // Top and bottom are written by different threads, keep them on different
+  // cache lines
+  alignas(64) std::atomic<int64_t> _top;
+  alignas(64) std::atomic<int64_t> _bottom;
+  alignas(64) std::atomic<Buffer *> _buffer;
+  peVector<std::unique_ptr<Buffer>> _buffers;
+};
+
+} // namespace pe
@@ -0,0 +1,144 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+namespace pe {
+
+//! \brief Converts a 32-bit float into an IEEE 754 half-precision float. Rounds
+//! to nearest even, values that exceed the half range become infinity
+//! \param value Float value
+//! \returns Bit pattern of the half-precision value
+inline uint16_t FloatToHalf(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+
+  const auto sign = static_cast<uint16_t>((bits >> 16) & 0x8000u);
+  const auto absBits = bits & 0x7FFFFFFFu;
+
+  // Infinity and NaN, keep NaNs quiet
+  if (absBits >= 0x7F800000u)
+    return static_cast<uint16_t>(sign | 0x7C00u |
+                                 (absBits > 0x7F800000u ? 0x200u : 0u));
+  // Everything that rounds to a value above 65504 overflows to infinity
+  if (absBits >= 0x477FF000u)
+    return static_cast<uint16_t>(sign | 0x7C00u);
+
+  // Results in a denormalized half or zero
+  if (absBits < 0x38800000u) {
+    if (absBits < 0x33000000u)
+      return sign;
+    const auto exponent = absBits >> 23;
+    const auto mantissa = (absBits & 0x7FFFFFu) | 0x800000u;
+    const auto shift = 126u - exponent;
+    auto half = mantissa >> shift;
+    const auto remainder = mantissa & ((1u << shift) - 1u);
+    const auto halfway = 1u << (shift - 1u);
+    if (remainder > halfway || (remainder == halfway && (half & 1u)))
+      ++half;
+    return static_cast<uint16_t>(sign | half);
+  }
+
+  // Normalized half, rebias the exponent from 127 to 15. A rounding carry
+  // correctly propagates into the exponent
+  auto half = (absBits - 0x38000000u) >> 13;
+  const auto remainder = absBits & 0x1FFFu;
+  if (remainder > 0x1000u || (remainder == 0x1000u && (half & 1u)))
+    ++half;
+  return static_cast<uint16_t>(sign | half);
+}
+
+//! \brief Converts an IEEE 754 half-precision float into a 32-bit float
+//! \param half Bit pattern of the half-precision value
+//! \returns Float value
+inline float HalfToFloat(uint16_t half) {
+  const auto sign = static_cast<uint32_t>(half & 0x8000u) << 16;
+  auto exponent = static_cast<uint32_t>((half >> 10) & 0x1Fu);
+  auto mantissa = static_cast<uint32_t>(half & 0x3FFu);
+
+  uint32_t bits;
+  if (exponent == 0) {
+    if (mantissa == 0) {
+      bits = sign;
+    } else {
+      // Denormalized half, normalize it for the float representation
+      exponent = 113;
+      while (!(mantissa & 0x400u)) {
+        mantissa <<= 1;
+        --exponent;
+      }
+      bits = sign | (exponent << 23) | ((mantissa & 0x3FFu) << 13);
+    }
+  } else if (exponent == 0x1F) {
+    bits = sign | 0x7F800000u | (mantissa << 13);
+  } else {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  }
+
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+namespace detail {
+constexpr int RGB9E5MantissaBits = 9;
+constexpr int RGB9E5ExponentBias = 15;
+constexpr float RGB9E5MaxValue = 65408.f; // (511 / 512) * 2^16
+} // namespace detail
+
+//! \brief Packs a non-negative RGB triplet into the shared-exponent 9:9:9:5
+//! format. All channels share the exponent of the largest channel, so small
+//! channels lose precision relative to the largest one. Negative values and
+//! NaNs are stored as zero, values above 65408 are clamped
+//! \returns Packed RGB9E5 value
+inline uint32_t PackRGB9E5(float r, float g, float b) {
+  using namespace detail;
+  auto clampChannel = [](float val) {
+    // Written so that NaN ends up as zero
+    return (val > 0.f) ? std::min(val, RGB9E5MaxValue) : 0.f;
+  };
+  const auto rc = clampChannel(r);
+  const auto gc = clampChannel(g);
+  const auto bc = clampChannel(b);
+  const auto maxChannel = std::max(rc, std::max(gc, bc));
+  if (maxChannel == 0.f)
+    return 0;
+
+  int exponent;
+  std::frexp(maxChannel, &exponent);
+  // frexp yields maxChannel = m * 2^exponent with m in [0.5;1)
+  auto sharedExponent =
+      std::max(-RGB9E5ExponentBias - 1, exponent - 1) + 1 + RGB9E5ExponentBias;
+  auto scale = std::ldexp(
+      1.f, sharedExponent - RGB9E5ExponentBias - RGB9E5MantissaBits);
+  const auto maxMantissa =
+      static_cast<int>(std::floor(maxChannel / scale + 0.5f));
+  if (maxMantissa == (1 << RGB9E5MantissaBits)) {
+    ++sharedExponent;
+    scale *= 2.f;
+  }
+
+  auto toMantissa = [scale](float val) {
+    return static_cast<uint32_t>(std::floor(val / scale + 0.5f));
+  };
+  return toMantissa(rc) | (toMantissa(gc) << 9) | (toMantissa(bc) << 18) |
+         (static_cast<uint32_t>(sharedExponent) << 27);
+}
+
+//! \brief Unpacks a shared-exponent 9:9:9:5 value
+//! \param packed Packed value
+//! \param r Red channel
+//! \param g Green channel
+//! \param b Blue channel
+inline void UnpackRGB9E5(uint32_t packed, float &r, float &g, float &b) {
+  using namespace detail;
+  const auto exponent = static_cast<int>(packed >> 27);
+  const auto scale =
+      std::ldexp(1.f, exponent - RGB9E5ExponentBias - RGB9E5MantissaBits);
+  r = static_cast<float>(packed & 0x1FFu) * scale;
+  g = static_cast<float>((packed >> 9) & 0x1FFu) * scale;
+  b = static_cast<float>((packed >> 18) & 0x1FFu) * scale;
+}
+
+} // namespace pe
@@ -10,18 +10,107 @@ pe::peWeakHandle pe::peWeakHandle::Invalid() {
   return {uintMax, uintMax};
 }
 
-pe::peWeakTableBase::peWeakTableBase(size_t elementSize, size_t chunkSize,
-                                     IAllocator *parentAllocator)
-    : _allocator(elementSize, chunkSize, parentAllocator) {}
+pe::peWeakTableBase::peWeakTableBase(size_t elementSize, size_t alignment,
+                                     size_t chunkSize,
+                                     IAllocator *parentAllocator,
+                                     bool concurrent)
+    : _elementSize(elementSize), _parentAllocator(parentAllocator),
+      _concurrent(concurrent),
+      _allocator(elementSize, chunkSize, parentAllocator, alignment),
+      _numSlots(0), _firstFree(NoSlot) {
+  for (auto &segment : _segments)
+    segment.store(nullptr, std::memory_order_relaxed);
+}
+
+pe::peWeakTableBase::~peWeakTableBase() {
+  for (auto &segment : _segments) {
+    auto slots = segment.load(std::memory_order_relaxed);
+    if (!slots)
+      break;
+    for (uint32_t idx = 0; idx < SlotsPerSegment; ++idx)
+      slots[idx].~Slot();
+    _parentAllocator->Free(slots);
+  }
+}
 
 void *pe::peWeakTableBase::Deref(peWeakHandle handle) const {
-  auto iter = _entries.find(handle.index);
-  if (iter == _entries.end())
+  // Slots are fully initialized before the count includes them
+  if (handle.index >= NumSlots())
+    return nullptr;
+  auto &slot = SlotAt(handle.index);
+  if (slot.version.load(std::memory_order_acquire) != handle.version)
     return nullptr;
+  return slot.instance.load(std::memory_order_acquire);
+}
+
+void *pe::peWeakTableBase::AllocateInstance() {
+  std::unique_lock<std::mutex> lock{_lock, std::defer_lock};
+  if (_concurrent)
+    lock.lock();
+  auto instance = _allocator.Allocate(_elementSize);
+  if (!instance)
+    throw std::runtime_error{"Could not allocate weak table entry!"};
+  return instance;
+}
 
-  auto &entry = iter->second;
-  if (entry.version != handle.version)
+void pe::peWeakTableBase::FreeInstance(void *instance) {
+  std::unique_lock<std::mutex> lock{_lock, std::defer_lock};
+  if (_concurrent)
+    lock.lock();
+  _allocator.Free(instance);
+}
+
+pe::peWeakHandle pe::peWeakTableBase::Publish(void *instance) {
+  std::unique_lock<std::mutex> lock{_lock, std::defer_lock};
+  if (_concurrent)
+    lock.lock();
+
+  // Freed slots carry the version that their next handle gets
+  if (_firstFree != NoSlot) {
+    const auto index = _firstFree;
+    auto &slot = SlotAt(index);
+    _firstFree = slot.nextFree;
+    slot.instance.store(instance, std::memory_order_release);
+    return {index, slot.version.load(std::memory_order_relaxed)};
+  }
+
+  const auto index = _numSlots.load(std::memory_order_relaxed);
+  const auto segmentIdx = index / SlotsPerSegment;
+  if (segmentIdx == MaxSegments)
+    throw std::runtime_error{"Weak table is full!"};
+  if (index % SlotsPerSegment == 0) {
+    auto slots = static_cast<Slot *>(_parentAllocator->Allocate(
+        sizeof(Slot) * SlotsPerSegment, alignof(Slot)));
+    if (!slots)
+      throw std::runtime_error{"Could not allocate weak table slots!"};
+    for (uint32_t idx = 0; idx < SlotsPerSegment; ++idx)
+      new (slots + idx) Slot{{nullptr}, {0}, NoSlot};
+    _segments[segmentIdx].store(slots, std::memory_order_release);
+  }
+  auto &slot = SlotAt(index);
+  slot.instance.store(instance, std::memory_order_relaxed);
+  _numSlots.store(index + 1, std::memory_order_release);
+  return {index, 0};
+}
+
+void *pe::peWeakTableBase::Unpublish(peWeakHandle handle) {
+  std::unique_lock<std::mutex> lock{_lock, std::defer_lock};
+  if (_concurrent)
+    lock.lock();
+
+  if (handle.index >= NumSlots())
+    throw std::runtime_error{"Invalid handle!"};
+  auto &slot = SlotAt(handle.index);
+  if (slot.version.load(std::memory_order_relaxed) != handle.version)
+    return nullptr;
+  auto instance = slot.instance.load(std::memory_order_relaxed);
+  if (!instance)
     return nullptr;
 
-  return entry.instance;
+  // Bumping the version first expires the handles before the slot is empty
+  slot.version.store(handle.version + 1, std::memory_order_release);
+  slot.instance.store(nullptr, std::memory_order_release);
+  slot.nextFree = _firstFree;
+  _firstFree = handle.index;
+  return instance;
 }
@@ -0,0 +1,85 @@
+#include "FileSystem/peBufferedFile.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+pe::peBufferedFileWriter::peBufferedFileWriter(const std::string &path,
+                                               size_t bufferSize)
+    : _file(nullptr), _bufferFill(0), _position(0) {
+  if (fopen_s(&_file, path.c_str(), "wb") != 0 || !_file)
+    throw std::runtime_error{"Could not open file " + path + " for writing!"};
+  // We do our own buffering, no need to copy everything twice
+  setvbuf(_file, nullptr, _IONBF, 0);
+  _buffer.resize(bufferSize);
+}
+
+pe::peBufferedFileWriter::~peBufferedFileWriter() {
+  if (!_file)
+    return;
+  try {
+    Close();
+  } catch (...) {
+    // Destructors must not throw, call Close() explicitly to see errors
+  }
+}
+
+void pe::peBufferedFileWriter::Write(const void *data, size_t size) {
+  auto src = static_cast<const char *>(data);
+  _position += size;
+
+  if (size >= _buffer.size()) {
+    // Big writes bypass the buffer
+    Flush();
+    if (fwrite(src, 1, size, _file) != size)
+      throw std::runtime_error{"Writing to file failed!"};
+    return;
+  }
+
+  while (size > 0) {
+    const auto chunk = std::min(size, _buffer.size() - _bufferFill);
+    std::memcpy(_buffer.data() + _bufferFill, src, chunk);
+    _bufferFill += chunk;
+    src += chunk;
+    size -= chunk;
+    if (_bufferFill == _buffer.size())
+      Flush();
+  }
+}
+
+void pe::peBufferedFileWriter::WriteAt(uint64_t position, const void *data,
+                                       size_t size) {
+  if (position + size > _position)
+    throw std::runtime_error{"WriteAt can only overwrite written data!"};
+  Flush();
+  if (_fseeki64(_file, static_cast<int64_t>(position), SEEK_SET) != 0 ||
+      fwrite(data, 1, size, _file) != size ||
+      _fseeki64(_file, 0, SEEK_END) != 0)
+    throw std::runtime_error{"Writing to file failed!"};
+}
+
+void pe::peBufferedFileWriter::Flush() {
+  if (!_bufferFill)
+    return;
+  const auto written = fwrite(_buffer.data(), 1, _bufferFill, _file);
+  const auto expected = _bufferFill;
+  _bufferFill = 0;
+  if (written != expected)
+    throw std::runtime_error{"Writing to file failed!"};
+}
+
+void pe::peBufferedFileWriter::Close() {
+  if (!_file)
+    return;
+  auto file = _file;
+  try {
+    Flush();
+  } catch (...) {
+    _file = nullptr;
+    fclose(file);
+    throw;
+  }
+  _file = nullptr;
+  if (fclose(file) != 0)
+    throw std::runtime_error{"Closing file failed!"};
+}
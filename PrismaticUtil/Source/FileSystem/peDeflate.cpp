@@ -0,0 +1,534 @@
+#include "FileSystem/peDeflate.h"
+#include "FileSystem/lodepng.h"
+
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+
+namespace {
+constexpr size_t WindowSize = 32768;
+constexpr size_t WindowMask = WindowSize - 1;
+constexpr uint32_t HashBits = 15;
+constexpr uint32_t HashSize = 1u << HashBits;
+constexpr size_t MinMatch = 3;
+constexpr size_t MaxMatch = 258;
+constexpr size_t NiceMatch = 64;
+constexpr uint32_t MaxChainLength = 32;
+constexpr size_t NoPosition = ~size_t(0);
+
+constexpr size_t SymbolsPerBlock = 16384;
+constexpr size_t MaxStoredBlockSize = 65535;
+constexpr uint32_t EndOfBlock = 256;
+constexpr uint32_t NumLitLenCodes = 286;
+constexpr uint32_t NumDistCodes = 30;
+constexpr uint32_t NumCodeLengthCodes = 19;
+
+const uint16_t LengthBase[29] = {3,  4,  5,  6,   7,   8,   9,   10,  11, 13,
+                                 15, 17, 19, 23,  27,  31,  35,  43,  51, 59,
+                                 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t LengthExtraBits[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                     1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                     4, 4, 4, 4, 5, 5, 5, 5, 0};
+const uint16_t DistanceBase[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+const uint8_t DistanceExtraBits[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                       4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                       9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+const uint8_t CodeLengthOrder[NumCodeLengthCodes] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+//! \brief Literal (dist == 0) or length/distance pair
+struct Symbol {
+  uint16_t litLen;
+  uint16_t dist;
+};
+
+//! \brief Code length symbol with the value of its extra bits
+struct CodeLengthSymbol {
+  uint8_t symbol;
+  uint8_t extra;
+};
+
+uint32_t LengthCode(size_t length) {
+  return static_cast<uint32_t>(
+      std::upper_bound(std::begin(LengthBase), std::end(LengthBase), length) -
+      std::begin(LengthBase) - 1);
+}
+
+uint32_t DistanceCode(size_t distance) {
+  return static_cast<uint32_t>(std::upper_bound(std::begin(DistanceBase),
+                                                std::end(DistanceBase),
+                                                distance) -
+                               std::begin(DistanceBase) - 1);
+}
+
+//! \brief Writes bits in the LSB-first order that deflate uses
+class BitWriter {
+public:
+  explicit BitWriter(std::vector<unsigned char> &out)
+      : _out(out), _bits(0), _count(0) {}
+
+  void Write(uint32_t value, uint32_t numBits) {
+    _bits |= static_cast<uint64_t>(value) << _count;
+    _count += numBits;
+    while (_count >= 8) {
+      _out.push_back(static_cast<unsigned char>(_bits));
+      _bits >>= 8;
+      _count -= 8;
+    }
+  }
+
+  void AlignToByte() {
+    if (_count)
+      _out.push_back(static_cast<unsigned char>(_bits));
+    _bits = 0;
+    _count = 0;
+  }
+
+  //! \brief Appends whole bytes. The writer has to be aligned to a byte
+  void WriteBytes(const unsigned char *data, size_t size) {
+    _out.insert(_out.end(), data, data + size);
+  }
+
+private:
+  std::vector<unsigned char> &_out;
+  uint64_t _bits;
+  uint32_t _count;
+};
+
+//! \brief Computes the canonical huffman codes for the given code lengths. The
+//! codes are bit-reversed so that they can be written LSB-first
+void BuildCodes(const unsigned *lengths, size_t numCodes, uint16_t *codes) {
+  uint32_t lengthCounts[16] = {};
+  for (size_t idx = 0; idx < numCodes; ++idx)
+    ++lengthCounts[lengths[idx]];
+  lengthCounts[0] = 0;
+
+  uint32_t nextCode[16] = {};
+  uint32_t code = 0;
+  for (uint32_t bits = 1; bits < 16; ++bits) {
+    code = (code + lengthCounts[bits - 1]) << 1;
+    nextCode[bits] = code;
+  }
+
+  for (size_t idx = 0; idx < numCodes; ++idx) {
+    const auto length = lengths[idx];
+    if (!length)
+      continue;
+    auto value = nextCode[length]++;
+    uint32_t reversed = 0;
+    for (uint32_t bit = 0; bit < length; ++bit) {
+      reversed = (reversed << 1) | (value & 1);
+      value >>= 1;
+    }
+    codes[idx] = static_cast<uint16_t>(reversed);
+  }
+}
+
+void ComputeCodeLengths(unsigned *lengths, const unsigned *frequencies,
+                        size_t numCodes, unsigned maxBits) {
+  if (lodepng_huffman_code_lengths(lengths, frequencies, numCodes, maxBits))
+    throw std::runtime_error{"Could not build huffman code!"};
+}
+
+//! \brief LZ77 matcher with hash chains over a 32KiB window
+class Matcher {
+public:
+  Matcher(const unsigned char *data, size_t end)
+      : _data(data), _end(end), _head(HashSize, NoPosition),
+        _prev(WindowSize, NoPosition) {}
+
+  void Insert(size_t pos) {
+    if (pos + MinMatch > _end)
+      return;
+    const auto hash = Hash(pos);
+    _prev[pos & WindowMask] = _head[hash];
+    _head[hash] = pos;
+  }
+
+  //! \brief Returns the length of the longest match for pos, or 0 if there is
+  //! none. Pos must not be inserted yet
+  size_t LongestMatch(size_t pos, size_t &distance) const {
+    const auto limit = std::min(MaxMatch, _end - pos);
+    if (limit < MinMatch)
+      return 0;
+
+    auto best = MinMatch - 1;
+    auto candidate = _head[Hash(pos)];
+    for (uint32_t chain = 0;
+         chain < MaxChainLength && candidate != NoPosition &&
+         pos - candidate <= WindowSize;
+         ++chain) {
+      // Cheap reject, a better match has to differ from the best one at its end
+      if (_data[candidate + best] == _data[pos + best]) {
+        size_t length = 0;
+        while (length < limit &&
+               _data[candidate + length] == _data[pos + length])
+          ++length;
+        if (length > best) {
+          best = length;
+          distance = pos - candidate;
+          if (length >= NiceMatch || length == limit)
+            break;
+        }
+      }
+
+      const auto next = _prev[candidate & WindowMask];
+      if (next == NoPosition || next >= candidate)
+        break;
+      candidate = next;
+    }
+    return best >= MinMatch ? best : 0;
+  }
+
+private:
+  uint32_t Hash(size_t pos) const {
+    const auto value = static_cast<uint32_t>(_data[pos]) |
+                       (static_cast<uint32_t>(_data[pos + 1]) << 8) |
+                       (static_cast<uint32_t>(_data[pos + 2]) << 16);
+    return (value * 2654435761u) >> (32 - HashBits);
+  }
+
+  const unsigned char *_data;
+  const size_t _end;
+  std::vector<size_t> _head;
+  std::vector<size_t> _prev;
+};
+
+void FindSymbols(const unsigned char *data, size_t dictionaryStart,
+                 size_t start, size_t end, std::vector<Symbol> &symbols) {
+  Matcher matcher{data, end};
+  for (auto pos = dictionaryStart; pos < start; ++pos)
+    matcher.Insert(pos);
+
+  auto pos = start;
+  while (pos < end) {
+    size_t distance = 0;
+    const auto length = matcher.LongestMatch(pos, distance);
+    matcher.Insert(pos);
+
+    if (!length) {
+      symbols.push_back({data[pos], 0});
+      ++pos;
+      continue;
+    }
+
+    // Lazy matching: Emit a literal if the next position has a longer match
+    if (length < NiceMatch && pos + 1 < end) {
+      size_t nextDistance = 0;
+      if (matcher.LongestMatch(pos + 1, nextDistance) > length) {
+        symbols.push_back({data[pos], 0});
+        ++pos;
+        continue;
+      }
+    }
+
+    symbols.push_back(
+        {static_cast<uint16_t>(length), static_cast<uint16_t>(distance)});
+    for (size_t idx = 1; idx < length; ++idx)
+      matcher.Insert(pos + idx);
+    pos += length;
+  }
+}
+
+//! \brief Run-length encodes the code lengths of the literal/length and
+//! distance codes
+void EncodeCodeLengths(const unsigned *lengths, size_t count,
+                       std::vector<CodeLengthSymbol> &result) {
+  size_t idx = 0;
+  while (idx < count) {
+    const auto value = lengths[idx];
+    size_t run = 1;
+    while (idx + run < count && lengths[idx + run] == value)
+      ++run;
+
+    if (value == 0 && run >= 3) {
+      auto remaining = run;
+      while (remaining >= 11) {
+        const auto chunk = std::min<size_t>(remaining, 138);
+        result.push_back({18, static_cast<uint8_t>(chunk - 11)});
+        remaining -= chunk;
+      }
+      if (remaining >= 3) {
+        result.push_back({17, static_cast<uint8_t>(remaining - 3)});
+        remaining = 0;
+      }
+      for (; remaining > 0; --remaining)
+        result.push_back({0, 0});
+    } else if (value != 0 && run >= 4) {
+      result.push_back({static_cast<uint8_t>(value), 0});
+      auto remaining = run - 1;
+      while (remaining >= 3) {
+        const auto chunk = std::min<size_t>(remaining, 6);
+        result.push_back({16, static_cast<uint8_t>(chunk - 3)});
+        remaining -= chunk;
+      }
+      for (; remaining > 0; --remaining)
+        result.push_back({static_cast<uint8_t>(value), 0});
+    } else {
+      for (size_t rep = 0; rep < run; ++rep)
+        result.push_back({static_cast<uint8_t>(value), 0});
+    }
+    idx += run;
+  }
+}
+
+//! \brief Huffman codes of a dynamic block
+struct DynamicBlock {
+  unsigned litLenLengths[NumLitLenCodes];
+  unsigned distLengths[NumDistCodes];
+  uint16_t litLenCodes[NumLitLenCodes];
+  uint16_t distCodes[NumDistCodes];
+  unsigned codeLengthLengths[NumCodeLengthCodes];
+  uint16_t codeLengthCodes[NumCodeLengthCodes];
+  std::vector<CodeLengthSymbol> codeLengthSymbols;
+  uint32_t numLitLen;
+  uint32_t numDist;
+  uint32_t numCodeLength;
+  //! \brief Size of the whole block in bits, including its header
+  size_t numBits;
+};
+
+//! \brief Builds the huffman codes for a block of the given symbols and
+//! computes its size, without writing anything yet
+void BuildDynamicBlock(const Symbol *symbols, size_t numSymbols,
+                       DynamicBlock &block) {
+  unsigned litLenFrequencies[NumLitLenCodes] = {};
+  unsigned distFrequencies[NumDistCodes] = {};
+  for (size_t idx = 0; idx < numSymbols; ++idx) {
+    auto &symbol = symbols[idx];
+    if (!symbol.dist) {
+      ++litLenFrequencies[symbol.litLen];
+    } else {
+      ++litLenFrequencies[257 + LengthCode(symbol.litLen)];
+      ++distFrequencies[DistanceCode(symbol.dist)];
+    }
+  }
+  litLenFrequencies[EndOfBlock] = 1;
+
+  ComputeCodeLengths(block.litLenLengths, litLenFrequencies, NumLitLenCodes,
+                     15);
+  ComputeCodeLengths(block.distLengths, distFrequencies, NumDistCodes, 15);
+  std::fill(std::begin(block.litLenCodes), std::end(block.litLenCodes), 0);
+  std::fill(std::begin(block.distCodes), std::end(block.distCodes), 0);
+  BuildCodes(block.litLenLengths, NumLitLenCodes, block.litLenCodes);
+  BuildCodes(block.distLengths, NumDistCodes, block.distCodes);
+
+  block.numLitLen = NumLitLenCodes;
+  while (block.numLitLen > 257 && !block.litLenLengths[block.numLitLen - 1])
+    --block.numLitLen;
+  block.numDist = NumDistCodes;
+  while (block.numDist > 1 && !block.distLengths[block.numDist - 1])
+    --block.numDist;
+
+  // Both code length sequences are encoded together, so runs may cross from
+  // the literal/length codes into the distance codes
+  unsigned lengths[NumLitLenCodes + NumDistCodes];
+  std::copy(block.litLenLengths, block.litLenLengths + block.numLitLen,
+            lengths);
+  std::copy(block.distLengths, block.distLengths + block.numDist,
+            lengths + block.numLitLen);
+  block.codeLengthSymbols.clear();
+  EncodeCodeLengths(lengths, block.numLitLen + block.numDist,
+                    block.codeLengthSymbols);
+
+  unsigned codeLengthFrequencies[NumCodeLengthCodes] = {};
+  for (auto &symbol : block.codeLengthSymbols)
+    ++codeLengthFrequencies[symbol.symbol];
+  ComputeCodeLengths(block.codeLengthLengths, codeLengthFrequencies,
+                     NumCodeLengthCodes, 7);
+  std::fill(std::begin(block.codeLengthCodes),
+            std::end(block.codeLengthCodes), 0);
+  BuildCodes(block.codeLengthLengths, NumCodeLengthCodes,
+             block.codeLengthCodes);
+
+  block.numCodeLength = NumCodeLengthCodes;
+  while (block.numCodeLength > 4 &&
+         !block.codeLengthLengths[CodeLengthOrder[block.numCodeLength - 1]])
+    --block.numCodeLength;
+
+  // Header and code lengths
+  auto numBits = size_t{3 + 5 + 5 + 4} + 3 * block.numCodeLength;
+  for (auto &symbol : block.codeLengthSymbols) {
+    numBits += block.codeLengthLengths[symbol.symbol];
+    numBits += symbol.symbol == 16 ? 2
+               : symbol.symbol == 17 ? 3
+               : symbol.symbol == 18 ? 7
+                                     : 0;
+  }
+  // Symbols, including the end of block
+  for (uint32_t code = 0; code < NumLitLenCodes; ++code) {
+    auto bits = block.litLenLengths[code];
+    if (code > EndOfBlock)
+      bits += LengthExtraBits[code - 257];
+    numBits += static_cast<size_t>(litLenFrequencies[code]) * bits;
+  }
+  for (uint32_t code = 0; code < NumDistCodes; ++code) {
+    numBits += static_cast<size_t>(distFrequencies[code]) *
+               (block.distLengths[code] + DistanceExtraBits[code]);
+  }
+  block.numBits = numBits;
+}
+
+//! \brief Writes a non-final block with dynamic huffman codes
+void WriteDynamicBlock(BitWriter &writer, const DynamicBlock &block,
+                       const Symbol *symbols, size_t numSymbols) {
+  // Block header: not final, dynamic huffman codes
+  writer.Write(0, 1);
+  writer.Write(2, 2);
+  writer.Write(block.numLitLen - 257, 5);
+  writer.Write(block.numDist - 1, 5);
+  writer.Write(block.numCodeLength - 4, 4);
+  for (uint32_t idx = 0; idx < block.numCodeLength; ++idx)
+    writer.Write(block.codeLengthLengths[CodeLengthOrder[idx]], 3);
+
+  for (auto &symbol : block.codeLengthSymbols) {
+    writer.Write(block.codeLengthCodes[symbol.symbol],
+                 block.codeLengthLengths[symbol.symbol]);
+    if (symbol.symbol == 16)
+      writer.Write(symbol.extra, 2);
+    else if (symbol.symbol == 17)
+      writer.Write(symbol.extra, 3);
+    else if (symbol.symbol == 18)
+      writer.Write(symbol.extra, 7);
+  }
+
+  auto &litLenCodes = block.litLenCodes;
+  auto &litLenLengths = block.litLenLengths;
+  for (size_t idx = 0; idx < numSymbols; ++idx) {
+    auto &symbol = symbols[idx];
+    if (!symbol.dist) {
+      writer.Write(litLenCodes[symbol.litLen], litLenLengths[symbol.litLen]);
+      continue;
+    }
+    const auto lengthCode = LengthCode(symbol.litLen);
+    writer.Write(litLenCodes[257 + lengthCode],
+                 litLenLengths[257 + lengthCode]);
+    writer.Write(symbol.litLen - LengthBase[lengthCode],
+                 LengthExtraBits[lengthCode]);
+    const auto distCode = DistanceCode(symbol.dist);
+    writer.Write(block.distCodes[distCode], block.distLengths[distCode]);
+    writer.Write(symbol.dist - DistanceBase[distCode],
+                 DistanceExtraBits[distCode]);
+  }
+
+  writer.Write(litLenCodes[EndOfBlock], litLenLengths[EndOfBlock]);
+}
+
+//! \brief Upper bound of the size in bits of the stored blocks that hold the
+//! given number of bytes. Each block pads its header to a byte boundary
+size_t StoredBlocksBits(size_t size) {
+  const auto numBlocks =
+      std::max<size_t>(1, (size + MaxStoredBlockSize - 1) / MaxStoredBlockSize);
+  return numBlocks * (3 + 7 + 32) + 8 * size;
+}
+
+//! \brief Writes the data uncompressed in non-final stored blocks
+void WriteStoredBlocks(BitWriter &writer, const unsigned char *data,
+                       size_t size) {
+  do {
+    const auto blockSize = std::min(size, MaxStoredBlockSize);
+    // Block header: not final, stored
+    writer.Write(0, 3);
+    writer.AlignToByte();
+    const auto length = static_cast<uint16_t>(blockSize);
+    const auto inverted = static_cast<uint16_t>(~length);
+    const unsigned char lengths[] = {
+        static_cast<unsigned char>(length),
+        static_cast<unsigned char>(length >> 8),
+        static_cast<unsigned char>(inverted),
+        static_cast<unsigned char>(inverted >> 8)};
+    writer.WriteBytes(lengths, sizeof(lengths));
+    writer.WriteBytes(data, blockSize);
+    data += blockSize;
+    size -= blockSize;
+  } while (size > 0);
+}
+} // namespace
+
+void pe::deflate::CompressStrip(const unsigned char *data,
+                                size_t dictionaryStart, size_t start,
+                                size_t end, std::vector<unsigned char> &out) {
+  if (dictionaryStart > start || start - dictionaryStart > WindowSize ||
+      start > end)
+    throw std::runtime_error{"Invalid strip range!"};
+
+  std::vector<Symbol> symbols;
+  symbols.reserve(end - start);
+  FindSymbols(data, dictionaryStart, start, end, symbols);
+
+  BitWriter writer{out};
+  DynamicBlock block;
+  auto blockStart = start;
+  for (size_t first = 0; first < symbols.size(); first += SymbolsPerBlock) {
+    const auto count = std::min(SymbolsPerBlock, symbols.size() - first);
+    size_t blockSize = 0;
+    for (size_t idx = first; idx < first + count; ++idx)
+      blockSize += symbols[idx].dist ? symbols[idx].litLen : 1;
+
+    // Data without structure, e.g. noise, only grows with huffman codes. Later
+    // blocks may still reference stored data
+    BuildDynamicBlock(symbols.data() + first, count, block);
+    if (StoredBlocksBits(blockSize) < block.numBits)
+      WriteStoredBlocks(writer, data + blockStart, blockSize);
+    else
+      WriteDynamicBlock(writer, block, symbols.data() + first, count);
+    blockStart += blockSize;
+  }
+
+  // Empty stored block, aligns the output to a byte boundary
+  writer.Write(0, 3);
+  writer.AlignToByte();
+  const unsigned char storedLength[] = {0x00, 0x00, 0xFF, 0xFF};
+  out.insert(out.end(), std::begin(storedLength), std::end(storedLength));
+}
+
+void pe::deflate::FinishStream(std::vector<unsigned char> &out) {
+  // Final block with fixed huffman codes that only holds the end-of-block code
+  out.push_back(0x03);
+  out.push_back(0x00);
+}
+
+uint32_t pe::deflate::Adler32(const unsigned char *data, size_t size,
+                              uint32_t adler) {
+  constexpr uint32_t Base = 65521;
+  // Largest n such that 255n(n+1)/2 + (n+1)(Base-1) fits into 32 bits
+  constexpr size_t MaxRun = 5552;
+
+  uint32_t s1 = adler & 0xFFFF;
+  uint32_t s2 = adler >> 16;
+  while (size > 0) {
+    const auto run = std::min(size, MaxRun);
+    for (size_t idx = 0; idx < run; ++idx) {
+      s1 += data[idx];
+      s2 += s1;
+    }
+    s1 %= Base;
+    s2 %= Base;
+    data += run;
+    size -= run;
+  }
+  return (s2 << 16) | s1;
+}
+
+uint32_t pe::deflate::CombineAdler32(uint32_t adler1, uint32_t adler2,
+                                     size_t size2) {
+  constexpr uint32_t Base = 65521;
+  const auto remainder = static_cast<uint32_t>(size2 % Base);
+  uint32_t sum1 = adler1 & 0xFFFF;
+  uint32_t sum2 = static_cast<uint32_t>(
+      (static_cast<uint64_t>(remainder) * sum1) % Base);
+  sum1 += (adler2 & 0xFFFF) + Base - 1;
+  sum2 += (adler1 >> 16) + (adler2 >> 16) + Base - remainder;
+  if (sum1 >= Base)
+    sum1 -= Base;
+  if (sum1 >= Base)
+    sum1 -= Base;
+  if (sum2 >= (Base << 1))
+    sum2 -= (Base << 1);
+  if (sum2 >= Base)
+    sum2 -= Base;
+  return sum1 | (sum2 << 16);
+}
@@ -3,10 +3,95 @@
 #include "Memory/peMemoryUtil.h"
 
 #include "FileSystem/lodepng.h"
+#include "FileSystem/peDeflate.h"
+#include "Threading/peParallel.h"
 #include "Windows.h"
 
+#include <cstring>
+
 EXTERN_C IMAGE_DOS_HEADER __ImageBase;
 
+namespace {
+//! \brief Size of the strips that are compressed in parallel. Large enough that
+//! losing the matches across strip borders costs almost nothing
+constexpr size_t PNGStripSize = 256 * 1024;
+//! \brief Back-references may reach 32KiB into the previous strip
+constexpr size_t DeflateWindowSize = 32 * 1024;
+
+//! \brief Replacement for the zlib compression of lodepng that compresses
+//! strips of the filtered image data in parallel and concatenates them
+unsigned ParallelZlibCompress(unsigned char **out, size_t *outsize,
+                              const unsigned char *in, size_t insize,
+                              const LodePNGCompressSettings *settings) {
+  auto &taskSystem = *static_cast<pe::peTaskSystem *>(
+      const_cast<void *>(settings->custom_context));
+
+  const auto numStrips =
+      std::max<size_t>(1, (insize + PNGStripSize - 1) / PNGStripSize);
+
+  struct StripResult {
+    std::vector<unsigned char> compressed;
+    uint32_t adler;
+    bool failed = false;
+  };
+  std::vector<StripResult> strips;
+  strips.resize(numStrips);
+
+  // The calling thread helps with the compression instead of just blocking,
+  // this might very well be called from a task of the same task system
+  pe::ParallelFor(taskSystem, 0, numStrips, 1, [&](size_t idx) {
+    const auto start = idx * PNGStripSize;
+    const auto end = std::min(insize, start + PNGStripSize);
+    const auto dictionaryStart =
+        start > DeflateWindowSize ? start - DeflateWindowSize : 0;
+    auto &strip = strips[idx];
+    try {
+      strip.compressed.reserve((end - start) / 2);
+      pe::deflate::CompressStrip(in, dictionaryStart, start, end,
+                                 strip.compressed);
+      strip.adler = pe::deflate::Adler32(in + start, end - start);
+    } catch (...) {
+      strip.failed = true;
+    }
+  });
+
+  std::vector<unsigned char> result;
+  size_t totalSize = 2 + 2 + 4;
+  for (auto &strip : strips) {
+    if (strip.failed)
+      return 83;
+    totalSize += strip.compressed.size();
+  }
+  result.reserve(totalSize);
+
+  // zlib header: deflate with 32KiB window, default compression level
+  result.push_back(0x78);
+  result.push_back(0x9C);
+
+  uint32_t adler = 1;
+  for (size_t idx = 0; idx < numStrips; ++idx) {
+    auto &strip = strips[idx];
+    result.insert(result.end(), strip.compressed.begin(),
+                  strip.compressed.end());
+    const auto stripSize =
+        std::min(insize, (idx + 1) * PNGStripSize) - idx * PNGStripSize;
+    adler = pe::deflate::CombineAdler32(adler, strip.adler, stripSize);
+  }
+  pe::deflate::FinishStream(result);
+
+  for (auto shift : {24, 16, 8, 0})
+    result.push_back(static_cast<unsigned char>(adler >> shift));
+
+  // lodepng frees the buffer with free()
+  *out = static_cast<unsigned char *>(malloc(result.size()));
+  if (!*out)
+    return 83;
+  std::memcpy(*out, result.data(), result.size());
+  *outsize = result.size();
+  return 0;
+}
+} // namespace
+
 namespace pe {
 namespace file {
 std::string GetModulePath() {
@@ -37,4 +122,39 @@ void DumpPNG(const peVector<RGBA_8Bit> &pixels, const uint32_t width,
   if (!err)
     lodepng::save_file(out, path);
 }
+
+void DumpPNG(const peVector<RGBA_8Bit> &pixels, const uint32_t width,
+             const uint32_t height, const std::string &path,
+             peTaskSystem &taskSystem) {
+  lodepng::State state;
+  state.encoder.zlibsettings.custom_zlib = &ParallelZlibCompress;
+  state.encoder.zlibsettings.custom_context = &taskSystem;
+
+  std::vector<unsigned char> out;
+  auto err = lodepng::encode(
+      out, reinterpret_cast<const unsigned char *>(pixels.data()), width,
+      height, state);
+  if (err)
+    throw std::runtime_error{std::string{"PNG encoding failed: "} +
+                             lodepng_error_text(err)};
+  if (lodepng::save_file(out, path))
+    throw std::runtime_error{"Could not write " + path};
+}
+
+std::future<void> DumpPNGAsync(peVector<RGBA_8Bit> pixels,
+                               const uint32_t width, const uint32_t height,
+                               std::string path, peTaskSystem &taskSystem) {
+  auto promise = std::make_shared<std::promise<void>>();
+  auto future = promise->get_future();
+  auto image = std::make_shared<peVector<RGBA_8Bit>>(std::move(pixels));
+  taskSystem.AddTask([=, &taskSystem]() {
+    try {
+      DumpPNG(*image, width, height, path, taskSystem);
+      promise->set_value();
+    } catch (...) {
+      promise->set_exception(std::current_exception());
+    }
+  });
+  return future;
+}
 } // namespace pe
@@ -0,0 +1,254 @@
+#include "FileSystem/peHDRImageWriter.h"
+#include "FileSystem/lodepng.h"
+#include "Type/peHalf.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#pragma region peHDRImageWriter
+
+pe::peHDRImageWriter::peHDRImageWriter(const std::string &path, uint32_t width,
+                                       uint32_t height)
+    : _file(path), _width(width), _height(height), _rowsWritten(0),
+      _finished(false) {
+  if (!width || !height)
+    throw std::runtime_error{"Image must not be empty!"};
+}
+
+void pe::peHDRImageWriter::WriteRows(gsl::span<const RGB_32BitFloat> rows) {
+  if (rows.size() % _width)
+    throw std::runtime_error{"Only complete rows can be written!"};
+  const auto numRows = static_cast<uint32_t>(rows.size() / _width);
+  if (_rowsWritten + numRows > _height)
+    throw std::runtime_error{"Too many rows for the image!"};
+
+  for (uint32_t idx = 0; idx < numRows; ++idx) {
+    WriteRow(_rowsWritten++, rows.subspan(static_cast<std::ptrdiff_t>(idx) *
+                                              _width,
+                                          _width));
+  }
+}
+
+void pe::peHDRImageWriter::Finish() {
+  if (_finished)
+    return;
+  if (_rowsWritten != _height)
+    throw std::runtime_error{"Not all rows of the image were written!"};
+  FinishImage();
+  _file.Close();
+  _finished = true;
+}
+
+#pragma endregion
+
+#pragma region pePFMWriter
+
+pe::pePFMWriter::pePFMWriter(const std::string &path, uint32_t width,
+                             uint32_t height)
+    : peHDRImageWriter(path, width, height) {
+  static_assert(sizeof(RGB_32BitFloat) == 3 * sizeof(float),
+                "RGB_32BitFloat must be tightly packed!");
+  char header[64];
+  // Negative scale denotes little-endian data
+  const auto length =
+      snprintf(header, sizeof(header), "PF\n%u %u\n-1.0\n", width, height);
+  _file.Write(header, static_cast<size_t>(length));
+}
+
+void pe::pePFMWriter::WriteRow(uint32_t row,
+                               gsl::span<const RGB_32BitFloat> pixels) {
+  // PFM stores the rows bottom-to-top, just like we get them
+  _file.Write(pixels.data(), pixels.size() * sizeof(RGB_32BitFloat));
+}
+
+void pe::pePFMWriter::FinishImage() {}
+
+#pragma endregion
+
+#pragma region peEXRWriter
+
+namespace {
+constexpr uint32_t EXRMagic = 20000630;
+constexpr uint32_t EXRVersion = 2;
+
+//! \brief Attribute values as defined by the OpenEXR file layout
+constexpr uint8_t EXRCompressionNone = 0;
+constexpr uint8_t EXRCompressionZip = 3;
+constexpr uint8_t EXRLineOrderDecreasingY = 1;
+constexpr int32_t EXRPixelTypeHalf = 1;
+constexpr int32_t EXRPixelTypeFloat = 2;
+
+void WriteAttribute(pe::peBufferedFileWriter &file, const char *name,
+                    const char *type, const void *value, uint32_t size) {
+  file.Write(name, std::strlen(name) + 1);
+  file.Write(type, std::strlen(type) + 1);
+  file.WriteValue(size);
+  file.Write(value, size);
+}
+
+//! \brief Prepares data for zlib compression like the OpenEXR library does:
+//! Splits the bytes into two halves and stores the differences between
+//! successive bytes, which makes floating point data much more compressible
+void ReorderAndPredict(const unsigned char *src, unsigned char *dst,
+                       size_t size) {
+  auto t1 = dst;
+  auto t2 = dst + (size + 1) / 2;
+  for (size_t idx = 0; idx < size; idx += 2) {
+    *t1++ = src[idx];
+    if (idx + 1 < size)
+      *t2++ = src[idx + 1];
+  }
+
+  int prev = dst[0];
+  for (size_t idx = 1; idx < size; ++idx) {
+    const int cur = dst[idx];
+    dst[idx] = static_cast<unsigned char>(cur - prev + (128 + 256));
+    prev = cur;
+  }
+}
+} // namespace
+
+pe::peEXRWriter::peEXRWriter(const std::string &path, uint32_t width,
+                             uint32_t height, EXRCompression compression,
+                             EXRPixelType pixelType)
+    : peHDRImageWriter(path, width, height), _compression(compression),
+      _pixelType(pixelType),
+      _linesPerChunk(compression == EXRCompression::Zip ? 16 : 1),
+      _bytesPerLine(static_cast<size_t>(width) * 3 *
+                    (pixelType == EXRPixelType::Half ? 2 : 4)),
+      _offsetTablePosition(0) {
+  const auto numChunks = (height + _linesPerChunk - 1) / _linesPerChunk;
+  _chunkOffsets.resize(numChunks, 0);
+  _chunkData.resize(_bytesPerLine * _linesPerChunk);
+  if (_compression == EXRCompression::Zip)
+    _reordered.resize(_chunkData.size());
+
+  // EXR counts scanlines from the top, but we receive the bottom row first, so
+  // we start with the last chunk
+  _currentChunk = numChunks - 1;
+  _linesInCurrentChunk = 0;
+
+  WriteHeader();
+}
+
+void pe::peEXRWriter::WriteHeader() {
+  _file.WriteValue(EXRMagic);
+  _file.WriteValue(EXRVersion);
+
+  // Channels have to be sorted alphabetically
+  {
+    peVector<unsigned char> channels;
+    const int32_t pixelType = _pixelType == EXRPixelType::Half
+                                  ? EXRPixelTypeHalf
+                                  : EXRPixelTypeFloat;
+    for (auto name : {'B', 'G', 'R'}) {
+      unsigned char entry[18] = {};
+      entry[0] = static_cast<unsigned char>(name);
+      std::memcpy(entry + 2, &pixelType, sizeof(pixelType));
+      const int32_t sampling = 1;
+      std::memcpy(entry + 10, &sampling, sizeof(sampling));
+      std::memcpy(entry + 14, &sampling, sizeof(sampling));
+      channels.insert(channels.end(), std::begin(entry), std::end(entry));
+    }
+    channels.push_back(0);
+    WriteAttribute(_file, "channels", "chlist", channels.data(),
+                   static_cast<uint32_t>(channels.size()));
+  }
+
+  const auto compression = _compression == EXRCompression::Zip
+                               ? EXRCompressionZip
+                               : EXRCompressionNone;
+  WriteAttribute(_file, "compression", "compression", &compression, 1);
+
+  const int32_t window[] = {0, 0, static_cast<int32_t>(_width) - 1,
+                            static_cast<int32_t>(_height) - 1};
+  WriteAttribute(_file, "dataWindow", "box2i", window, sizeof(window));
+  WriteAttribute(_file, "displayWindow", "box2i", window, sizeof(window));
+
+  // Chunks are written in the order in which the rows arrive
+  WriteAttribute(_file, "lineOrder", "lineOrder", &EXRLineOrderDecreasingY, 1);
+
+  const float pixelAspectRatio = 1.f;
+  WriteAttribute(_file, "pixelAspectRatio", "float", &pixelAspectRatio,
+                 sizeof(pixelAspectRatio));
+  const float screenWindowCenter[] = {0.f, 0.f};
+  WriteAttribute(_file, "screenWindowCenter", "v2f", screenWindowCenter,
+                 sizeof(screenWindowCenter));
+  const float screenWindowWidth = 1.f;
+  WriteAttribute(_file, "screenWindowWidth", "float", &screenWindowWidth,
+                 sizeof(screenWindowWidth));
+
+  const char endOfHeader = 0;
+  _file.WriteValue(endOfHeader);
+
+  // The chunk offsets are only known once the chunks are written, so we
+  // reserve the space for the table and fill it in at the end
+  _offsetTablePosition = _file.Position();
+  _file.Write(_chunkOffsets.data(), _chunkOffsets.size() * sizeof(uint64_t));
+}
+
+void pe::peEXRWriter::WriteRow(uint32_t row,
+                               gsl::span<const RGB_32BitFloat> pixels) {
+  const auto exrLine = _height - 1 - row;
+  const auto lineInChunk = exrLine - _currentChunk * _linesPerChunk;
+  auto dst = _chunkData.data() + lineInChunk * _bytesPerLine;
+
+  // Scanlines store all values of one channel after another, ordered like the
+  // channel list
+  const auto channelStride = _bytesPerLine / 3;
+  for (size_t channel = 0; channel < 3; ++channel) {
+    auto channelDst = dst + channel * channelStride;
+    const auto srcChannel = 2 - channel; // B, G, R
+    if (_pixelType == EXRPixelType::Half) {
+      for (uint32_t x = 0; x < _width; ++x) {
+        const auto half = FloatToHalf(pixels[x][srcChannel]);
+        std::memcpy(channelDst + x * sizeof(half), &half, sizeof(half));
+      }
+    } else {
+      for (uint32_t x = 0; x < _width; ++x) {
+        const auto val = pixels[x][srcChannel];
+        std::memcpy(channelDst + x * sizeof(val), &val, sizeof(val));
+      }
+    }
+  }
+
+  ++_linesInCurrentChunk;
+  const auto linesInChunk =
+      std::min(_linesPerChunk, _height - _currentChunk * _linesPerChunk);
+  if (_linesInCurrentChunk == linesInChunk)
+    FlushChunk();
+}
+
+void pe::peEXRWriter::FlushChunk() {
+  const auto rawSize = _linesInCurrentChunk * _bytesPerLine;
+  const unsigned char *data = _chunkData.data();
+  auto dataSize = rawSize;
+
+  if (_compression == EXRCompression::Zip) {
+    ReorderAndPredict(_chunkData.data(), _reordered.data(), rawSize);
+    _compressed.clear();
+    const auto err = lodepng::compress(_compressed, _reordered.data(), rawSize);
+    // Chunks that don't get smaller are stored uncompressed, readers detect
+    // this by the size of the chunk
+    if (!err && _compressed.size() < rawSize) {
+      data = _compressed.data();
+      dataSize = _compressed.size();
+    }
+  }
+
+  _chunkOffsets[_currentChunk] = _file.Position();
+  _file.WriteValue(static_cast<int32_t>(_currentChunk * _linesPerChunk));
+  _file.WriteValue(static_cast<int32_t>(dataSize));
+  _file.Write(data, dataSize);
+
+  _linesInCurrentChunk = 0;
+  if (_currentChunk > 0)
+    --_currentChunk;
+}
+
+void pe::peEXRWriter::FinishImage() {
+  _file.WriteAt(_offsetTablePosition, _chunkOffsets.data(),
+                _chunkOffsets.size() * sizeof(uint64_t));
+}
+
+#pragma endregion
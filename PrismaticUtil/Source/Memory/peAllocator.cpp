@@ -3,6 +3,7 @@
 #include "Memory\NewDelete.inl"
 #include "Memory\peLeakDetection.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <iostream>
 #include <sstream>
@@ -11,6 +12,56 @@
 
 namespace pe {
 
+namespace {
+//! \brief Sits in front of every block of the malloc-based allocators, so that
+//! blocks of any alignment are freed the same way
+struct BlockHeader {
+  size_t numBytes;
+  //! \brief Distance from the start of the malloc'd memory to the block
+  size_t offset;
+};
+//! \brief Alignment of plain allocations, which is also what malloc provides
+constexpr size_t MinAlignment = 16;
+static_assert(sizeof(BlockHeader) <= MinAlignment,
+              "Header must fit into the padding of an aligned block");
+
+BlockHeader *HeaderOf(void *mem) {
+  return reinterpret_cast<BlockHeader *>(mem) - 1;
+}
+
+void *AlignedMalloc(size_t numBytes, size_t alignment) {
+  alignment = std::max(alignment, MinAlignment);
+  // malloc is aligned to MinAlignment, so the block starts at most
+  // 'alignment' bytes in, and there is always room for the header
+  auto mem = static_cast<char *>(std::malloc(numBytes + alignment));
+  if (!mem)
+    return nullptr;
+  auto block = reinterpret_cast<char *>(
+      (reinterpret_cast<uintptr_t>(mem) + MinAlignment + alignment - 1) &
+      ~(alignment - 1));
+  auto header = HeaderOf(block);
+  header->numBytes = numBytes;
+  header->offset = static_cast<size_t>(block - mem);
+  return block;
+}
+
+void AlignedFree(void *mem) {
+  std::free(static_cast<char *>(mem) - HeaderOf(mem)->offset);
+}
+
+//! \brief The physical memory doesn't change while the process runs, but
+//! querying it is a system call, and the statistics are polled frequently
+size_t PhysicalMemory() {
+  static const size_t s_physicalMemory = []() {
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    GlobalMemoryStatusEx(&status);
+    return static_cast<size_t>(status.ullTotalPhys);
+  }();
+  return s_physicalMemory;
+}
+} // namespace
+
 //------StdAllocator------
 
 peStdAllocator::peStdAllocator()
@@ -23,22 +74,28 @@ peStdAllocator::~peStdAllocator() {
   m_reservedMemory = 0;
 }
 
+size_t peStdAllocator::GetFreeMemory() const { return PhysicalMemory(); }
+
 peStdAllocator *peStdAllocator::GetInstance() {
   static peStdAllocator s_instance;
   return &s_instance;
 }
 
 void *peStdAllocator::Allocate(size_t numBytes) {
+  return Allocate(numBytes, MinAlignment);
+}
+
+void *peStdAllocator::Allocate(size_t numBytes, size_t alignment) {
   m_numAllocations++;
   m_reservedMemory += numBytes;
-  return std::malloc(numBytes);
+  return AlignedMalloc(numBytes, alignment);
 }
 
 void peStdAllocator::Free(void *mem) {
   if (mem != nullptr) {
-    m_reservedMemory -= _msize(mem);
+    m_reservedMemory -= HeaderOf(mem)->numBytes;
     m_numFrees++;
-    free(mem);
+    AlignedFree(mem);
   } else {
     PE_FAIL("Trying to free memory that is null!");
   }
@@ -65,8 +122,16 @@ peLeakDetectionAllocator::~peLeakDetectionAllocator() {
   m_reservedMemory = 0;
 }
 
+size_t peLeakDetectionAllocator::GetFreeMemory() const {
+  return PhysicalMemory();
+}
+
 void *peLeakDetectionAllocator::Allocate(size_t size) {
-  void *mem = malloc(size);
+  return Allocate(size, MinAlignment);
+}
+
+void *peLeakDetectionAllocator::Allocate(size_t size, size_t alignment) {
+  void *mem = AlignedMalloc(size, alignment);
   PE_ASSERT(mem != nullptr);
   TrackAllocation(size, mem);
   return mem;
@@ -75,7 +140,7 @@ void *peLeakDetectionAllocator::Allocate(size_t size) {
 void peLeakDetectionAllocator::Free(void *mem) {
   PE_ASSERT(mem != nullptr);
   TrackFree(mem);
-  free(mem);
+  AlignedFree(mem);
 }
 
 void peLeakDetectionAllocator::TrackAllocation(size_t size, void *mem) {
@@ -2,6 +2,8 @@
 #include "Algorithms/peAlgorithms.h"
 #include "Memory\peMemoryUtil.h"
 
+#include <algorithm>
+
 namespace pe {
 
 //--------StackAllocator--------
@@ -42,12 +44,20 @@ void *peStackAllocator::Allocate(size_t numBytes) {
   return stackPos;
 }
 
+void *peStackAllocator::Allocate(size_t numBytes, size_t alignment) {
+  const auto top = reinterpret_cast<uintptr_t>(m_topOfStack);
+  const auto padding = ((top + alignment - 1) & ~(alignment - 1)) - top;
+  auto mem = static_cast<char *>(Allocate(padding + numBytes));
+  return mem ? mem + padding : nullptr;
+}
+
 void peStackAllocator::Free(void *mem) {
   if (mem == nullptr)
     return;
   size_t lastAllocSize = m_sizePerAlloc.back();
-  PE_ASSERT(mem == (m_topOfStack - lastAllocSize));
-  m_topOfStack = (char *)mem;
+  // Aligned allocations start behind their padding
+  PE_ASSERT(mem >= (m_topOfStack - lastAllocSize) && mem <= m_topOfStack);
+  m_topOfStack -= lastAllocSize;
   m_numFrees++;
   m_sizePerAlloc.pop_back();
 }
@@ -67,89 +77,363 @@ void peStackAllocator::FreeToMarker(void *marker) {
   if (marker == m_topOfStack)
     return;
   PE_ASSERT(marker >= m_buffer && marker < m_topOfStack);
-  size_t numFrees = 0;
-  size_t curAllocPos = m_sizePerAlloc.size() - 1;
-  do {
-    size_t curAllocSize = m_sizePerAlloc[curAllocPos--];
-    numFrees++;
-    if (m_topOfStack - curAllocSize == marker) {
-      m_topOfStack -= curAllocSize;
-      for (size_t j = 0; j < numFrees; j++) {
-        m_sizePerAlloc.pop_back();
-      }
-      m_numFrees += numFrees;
-      break;
-    }
-    m_topOfStack -= curAllocSize;
-  } while (curAllocPos != 0);
+  // Pop allocations until we reach the marker, including the very first one
+  while (m_topOfStack != marker && !m_sizePerAlloc.empty()) {
+    m_topOfStack -= m_sizePerAlloc.back();
+    m_sizePerAlloc.pop_back();
+    m_numFrees++;
+  }
 }
 
-//----PoolAllocator----
-pePoolAllocator::pePoolAllocator(size_t elementSize, size_t chunkSize,
-                                 IAllocator *parentAllocator)
-    : _parentAllocator(parentAllocator ? parentAllocator : GlobalAllocator),
-      _chunks(WrapAllocator<char *>(_parentAllocator)), _chunkSize(chunkSize),
-      _elementSize(elementSize),
-      _freeList(WrapAllocator<FreeIndex>(parentAllocator)) {
-  if (elementSize > chunkSize)
-    throw std::runtime_error{"Element size must be less than chunk size!"};
+//--------ScratchArena--------
 
-  AllocateNewChunk();
+peScratchArena::peScratchArena(size_t blockSize, IAllocator *parentAllocator)
+    : m_parentAllocator(parentAllocator ? parentAllocator : GlobalAllocator),
+      m_blocks(WrapAllocator<peStackAllocator *>(m_parentAllocator)),
+      m_currentBlock(0), m_blockSize(std::max(blockSize, Alignment)),
+      m_numAllocations(0), m_numFrees(0) {}
+
+peScratchArena::~peScratchArena() {
+  for (auto block : m_blocks)
+    Delete(block, m_parentAllocator);
+}
+
+size_t peScratchArena::GetReservedMemory() const {
+  size_t reserved = 0;
+  for (auto block : m_blocks)
+    reserved += block->GetReservedMemory();
+  return reserved;
+}
+
+size_t peScratchArena::GetTotalMemory() const {
+  size_t total = 0;
+  for (auto block : m_blocks)
+    total += block->GetTotalMemory();
+  return total;
+}
+
+void *peScratchArena::Allocate(size_t numBytes) {
+  return Allocate(numBytes, Alignment);
+}
+
+void *peScratchArena::Allocate(size_t numBytes, size_t alignment) {
+  // The blocks come from the parent allocator and are aligned at least as
+  // strictly as Alignment, so padding every allocation keeps all of them
+  // aligned. Only stricter alignments need padding in front
+  alignment = std::max(alignment, Alignment);
+  const auto paddedSize = (numBytes + Alignment - 1) & ~(Alignment - 1);
+  m_numAllocations++;
+
+  // Blocks behind the current one are empty, but might be too small
+  for (; m_currentBlock < m_blocks.size(); ++m_currentBlock) {
+    if (auto mem = m_blocks[m_currentBlock]->Allocate(paddedSize, alignment))
+      return mem;
+  }
+
+  // Every new block is at least as large as all previous ones together, so
+  // the arena needs only a few of them
+  const auto blockSize = std::max(
+      {m_blockSize, GetTotalMemory(), paddedSize + alignment - Alignment});
+  m_blocks.push_back(
+      New<peStackAllocator>(m_parentAllocator, blockSize, m_parentAllocator));
+  m_currentBlock = m_blocks.size() - 1;
+  return m_blocks.back()->Allocate(paddedSize, alignment);
+}
+
+void peScratchArena::Free(void *mem) {
+  if (mem)
+    m_numFrees++;
+}
+
+void peScratchArena::Clear() {
+  for (auto block : m_blocks)
+    block->Clear();
+  m_currentBlock = 0;
+}
+
+peScratchArena::Marker peScratchArena::ObtainMarker() const {
+  if (m_currentBlock >= m_blocks.size())
+    return {m_currentBlock, nullptr};
+  auto block = m_blocks[m_currentBlock];
+  return {m_currentBlock,
+          block->GetReservedMemory() ? block->ObtainMarker() : nullptr};
+}
+
+void peScratchArena::FreeToMarker(const Marker &marker) {
+  for (auto idx = marker.blockIdx + 1; idx < m_blocks.size(); ++idx)
+    m_blocks[idx]->Clear();
+  if (marker.blockIdx < m_blocks.size()) {
+    auto block = m_blocks[marker.blockIdx];
+    if (marker.stackMarker)
+      block->FreeToMarker(marker.stackMarker);
+    else
+      block->Clear();
+  }
+  m_currentBlock = marker.blockIdx;
+}
+
+//----PoolChunks----
+namespace {
+//! \brief Fibonacci hashing, which spreads consecutive buckets over the table
+size_t PoolChunkSlot(uintptr_t bucket, uint32_t capacityLog2) {
+  return static_cast<size_t>((uint64_t(bucket) * 0x9E3779B97F4A7C15ull) >>
+                             (64 - capacityLog2));
 }
+} // namespace
+
+pePoolChunks::pePoolChunks(size_t chunkSize, size_t alignment,
+                           IAllocator *parentAllocator)
+    : _parentAllocator(parentAllocator), _chunkSize(chunkSize),
+      _alignment(alignment), _chunks(WrapAllocator<char *>(parentAllocator)),
+      _tables(WrapAllocator<Table *>(parentAllocator)), _table(nullptr),
+      _numEntries(0) {}
 
-pePoolAllocator::~pePoolAllocator() {
+pePoolChunks::~pePoolChunks() {
   for (auto chunk : _chunks)
     _parentAllocator->Free(chunk);
+  for (auto table : _tables) {
+    _parentAllocator->Free(table->slots);
+    Delete(table, _parentAllocator);
+  }
+}
+
+char *pePoolChunks::AddChunk() {
+  auto chunk =
+      static_cast<char *>(_parentAllocator->Allocate(_chunkSize, _alignment));
+  _chunks.push_back(chunk);
+  const auto address = reinterpret_cast<uintptr_t>(chunk);
+  _numEntries += address % _chunkSize == 0 ? 1 : 2;
+
+  // The table is kept at most half full, so that probes stay short and
+  // always end at an empty slot
+  auto table = _table.load(std::memory_order_relaxed);
+  if (!table || _numEntries * 2 > (size_t(1) << table->capacityLog2)) {
+    table = AllocateTable(table ? table->capacityLog2 + 1 : 4);
+    for (auto addedChunk : _chunks)
+      Insert(*table, reinterpret_cast<uintptr_t>(addedChunk));
+    _table.store(table, std::memory_order_release);
+  } else {
+    Insert(*table, address);
+  }
+  return chunk;
+}
+
+char *pePoolChunks::Find(const void *mem) const {
+  const auto table = _table.load(std::memory_order_acquire);
+  if (!table)
+    return nullptr;
+  // The chunk that contains mem overlaps the bucket of mem, so it was entered
+  // under it
+  const auto address = reinterpret_cast<uintptr_t>(mem);
+  const auto mask = (size_t(1) << table->capacityLog2) - 1;
+  for (auto slot = PoolChunkSlot(address / _chunkSize, table->capacityLog2);;
+       slot = (slot + 1) & mask) {
+    const auto chunk = table->slots[slot].load(std::memory_order_acquire);
+    if (chunk == 0)
+      return nullptr;
+    if (address >= chunk && address - chunk < _chunkSize)
+      return reinterpret_cast<char *>(chunk);
+  }
+}
+
+pePoolChunks::Table *pePoolChunks::AllocateTable(uint32_t capacityLog2) {
+  const auto capacity = size_t(1) << capacityLog2;
+  auto table = New<Table>(_parentAllocator);
+  table->capacityLog2 = capacityLog2;
+  table->slots = static_cast<std::atomic<uintptr_t> *>(
+      _parentAllocator->Allocate(capacity * sizeof(std::atomic<uintptr_t>),
+                                 alignof(std::atomic<uintptr_t>)));
+  for (size_t slot = 0; slot < capacity; ++slot)
+    new (table->slots + slot) std::atomic<uintptr_t>(0);
+  _tables.push_back(table);
+  return table;
+}
+
+void pePoolChunks::Insert(Table &table, uintptr_t chunk) {
+  // A chunk overlaps the buckets of its first and its last byte
+  const auto mask = (size_t(1) << table.capacityLog2) - 1;
+  const auto firstBucket = chunk / _chunkSize;
+  const auto lastBucket = (chunk + _chunkSize - 1) / _chunkSize;
+  for (auto bucket = firstBucket; bucket <= lastBucket; ++bucket) {
+    auto slot = PoolChunkSlot(bucket, table.capacityLog2);
+    while (table.slots[slot].load(std::memory_order_relaxed) != 0)
+      slot = (slot + 1) & mask;
+    table.slots[slot].store(chunk, std::memory_order_release);
+  }
+}
+
+//----PoolAllocator----
+namespace {
+size_t PoolAlignment(size_t alignment) {
+  if (alignment & (alignment - 1))
+    throw std::runtime_error{"Alignment must be a power of two!"};
+  return std::max(alignment, sizeof(void *));
+}
+
+size_t PoolElementSize(size_t elementSize, size_t alignment,
+                       size_t chunkSize) {
+  const auto size = (std::max(elementSize, sizeof(void *)) + alignment - 1) &
+                    ~(alignment - 1);
+  if (size > chunkSize)
+    throw std::runtime_error{"Element size must be less than chunk size!"};
+  return size;
+}
+
+//! \brief Throws unless mem is the start of an element in one of the chunks.
+//! Nothing is read from mem, a foreign pointer might not even be mapped
+void ValidatePoolElement(const pePoolChunks &chunks, const void *mem,
+                         size_t chunkSize, size_t elementSize) {
+  const auto chunk = chunks.Find(mem);
+  const auto offset =
+      chunk ? static_cast<size_t>(static_cast<const char *>(mem) - chunk) : 0;
+  if (!chunk || offset + elementSize > chunkSize || offset % elementSize != 0)
+    throw std::runtime_error{"Memory does not belong to this allocator!"};
+}
+} // namespace
+
+// Chunks are aligned to the elements only, aligning them to the chunk size
+// would make most parents allocate twice the chunk size
+pePoolAllocator::pePoolAllocator(size_t elementSize, size_t chunkSize,
+                                 IAllocator *parentAllocator, size_t alignment)
+    : _chunkSize(chunkSize), _alignment(PoolAlignment(alignment)),
+      _elementSize(PoolElementSize(elementSize, _alignment, _chunkSize)),
+      _chunks(_chunkSize, _alignment,
+              parentAllocator ? parentAllocator : GlobalAllocator),
+      _freeList(nullptr), _bumpCurrent(nullptr), _bumpEnd(nullptr) {
+  AllocateNewChunk();
 }
 
 void *pePoolAllocator::Allocate(size_t numBytes) {
   if (numBytes > _elementSize)
     throw std::runtime_error{"Pool allocator can't allocate memory blocks that "
                              "are larger than its element size!"};
-  if (_freeList.empty())
+  // Recently freed elements first, they are likely still in the cache
+  if (_freeList) {
+    auto node = _freeList;
+    _freeList = node->next;
+    return node;
+  }
+  if (_bumpCurrent + _elementSize > _bumpEnd)
     AllocateNewChunk();
-  // Take free indices from the back as this has better performance
-  auto freeIndex = _freeList.back();
-  _freeList.pop_back();
+  auto mem = _bumpCurrent;
+  _bumpCurrent += _elementSize;
+  return mem;
+}
 
-  return _chunks[freeIndex.chunkIdx] + freeIndex.offset;
+void *pePoolAllocator::Allocate(size_t numBytes, size_t alignment) {
+  if (alignment > _alignment)
+    throw std::runtime_error{"Pool allocator can't allocate memory blocks with "
+                             "a stricter alignment than its own!"};
+  return Allocate(numBytes);
 }
 
 void pePoolAllocator::Free(void *mem) {
   if (mem == nullptr)
     return;
-  auto chunkIter =
-      std::find_if(_chunks.begin(), _chunks.end(), [=](auto chunk) {
-        auto distance = std::distance(chunk, reinterpret_cast<char *>(mem));
-        return distance >= 0 &&
-               distance <=
-                   static_cast<int64_t>(_chunkSize -
-                                        _elementSize); //-_elementSize because
-                                                       // the last block in a
-                                                       // chunk will be at this
-                                                       // index!
-      });
-  if (chunkIter == _chunks.end())
-    throw std::runtime_error{"Memory does not belong to this allocator!"};
-  auto chunkIdx =
-      static_cast<uint32_t>(std::distance(_chunks.begin(), chunkIter));
-  auto offset = static_cast<uint32_t>(
-      std::distance(*chunkIter, reinterpret_cast<char *>(mem)));
-  _freeList.emplace_back(chunkIdx, offset);
+  ValidatePoolElement(_chunks, mem, _chunkSize, _elementSize);
+  auto node = reinterpret_cast<FreeNode *>(mem);
+  node->next = _freeList;
+  _freeList = node;
 }
 
-pePoolAllocator::FreeIndex::FreeIndex(uint32_t chunkIdx, uint32_t offset)
-    : chunkIdx(chunkIdx), offset(offset) {}
-
 void pePoolAllocator::AllocateNewChunk() {
-  auto chunk = reinterpret_cast<char *>(_parentAllocator->Allocate(_chunkSize));
-  _chunks.push_back(chunk);
-  auto chunkIdx = static_cast<uint32_t>(_chunks.size()) - 1;
-  for (auto curElement = chunk;
-       curElement < chunk + (_chunkSize - _elementSize);
-       curElement += _elementSize) {
-    auto offset = static_cast<uint32_t>(std::distance(chunk, curElement));
-    _freeList.emplace_back(chunkIdx, offset);
+  auto chunk = _chunks.AddChunk();
+  _bumpCurrent = chunk;
+  _bumpEnd = chunk + _chunkSize;
+}
+
+//----ConcurrentPoolAllocator----
+namespace {
+static_assert(sizeof(void *) == 8,
+              "Tagged free list pointers require 64-bit addresses");
+// User space addresses fit into the lower 48 bits, the upper 16 bits hold the
+// ABA tag
+constexpr uint64_t TagShift = 48;
+constexpr uint64_t PointerMask = (uint64_t(1) << TagShift) - 1;
+
+template <typename T> T *UntagPointer(uint64_t tagged) {
+  return reinterpret_cast<T *>(tagged & PointerMask);
+}
+
+uint64_t TagPointer(const void *ptr, uint64_t previous) {
+  const auto tag = (previous >> TagShift) + 1;
+  return reinterpret_cast<uintptr_t>(ptr) | (tag << TagShift);
+}
+} // namespace
+
+peConcurrentPoolAllocator::peConcurrentPoolAllocator(
+    size_t elementSize, size_t chunkSize, IAllocator *parentAllocator,
+    size_t alignment)
+    : _chunkSize(chunkSize), _alignment(PoolAlignment(alignment)),
+      _elementSize(PoolElementSize(elementSize, _alignment, _chunkSize)),
+      _chunks(_chunkSize, _alignment,
+              parentAllocator ? parentAllocator : GlobalAllocator),
+      _freeList(0) {
+  AllocateNewChunk();
+}
+
+void *peConcurrentPoolAllocator::Allocate(size_t numBytes) {
+  if (numBytes > _elementSize)
+    throw std::runtime_error{"Pool allocator can't allocate memory blocks that "
+                             "are larger than its element size!"};
+  auto head = _freeList.load(std::memory_order_acquire);
+  while (true) {
+    auto node = UntagPointer<FreeNode>(head);
+    if (!node) {
+      AllocateNewChunk();
+      head = _freeList.load(std::memory_order_acquire);
+      continue;
+    }
+    // The node might be handed out and overwritten by another thread right
+    // now. Then the value read here is garbage, but the tag makes the swap
+    // fail. Chunks live until destruction, so the read itself is safe
+    auto next = node->next.load(std::memory_order_relaxed);
+    if (_freeList.compare_exchange_weak(head, TagPointer(next, head),
+                                        std::memory_order_acquire,
+                                        std::memory_order_acquire))
+      return node;
+  }
+}
+
+void *peConcurrentPoolAllocator::Allocate(size_t numBytes, size_t alignment) {
+  if (alignment > _alignment)
+    throw std::runtime_error{"Pool allocator can't allocate memory blocks with "
+                             "a stricter alignment than its own!"};
+  return Allocate(numBytes);
+}
+
+void peConcurrentPoolAllocator::Free(void *mem) {
+  if (mem == nullptr)
+    return;
+  ValidatePoolElement(_chunks, mem, _chunkSize, _elementSize);
+  auto node = new (mem) FreeNode;
+  Push(node, node);
+}
+
+void peConcurrentPoolAllocator::Push(FreeNode *first, FreeNode *last) {
+  auto head = _freeList.load(std::memory_order_relaxed);
+  do {
+    last->next.store(UntagPointer<FreeNode>(head), std::memory_order_relaxed);
+  } while (!_freeList.compare_exchange_weak(head, TagPointer(first, head),
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed));
+}
+
+void peConcurrentPoolAllocator::AllocateNewChunk() {
+  std::lock_guard<std::mutex> lock{_growLock};
+  // Another thread may have grown the pool while we waited
+  if (UntagPointer<FreeNode>(_freeList.load(std::memory_order_acquire)))
+    return;
+
+  auto chunk = _chunks.AddChunk();
+  auto first = new (chunk) FreeNode;
+  auto last = first;
+  for (auto element = chunk + _elementSize;
+       element + _elementSize <= chunk + _chunkSize; element += _elementSize) {
+    auto node = new (element) FreeNode;
+    last->next.store(node, std::memory_order_relaxed);
+    last = node;
   }
+  Push(first, last);
 }
 } // namespace pe
@@ -0,0 +1,394 @@
+#include "Memory\peAllocator.h"
+#include "Memory\peLeakDetection.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+#pragma region CallSites
+
+//! \brief Frames per callstack, peStackWalker captures at most 20
+constexpr uint32_t MaxFrames = 20;
+constexpr size_t NumCallSites = 4096;
+constexpr size_t MaxProbes = 64;
+
+//! \brief Samples of one callstack. The table is filled with compare-and-swap
+//! on the hash, so neither sampling nor reporting takes a lock
+struct CallSite {
+  //! \brief Hash of the frames, 0 for an empty entry
+  std::atomic<uint64_t> hash;
+  //! \brief Set once the frames are written
+  std::atomic<bool> ready;
+  uint32_t numFrames;
+  size_t frames[MaxFrames];
+  std::atomic<size_t> allocatedBytes;
+  std::atomic<size_t> liveBytes;
+  std::atomic<size_t> numSamples;
+};
+
+// Static storage is zeroed, and all these types are trivially constructible,
+// so the tables are usable before any constructor of this file runs
+CallSite g_callSites[NumCallSites];
+std::atomic<size_t> g_droppedSamples;
+
+uint64_t HashFrames(const size_t *frames, uint32_t numFrames) {
+  uint64_t hash = 14695981039346656037ull;
+  for (uint32_t idx = 0; idx < numFrames; ++idx) {
+    hash ^= frames[idx];
+    hash *= 1099511628211ull;
+  }
+  return hash ? hash : 1;
+}
+
+//! \returns Index of the call site, or NumCallSites if the table is full
+size_t FindOrInsertCallSite(const size_t *frames, uint32_t numFrames) {
+  const auto hash = HashFrames(frames, numFrames);
+  for (size_t probe = 0; probe < MaxProbes; ++probe) {
+    const auto idx = (hash + probe) % NumCallSites;
+    auto &site = g_callSites[idx];
+    auto siteHash = site.hash.load(std::memory_order_acquire);
+    if (siteHash == 0 &&
+        site.hash.compare_exchange_strong(siteHash, hash,
+                                          std::memory_order_acq_rel)) {
+      std::copy(frames, frames + numFrames, site.frames);
+      site.numFrames = numFrames;
+      site.ready.store(true, std::memory_order_release);
+      return idx;
+    }
+    if (siteHash == hash)
+      return idx;
+  }
+  return NumCallSites;
+}
+
+#pragma endregion
+
+#pragma region LiveSamples
+
+constexpr size_t NumLiveSlots = size_t{1} << 16;
+constexpr uintptr_t EmptySlot = 0;
+constexpr uintptr_t FreedSlot = 1;
+
+//! \brief A sampled block that was not freed yet
+struct LiveSample {
+  std::atomic<uintptr_t> address;
+  uint32_t callSite;
+  size_t weight;
+};
+
+LiveSample g_liveSamples[NumLiveSlots];
+std::atomic<size_t> g_numLiveSamples;
+//! \brief Counting filter over the addresses of the live samples. Almost all
+//! frees find a zero here and skip the lookup in the live sample table
+std::atomic<uint16_t> g_liveFilter[NumLiveSlots];
+
+size_t HashAddress(uintptr_t address) {
+  return static_cast<size_t>((address >> 4) * 0x9E3779B97F4A7C15ull >> 48);
+}
+
+bool InsertLiveSample(uintptr_t address, uint32_t callSite, size_t weight) {
+  const auto home = HashAddress(address);
+  for (size_t probe = 0; probe < MaxProbes; ++probe) {
+    auto &slot = g_liveSamples[(home + probe) % NumLiveSlots];
+    auto current = slot.address.load(std::memory_order_relaxed);
+    if ((current == EmptySlot || current == FreedSlot) &&
+        slot.address.compare_exchange_strong(current, address,
+                                             std::memory_order_relaxed)) {
+      // The block is not handed out yet, so nobody looks at the slot before
+      // these are written
+      slot.callSite = callSite;
+      slot.weight = weight;
+      g_liveFilter[home].fetch_add(1, std::memory_order_relaxed);
+      g_numLiveSamples.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+  return false;
+}
+
+void RemoveLiveSample(uintptr_t address) {
+  const auto home = HashAddress(address);
+  if (!g_liveFilter[home].load(std::memory_order_relaxed))
+    return;
+  for (size_t probe = 0; probe < MaxProbes; ++probe) {
+    auto &slot = g_liveSamples[(home + probe) % NumLiveSlots];
+    const auto current = slot.address.load(std::memory_order_relaxed);
+    if (current == EmptySlot)
+      return;
+    if (current != address)
+      continue;
+    g_callSites[slot.callSite].liveBytes.fetch_sub(slot.weight,
+                                                   std::memory_order_relaxed);
+    // Freed instead of empty, lookups must not stop at this slot
+    slot.address.store(FreedSlot, std::memory_order_relaxed);
+    g_liveFilter[home].fetch_sub(1, std::memory_order_relaxed);
+    g_numLiveSamples.fetch_sub(1, std::memory_order_relaxed);
+    return;
+  }
+}
+
+#pragma endregion
+
+#pragma region Sampler
+
+std::atomic<size_t> g_sampleInterval;
+
+//! \brief Bytes after which a thread checks again whether sampling was
+//! enabled, while it is disabled
+constexpr int64_t DisabledRecheckBytes = int64_t{64} << 20;
+
+//! \brief Sampling state of one thread. Trivially constructible like the
+//! thread caches, so it is usable at any time during the life of the thread
+struct Sampler {
+  int64_t bytesUntilSample;
+  //! \brief Interval that bytesUntilSample was drawn with, 0 while the thread
+  //! is not counting yet
+  size_t interval;
+  uint64_t rngState;
+  //! \brief Set while a sample is recorded, allocations that happen meanwhile
+  //! (e.g. when the stack walker loads its library) are not sampled
+  bool recording;
+};
+
+thread_local Sampler tl_sampler;
+
+//! \brief Draws the distance to the next sampled byte. Exponentially
+//! distributed distances make every byte equally likely to be sampled,
+//! independent of the allocation pattern
+int64_t NextSampleDistance(Sampler &sampler, size_t interval) {
+  if (!sampler.rngState)
+    sampler.rngState = reinterpret_cast<uintptr_t>(&sampler) | 1;
+  // xorshift64*
+  sampler.rngState ^= sampler.rngState >> 12;
+  sampler.rngState ^= sampler.rngState << 25;
+  sampler.rngState ^= sampler.rngState >> 27;
+  const auto bits = (sampler.rngState * 2685821657736338717ull) >> 11;
+  const auto uniform = (bits + 1) * (1.0 / 9007199254740992.0);
+  return static_cast<int64_t>(-std::log(uniform) * interval) + 1;
+}
+
+#pragma endregion
+
+//! \brief Reads PE_HEAP_PROFILE_INTERVAL. Runs while the global allocator is
+//! constructed, so it must not allocate
+bool ReadIntervalFromEnvironment(size_t &interval) {
+#ifdef _WIN32
+  char buffer[32] = {'\0'};
+  if (!GetEnvironmentVariableA("PE_HEAP_PROFILE_INTERVAL", buffer,
+                               static_cast<DWORD>(sizeof(buffer))))
+    return false;
+  const char *value = buffer;
+#else
+  const char *value = std::getenv("PE_HEAP_PROFILE_INTERVAL");
+  if (!value)
+    return false;
+#endif
+  interval = std::strtoull(value, nullptr, 10);
+  return true;
+}
+
+//! \brief Resolved frames of a call site, from the root to the allocation
+std::vector<std::string> ResolveCallSite(const CallSite &site) {
+  constexpr size_t NameBufferSize = 1024;
+  size_t frames[MaxFrames];
+  std::copy(site.frames, site.frames + site.numFrames, frames);
+  auto names = static_cast<char *>(malloc(site.numFrames * NameBufferSize));
+  pe::peStackWalker::ResolveCallstack(frames, site.numFrames, names,
+                                      NameBufferSize);
+  std::vector<std::string> resolved;
+  for (auto idx = site.numFrames; idx > 0; --idx)
+    resolved.emplace_back(names + (idx - 1) * NameBufferSize);
+  free(names);
+  return resolved;
+}
+
+} // namespace
+
+namespace pe {
+
+peHeapProfiler::peHeapProfiler(IAllocatorStatistics *parentAllocator)
+    : _parentAllocator(parentAllocator) {
+#ifdef _DEBUG
+  SetSampleInterval(DefaultSampleInterval);
+#endif
+  size_t interval;
+  if (ReadIntervalFromEnvironment(interval))
+    SetSampleInterval(interval);
+}
+
+peHeapProfiler::~peHeapProfiler() {}
+
+peHeapProfiler *peHeapProfiler::GetInstance() {
+  // Constructed in place and never destroyed, since blocks might still be
+  // freed by destructors of other static objects
+  alignas(peHeapProfiler) static unsigned char
+      s_storage[sizeof(peHeapProfiler)];
+  static auto s_instance =
+      new (s_storage) peHeapProfiler(peThreadCachingAllocator::GetInstance());
+  return s_instance;
+}
+
+void *peHeapProfiler::Allocate(size_t numBytes) {
+  auto mem = _parentAllocator->Allocate(numBytes);
+  auto &sampler = tl_sampler;
+  sampler.bytesUntilSample -= static_cast<int64_t>(numBytes);
+  if (sampler.bytesUntilSample > 0)
+    return mem;
+  return RecordSample(mem, numBytes);
+}
+
+void *peHeapProfiler::Allocate(size_t numBytes, size_t alignment) {
+  auto mem = _parentAllocator->Allocate(numBytes, alignment);
+  auto &sampler = tl_sampler;
+  sampler.bytesUntilSample -= static_cast<int64_t>(numBytes);
+  if (sampler.bytesUntilSample > 0)
+    return mem;
+  return RecordSample(mem, numBytes);
+}
+
+void peHeapProfiler::Free(void *mem) {
+  if (mem && g_numLiveSamples.load(std::memory_order_relaxed))
+    RemoveLiveSample(reinterpret_cast<uintptr_t>(mem));
+  _parentAllocator->Free(mem);
+}
+
+void *peHeapProfiler::RecordSample(void *mem, size_t numBytes) {
+  auto &sampler = tl_sampler;
+  const auto interval = g_sampleInterval.load(std::memory_order_relaxed);
+  if (!interval) {
+    sampler.interval = 0;
+    sampler.bytesUntilSample = DisabledRecheckBytes;
+    return mem;
+  }
+  // A thread that allocates for the first time, or that was running while
+  // sampling was disabled, only starts to count
+  const auto wasCounting = sampler.interval != 0;
+  sampler.interval = interval;
+  sampler.bytesUntilSample = NextSampleDistance(sampler, interval);
+  if (!wasCounting || sampler.recording || !mem)
+    return mem;
+
+  sampler.recording = true;
+  // A block of n bytes is sampled with probability 1 - exp(-n / interval), so
+  // each sample stands for n / probability bytes
+  const auto probability =
+      1.0 - std::exp(-static_cast<double>(std::max<size_t>(numBytes, 1)) /
+                     static_cast<double>(interval));
+  const auto weight = static_cast<size_t>(numBytes / probability);
+
+  size_t frames[MaxFrames];
+  const auto numFrames = peStackWalker::GetCallstack(MaxFrames, frames);
+  const auto siteIdx = FindOrInsertCallSite(frames, numFrames);
+  if (siteIdx < NumCallSites) {
+    auto &site = g_callSites[siteIdx];
+    site.allocatedBytes.fetch_add(weight, std::memory_order_relaxed);
+    site.numSamples.fetch_add(1, std::memory_order_relaxed);
+    site.liveBytes.fetch_add(weight, std::memory_order_relaxed);
+    if (!InsertLiveSample(reinterpret_cast<uintptr_t>(mem),
+                          static_cast<uint32_t>(siteIdx), weight)) {
+      site.liveBytes.fetch_sub(weight, std::memory_order_relaxed);
+      g_droppedSamples.fetch_add(1, std::memory_order_relaxed);
+    }
+  } else {
+    g_droppedSamples.fetch_add(1, std::memory_order_relaxed);
+  }
+  sampler.recording = false;
+  return mem;
+}
+
+void peHeapProfiler::SetSampleInterval(size_t numBytes) {
+  g_sampleInterval.store(numBytes, std::memory_order_relaxed);
+}
+
+size_t peHeapProfiler::GetSampleInterval() const {
+  return g_sampleInterval.load(std::memory_order_relaxed);
+}
+
+void peHeapProfiler::WriteFoldedStacks(
+    Profile profile, std::function<void(const char *)> printer) const {
+  peStackWalker::Init();
+
+  std::stringstream ss;
+  for (auto &site : g_callSites) {
+    if (!site.ready.load(std::memory_order_acquire))
+      continue;
+    const auto bytes =
+        profile == Profile::AllocatedBytes
+            ? site.allocatedBytes.load(std::memory_order_relaxed)
+            : site.liveBytes.load(std::memory_order_relaxed);
+    if (!bytes)
+      continue;
+
+    auto first = true;
+    for (auto &frame : ResolveCallSite(site)) {
+      // Semicolons separate the frames, so they must not appear in names
+      std::replace(frame.begin(), frame.end(), ';', ':');
+      ss << (first ? "" : ";") << frame;
+      first = false;
+    }
+    ss << " " << bytes << "\n";
+  }
+  printer(ss.str().c_str());
+}
+
+void peHeapProfiler::LogLeaks(std::function<void(const char *)> printer) const {
+  peStackWalker::Init();
+
+  std::vector<const CallSite *> sites;
+  for (auto &site : g_callSites) {
+    if (site.ready.load(std::memory_order_acquire) &&
+        site.liveBytes.load(std::memory_order_relaxed))
+      sites.push_back(&site);
+  }
+  std::sort(sites.begin(), sites.end(), [](auto lhs, auto rhs) {
+    return lhs->liveBytes.load(std::memory_order_relaxed) >
+           rhs->liveBytes.load(std::memory_order_relaxed);
+  });
+  // Release builds don't sample by default, so there is nothing to report
+  if (sites.empty())
+    return;
+
+  std::stringstream ss;
+  if (!GetSampleInterval())
+    ss << "Heap profiling was disabled, not all leaks were sampled!\n";
+  if (auto dropped = g_droppedSamples.load(std::memory_order_relaxed))
+    ss << dropped << " samples were dropped, the profile is incomplete!\n";
+  for (auto site : sites) {
+    ss << "Leaked ~" << site->liveBytes.load(std::memory_order_relaxed)
+       << " bytes (estimated from sampled allocations)! Callstack: \n";
+    const auto frames = ResolveCallSite(*site);
+    // Innermost frame first, like the leak detection allocator
+    for (auto frame = frames.rbegin(); frame != frames.rend(); ++frame)
+      ss << *frame << "\n";
+  }
+  printer(ss.str().c_str());
+}
+
+size_t peHeapProfiler::GetFreeMemory() const {
+  return _parentAllocator->GetFreeMemory();
+}
+
+size_t peHeapProfiler::GetNumAllocations() const {
+  return _parentAllocator->GetNumAllocations();
+}
+
+size_t peHeapProfiler::GetNumFrees() const {
+  return _parentAllocator->GetNumFrees();
+}
+
+size_t peHeapProfiler::GetReservedMemory() const {
+  return _parentAllocator->GetReservedMemory();
+}
+
+size_t peHeapProfiler::GetTotalMemory() const {
+  return _parentAllocator->GetTotalMemory();
+}
+
+} // namespace pe
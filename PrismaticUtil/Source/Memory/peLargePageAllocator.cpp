@@ -0,0 +1,247 @@
+#include "Memory\peAllocators.h"
+#include "Threading\peParallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace {
+
+constexpr size_t SmallPageSize = 4096;
+//! \brief Size of the huge pages that blocks are aligned to. Windows reports
+//! its large page size at runtime, but it is 2 MiB on every x64 system as well
+constexpr size_t HugePageSize = 2 * 1024 * 1024;
+
+//! \brief Sits in front of every block
+struct BlockHeader {
+  //! \brief Size of the mapping that holds the block, 0 for blocks of the
+  //! parent allocator
+  size_t mappedBytes;
+  //! \brief Distance from the start of the mapping or parent block to the
+  //! block
+  uint32_t offset;
+  uint32_t explicitHugePages;
+};
+constexpr size_t HeaderSize = 16;
+static_assert(sizeof(BlockHeader) <= HeaderSize,
+              "Block header must fit into its padding");
+
+BlockHeader *HeaderOf(void *mem) {
+  return reinterpret_cast<BlockHeader *>(mem) - 1;
+}
+
+constexpr size_t RoundUp(size_t value, size_t multiple) {
+  return (value + multiple - 1) / multiple * multiple;
+}
+
+#pragma region Mapping
+
+struct Mapping {
+  char *base;
+  size_t numBytes;
+  bool explicitHugePages;
+};
+
+#ifdef _WIN32
+
+//! \brief Large pages need the SeLockMemoryPrivilege, which has to be granted
+//! to the user and then enabled for the process
+bool EnableLockMemoryPrivilege() {
+  HANDLE token;
+  if (!OpenProcessToken(GetCurrentProcess(),
+                        TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+    return false;
+  TOKEN_PRIVILEGES privileges = {};
+  privileges.PrivilegeCount = 1;
+  privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+  // AdjustTokenPrivileges succeeds even if the privilege was not granted and
+  // only reports that through the last error
+  const auto enabled =
+      LookupPrivilegeValueA(nullptr, "SeLockMemoryPrivilege",
+                            &privileges.Privileges[0].Luid) &&
+      AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr) &&
+      GetLastError() == ERROR_SUCCESS;
+  CloseHandle(token);
+  return enabled;
+}
+
+size_t LargePageSize() {
+  static const size_t s_largePageSize =
+      EnableLockMemoryPrivilege() ? GetLargePageMinimum() : 0;
+  return s_largePageSize;
+}
+
+Mapping Map(size_t numBytes) {
+  // Large pages are committed and resident right away, there is no
+  // transparent fallback on Windows
+  if (const auto largePageSize = LargePageSize()) {
+    const auto mappedBytes = RoundUp(numBytes, largePageSize);
+    auto mem = VirtualAlloc(nullptr, mappedBytes,
+                            MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                            PAGE_READWRITE);
+    if (mem)
+      return {static_cast<char *>(mem), mappedBytes, true};
+  }
+
+  const auto mappedBytes = RoundUp(numBytes, SmallPageSize);
+  auto mem = VirtualAlloc(nullptr, mappedBytes, MEM_RESERVE | MEM_COMMIT,
+                          PAGE_READWRITE);
+  return {static_cast<char *>(mem), mappedBytes, false};
+}
+
+void Unmap(const Mapping &mapping) {
+  VirtualFree(mapping.base, 0, MEM_RELEASE);
+}
+
+#else
+
+//! \brief Set once the hugetlb pool failed to serve a block, so that later
+//! blocks don't retry a syscall that is bound to fail
+std::atomic<bool> g_explicitHugePagesUnavailable{false};
+
+Mapping Map(size_t numBytes) {
+  const auto mappedBytes = RoundUp(numBytes, HugePageSize);
+
+#ifdef MAP_HUGETLB
+  if (!g_explicitHugePagesUnavailable.load(std::memory_order_relaxed)) {
+    auto mem = mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem != MAP_FAILED)
+      return {static_cast<char *>(mem), mappedBytes, true};
+    g_explicitHugePagesUnavailable.store(true, std::memory_order_relaxed);
+  }
+#endif
+
+  // Transparent huge pages only back ranges that are aligned to the huge page
+  // size, so map a huge page more and trim the ends
+  auto mem = mmap(nullptr, mappedBytes + HugePageSize, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    return {nullptr, 0, false};
+  const auto begin = static_cast<char *>(mem);
+  const auto alignedBegin = reinterpret_cast<char *>(
+      RoundUp(reinterpret_cast<uintptr_t>(begin), HugePageSize));
+  const auto head = static_cast<size_t>(alignedBegin - begin);
+  if (head)
+    munmap(begin, head);
+  if (HugePageSize - head)
+    munmap(alignedBegin + mappedBytes, HugePageSize - head);
+
+#ifdef MADV_HUGEPAGE
+  madvise(alignedBegin, mappedBytes, MADV_HUGEPAGE);
+#endif
+  return {alignedBegin, mappedBytes, false};
+}
+
+void Unmap(const Mapping &mapping) { munmap(mapping.base, mapping.numBytes); }
+
+#endif
+
+#pragma endregion
+
+} // namespace
+
+pe::peLargePageAllocator::peLargePageAllocator(IAllocator *parentAllocator,
+                                               peTaskSystem *prefaultTaskSystem,
+                                               size_t minMappedSize)
+    : _parentAllocator(parentAllocator ? parentAllocator : GlobalAllocator),
+      _prefaultTaskSystem(prefaultTaskSystem), _minMappedSize(minMappedSize),
+      _mappedBytes(0), _hugePageBytes(0), _numAllocations(0), _numFrees(0) {}
+
+pe::peLargePageAllocator *pe::peLargePageAllocator::GetInstance() {
+  // Constructed in place and never destroyed, like the tagged allocators that
+  // sit on top of it
+  alignas(peLargePageAllocator) static unsigned char
+      s_storage[sizeof(peLargePageAllocator)];
+  static auto s_instance = new (s_storage) peLargePageAllocator(GlobalAllocator);
+  return s_instance;
+}
+
+void *pe::peLargePageAllocator::Allocate(size_t numBytes) {
+  return Allocate(numBytes, HeaderSize);
+}
+
+void *pe::peLargePageAllocator::Allocate(size_t numBytes, size_t alignment) {
+  // Mappings are aligned to huge pages, the header goes into the padding in
+  // front of the block
+  if (alignment > HugePageSize)
+    throw std::runtime_error{"Alignment exceeds the huge page size!"};
+  alignment = std::max(alignment, HeaderSize);
+
+  char *block = nullptr;
+  BlockHeader header = {};
+  header.offset = static_cast<uint32_t>(alignment);
+
+  if (numBytes + alignment < _minMappedSize) {
+    auto mem = static_cast<char *>(
+        _parentAllocator->Allocate(numBytes + alignment, alignment));
+    if (!mem)
+      return nullptr;
+    block = mem + alignment;
+  } else {
+    const auto mapping = Map(numBytes + alignment);
+    if (!mapping.base)
+      return nullptr;
+    block = mapping.base + alignment;
+    header.mappedBytes = mapping.numBytes;
+    header.explicitHugePages = mapping.explicitHugePages;
+
+    _mappedBytes.fetch_add(mapping.numBytes, std::memory_order_relaxed);
+    if (mapping.explicitHugePages)
+      _hugePageBytes.fetch_add(mapping.numBytes, std::memory_order_relaxed);
+
+#ifdef _WIN32
+    // Large pages are resident already
+    const auto needsPrefault = !mapping.explicitHugePages;
+#else
+    const auto needsPrefault = true;
+#endif
+    if (_prefaultTaskSystem && needsPrefault)
+      Prefault(mapping.base, mapping.numBytes,
+               mapping.explicitHugePages ? HugePageSize : SmallPageSize,
+               *_prefaultTaskSystem);
+  }
+
+  *HeaderOf(block) = header;
+  _numAllocations.fetch_add(1, std::memory_order_relaxed);
+  return block;
+}
+
+void pe::peLargePageAllocator::Free(void *mem) {
+  if (!mem)
+    return;
+  const auto header = *HeaderOf(mem);
+  const auto base = static_cast<char *>(mem) - header.offset;
+  if (header.mappedBytes) {
+    _mappedBytes.fetch_sub(header.mappedBytes, std::memory_order_relaxed);
+    if (header.explicitHugePages)
+      _hugePageBytes.fetch_sub(header.mappedBytes, std::memory_order_relaxed);
+    Unmap({base, header.mappedBytes, header.explicitHugePages != 0});
+  } else {
+    _parentAllocator->Free(base);
+  }
+  _numFrees.fetch_add(1, std::memory_order_relaxed);
+}
+
+void pe::peLargePageAllocator::Prefault(void *mem, size_t numBytes,
+                                        size_t pageSize,
+                                        peTaskSystem &taskSystem) {
+  auto begin = static_cast<char *>(mem);
+  const auto numPages = (numBytes + pageSize - 1) / pageSize;
+  // A huge page worth of small pages per chunk keeps the tasks coarse enough,
+  // and lets each transparent huge page be faulted by a single worker
+  const auto grain = std::max<size_t>(HugePageSize / pageSize, 1);
+  // Fresh mappings are zeroed, so writing a zero changes nothing but forces
+  // the page to be backed on the node of the writing thread
+  ParallelFor(taskSystem, 0, numPages, grain, [=](size_t first, size_t last) {
+    for (auto page = first; page < last; ++page)
+      *reinterpret_cast<volatile char *>(begin + page * pageSize) = 0;
+  });
+}
@@ -1,6 +1,7 @@
 #include "Memory\peLeakDetection.h"
 #include "Memory\peMemoryUtil.h"
 
+#ifdef _WIN32
 #include <DbgHelp.h>
 #include <Tlhelp32.h>
 #include <Windows.h>
@@ -103,3 +104,69 @@ std::string peStackWalker::GenerateSearchPath() {
 }
 
 } // namespace pe
+
+#else
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+
+namespace pe {
+
+bool peStackWalker::s_initialized = false;
+
+uint32_t peStackWalker::GetCallstack(uint32_t maxFrames, size_t addresses[20]) {
+  // Skips this function and its caller, like RtlCaptureStackBackTrace(2, ...)
+  constexpr uint32_t FramesToSkip = 2;
+  constexpr uint32_t MaxFrames = 64;
+  void *frames[MaxFrames];
+  const auto numFrames = static_cast<uint32_t>(
+      backtrace(frames, static_cast<int>(std::min(maxFrames + FramesToSkip,
+                                                  MaxFrames))));
+  uint32_t count = 0;
+  for (auto idx = FramesToSkip; idx < numFrames; ++idx)
+    addresses[count++] = reinterpret_cast<size_t>(frames[idx]);
+  return count;
+}
+
+void peStackWalker::ResolveCallstack(size_t addresses[20], size_t numFrames,
+                                     char *names, size_t maxNameLength) {
+  for (size_t i = 0; i < numFrames; i++) {
+    char *funcName = names + (maxNameLength * i);
+    Dl_info info;
+    if (addresses[i] == 0 ||
+        !dladdr(reinterpret_cast<void *>(addresses[i]), &info)) {
+      snprintf(funcName, maxNameLength, "unknown %zu", addresses[i]);
+      continue;
+    }
+
+    const char *module = "unknown";
+    if (info.dli_fname) {
+      auto slash = strrchr(info.dli_fname, '/');
+      module = slash ? slash + 1 : info.dli_fname;
+    }
+    if (info.dli_sname) {
+      int status = 0;
+      auto demangled =
+          abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+      snprintf(funcName, maxNameLength, "%s!%s+0x%zx", module,
+               status == 0 ? demangled : info.dli_sname,
+               addresses[i] - reinterpret_cast<size_t>(info.dli_saddr));
+      free(demangled);
+    } else {
+      // Static functions are not exported, so only the module offset is left
+      snprintf(funcName, maxNameLength, "%s+0x%zx", module,
+               addresses[i] - reinterpret_cast<size_t>(info.dli_fbase));
+    }
+  }
+}
+
+void peStackWalker::Init() { s_initialized = true; }
+
+} // namespace pe
+
+#endif
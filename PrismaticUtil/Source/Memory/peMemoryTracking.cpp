@@ -0,0 +1,230 @@
+#include "Memory\peMemoryTracking.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <new>
+#include <sstream>
+
+namespace {
+
+constexpr size_t NumTags = static_cast<size_t>(pe::MemoryTag::Count);
+
+//! \brief Counters of one tag. Padded to a cache line, so that subsystems that
+//! allocate concurrently don't contend on the same line
+struct alignas(64) TagCounters {
+  std::atomic<size_t> currentBytes{0};
+  std::atomic<size_t> peakBytes{0};
+  std::atomic<size_t> numAllocations{0};
+  std::atomic<size_t> numFrees{0};
+};
+
+TagCounters g_counters[NumTags];
+
+TagCounters &CountersOf(pe::MemoryTag tag) {
+  return g_counters[static_cast<size_t>(tag)];
+}
+
+//! \brief Sits in front of every tagged allocation
+struct TaggedHeader {
+  size_t numBytes;
+  //! \brief Distance from the start of the parent allocation to the block
+  size_t offset;
+};
+constexpr size_t TaggedHeaderSize = 16;
+static_assert(sizeof(TaggedHeader) <= TaggedHeaderSize,
+              "Tagged header must fit into its padding");
+
+TaggedHeader *HeaderOf(void *mem) {
+  return reinterpret_cast<TaggedHeader *>(mem) - 1;
+}
+
+} // namespace
+
+namespace pe {
+
+#pragma region peMemoryTracker
+
+void peMemoryTracker::TrackAllocation(MemoryTag tag, size_t numBytes) {
+  auto &counters = CountersOf(tag);
+  counters.numAllocations.fetch_add(1, std::memory_order_relaxed);
+  const auto current =
+      counters.currentBytes.fetch_add(numBytes, std::memory_order_relaxed) +
+      numBytes;
+  auto peak = counters.peakBytes.load(std::memory_order_relaxed);
+  while (current > peak &&
+         !counters.peakBytes.compare_exchange_weak(peak, current,
+                                                   std::memory_order_relaxed))
+    ;
+}
+
+void peMemoryTracker::TrackFree(MemoryTag tag, size_t numBytes) {
+  auto &counters = CountersOf(tag);
+  counters.numFrees.fetch_add(1, std::memory_order_relaxed);
+  counters.currentBytes.fetch_sub(numBytes, std::memory_order_relaxed);
+}
+
+peMemoryTagStatistics peMemoryTracker::GetStatistics(MemoryTag tag) {
+  const auto &counters = CountersOf(tag);
+  peMemoryTagStatistics stats;
+  stats.currentBytes = counters.currentBytes.load(std::memory_order_relaxed);
+  stats.peakBytes = counters.peakBytes.load(std::memory_order_relaxed);
+  stats.numAllocations =
+      counters.numAllocations.load(std::memory_order_relaxed);
+  stats.numFrees = counters.numFrees.load(std::memory_order_relaxed);
+  // The counters are read one after another, so a concurrent allocation
+  // might show up in the current bytes before it raised the peak
+  stats.peakBytes = std::max(stats.peakBytes, stats.currentBytes);
+  return stats;
+}
+
+const char *peMemoryTracker::GetTagName(MemoryTag tag) {
+  switch (tag) {
+  case MemoryTag::General:
+    return "General";
+  case MemoryTag::Geometry:
+    return "Geometry";
+  case MemoryTag::AccelerationStructures:
+    return "AccelerationStructures";
+  case MemoryTag::Film:
+    return "Film";
+  case MemoryTag::Textures:
+    return "Textures";
+  case MemoryTag::Entities:
+    return "Entities";
+  default:
+    throw std::runtime_error{"Invalid memory tag!"};
+  }
+}
+
+void peMemoryTracker::ResetPeaks() {
+  for (auto &counters : g_counters)
+    counters.peakBytes.store(
+        counters.currentBytes.load(std::memory_order_relaxed),
+        std::memory_order_relaxed);
+}
+
+std::string peMemoryTracker::ToJson() {
+  std::stringstream ss;
+  ss << "{";
+  for (size_t idx = 0; idx < NumTags; ++idx) {
+    const auto tag = static_cast<MemoryTag>(idx);
+    const auto stats = GetStatistics(tag);
+    ss << (idx ? "," : "") << "\"" << GetTagName(tag) << "\":{"
+       << "\"currentBytes\":" << stats.currentBytes << ","
+       << "\"peakBytes\":" << stats.peakBytes << ","
+       << "\"numAllocations\":" << stats.numAllocations << ","
+       << "\"numFrees\":" << stats.numFrees << "}";
+  }
+  ss << "}";
+  return ss.str();
+}
+
+void peMemoryTracker::LogReport(std::function<void(const char *)> printer) {
+  constexpr double MiB = 1024.0 * 1024.0;
+  std::stringstream ss;
+  ss << std::left << std::setw(24) << "Tag" << std::right << std::setw(14)
+     << "Current [MiB]" << std::setw(14) << "Peak [MiB]" << std::setw(14)
+     << "Allocations" << std::setw(14) << "Frees"
+     << "\n";
+  ss << std::fixed << std::setprecision(2);
+  for (size_t idx = 0; idx < NumTags; ++idx) {
+    const auto tag = static_cast<MemoryTag>(idx);
+    const auto stats = GetStatistics(tag);
+    ss << std::left << std::setw(24) << GetTagName(tag) << std::right
+       << std::setw(14) << stats.currentBytes / MiB << std::setw(14)
+       << stats.peakBytes / MiB << std::setw(14) << stats.numAllocations
+       << std::setw(14) << stats.numFrees << "\n";
+  }
+  printer(ss.str().c_str());
+}
+
+#pragma endregion
+
+#pragma region peTaggedAllocator
+
+peTaggedAllocator::peTaggedAllocator(MemoryTag tag,
+                                     IAllocator *parentAllocator)
+    : _tag(tag),
+      _parentAllocator(parentAllocator ? parentAllocator : GlobalAllocator) {}
+
+peTaggedAllocator *peTaggedAllocator::ForTag(MemoryTag tag) {
+  // Constructed in place and never destroyed, since tagged memory might still
+  // be freed by destructors of other static objects
+  struct Instances {
+    peTaggedAllocator allocators[NumTags] = {
+        {MemoryTag::General, GlobalAllocator},
+        {MemoryTag::Geometry, GlobalAllocator},
+        {MemoryTag::AccelerationStructures, GlobalAllocator},
+        {MemoryTag::Film, GlobalAllocator},
+        {MemoryTag::Textures, GlobalAllocator},
+        {MemoryTag::Entities, GlobalAllocator}};
+  };
+  static_assert(NumTags == 6, "Add an allocator for every memory tag!");
+  alignas(Instances) static unsigned char s_storage[sizeof(Instances)];
+  static auto s_instances = new (s_storage) Instances();
+  return &s_instances->allocators[static_cast<size_t>(tag)];
+}
+
+void *peTaggedAllocator::Allocate(size_t numBytes) {
+  return Allocate(numBytes, TaggedHeaderSize);
+}
+
+void *peTaggedAllocator::Allocate(size_t numBytes, size_t alignment) {
+  // The header goes into the padding in front of the block, which is a whole
+  // alignment unit, so the block keeps the requested alignment
+  alignment = std::max(alignment, TaggedHeaderSize);
+  auto mem = static_cast<char *>(
+      _parentAllocator->Allocate(numBytes + alignment, alignment));
+  if (!mem)
+    return nullptr;
+  auto block = mem + alignment;
+  auto header = HeaderOf(block);
+  header->numBytes = numBytes;
+  header->offset = alignment;
+  peMemoryTracker::TrackAllocation(_tag, numBytes);
+  return block;
+}
+
+void peTaggedAllocator::Free(void *mem) {
+  if (!mem)
+    return;
+  auto header = HeaderOf(mem);
+  peMemoryTracker::TrackFree(_tag, header->numBytes);
+  _parentAllocator->Free(static_cast<char *>(mem) - header->offset);
+}
+
+#pragma endregion
+
+#pragma region peMemoryReporter
+
+peMemoryReporter::peMemoryReporter(std::chrono::milliseconds interval,
+                                   std::function<void(const char *)> printer,
+                                   bool asJson)
+    : _interval(interval), _printer(std::move(printer)), _asJson(asJson),
+      _stop(false), _thread([this]() { Run(); }) {}
+
+peMemoryReporter::~peMemoryReporter() {
+  {
+    std::lock_guard<std::mutex> guard{_lock};
+    _stop = true;
+  }
+  _stopSignal.notify_all();
+  _thread.join();
+}
+
+void peMemoryReporter::Run() {
+  std::unique_lock<std::mutex> lock{_lock};
+  while (!_stopSignal.wait_for(lock, _interval, [this]() { return _stop; })) {
+    lock.unlock();
+    if (_asJson)
+      _printer(peMemoryTracker::ToJson().c_str());
+    else
+      peMemoryTracker::LogReport(_printer);
+    lock.lock();
+  }
+}
+
+#pragma endregion
+
+} // namespace pe
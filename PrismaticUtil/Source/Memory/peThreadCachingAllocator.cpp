@@ -0,0 +1,504 @@
+#include "Memory\peAllocator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+namespace {
+
+#pragma region SizeClasses
+
+// Sizes up to 128 bytes in steps of 16, then four classes per power of two.
+// That wastes at most 25% of a block, and all sizes are multiples of 16, which
+// keeps every block 16-byte aligned
+constexpr uint32_t NumLinearClasses = 8;
+constexpr uint32_t LinearStep = 16;
+constexpr uint32_t LinearLimit = NumLinearClasses * LinearStep;
+constexpr uint32_t ClassesPerDoubling = 4;
+// Class 0 is unused, so that a zeroed span table means 'no small blocks'
+constexpr uint32_t NumSizeClasses =
+    1 + NumLinearClasses + 7 * ClassesPerDoubling;
+
+constexpr uint32_t Log2Floor(size_t value) {
+  uint32_t log = 0;
+  while (value >>= 1)
+    ++log;
+  return log;
+}
+
+constexpr uint32_t SizeClassOf(size_t size) {
+  if (size <= LinearLimit)
+    return size ? static_cast<uint32_t>((size + LinearStep - 1) / LinearStep)
+                : 1;
+  // size is in (2^log, 2^(log+1)]
+  const auto log = Log2Floor(size - 1);
+  const auto step = size_t{1} << (log - 2);
+  const auto idx =
+      static_cast<uint32_t>((size - 1 - (size_t{1} << log)) / step);
+  return NumLinearClasses + (log - 7) * ClassesPerDoubling + idx + 1;
+}
+
+constexpr size_t ClassSize(uint32_t sizeClass) {
+  if (sizeClass <= NumLinearClasses)
+    return sizeClass * LinearStep;
+  const auto idx = sizeClass - NumLinearClasses - 1;
+  const auto log = 7 + idx / ClassesPerDoubling;
+  return (size_t{1} << log) +
+         (idx % ClassesPerDoubling + 1) * (size_t{1} << (log - 2));
+}
+
+static_assert(ClassSize(NumSizeClasses - 1) ==
+                  pe::peThreadCachingAllocator::MaxSmallSize,
+              "The largest size class must match MaxSmallSize!");
+static_assert(SizeClassOf(pe::peThreadCachingAllocator::MaxSmallSize) ==
+                  NumSizeClasses - 1,
+              "The largest size class must match MaxSmallSize!");
+
+//! \brief Number of blocks that a thread exchanges with the central list at
+//! once. Smaller classes move more blocks to amortize the lock
+constexpr uint32_t BatchSize(uint32_t sizeClass) {
+  return static_cast<uint32_t>(
+      std::min<size_t>(std::max<size_t>(32 * 1024 / ClassSize(sizeClass), 2),
+                       32));
+}
+
+#pragma endregion
+
+#pragma region PageHeap
+
+constexpr size_t SpanSize = 64 * 1024;
+//! \brief Spans are committed in groups, to keep the number of syscalls down
+constexpr size_t SpansPerCommit = 16;
+//! \brief Address space that is reserved up front. Only committed spans cost
+//! memory
+constexpr size_t MaxRegionSize = size_t{32} << 30;
+constexpr size_t MinRegionSize = size_t{64} << 20;
+
+//! \brief Region that holds all spans. Set once while the allocator is
+//! constructed, before any block exists
+char *g_regionBegin = nullptr;
+size_t g_regionSize = 0;
+//! \brief Size class of each span
+uint8_t g_spanClasses[MaxRegionSize / SpanSize];
+
+std::mutex *g_spanLock = nullptr;
+size_t g_nextSpan = 0;
+size_t g_committedSpans = 0;
+std::atomic<size_t> g_committedBytes{0};
+
+void ReserveRegion() {
+  // Smaller reservations for 32-bit processes and strict overcommit settings
+  for (auto size = MaxRegionSize; size >= MinRegionSize; size /= 2) {
+#ifdef _WIN32
+    auto region = VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+    auto region = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED)
+      region = nullptr;
+    // mmap only aligns to pages, but aligned allocations rely on spans that
+    // are aligned to their size, like the reservations of VirtualAlloc
+    if (region) {
+      const auto begin = reinterpret_cast<uintptr_t>(region);
+      const auto alignedBegin = (begin + SpanSize - 1) & ~(SpanSize - 1);
+      region = reinterpret_cast<void *>(alignedBegin);
+      size -= SpanSize;
+    }
+#endif
+    if (region) {
+      g_regionBegin = static_cast<char *>(region);
+      g_regionSize = size;
+      return;
+    }
+  }
+}
+
+//! \returns A new span, or nullptr if the region is exhausted
+char *AllocateSpan() {
+  std::lock_guard<std::mutex> guard{*g_spanLock};
+  if ((g_nextSpan + 1) * SpanSize > g_regionSize)
+    return nullptr;
+
+  if (g_nextSpan == g_committedSpans) {
+    const auto numSpans = std::min(SpansPerCommit,
+                                   g_regionSize / SpanSize - g_committedSpans);
+#ifdef _WIN32
+    if (!VirtualAlloc(g_regionBegin + g_committedSpans * SpanSize,
+                      numSpans * SpanSize, MEM_COMMIT, PAGE_READWRITE))
+      return nullptr;
+#endif
+    g_committedSpans += numSpans;
+    g_committedBytes.fetch_add(numSpans * SpanSize, std::memory_order_relaxed);
+  }
+  return g_regionBegin + g_nextSpan++ * SpanSize;
+}
+
+#pragma endregion
+
+#pragma region CentralLists
+
+struct alignas(64) CentralList {
+  std::mutex lock;
+  void *head = nullptr;
+  size_t length = 0;
+};
+
+CentralList *g_centralLists = nullptr;
+
+void *&NextOf(void *block) { return *static_cast<void **>(block); }
+
+//! \brief Moves up to 'count' blocks of the size class to the given list
+//! \returns Number of blocks that were moved
+uint32_t FetchBlocks(uint32_t sizeClass, uint32_t count, void *&head) {
+  auto &central = g_centralLists[sizeClass];
+  std::lock_guard<std::mutex> guard{central.lock};
+  if (central.length < count) {
+    if (auto span = AllocateSpan()) {
+      g_spanClasses[(span - g_regionBegin) / SpanSize] =
+          static_cast<uint8_t>(sizeClass);
+      const auto blockSize = ClassSize(sizeClass);
+      for (auto block = span + (SpanSize / blockSize - 1) * blockSize;
+           block >= span; block -= blockSize) {
+        NextOf(block) = central.head;
+        central.head = block;
+        ++central.length;
+      }
+    }
+  }
+
+  uint32_t numFetched = 0;
+  while (numFetched < count && central.head) {
+    auto block = central.head;
+    central.head = NextOf(block);
+    NextOf(block) = head;
+    head = block;
+    ++numFetched;
+  }
+  central.length -= numFetched;
+  return numFetched;
+}
+
+//! \brief Returns a chain of blocks to the central list
+void ReleaseBlocks(uint32_t sizeClass, void *first, void *last,
+                   uint32_t count) {
+  auto &central = g_centralLists[sizeClass];
+  std::lock_guard<std::mutex> guard{central.lock};
+  NextOf(last) = central.head;
+  central.head = first;
+  central.length += count;
+}
+
+#pragma endregion
+
+#pragma region ThreadCaches
+
+struct FreeList {
+  void *head;
+  uint32_t length;
+};
+
+//! \brief Free lists and statistics of one thread. Only the owning thread
+//! writes to it. Trivially constructible, so it needs no initialization guard
+//! and stays usable while other thread-local objects are destroyed
+struct ThreadCache {
+  FreeList lists[NumSizeClasses];
+  std::atomic<size_t> numAllocations;
+  std::atomic<size_t> numFrees;
+  std::atomic<size_t> allocatedBytes;
+  std::atomic<size_t> freedBytes;
+  ThreadCache *prev, *next;
+  bool registered;
+  //! \brief Set once the thread has released its cache. Later allocations of
+  //! the thread go to the central lists directly
+  bool released;
+};
+
+thread_local ThreadCache tl_cache;
+
+//! \brief All registered thread caches, for the statistics
+std::mutex *g_cachesLock = nullptr;
+ThreadCache *g_caches = nullptr;
+//! \brief Statistics of threads that have exited, and of large blocks
+std::atomic<size_t> g_numAllocations{0};
+std::atomic<size_t> g_numFrees{0};
+std::atomic<size_t> g_allocatedBytes{0};
+std::atomic<size_t> g_freedBytes{0};
+//! \brief Size of all large blocks in use
+std::atomic<size_t> g_largeBytes{0};
+
+void AddTo(std::atomic<size_t> &counter, size_t value) {
+  // Only the owner writes, so there is no need for a read-modify-write
+  counter.store(counter.load(std::memory_order_relaxed) + value,
+                std::memory_order_relaxed);
+}
+
+void ReleaseThreadCache(ThreadCache &cache) {
+  for (uint32_t sizeClass = 1; sizeClass < NumSizeClasses; ++sizeClass) {
+    auto &list = cache.lists[sizeClass];
+    if (!list.head)
+      continue;
+    auto last = list.head;
+    while (NextOf(last))
+      last = NextOf(last);
+    ReleaseBlocks(sizeClass, list.head, last, list.length);
+    list = {nullptr, 0};
+  }
+
+  std::lock_guard<std::mutex> guard{*g_cachesLock};
+  g_numAllocations += cache.numAllocations.load(std::memory_order_relaxed);
+  g_numFrees += cache.numFrees.load(std::memory_order_relaxed);
+  g_allocatedBytes += cache.allocatedBytes.load(std::memory_order_relaxed);
+  g_freedBytes += cache.freedBytes.load(std::memory_order_relaxed);
+  if (cache.prev)
+    cache.prev->next = cache.next;
+  else
+    g_caches = cache.next;
+  if (cache.next)
+    cache.next->prev = cache.prev;
+  cache.released = true;
+}
+
+//! \brief Returns the cached blocks of a thread when it exits
+struct ThreadCacheReleaser {
+  ~ThreadCacheReleaser() { ReleaseThreadCache(tl_cache); }
+};
+
+thread_local ThreadCacheReleaser tl_releaser;
+
+void RegisterThreadCache(ThreadCache &cache) {
+  // Touching the releaser registers its destructor for this thread
+  (void)&tl_releaser;
+  std::lock_guard<std::mutex> guard{*g_cachesLock};
+  cache.registered = true;
+  cache.prev = nullptr;
+  cache.next = g_caches;
+  if (g_caches)
+    g_caches->prev = &cache;
+  g_caches = &cache;
+}
+
+template <typename Func> size_t SumOverCaches(Func &&func) {
+  std::lock_guard<std::mutex> guard{*g_cachesLock};
+  size_t sum = 0;
+  for (auto cache = g_caches; cache; cache = cache->next)
+    sum += func(*cache);
+  return sum;
+}
+
+#pragma endregion
+
+#pragma region LargeBlocks
+
+//! \brief Large blocks store their size and their offset into the malloc'd
+//! memory in front, keeping at least the 16-byte alignment of malloc
+struct LargeHeader {
+  size_t numBytes;
+  size_t offset;
+};
+constexpr size_t LargeHeaderSize = 16;
+static_assert(sizeof(LargeHeader) <= LargeHeaderSize,
+              "Large block header must fit into its padding");
+
+void *AllocateLarge(size_t numBytes, size_t alignment = LargeHeaderSize) {
+  alignment = std::max(alignment, LargeHeaderSize);
+  auto mem = static_cast<char *>(std::malloc(numBytes + alignment));
+  if (!mem)
+    throw std::bad_alloc{};
+  auto block = reinterpret_cast<char *>(
+      (reinterpret_cast<uintptr_t>(mem) + LargeHeaderSize + alignment - 1) &
+      ~(alignment - 1));
+  auto header = reinterpret_cast<LargeHeader *>(block) - 1;
+  header->numBytes = numBytes;
+  header->offset = static_cast<size_t>(block - mem);
+  g_numAllocations.fetch_add(1, std::memory_order_relaxed);
+  g_allocatedBytes.fetch_add(numBytes, std::memory_order_relaxed);
+  g_largeBytes.fetch_add(numBytes, std::memory_order_relaxed);
+  return block;
+}
+
+void FreeLarge(void *mem) {
+  auto header = static_cast<LargeHeader *>(mem) - 1;
+  const auto numBytes = header->numBytes;
+  g_numFrees.fetch_add(1, std::memory_order_relaxed);
+  g_freedBytes.fetch_add(numBytes, std::memory_order_relaxed);
+  g_largeBytes.fetch_sub(numBytes, std::memory_order_relaxed);
+  std::free(static_cast<char *>(mem) - header->offset);
+}
+
+#pragma endregion
+
+#pragma region SmallBlocks
+
+//! \brief Takes a block of the size class from the cache of the thread
+//! \param numBytes Requested size, for the fallback to a large block
+//! \param alignment Requested alignment, for the fallback to a large block
+void *AllocateSmall(uint32_t sizeClass, size_t numBytes, size_t alignment) {
+  auto &cache = tl_cache;
+  auto &list = cache.lists[sizeClass];
+  if (!list.head) {
+    if (!cache.registered)
+      RegisterThreadCache(cache);
+    if (cache.released) {
+      // The thread is exiting, so nothing goes into its cache anymore
+      void *block = nullptr;
+      if (!FetchBlocks(sizeClass, 1, block))
+        return AllocateLarge(numBytes, alignment);
+      g_numAllocations.fetch_add(1, std::memory_order_relaxed);
+      g_allocatedBytes.fetch_add(ClassSize(sizeClass),
+                                 std::memory_order_relaxed);
+      return block;
+    }
+    list.length += FetchBlocks(sizeClass, BatchSize(sizeClass), list.head);
+    if (!list.head)
+      return AllocateLarge(numBytes, alignment);
+  }
+
+  auto block = list.head;
+  list.head = NextOf(block);
+  --list.length;
+  AddTo(cache.numAllocations, 1);
+  AddTo(cache.allocatedBytes, ClassSize(sizeClass));
+  return block;
+}
+
+#pragma endregion
+
+} // namespace
+
+namespace pe {
+
+peThreadCachingAllocator::peThreadCachingAllocator() {
+  // Other static constructors might allocate before the globals of this file
+  // are initialized, and destructors might free after they are destroyed, so
+  // the locks live in storage that is never cleaned up
+  struct Locks {
+    std::mutex spanLock, cachesLock;
+    CentralList centralLists[NumSizeClasses];
+  };
+  alignas(Locks) static unsigned char s_storage[sizeof(Locks)];
+  auto locks = new (s_storage) Locks();
+  g_spanLock = &locks->spanLock;
+  g_cachesLock = &locks->cachesLock;
+  g_centralLists = locks->centralLists;
+  ReserveRegion();
+}
+
+peThreadCachingAllocator::~peThreadCachingAllocator() {}
+
+peThreadCachingAllocator *peThreadCachingAllocator::GetInstance() {
+  // Constructed in place and never destroyed, since blocks might still be
+  // freed by destructors of other static objects
+  alignas(peThreadCachingAllocator) static unsigned char
+      s_storage[sizeof(peThreadCachingAllocator)];
+  static auto s_instance = new (s_storage) peThreadCachingAllocator();
+  return s_instance;
+}
+
+void *peThreadCachingAllocator::Allocate(size_t numBytes) {
+  if (numBytes > MaxSmallSize)
+    return AllocateLarge(numBytes);
+  return AllocateSmall(SizeClassOf(numBytes), numBytes, LinearStep);
+}
+
+void *peThreadCachingAllocator::Allocate(size_t numBytes, size_t alignment) {
+  if (alignment <= LinearStep)
+    return Allocate(numBytes);
+  // Blocks sit at multiples of their size from the start of a span, and spans
+  // are aligned to SpanSize. So every class whose size is a multiple of the
+  // alignment hands out aligned blocks. The power-of-two classes guarantee
+  // that there is one
+  if (numBytes <= MaxSmallSize && alignment <= MaxSmallSize) {
+    for (auto sizeClass = SizeClassOf(std::max(numBytes, alignment));
+         sizeClass < NumSizeClasses; ++sizeClass) {
+      if (ClassSize(sizeClass) % alignment == 0)
+        return AllocateSmall(sizeClass, numBytes, alignment);
+    }
+  }
+  return AllocateLarge(numBytes, alignment);
+}
+
+void peThreadCachingAllocator::Free(void *mem) {
+  if (!mem)
+    return;
+
+  const auto offset = static_cast<size_t>(static_cast<char *>(mem) -
+                                          g_regionBegin);
+  if (static_cast<char *>(mem) < g_regionBegin || offset >= g_regionSize) {
+    FreeLarge(mem);
+    return;
+  }
+
+  const uint32_t sizeClass = g_spanClasses[offset / SpanSize];
+  auto &cache = tl_cache;
+  if (cache.released) {
+    ReleaseBlocks(sizeClass, mem, mem, 1);
+    g_numFrees.fetch_add(1, std::memory_order_relaxed);
+    g_freedBytes.fetch_add(ClassSize(sizeClass), std::memory_order_relaxed);
+    return;
+  }
+  if (!cache.registered)
+    RegisterThreadCache(cache);
+
+  auto &list = cache.lists[sizeClass];
+  NextOf(mem) = list.head;
+  list.head = mem;
+  ++list.length;
+  AddTo(cache.numFrees, 1);
+  AddTo(cache.freedBytes, ClassSize(sizeClass));
+
+  // Threads that free more than they allocate, e.g. consumers of a queue,
+  // hand the surplus back in batches
+  const auto batchSize = BatchSize(sizeClass);
+  if (list.length > 2 * batchSize) {
+    auto first = list.head;
+    auto last = first;
+    for (uint32_t idx = 1; idx < batchSize; ++idx)
+      last = NextOf(last);
+    list.head = NextOf(last);
+    list.length -= batchSize;
+    ReleaseBlocks(sizeClass, first, last, batchSize);
+  }
+}
+
+size_t peThreadCachingAllocator::GetNumAllocations() const {
+  return g_numAllocations.load(std::memory_order_relaxed) +
+         SumOverCaches([](const ThreadCache &cache) {
+           return cache.numAllocations.load(std::memory_order_relaxed);
+         });
+}
+
+size_t peThreadCachingAllocator::GetNumFrees() const {
+  return g_numFrees.load(std::memory_order_relaxed) +
+         SumOverCaches([](const ThreadCache &cache) {
+           return cache.numFrees.load(std::memory_order_relaxed);
+         });
+}
+
+size_t peThreadCachingAllocator::GetReservedMemory() const {
+  // Blocks are often freed by another thread than the one that allocated
+  // them, so only the sum over all threads is meaningful
+  const auto allocated = g_allocatedBytes.load(std::memory_order_relaxed) +
+                         SumOverCaches([](const ThreadCache &cache) {
+                           return cache.allocatedBytes.load(
+                               std::memory_order_relaxed);
+                         });
+  const auto freed = g_freedBytes.load(std::memory_order_relaxed) +
+                     SumOverCaches([](const ThreadCache &cache) {
+                       return cache.freedBytes.load(std::memory_order_relaxed);
+                     });
+  return allocated - freed;
+}
+
+size_t peThreadCachingAllocator::GetTotalMemory() const {
+  // Large blocks belong to malloc, but count as long as they are in use
+  return g_committedBytes.load(std::memory_order_relaxed) +
+         g_largeBytes.load(std::memory_order_relaxed);
+}
+
+} // namespace pe
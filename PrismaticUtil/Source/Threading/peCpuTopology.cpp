@@ -0,0 +1,330 @@
+#include "Threading/peCpuTopology.h"
+
+#include <algorithm>
+#include <map>
+#include <thread>
+#include <tuple>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <dirent.h>
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace {
+
+//! \brief Maps the given member of all processors to dense indices, in the
+//! order of their first appearance
+template <typename Member>
+void Densify(pe::peVector<pe::peLogicalCpu> &cpus, Member member) {
+  std::map<uint32_t, uint32_t> denseIndices;
+  for (auto &cpu : cpus) {
+    const auto iter =
+        denseIndices
+            .emplace(cpu.*member, static_cast<uint32_t>(denseIndices.size()))
+            .first;
+    cpu.*member = iter->second;
+  }
+}
+
+#ifndef _WIN32
+
+bool ReadLine(const std::string &path, std::string &line) {
+  std::ifstream file{path};
+  return file && std::getline(file, line);
+}
+
+bool ReadNumber(const std::string &path, uint32_t &number) {
+  std::ifstream file{path};
+  return file && (file >> number);
+}
+
+//! \brief Parses lists like "0-3,8,10-11"
+pe::peVector<uint32_t> ParseCpuList(const std::string &list) {
+  pe::peVector<uint32_t> cpus;
+  size_t pos = 0;
+  while (pos < list.size()) {
+    auto end = list.find(',', pos);
+    if (end == std::string::npos)
+      end = list.size();
+    const auto range = list.substr(pos, end - pos);
+    const auto dash = range.find('-');
+    try {
+      const auto first = static_cast<uint32_t>(std::stoul(range));
+      const auto last =
+          dash == std::string::npos
+              ? first
+              : static_cast<uint32_t>(std::stoul(range.substr(dash + 1)));
+      for (auto cpu = first; cpu <= last; ++cpu)
+        cpus.push_back(cpu);
+    } catch (const std::exception &) {
+      // Empty or malformed entry, e.g. a trailing newline
+    }
+    pos = end + 1;
+  }
+  return cpus;
+}
+
+//! \brief Names of all entries in the directory that start with the prefix
+//! and continue with a number
+pe::peVector<uint32_t> NumberedEntries(const std::string &path,
+                                       const std::string &prefix) {
+  pe::peVector<uint32_t> numbers;
+  auto dir = opendir(path.c_str());
+  if (!dir)
+    return numbers;
+  while (auto entry = readdir(dir)) {
+    const std::string name{entry->d_name};
+    if (name.size() <= prefix.size() || name.compare(0, prefix.size(), prefix))
+      continue;
+    const auto suffix = name.substr(prefix.size());
+    if (!std::all_of(suffix.begin(), suffix.end(),
+                     [](char c) { return c >= '0' && c <= '9'; }))
+      continue;
+    numbers.push_back(static_cast<uint32_t>(std::stoul(suffix)));
+  }
+  closedir(dir);
+  std::sort(numbers.begin(), numbers.end());
+  return numbers;
+}
+
+#endif
+
+} // namespace
+
+pe::peCpuTopology pe::peCpuTopology::Detect() {
+#ifdef _WIN32
+  DWORD length = 0;
+  GetLogicalProcessorInformationEx(RelationAll, nullptr, &length);
+  if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+    return Uniform(std::thread::hardware_concurrency());
+  peVector<uint8_t> buffer(length);
+  if (!GetLogicalProcessorInformationEx(
+          RelationAll,
+          reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *>(
+              buffer.data()),
+          &length))
+    return Uniform(std::thread::hardware_concurrency());
+
+  // Every relation lists its processors as group masks, so we collect the
+  // relations per processor id first
+  std::map<uint32_t, peLogicalCpu> cpus;
+  const auto forEachCpu = [&](const GROUP_AFFINITY &mask, auto func) {
+    for (uint32_t bit = 0; bit < sizeof(KAFFINITY) * 8; ++bit) {
+      if (mask.Mask & (KAFFINITY{1} << bit)) {
+        const auto id = static_cast<uint32_t>(mask.Group) * 64 + bit;
+        auto &cpu = cpus[id];
+        cpu.id = id;
+        func(cpu);
+      }
+    }
+  };
+
+  uint32_t coreIdx = 0, packageIdx = 0;
+  peVector<const CACHE_RELATIONSHIP *> caches;
+  for (size_t offset = 0; offset < length;) {
+    const auto info =
+        reinterpret_cast<const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *>(
+            buffer.data() + offset);
+    switch (info->Relationship) {
+    case RelationProcessorCore:
+      for (WORD group = 0; group < info->Processor.GroupCount; ++group)
+        forEachCpu(info->Processor.GroupMask[group],
+                   [&](peLogicalCpu &cpu) { cpu.core = coreIdx; });
+      ++coreIdx;
+      break;
+    case RelationProcessorPackage:
+      for (WORD group = 0; group < info->Processor.GroupCount; ++group)
+        forEachCpu(info->Processor.GroupMask[group],
+                   [&](peLogicalCpu &cpu) { cpu.package = packageIdx; });
+      ++packageIdx;
+      break;
+    case RelationNumaNode:
+      forEachCpu(info->NumaNode.GroupMask, [&](peLogicalCpu &cpu) {
+        cpu.numaNode = info->NumaNode.NodeNumber;
+      });
+      break;
+    case RelationCache:
+      if (info->Cache.Type != CacheInstruction)
+        caches.push_back(&info->Cache);
+      break;
+    default:
+      break;
+    }
+    offset += info->Size;
+  }
+
+  // The last-level caches are the data or unified caches of the highest level
+  BYTE lastLevel = 0;
+  for (auto cache : caches)
+    lastLevel = std::max(lastLevel, cache->Level);
+  uint32_t cacheIdx = 0;
+  for (auto cache : caches) {
+    if (cache->Level != lastLevel)
+      continue;
+    forEachCpu(cache->GroupMask,
+               [&](peLogicalCpu &cpu) { cpu.lastLevelCache = cacheIdx; });
+    ++cacheIdx;
+  }
+
+  peCpuTopology topology;
+  for (auto &entry : cpus)
+    topology._cpus.push_back(entry.second);
+  if (topology._cpus.empty())
+    return Uniform(std::thread::hardware_concurrency());
+  topology.Normalize();
+  return topology;
+#else
+  auto topology = FromSysfs("/sys/devices/system");
+
+  // Containers and taskset might restrict us to some of the processors
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (!sched_getaffinity(0, sizeof(allowed), &allowed)) {
+    auto &cpus = topology._cpus;
+    cpus.erase(std::remove_if(cpus.begin(), cpus.end(),
+                              [&](const peLogicalCpu &cpu) {
+                                return cpu.id >= CPU_SETSIZE ||
+                                       !CPU_ISSET(cpu.id, &allowed);
+                              }),
+               cpus.end());
+    topology.Normalize();
+  }
+
+  if (topology._cpus.empty())
+    return Uniform(std::thread::hardware_concurrency());
+  return topology;
+#endif
+}
+
+pe::peCpuTopology pe::peCpuTopology::Uniform(uint32_t numCpus) {
+  peCpuTopology topology;
+  numCpus = std::max(numCpus, 1u);
+  for (uint32_t id = 0; id < numCpus; ++id)
+    topology._cpus.push_back({id, id, 0, 0, 0, 0});
+  return topology;
+}
+
+#ifndef _WIN32
+pe::peCpuTopology pe::peCpuTopology::FromSysfs(const std::string &sysRoot) {
+  peCpuTopology topology;
+  const auto cpuRoot = sysRoot + "/cpu";
+
+  std::string online;
+  if (!ReadLine(cpuRoot + "/online", online))
+    return topology;
+
+  for (auto id : ParseCpuList(online)) {
+    const auto cpuPath = cpuRoot + "/cpu" + std::to_string(id);
+    peLogicalCpu cpu{id, id, 0, 0, 0, 0};
+
+    uint32_t package = 0, coreId = id;
+    ReadNumber(cpuPath + "/topology/physical_package_id", package);
+    ReadNumber(cpuPath + "/topology/core_id", coreId);
+    cpu.package = package;
+    // Core ids are only unique within their package
+    cpu.core = (package << 16) | coreId;
+
+    // The last-level cache is the highest data or unified cache, identified
+    // by the first processor that shares it
+    cpu.lastLevelCache = package << 16;
+    uint32_t lastLevel = 0;
+    for (auto index : NumberedEntries(cpuPath + "/cache", "index")) {
+      const auto cachePath = cpuPath + "/cache/index" + std::to_string(index);
+      uint32_t level = 0;
+      std::string type, sharedCpus;
+      if (!ReadNumber(cachePath + "/level", level) ||
+          !ReadLine(cachePath + "/type", type) || type == "Instruction" ||
+          level < lastLevel)
+        continue;
+      if (!ReadLine(cachePath + "/shared_cpu_list", sharedCpus))
+        continue;
+      const auto shared = ParseCpuList(sharedCpus);
+      if (shared.empty())
+        continue;
+      lastLevel = level;
+      cpu.lastLevelCache = *std::min_element(shared.begin(), shared.end());
+    }
+
+    topology._cpus.push_back(cpu);
+  }
+
+  // Machines without NUMA have no node directory at all, which leaves every
+  // processor on node 0
+  const auto nodeRoot = sysRoot + "/node";
+  for (auto node : NumberedEntries(nodeRoot, "node")) {
+    std::string cpuList;
+    if (!ReadLine(nodeRoot + "/node" + std::to_string(node) + "/cpulist",
+                  cpuList))
+      continue;
+    for (auto id : ParseCpuList(cpuList)) {
+      for (auto &cpu : topology._cpus) {
+        if (cpu.id == id)
+          cpu.numaNode = node;
+      }
+    }
+  }
+
+  topology.Normalize();
+  return topology;
+}
+#endif
+
+pe::peVector<pe::peLogicalCpu> pe::peCpuTopology::PlacementOrder() const {
+  auto order = _cpus;
+  std::sort(order.begin(), order.end(),
+            [](const peLogicalCpu &l, const peLogicalCpu &r) {
+              return std::tie(l.smtIndex, l.numaNode, l.lastLevelCache,
+                              l.core, l.id) <
+                     std::tie(r.smtIndex, r.numaNode, r.lastLevelCache,
+                              r.core, r.id);
+            });
+  return order;
+}
+
+uint32_t pe::peCpuTopology::NumCores() const {
+  uint32_t numCores = 0;
+  for (auto &cpu : _cpus)
+    numCores = std::max(numCores, cpu.core + 1);
+  return numCores;
+}
+
+uint32_t pe::peCpuTopology::NumNumaNodes() const {
+  uint32_t numNodes = 0;
+  for (auto &cpu : _cpus)
+    numNodes = std::max(numNodes, cpu.numaNode + 1);
+  return numNodes;
+}
+
+bool pe::peCpuTopology::PinCurrentThread(const peLogicalCpu &cpu) {
+#ifdef _WIN32
+  GROUP_AFFINITY affinity = {};
+  affinity.Group = static_cast<WORD>(cpu.id / 64);
+  affinity.Mask = KAFFINITY{1} << (cpu.id % 64);
+  return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+#else
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  CPU_SET(cpu.id, &cpuSet);
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet) == 0;
+#endif
+}
+
+void pe::peCpuTopology::Normalize() {
+  std::sort(_cpus.begin(), _cpus.end(),
+            [](const peLogicalCpu &l, const peLogicalCpu &r) {
+              return l.id < r.id;
+            });
+
+  Densify(_cpus, &peLogicalCpu::core);
+  Densify(_cpus, &peLogicalCpu::package);
+  Densify(_cpus, &peLogicalCpu::numaNode);
+  Densify(_cpus, &peLogicalCpu::lastLevelCache);
+
+  std::map<uint32_t, uint32_t> threadsPerCore;
+  for (auto &cpu : _cpus)
+    cpu.smtIndex = threadsPerCore[cpu.core]++;
+}
@@ -0,0 +1,65 @@
+#include "Threading/peEventCount.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <climits>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+//! \brief Sleeps as long as the word has the expected value. Might return
+//! spuriously
+void FutexWait(std::atomic<uint32_t> &word, uint32_t expected) {
+#ifdef _WIN32
+  WaitOnAddress(&word, &expected, sizeof(expected), INFINITE);
+#else
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT_PRIVATE,
+          expected, nullptr, nullptr, 0);
+#endif
+}
+
+void FutexWake(std::atomic<uint32_t> &word, bool all) {
+#ifdef _WIN32
+  if (all)
+    WakeByAddressAll(&word);
+  else
+    WakeByAddressSingle(&word);
+#else
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE_PRIVATE,
+          all ? INT_MAX : 1, nullptr, nullptr, 0);
+#endif
+}
+} // namespace
+
+pe::peEventCount::peEventCount() : _epoch(0), _numWaiters(0) {}
+
+pe::peEventCount::Key_t pe::peEventCount::PrepareWait() {
+  // Sequentially consistent, so that either the notifier sees the waiter or
+  // the waiter sees the new epoch (and whatever the notifier published before)
+  _numWaiters.fetch_add(1, std::memory_order_seq_cst);
+  return _epoch.load(std::memory_order_seq_cst);
+}
+
+void pe::peEventCount::CancelWait() {
+  _numWaiters.fetch_sub(1, std::memory_order_seq_cst);
+}
+
+void pe::peEventCount::CommitWait(const Key_t key) {
+  while (_epoch.load(std::memory_order_acquire) == key)
+    FutexWait(_epoch, key);
+  _numWaiters.fetch_sub(1, std::memory_order_seq_cst);
+}
+
+void pe::peEventCount::NotifyOne() { Notify(false); }
+
+void pe::peEventCount::NotifyAll() { Notify(true); }
+
+void pe::peEventCount::Notify(const bool all) {
+  _epoch.fetch_add(1, std::memory_order_seq_cst);
+  // The syscall is only needed if somebody might sleep
+  if (_numWaiters.load(std::memory_order_seq_cst))
+    FutexWake(_epoch, all);
+}
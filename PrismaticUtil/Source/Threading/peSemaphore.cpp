@@ -2,28 +2,52 @@
 
 namespace pe {
 
-peSemaphore::peSemaphore(int maxCount) {
-  m_handle = CreateSemaphore(nullptr, 0, maxCount, nullptr);
-}
+peSemaphore::peSemaphore(int maxCount) : peSemaphore(0, maxCount) {}
 
-peSemaphore::peSemaphore(int startCount, int maxCount) {
-  m_handle = CreateSemaphore(nullptr, startCount, maxCount, nullptr);
-}
+peSemaphore::peSemaphore(int startCount, int maxCount)
+    : _count(startCount), _maxCount(maxCount) {}
 
-peSemaphore::~peSemaphore() { CloseHandle(m_handle); }
+peSemaphore::~peSemaphore() {}
 
-void peSemaphore::Increment() const { ReleaseSemaphore(m_handle, 1, nullptr); }
+void peSemaphore::Increment() const { IncrementToCount(1); }
 
 void peSemaphore::IncrementToCount(unsigned int count) const {
-  ReleaseSemaphore(m_handle, count, nullptr);
+  if (!count)
+    return;
+  auto current = _count.load(std::memory_order_relaxed);
+  do {
+    if (current + static_cast<int64_t>(count) > _maxCount)
+      return;
+  } while (!_count.compare_exchange_weak(current,
+                                         current + static_cast<int>(count),
+                                         std::memory_order_release,
+                                         std::memory_order_relaxed));
+
+  if (count == 1)
+    _waiters.NotifyOne();
+  else
+    _waiters.NotifyAll();
 }
 
 void peSemaphore::WaitAndDecrement() const {
-  WaitForSingleObject(m_handle, INFINITE);
+  while (!TryDecrement()) {
+    const auto key = _waiters.PrepareWait();
+    if (TryDecrement()) {
+      _waiters.CancelWait();
+      return;
+    }
+    _waiters.CommitWait(key);
+  }
 }
 
 bool peSemaphore::TryDecrement() const {
-  const auto res = WaitForSingleObject(m_handle, 0);
-  return res == WAIT_OBJECT_0;
+  auto current = _count.load(std::memory_order_relaxed);
+  while (current > 0) {
+    if (_count.compare_exchange_weak(current, current - 1,
+                                     std::memory_order_acquire,
+                                     std::memory_order_relaxed))
+      return true;
+  }
+  return false;
 }
 } // namespace pe
@@ -0,0 +1,76 @@
+#include "Threading/peTaskGroup.h"
+
+pe::peTaskGroup::peTaskGroup(peTaskSystem &taskSystem)
+    : _taskSystem(taskSystem), _outstanding(0), _numSleepingWaiters(0),
+      _continuations(nullptr) {}
+
+pe::peTaskGroup::~peTaskGroup() { Wait(); }
+
+void pe::peTaskGroup::Wait() {
+  while (_outstanding.load(std::memory_order_acquire) > 0) {
+    if (_taskSystem.RunPendingTask())
+      continue;
+    // The task system is stopping. Its runners finish the tasks they are
+    // running, everything that is still queued is discarded and finished
+    if (!_taskSystem.IsRunning()) {
+      std::this_thread::yield();
+      continue;
+    }
+
+    // Nothing to help with. The tasks of this group are running elsewhere, so
+    // we sleep until they are done or new tasks arrive
+    _numSleepingWaiters.fetch_add(1, std::memory_order_seq_cst);
+    _taskSystem.ParkUntil([this]() {
+      return _outstanding.load(std::memory_order_seq_cst) == 0;
+    });
+    _numSleepingWaiters.fetch_sub(1, std::memory_order_relaxed);
+  }
+  // The last task might still be busy with the continuations, the group must
+  // not go away before it is done
+  std::lock_guard<std::mutex> guard{_lock};
+}
+
+void pe::peTaskGroup::AddContinuation(peTask *continuation) {
+  {
+    std::lock_guard<std::mutex> guard{_lock};
+    if (_outstanding.load(std::memory_order_acquire) > 0) {
+      continuation->next = _continuations;
+      _continuations = continuation;
+      return;
+    }
+  }
+  _taskSystem.Submit(continuation);
+}
+
+void pe::peTaskGroup::OnTaskFinished() {
+  // Fast path, this was not the last task
+  auto outstanding = _outstanding.load(std::memory_order_relaxed);
+  while (outstanding > 1) {
+    if (_outstanding.compare_exchange_weak(outstanding, outstanding - 1,
+                                           std::memory_order_acq_rel))
+      return;
+  }
+
+  // Most likely the last task. The transition to zero happens under the lock,
+  // so that no continuation can be registered in between
+  peTask *continuations = nullptr;
+  auto &taskSystem = _taskSystem;
+  auto wakeWaiters = false;
+  {
+    std::lock_guard<std::mutex> guard{_lock};
+    if (_outstanding.fetch_sub(1, std::memory_order_seq_cst) == 1) {
+      std::swap(continuations, _continuations);
+      wakeWaiters = _numSleepingWaiters.load(std::memory_order_seq_cst) > 0;
+    }
+  }
+
+  // Waiters may destroy the group as soon as the lock is released, so we
+  // can't touch any members from here on
+  while (continuations) {
+    auto next = continuations->next;
+    taskSystem.Submit(continuations);
+    continuations = next;
+  }
+  if (wakeWaiters)
+    taskSystem.WakeAll();
+}
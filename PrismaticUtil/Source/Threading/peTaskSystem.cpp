@@ -1,115 +1,435 @@
 #include "Threading\peTaskSystem.h"
+#include "Memory/peAllocator.h"
 
-pe::peTaskQueue::peTaskQueue() {}
+#include <algorithm>
 
-void pe::peTaskQueue::Enqueue(std::function<void()> task) {
-  std::unique_lock<std::mutex> lock{_lock};
-  _tasks.push_back(std::move(task));
-  _available.notify_one();
+namespace {
+//! \brief Task system that the current thread is a runner of
+thread_local const pe::peTaskSystem *tl_taskSystem = nullptr;
+thread_local uint32_t tl_runnerIdx = 0;
+
+uint32_t NextRandom(uint32_t &state) {
+  // xorshift32, plenty for picking victims
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
 }
+} // namespace
+
+#pragma region peTaskQueue
 
-std::function<void()> pe::peTaskQueue::WaitAndDequeue() {
+pe::peTaskQueue::peTaskQueue() : _head(nullptr), _tail(nullptr), _count(0) {}
+
+void pe::peTaskQueue::Enqueue(peTask *task) {
+  task->next = nullptr;
   std::unique_lock<std::mutex> lock{_lock};
-  while (_tasks.empty()) {
-    _available.wait(lock);
-  }
-  auto ret = std::move(_tasks.back());
-  _tasks.pop_back();
-  return std::move(ret);
+  if (_tail)
+    _tail->next = task;
+  else
+    _head = task;
+  _tail = task;
+  _count.fetch_add(1, std::memory_order_release);
 }
 
-std::optional<std::function<void()>> pe::peTaskQueue::TryDequeue() {
+pe::peTask *pe::peTaskQueue::TryDequeue() {
+  // Cheap check so that idle runners don't all hammer the lock
+  if (!_count.load(std::memory_order_acquire))
+    return nullptr;
+
   std::unique_lock<std::mutex> lock{_lock};
-  if (_tasks.empty())
-    return {};
-  auto ret = std::move(_tasks.back());
-  _tasks.pop_back();
-  return std::move(ret);
+  if (!_head)
+    return nullptr;
+  auto ret = _head;
+  _head = ret->next;
+  if (!_head)
+    _tail = nullptr;
+  _count.fetch_sub(1, std::memory_order_relaxed);
+  ret->next = nullptr;
+  return ret;
 }
 
 size_t pe::peTaskQueue::Count() const {
-  std::unique_lock<std::mutex> lock{_lock};
-  return _tasks.size();
+  return _count.load(std::memory_order_relaxed);
 }
 
-pe::peTaskSystem::peTaskSystem(const uint32_t concurrency)
-    : _concurrency(concurrency) {}
+#pragma endregion
+
+#pragma region peTaskSystem
+
+pe::peTaskSystem::peTaskSystem(const uint32_t concurrency,
+                               const bool pinRunners)
+    : _concurrency(concurrency), _pinRunners(pinRunners), _running(false),
+      _sharedFreeTasks(nullptr) {}
+
+pe::peTaskSystem::~peTaskSystem() {
+  Stop();
+  for (auto slab : _slabs)
+    GlobalAllocator->Free(slab);
+}
 
 void pe::peTaskSystem::Start() {
+  if (_running)
+    return;
   _running = true;
-  _nextRunnerIdx = 0;
 
-  _queues.reserve(_concurrency);
+  // One runner per physical core first, SMT siblings only get runners once
+  // every core has one. Unpinned runners go wherever the OS puts them, so
+  // they have no placement and steal from random victims
+  peVector<peLogicalCpu> placement;
+  if (_pinRunners)
+    placement = peCpuTopology::Detect().PlacementOrder();
+
+  _runnerStates.reserve(_concurrency);
   for (uint32_t idx = 0; idx < _concurrency; ++idx) {
-    _queues.emplace_back(std::make_unique<peTaskQueue>());
+    _runnerStates.emplace_back(std::make_unique<Runner>());
+    auto &runnerState = *_runnerStates.back();
+    // Zero is a fixed point of xorshift
+    runnerState.rngState = 0x9E3779B9u * (idx + 1);
+    if (idx < placement.size())
+      runnerState.cpu = placement[idx];
   }
+  for (uint32_t idx = 0; idx < _concurrency; ++idx)
+    BuildVictimList(idx);
 
   _runners.reserve(_concurrency);
-  for (uint32_t idx = 0; idx < _concurrency; ++idx) {
+  for (uint32_t idx = 0; idx < _concurrency; ++idx)
     _runners.emplace_back([this, idx]() { Run(idx); });
-    // Make sure each thread runs on its own core!
-    auto &runner = _runners.back();
-    const auto mask = (1 << idx);
-    SetThreadAffinityMask(runner.native_handle(), mask);
-  }
 }
 
 void pe::peTaskSystem::Stop() {
-  _running = false;
-  // Some runners may be stuck waiting on their queues, so we put dummy tasks in
-  // the queues to make sure the runners will end
-  for (auto &queue : _queues) {
-    queue->Enqueue([]() {});
-  }
+  if (!_running.exchange(false))
+    return;
+
+  _idleThreads.NotifyAll();
 
   for (auto &runner : _runners)
     runner.join();
 
-  _queues.clear();
+  // Tasks that did not run anymore are dropped. Discarding a task of a task
+  // group can finish the group, which submits its continuations, so this
+  // repeats until the queues stay empty
+  auto discarded = true;
+  while (discarded) {
+    discarded = false;
+    for (auto &injectionQueue : _injectionQueues) {
+      while (auto task = injectionQueue.TryDequeue()) {
+        DiscardTask(task);
+        discarded = true;
+      }
+    }
+    for (auto &runnerState : _runnerStates) {
+      for (auto &tasks : runnerState->tasks) {
+        while (auto task = tasks.Pop()) {
+          DiscardTask(*task);
+          discarded = true;
+        }
+      }
+    }
+  }
+  for (auto &runnerState : _runnerStates)
+    DrainPool(*runnerState, runnerState->numFreeTasks);
+
+  _runnerStates.clear();
   _runners.clear();
 }
 
-void pe::peTaskSystem::AddTask(std::function<void()> task) {
-  // Different scheduling strategies are possible, since we have work-stealing
-  // we can just do round-robin
-  // Also, this will overflow after 2^32 tasks, but we don't really care
-  const auto runnerIdx = _nextRunnerIdx.fetch_add(1u) % _concurrency;
-  _queues[runnerIdx]->Enqueue(std::move(task));
+void pe::peTaskSystem::Submit(peTask *task, const peTaskPriority priority) {
+  // Runners keep their own tasks local, which is where they are hot in the
+  // cache. Everybody else goes through the injection queue
+  const auto priorityIdx = static_cast<uint32_t>(priority);
+  const auto runnerIdx = CurrentRunnerIdx();
+  if (runnerIdx < _concurrency)
+    _runnerStates[runnerIdx]->tasks[priorityIdx].Push(task);
+  else
+    _injectionQueues[priorityIdx].Enqueue(task);
+
+  _idleThreads.NotifyOne();
+}
+
+void pe::peTaskSystem::DiscardTask(peTask *task) {
+  task->Reset();
+  ReleaseTask(task);
+}
+
+bool pe::peTaskSystem::RunPendingTask() {
+  if (!_running)
+    return false;
+  auto task = FindTask(CurrentRunnerIdx());
+  if (!task)
+    return false;
+  Execute(task);
+  return true;
+}
+
+bool pe::peTaskSystem::IsLocalQueueEmpty() const {
+  const auto runnerIdx = CurrentRunnerIdx();
+  if (runnerIdx < _concurrency) {
+    auto &tasks = _runnerStates[runnerIdx]->tasks;
+    return std::all_of(tasks.begin(), tasks.end(),
+                       [](auto &deque) { return deque.ApproximatelyEmpty(); });
+  }
+  return std::all_of(_injectionQueues.begin(), _injectionQueues.end(),
+                     [](auto &queue) { return queue.Count() == 0; });
 }
 
 void pe::peTaskSystem::Run(const uint32_t idx) {
-  auto &queue = *_queues[idx];
-  auto waitForNextTask = false;
+  tl_taskSystem = this;
+  tl_runnerIdx = idx;
+  if (const auto &cpu = _runnerStates[idx]->cpu)
+    peCpuTopology::PinCurrentThread(*cpu);
 
+  uint32_t idleRounds = 0;
   while (_running) {
+    if (auto task = FindTask(idx)) {
+      Execute(task);
+      idleRounds = 0;
+      continue;
+    }
 
-    // 0) If desired, we wait until a task becomes available (see 3)
-    if (waitForNextTask) {
-      const auto task = queue.WaitAndDequeue();
-      task();
+    // Work often arrives in bursts, looking again for a short while keeps the
+    // latency down without the syscalls of sleeping and waking up
+    if (idleRounds++ < IdleSpinRounds) {
+      std::this_thread::yield();
+      continue;
     }
+    idleRounds = 0;
 
-    // 1) Get tasks from this runners dedicated queue
-    while (auto task = queue.TryDequeue()) {
-      (*task)();
+    // No work anywhere, so we sleep until a new task arrives. Tasks that are
+    // added after PrepareWait wake us up, everything before that is seen by
+    // the second check. Steals can fail spuriously, so that check looks at
+    // the sizes of all queues instead of trying to steal again
+    const auto key = _idleThreads.PrepareWait();
+    if (!_running || HasPendingTasks()) {
+      _idleThreads.CancelWait();
+      continue;
     }
+    _idleThreads.CommitWait(key);
+  }
 
-    // 2) Nothing there, so try some work stealing
-    auto nextIdx = idx;
-    do {
-      auto stolenTask = _queues[nextIdx]->TryDequeue();
-      if (stolenTask) {
-        (*stolenTask)();
-        // Only ever steal one item at a time!
-        break;
-      }
-      nextIdx = (nextIdx + 1) % _concurrency;
-    } while (nextIdx != idx);
+  tl_taskSystem = nullptr;
+}
+
+void pe::peTaskSystem::BuildVictimList(const uint32_t idx) {
+  auto &runner = *_runnerStates[idx];
+  // 0: same last-level cache, 1: same NUMA node, 2: anywhere else
+  const auto distanceTo = [&](uint32_t other) {
+    const auto &cpu = runner.cpu;
+    const auto &otherCpu = _runnerStates[other]->cpu;
+    if (!cpu || !otherCpu)
+      return 2;
+    if (cpu->lastLevelCache == otherCpu->lastLevelCache)
+      return 0;
+    return cpu->numaNode == otherCpu->numaNode ? 1 : 2;
+  };
+
+  runner.victims.clear();
+  for (uint32_t other = 0; other < _concurrency; ++other) {
+    if (other != idx)
+      runner.victims.push_back(other);
+  }
+  std::stable_sort(
+      runner.victims.begin(), runner.victims.end(),
+      [&](uint32_t l, uint32_t r) { return distanceTo(l) < distanceTo(r); });
+
+  const auto countWithin = [&](int maxDistance) {
+    return static_cast<uint32_t>(
+        std::count_if(runner.victims.begin(), runner.victims.end(),
+                      [&](uint32_t victim) {
+                        return distanceTo(victim) <= maxDistance;
+                      }));
+  };
+  runner.numCacheVictims = countWithin(0);
+  runner.numNodeVictims = countWithin(1);
+}
+
+pe::peTask *pe::peTaskSystem::FindTask(const uint32_t idx) {
+  // Threads outside of the task system don't own a random state
+  thread_local uint32_t externalRngState = 0x2545F491u;
+  auto &rngState =
+      idx < _concurrency ? _runnerStates[idx]->rngState : externalRngState;
 
-    // 3) Work stealing did not work, so we will wait for the next task of our
-    // dedicated queue
-    if (nextIdx == idx) {
-      waitForNextTask = true;
+  // Work that needs no stealing comes first, even at a lower priority.
+  // Stealing touches the deques of other runners and costs far more
+  for (uint32_t priority = 0; priority < NumTaskPriorities; ++priority) {
+    if (idx < _concurrency) {
+      if (auto task = _runnerStates[idx]->tasks[priority].Pop())
+        return *task;
     }
+
+    if (auto task = _injectionQueues[priority].TryDequeue())
+      return task;
+  }
+
+  for (uint32_t priority = 0; priority < NumTaskPriorities; ++priority) {
+    // Relaxed check, a task that is pushed right now is found by the next
+    // call instead
+    const auto hasTasks = std::any_of(
+        _runnerStates.begin(), _runnerStates.end(), [&](auto &runnerState) {
+          return !runnerState->tasks[priority].ApproximatelyEmpty();
+        });
+    if (!hasTasks)
+      continue;
+
+    if (auto task = TrySteal(idx, rngState, priority))
+      return task;
+  }
+  return nullptr;
+}
+
+pe::peTask *pe::peTaskSystem::TrySteal(const uint32_t idx,
+                                       uint32_t &rngState,
+                                       const uint32_t priority) {
+  if (idx < _concurrency) {
+    // Close victims first, their tasks likely work on data that is in our
+    // cache or at least on our memory node. Within each level, random victims
+    // spread the thieves instead of having them all compete for one queue
+    auto &runner = *_runnerStates[idx];
+    uint32_t numTried = 0;
+    for (const auto numVictims :
+         {runner.numCacheVictims, runner.numNodeVictims,
+          static_cast<uint32_t>(runner.victims.size())}) {
+      if (numVictims == numTried)
+        continue;
+      numTried = numVictims;
+      for (uint32_t attempt = 0; attempt < 2 * numVictims; ++attempt) {
+        const auto victim = runner.victims[NextRandom(rngState) % numVictims];
+        if (auto task = _runnerStates[victim]->tasks[priority].Steal())
+          return *task;
+      }
+    }
+    return nullptr;
+  }
+
+  // Threads outside of the task system are close to no runner in particular
+  for (uint32_t attempt = 0; attempt < 2 * _concurrency; ++attempt) {
+    const auto victim = NextRandom(rngState) % _concurrency;
+    if (auto task = _runnerStates[victim]->tasks[priority].Steal())
+      return *task;
+  }
+  return nullptr;
+}
+
+bool pe::peTaskSystem::HasPendingTasks() const {
+  const auto hasTasks = [](auto &queue) { return queue.Count() != 0; };
+  if (std::any_of(_injectionQueues.begin(), _injectionQueues.end(), hasTasks))
+    return true;
+  return std::any_of(_runnerStates.begin(), _runnerStates.end(),
+                     [](auto &runnerState) {
+                       auto &tasks = runnerState->tasks;
+                       return std::any_of(
+                           tasks.begin(), tasks.end(), [](auto &deque) {
+                             return !deque.ApproximatelyEmpty();
+                           });
+                     });
+}
+
+void pe::peTaskSystem::Execute(peTask *task) {
+  // Markers instead of a full reset, since a task that waits for other tasks
+  // runs them on the same thread while its own scratch memory is still in use
+  auto &scratch = ScratchArena();
+  const auto marker = scratch.ObtainMarker();
+  task->Run();
+  task->Reset();
+  ReleaseTask(task);
+  scratch.FreeToMarker(marker);
+}
+
+pe::peTask *pe::peTaskSystem::AcquireTask() {
+  const auto runnerIdx = CurrentRunnerIdx();
+  if (runnerIdx < _concurrency) {
+    auto &runner = *_runnerStates[runnerIdx];
+    if (!runner.freeTasks)
+      RefillPool(runner);
+    auto task = runner.freeTasks;
+    runner.freeTasks = task->next;
+    --runner.numFreeTasks;
+    task->next = nullptr;
+    return task;
   }
+
+  std::lock_guard<std::mutex> guard{_poolLock};
+  if (!_sharedFreeTasks)
+    AllocateSlab();
+  auto task = _sharedFreeTasks;
+  _sharedFreeTasks = task->next;
+  task->next = nullptr;
+  return task;
 }
+
+void pe::peTaskSystem::ReleaseTask(peTask *task) {
+  // Records go to the pool of the thread that releases them, which is not
+  // necessarily the one that created them
+  const auto runnerIdx = CurrentRunnerIdx();
+  if (runnerIdx < _concurrency) {
+    auto &runner = *_runnerStates[runnerIdx];
+    task->next = runner.freeTasks;
+    runner.freeTasks = task;
+    if (++runner.numFreeTasks > MaxLocalFreeTasks)
+      DrainPool(runner, PoolBatchSize);
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard{_poolLock};
+  task->next = _sharedFreeTasks;
+  _sharedFreeTasks = task;
+}
+
+void pe::peTaskSystem::RefillPool(Runner &runner) {
+  std::lock_guard<std::mutex> guard{_poolLock};
+  if (!_sharedFreeTasks)
+    AllocateSlab();
+  for (uint32_t idx = 0; idx < PoolBatchSize && _sharedFreeTasks; ++idx) {
+    auto task = _sharedFreeTasks;
+    _sharedFreeTasks = task->next;
+    task->next = runner.freeTasks;
+    runner.freeTasks = task;
+    ++runner.numFreeTasks;
+  }
+}
+
+void pe::peTaskSystem::DrainPool(Runner &runner, const uint32_t count) {
+  if (!count)
+    return;
+
+  // Detach the first 'count' records, then splice them in with one lock
+  auto first = runner.freeTasks;
+  auto last = first;
+  for (uint32_t idx = 1; idx < count; ++idx)
+    last = last->next;
+  runner.freeTasks = last->next;
+  runner.numFreeTasks -= count;
+
+  std::lock_guard<std::mutex> guard{_poolLock};
+  last->next = _sharedFreeTasks;
+  _sharedFreeTasks = first;
+}
+
+void pe::peTaskSystem::AllocateSlab() {
+  constexpr size_t TasksPerSlab = 64;
+  const auto slab =
+      GlobalAllocator->Allocate(TasksPerSlab * sizeof(peTask), alignof(peTask));
+  _slabs.push_back(slab);
+
+  auto tasks = static_cast<peTask *>(slab);
+  for (size_t idx = 0; idx < TasksPerSlab; ++idx) {
+    auto task = new (tasks + idx) peTask{};
+    task->next = _sharedFreeTasks;
+    _sharedFreeTasks = task;
+  }
+}
+
+pe::peScratchArena &pe::peTaskSystem::ScratchArena() {
+  const auto runnerIdx = CurrentRunnerIdx();
+  if (runnerIdx < _concurrency)
+    return _runnerStates[runnerIdx]->scratch;
+  // Shared by all task systems that this thread helps out
+  thread_local peScratchArena externalScratch;
+  return externalScratch;
+}
+
+uint32_t pe::peTaskSystem::CurrentRunnerIdx() const {
+  return tl_taskSystem == this ? tl_runnerIdx : _concurrency;
+}
+
+#pragma endregion